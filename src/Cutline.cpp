@@ -0,0 +1,292 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file Cutline.cpp
+ * @brief This defines the `Cutline` class
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+
+#include "CTBException.hpp"
+#include "Cutline.hpp"
+
+using namespace ctb;
+
+/// The most bands the edges are indexed by
+static const size_t cMaxBands = 4096;
+
+/// Does an edge touch a rectangle?  This clips the edge to the rectangle.
+static bool
+touches(double x1, double y1, double x2, double y2, const CRSBounds &bounds) {
+  const double dx = x2 - x1, dy = y2 - y1;
+  const double p[4] = { -dx, dx, -dy, dy },
+    q[4] = { x1 - bounds.getMinX(), bounds.getMaxX() - x1, y1 - bounds.getMinY(), bounds.getMaxY() - y1 };
+  double t0 = 0, t1 = 1;
+
+  for (int i = 0; i < 4; ++i) {
+    if (p[i] == 0) {
+      if (q[i] < 0) return false; // parallel to and outside this side
+    } else {
+      const double t = q[i] / p[i];
+      if (p[i] < 0) {
+        if (t > t1) return false;
+        t0 = std::max(t0, t);
+      } else {
+        if (t < t0) return false;
+        t1 = std::min(t1, t);
+      }
+    }
+  }
+
+  return true;
+}
+
+/// Add a ring of a polygon to a list of rings
+static void
+addRing(const OGRLinearRing *ring, std::vector<Cutline::Ring> &rings) {
+  if (ring == NULL) {
+    return;
+  }
+
+  Cutline::Ring points;
+  for (int i = 0; i < ring->getNumPoints(); ++i) {
+    points.push_back(CRSPoint(ring->getX(i), ring->getY(i)));
+  }
+  rings.push_back(points);
+}
+
+void
+Cutline::addRings(const OGRGeometry *geometry, std::vector<Ring> &rings) {
+  switch (wkbFlatten(geometry->getGeometryType())) {
+  case wkbPolygon: {
+    const OGRPolygon *polygon = static_cast<const OGRPolygon *>(geometry);
+    addRing(polygon->getExteriorRing(), rings);
+    for (int i = 0; i < polygon->getNumInteriorRings(); ++i) {
+      addRing(polygon->getInteriorRing(i), rings);
+    }
+    break;
+  }
+  case wkbMultiPolygon:
+  case wkbGeometryCollection: {
+    const OGRGeometryCollection *collection = static_cast<const OGRGeometryCollection *>(geometry);
+    for (int i = 0; i < collection->getNumGeometries(); ++i) {
+      addRings(collection->getGeometryRef(i), rings);
+    }
+    break;
+  }
+  default:                      // only polygons have an area
+    break;
+  }
+}
+
+/**
+ * @details Edges of zero length are dropped.  There is a band for about every
+ * four edges, so each band usually holds only a few edges.
+ */
+Cutline::Cutline(const std::vector<Ring> &rings) {
+  double minX = HUGE_VAL, minY = HUGE_VAL, maxX = -HUGE_VAL, maxY = -HUGE_VAL;
+
+  for (const Ring &ring: rings) {
+    for (size_t i = 0; i < ring.size(); ++i) {
+      const CRSPoint &start = ring[i], &end = ring[(i + 1) % ring.size()];
+      if (start == end) continue;
+
+      const Edge edge = { start.x, start.y, end.x, end.y };
+      mEdges.push_back(edge);
+
+      minX = std::min(minX, start.x);
+      minY = std::min(minY, start.y);
+      maxX = std::max(maxX, start.x);
+      maxY = std::max(maxY, start.y);
+    }
+  }
+
+  if (mEdges.empty() || minX == maxX || minY == maxY) {
+    throw CTBException("The cutline does not enclose any area");
+  }
+
+  mBounds = CRSBounds(minX, minY, maxX, maxY);
+  mBands.resize(std::max<size_t>(1, std::min(cMaxBands, mEdges.size() / 4)));
+  mBandHeight = mBounds.getHeight() / mBands.size();
+
+  for (size_t i = 0; i < mEdges.size(); ++i) {
+    const Edge &edge = mEdges[i];
+    const size_t first = band(std::min(edge.y1, edge.y2)), last = band(std::max(edge.y1, edge.y2));
+
+    for (size_t j = first; j <= last; ++j) {
+      mBands[j].push_back(i);
+    }
+  }
+}
+
+/**
+ * @details The dataset is opened with the GDAL vector drivers, so any format
+ * they support can be used, such as a shapefile or GeoJSON.
+ */
+Cutline
+Cutline::load(const std::string &filename, const OGRSpatialReference &srs) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpenEx(filename.c_str(), GDAL_OF_VECTOR, NULL, NULL, NULL);
+  if (poDataset == NULL) {
+    throw CTBException("Could not open the cutline dataset");
+  }
+
+  OGRSpatialReference targetSRS(srs);
+  std::vector<Ring> rings;
+  const char *error = NULL;
+
+  for (int i = 0; error == NULL && i < poDataset->GetLayerCount(); ++i) {
+    OGRLayer *poLayer = poDataset->GetLayer(i);
+    OGRSpatialReference *layerSRS = poLayer->GetSpatialRef();
+
+    // Reproject the polygons if the layer is in another spatial reference system
+    std::unique_ptr<OGRCoordinateTransformation> transformer;
+    if (layerSRS != NULL && !layerSRS->IsSame(&targetSRS)) {
+      transformer.reset(OGRCreateCoordinateTransformation(layerSRS, &targetSRS));
+      if (!transformer) {
+        error = "The cutline to tile grid coordinate transformation could not be created";
+        break;
+      }
+    }
+
+    poLayer->ResetReading();
+    OGRFeature *poFeature;
+    while (error == NULL && (poFeature = poLayer->GetNextFeature()) != NULL) {
+      OGRGeometry *geometry = poFeature->GetGeometryRef();
+
+      if (geometry != NULL) {
+        if (transformer && geometry->transform(transformer.get()) != OGRERR_NONE) {
+          error = "Could not transform the cutline to the tile spatial reference system";
+        } else {
+          addRings(geometry, rings);
+        }
+      }
+
+      OGRFeature::DestroyFeature(poFeature);
+    }
+  }
+
+  GDALClose(poDataset);
+
+  if (error != NULL) {
+    throw CTBException(error);
+  } else if (rings.empty()) {
+    throw CTBException("The cutline dataset does not contain any polygons");
+  }
+
+  return Cutline(rings);
+}
+
+/**
+ * @details The crossings are found in a buffer kept by each thread, so that
+ * testing tiles doesn't allocate memory once the buffer has grown.
+ */
+bool
+Cutline::contains(const CRSPoint &point) const {
+  static thread_local std::vector<double> xs;
+  crossings(point.y, xs);
+
+  const size_t before = std::lower_bound(xs.begin(), xs.end(), point.x) - xs.begin();
+  return before % 2 == 1;
+}
+
+/**
+ * @details An area touched by an edge is partly within the region.
+ * Otherwise it lies entirely on one side of the boundary, so testing its
+ * centre decides whether it is inside or outside.
+ */
+Cutline::Coverage
+Cutline::coverage(const CRSBounds &bounds) const {
+  if (!mBounds.overlaps(bounds)) {
+    return OUTSIDE;
+  }
+
+  const size_t first = band(bounds.getMinY()), last = band(bounds.getMaxY());
+  for (size_t i = first; i <= last; ++i) {
+    for (size_t index: mBands[i]) {
+      const Edge &edge = mEdges[index];
+      if (touches(edge.x1, edge.y1, edge.x2, edge.y2, bounds)) {
+        return PARTIAL;
+      }
+    }
+  }
+
+  const CRSPoint centre(bounds.getMinX() + bounds.getWidth() / 2,
+                        bounds.getMinY() + bounds.getHeight() / 2);
+  return contains(centre) ? INSIDE : OUTSIDE;
+}
+
+/**
+ * @details The crossings of each row are found once, and the pixels of the row
+ * are then swept from west to east counting the crossings passed.  As with
+ * `contains` the crossings are found in a buffer kept by each thread, and
+ * `inside` only allocates memory if it is smaller than the raster.
+ */
+void
+Cutline::mask(const double (&adfGeoTransform)[6], int xSize, int ySize,
+              std::vector<bool> &inside) const {
+  inside.assign((size_t) xSize * ySize, false);
+  static thread_local std::vector<double> xs;
+
+  for (int row = 0; row < ySize; ++row) {
+    crossings(adfGeoTransform[3] + (row + 0.5) * adfGeoTransform[5], xs);
+    if (xs.empty()) continue;
+
+    size_t passed = 0;
+    for (int column = 0; column < xSize; ++column) {
+      const double x = adfGeoTransform[0] + (column + 0.5) * adfGeoTransform[1];
+      while (passed < xs.size() && xs[passed] < x) ++passed;
+
+      inside[(size_t) row * xSize + column] = (passed % 2 == 1);
+    }
+  }
+}
+
+size_t
+Cutline::band(double y) const {
+  const double position = std::floor((y - mBounds.getMinY()) / mBandHeight);
+  if (position <= 0) {
+    return 0;
+  }
+
+  return std::min(mBands.size() - 1, (size_t) position);
+}
+
+/**
+ * @details An edge crosses a northing if one end is north of it and the other
+ * isn't, so a vertex on the northing is only counted once.
+ */
+void
+Cutline::crossings(double y, std::vector<double> &xs) const {
+  xs.clear();
+  if (y < mBounds.getMinY() || y > mBounds.getMaxY()) {
+    return;
+  }
+
+  for (size_t index: mBands[band(y)]) {
+    const Edge &edge = mEdges[index];
+    if ((edge.y1 > y) != (edge.y2 > y)) {
+      xs.push_back(edge.x1 + (y - edge.y1) * (edge.x2 - edge.x1) / (edge.y2 - edge.y1));
+    }
+  }
+
+  std::sort(xs.begin(), xs.end());
+}
@@ -0,0 +1,128 @@
+#ifndef CUTLINE_HPP
+#define CUTLINE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file Cutline.hpp
+ * @brief This declares the `Cutline` class
+ */
+
+#include <string>
+#include <vector>
+
+#include "ogr_geometry.h"
+#include "ogr_spatialref.h"
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+
+namespace ctb {
+  class Cutline;
+}
+
+/**
+ * @brief A polygon region to which tiling is restricted
+ *
+ * The region is made up of rings in the coordinate reference system of the
+ * tile grid.  A point is within the region if it is enclosed by an odd number
+ * of rings, so holes and multiple polygons are handled without needing to know
+ * which ring belongs to which polygon.
+ *
+ * The edges of the rings are indexed by horizontal bands.  Deciding whether a
+ * tile lies within the region only tests the edges in the bands the tile
+ * covers, and the samples of a tile are tested a row at a time, so the cost
+ * depends little on the number of vertices in the region.
+ */
+class CTB_DLL ctb::Cutline {
+public:
+
+  /// A ring of points, which may or may not repeat the first point at the end
+  typedef std::vector<CRSPoint> Ring;
+
+  /// How much of an area lies within the region
+  enum Coverage {
+    OUTSIDE,                    ///< None of the area is within the region
+    PARTIAL,                    ///< Some of the area is within the region
+    INSIDE                      ///< All of the area is within the region
+  };
+
+  /// Create a region from rings
+  Cutline(const std::vector<Ring> &rings);
+
+  /**
+   * @brief Load the polygons in a vector dataset as a region
+   *
+   * Every polygon in every layer is used, reprojected to the given spatial
+   * reference system if its layer has a different one.
+   */
+  static Cutline
+  load(const std::string &filename, const OGRSpatialReference &srs);
+
+  /// Add the rings of the polygons in a geometry to a list of rings
+  static void
+  addRings(const OGRGeometry *geometry, std::vector<Ring> &rings);
+
+  /// Get the extent of the region
+  const CRSBounds &
+  bounds() const {
+    return mBounds;
+  }
+
+  /// Is a point within the region?
+  bool
+  contains(const CRSPoint &point) const;
+
+  /// Get how much of an area lies within the region
+  Coverage
+  coverage(const CRSBounds &bounds) const;
+
+  /**
+   * @brief Find which pixels of a raster lie within the region
+   *
+   * The raster is described by a north up GDAL geo transform and the centre
+   * of each pixel is tested.  `inside` is filled with a flag for each pixel,
+   * by row from the north west corner.
+   */
+  void
+  mask(const double (&adfGeoTransform)[6], int xSize, int ySize,
+       std::vector<bool> &inside) const;
+
+private:
+
+  /// An edge of a ring
+  struct Edge {
+    double x1, y1, x2, y2;
+  };
+
+  /// Get the band holding a northing, clamped to the bands
+  size_t
+  band(double y) const;
+
+  /// Get the eastings at which the edges cross a northing, in order
+  void
+  crossings(double y, std::vector<double> &xs) const;
+
+  std::vector<Edge> mEdges;     ///< The edges of all the rings
+  CRSBounds mBounds;            ///< The extent of the edges
+
+  /// The edges crossing each band, from south to north
+  std::vector<std::vector<size_t>> mBands;
+  double mBandHeight;
+};
+
+#endif /* CUTLINE_HPP */
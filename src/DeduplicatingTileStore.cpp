@@ -0,0 +1,229 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file DeduplicatingTileStore.cpp
+ * @brief This defines the `DeduplicatingTileStore` class
+ */
+
+#include <algorithm>
+#include <string.h>             // for memcmp
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "DeduplicatingTileStore.hpp"
+
+using namespace ctb;
+
+/// The magic bytes at the start of a manifest
+static const char cManifestMagic[] = "CTBHASH2";
+
+DeduplicatingTileStore::DeduplicatingTileStore(std::unique_ptr<TileStore> store,
+                                               const std::string &manifestFilename):
+  mStore(std::move(store)),
+  mManifestFilename(manifestFilename),
+  mClosed(false),
+  mOriginalData(ORIGINAL_CACHE_SIZE),
+  mDuplicateCount(0),
+  mUnchangedCount(0)
+{
+  if (mStore->preservesTiles()) {
+    loadManifest();
+  }
+}
+
+DeduplicatingTileStore::~DeduplicatingTileStore() {
+  try {
+    close();
+  } catch (CTBException &) {
+    // errors can only be reported by calling `close` explicitly
+  }
+}
+
+/**
+ * @details An original is only registered once it has been written, so a
+ * duplicate never references a tile which is still being written.  Two
+ * identical tiles written at the same time may therefore both be stored in
+ * full.  Likewise the digest of a tile is only recorded in the manifest once
+ * the tile has been stored.  A tile whose hash matches an original but whose
+ * data differs is written in full, and the original is kept.
+ */
+void
+DeduplicatingTileStore::writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) {
+  const TileHash::Digest digest = TileHash::digest(data, size);
+  const uint64_t hash = digest.first,
+    key = tileKey(coord);
+  Shard &tileShard = mShards[key % SHARD_COUNT],
+    &dataShard = mShards[hash % SHARD_COUNT];
+
+  // Check whether the tile is unchanged since the previous session
+  bool unchanged;
+  {
+    std::lock_guard<std::mutex> lock(tileShard.mutex);
+    const auto found = tileShard.digests.find(key);
+    unchanged = (found != tileShard.digests.end() && found->second == digest);
+  }
+
+  if (unchanged) {
+    ++mUnchangedCount;
+    std::lock_guard<std::mutex> lock(dataShard.mutex);
+    dataShard.originals.emplace(hash, coord);
+    return;
+  }
+
+  // Look for an original with the same data
+  TileCoordinate original;
+  bool duplicate;
+  {
+    std::lock_guard<std::mutex> lock(dataShard.mutex);
+    const auto found = dataShard.originals.find(hash);
+    duplicate = (found != dataShard.originals.end());
+    if (duplicate) {
+      original = found->second;
+    }
+  }
+
+  if (duplicate && isOriginal(original, hash, data, size)) {
+    ++mDuplicateCount;
+    mStore->writeDuplicate(coord, original, data, size);
+  } else {
+    mStore->writeTile(coord, data, size);
+
+    if (!duplicate) {
+      std::lock_guard<std::mutex> lock(dataShard.mutex);
+      if (dataShard.originals.emplace(hash, coord).second) {
+        mOriginalData.put(hash, std::make_shared<const std::vector<unsigned char>>(data, data + size), size);
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(tileShard.mutex);
+  tileShard.digests[key] = digest;
+}
+
+/**
+ * @details The cached data of the original is compared if it is available,
+ * otherwise the original is read back from the wrapped store and cached.
+ * Stores which can't read tiles while they are being written throw an
+ * exception, which counts as a mismatch.
+ */
+bool
+DeduplicatingTileStore::isOriginal(const TileCoordinate &original, uint64_t hash,
+                                   const unsigned char *data, size_t size) {
+  std::shared_ptr<const std::vector<unsigned char>> cached = mOriginalData.get(hash);
+
+  if (!cached) {
+    std::shared_ptr<std::vector<unsigned char>> stored = std::make_shared<std::vector<unsigned char>>();
+    try {
+      if (!mStore->readTile(original, *stored)) {
+        return false;
+      }
+    } catch (CTBException &) {
+      return false;
+    }
+
+    mOriginalData.put(hash, stored, stored->size());
+    cached = stored;
+  }
+
+  return cached->size() == size && memcmp(cached->data(), data, size) == 0;
+}
+
+bool
+DeduplicatingTileStore::readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const {
+  return mStore->readTile(coord, data);
+}
+
+void
+DeduplicatingTileStore::close() {
+  if (mClosed) {
+    return;
+  }
+  mClosed = true;
+
+  mStore->close();
+  saveManifest();
+}
+
+/**
+ * @details The manifest is the magic bytes, the number of tiles and then a
+ * tile key and the two halves of the data digest for each tile, all as 64 bit
+ * integers.  A missing or unreadable manifest, including one from a version
+ * which recorded 64 bit hashes, simply means every tile is treated as changed.
+ */
+void
+DeduplicatingTileStore::loadManifest() {
+  VSILFILE *fp = VSIFOpenL(mManifestFilename.c_str(), "rb");
+  if (fp == NULL) {
+    return;
+  }
+
+  char magic[8];
+  uint64_t count;
+  if (VSIFReadL(magic, 1, 8, fp) != 8 || memcmp(magic, cManifestMagic, 8) != 0
+      || VSIFReadL(&count, sizeof(count), 1, fp) != 1) {
+    VSIFCloseL(fp);
+    return;
+  }
+
+  uint64_t entry[3];
+  for (uint64_t i = 0; i < count && VSIFReadL(entry, sizeof(entry), 1, fp) == 1; ++i) {
+    const TileHash::Digest digest = {entry[1], entry[2]};
+    mShards[entry[0] % SHARD_COUNT].digests[entry[0]] = digest;
+  }
+
+  VSIFCloseL(fp);
+}
+
+/**
+ * @details The manifest is written to a temporary file which then replaces
+ * the previous manifest, so an interrupted session leaves the previous
+ * manifest intact.
+ */
+void
+DeduplicatingTileStore::saveManifest() {
+  std::vector<std::pair<uint64_t, TileHash::Digest>> entries;
+  for (Shard &shard: mShards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    entries.insert(entries.end(), shard.digests.begin(), shard.digests.end());
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const std::pair<uint64_t, TileHash::Digest> &a, const std::pair<uint64_t, TileHash::Digest> &b) {
+              return a.first < b.first;
+            });
+
+  const std::string tempFilename = mManifestFilename + ".tmp";
+  VSILFILE *fp = VSIFOpenL(tempFilename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the tile manifest");
+  }
+
+  const uint64_t count = entries.size();
+  bool failed = (VSIFWriteL(cManifestMagic, 1, 8, fp) != 8)
+    || (VSIFWriteL(&count, sizeof(count), 1, fp) != 1);
+
+  for (const auto &entry: entries) {
+    const uint64_t values[3] = {entry.first, entry.second.first, entry.second.second};
+    failed = failed || (VSIFWriteL(values, sizeof(values), 1, fp) != 1);
+  }
+
+  failed = (VSIFCloseL(fp) != 0) || failed;
+  if (failed || VSIRename(tempFilename.c_str(), mManifestFilename.c_str()) != 0) {
+    VSIUnlink(tempFilename.c_str());
+    throw CTBException("Failed to write the tile manifest");
+  }
+}
@@ -0,0 +1,138 @@
+#ifndef DEDUPLICATINGTILESTORE_HPP
+#define DEDUPLICATINGTILESTORE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file DeduplicatingTileStore.hpp
+ * @brief This declares the `DeduplicatingTileStore` class
+ */
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "LRUCache.hpp"
+#include "TileHash.hpp"
+#include "TileStore.hpp"
+
+namespace ctb {
+  class DeduplicatingTileStore;
+}
+
+/**
+ * @brief Avoid storing identical tiles more than once
+ *
+ * This wraps another tile store, hashing the data of each tile written with
+ * `TileHash`.  A tile whose hash matches one already written is compared byte
+ * for byte with that original, and only if they are identical is it passed to
+ * the wrapped store as a duplicate, which the store can then share:
+ * directories use hard links, MBTiles databases share the image and tile
+ * packs share the data.  The data of recent originals is cached for the
+ * comparison, and otherwise read back from the wrapped store.  A tile whose
+ * original can't be compared is written in full.
+ *
+ * The 128 bit digest of every tile is also recorded in a manifest file when
+ * the store is closed.  If the wrapped store preserves tiles between sessions
+ * then the manifest is read back when the store is next opened, and a tile
+ * whose digest matches the manifest is not written again as it is unchanged.
+ * This assumes the tiles aren't modified by anything else in the meantime.
+ *
+ * The hash tables are split into independently locked shards so that
+ * concurrent writers rarely contend.
+ */
+class CTB_DLL ctb::DeduplicatingTileStore :
+  public TileStore
+{
+public:
+
+  /// Wrap a store, using a manifest file to record the tile hashes
+  DeduplicatingTileStore(std::unique_ptr<TileStore> store, const std::string &manifestFilename);
+
+  /// Close the store, saving the manifest
+  ~DeduplicatingTileStore();
+
+  void
+  writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) override;
+
+  bool
+  readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const override;
+
+  /// Close the wrapped store and save the manifest
+  void
+  close() override;
+
+  bool
+  preservesTiles() const override {
+    return mStore->preservesTiles();
+  }
+
+  /// Get the wrapped store
+  TileStore &
+  store() const {
+    return *mStore;
+  }
+
+  /// Get the number of tiles written as duplicates
+  uint64_t
+  duplicateCount() const {
+    return mDuplicateCount;
+  }
+
+  /// Get the number of tiles not written as they were unchanged
+  uint64_t
+  unchangedCount() const {
+    return mUnchangedCount;
+  }
+
+  /// The number of shards the hash tables are split into
+  static const size_t SHARD_COUNT = 64;
+
+  /// The memory used to cache the data of originals
+  static const size_t ORIGINAL_CACHE_SIZE = 64 * 1024 * 1024;
+
+private:
+
+  /// A part of the hash tables
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, TileCoordinate> originals; ///< Tiles keyed by data hash
+    std::unordered_map<uint64_t, TileHash::Digest> digests; ///< Data digests keyed by tile key
+  };
+
+  /// Does an original have exactly the given data?
+  bool
+  isOriginal(const TileCoordinate &original, uint64_t hash, const unsigned char *data, size_t size);
+
+  /// Read the manifest from a previous session
+  void
+  loadManifest();
+
+  /// Write the manifest of all tiles
+  void
+  saveManifest();
+
+  std::unique_ptr<TileStore> mStore; ///< The wrapped store
+  std::string mManifestFilename; ///< Where the tile hashes are recorded
+  bool mClosed;                 ///< Has the store been closed?
+  Shard mShards[SHARD_COUNT];   ///< The hash tables
+  LRUCache<uint64_t, std::vector<unsigned char>> mOriginalData; ///< Data of originals by hash
+  std::atomic<uint64_t> mDuplicateCount; ///< The number of duplicates
+  std::atomic<uint64_t> mUnchangedCount; ///< The number of unchanged tiles
+};
+
+#endif /* DEDUPLICATINGTILESTORE_HPP */
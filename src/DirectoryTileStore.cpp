@@ -0,0 +1,263 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file DirectoryTileStore.cpp
+ * @brief This defines the `DirectoryTileStore` class
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "DirectoryTileStore.hpp"
+
+using namespace ctb;
+
+#ifdef _WIN32
+static const char *osDirSep = "\\";
+#else
+static const char *osDirSep = "/";
+#endif
+
+/// Append a number to a string without going through a stream
+static void
+appendNumber(std::string &str, unsigned long long number) {
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%llu", number);
+  str.append(digits, length);
+}
+
+/**
+ * Get a name for a temporary file alongside a tile file
+ *
+ * The name is unique to the thread and the process, which is itself
+ * identified by a random number as processes on different machines can share
+ * the directory.  The name is written to a buffer which can be reused between
+ * tiles.
+ */
+static void
+tempFilename(const std::string &filename, std::string &temp) {
+  static const std::string process = [] {
+    std::random_device random;
+    std::ostringstream name;
+    name << std::hex << random() << random();
+    return name.str();
+  }();
+  static std::atomic<uint64_t> counter(0);
+
+  temp.assign(filename);
+  temp.append(".tmp-");
+  temp.append(process);
+  temp.append("-");
+  appendNumber(temp, counter++);
+}
+
+/// Create a directory if it doesn't already exist
+static void
+ensureDirectory(const std::string &dirname, const char *error) {
+  VSIStatBufL stat;
+
+  if (VSIStatExL(dirname.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
+    if (VSIMkdir(dirname.c_str(), 0755)) {
+      throw CTBException(error);
+    }
+  } else if (!VSI_ISDIR(stat.st_mode)) {
+    throw CTBException(error);
+  }
+}
+
+DirectoryTileStore::DirectoryTileStore(const std::string &dirname, const std::string &extension, bool writable):
+  mDirname(dirname),
+  mExtension(extension)
+{
+  if (writable) {
+    ensureDirectory(mDirname, "Could not create the output directory");
+  } else {
+    VSIStatBufL stat;
+    if (VSIStatExL(mDirname.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)
+        || !VSI_ISDIR(stat.st_mode)) {
+      throw CTBException("The tile directory does not exist");
+    }
+  }
+}
+
+std::string
+DirectoryTileStore::tileFilename(const TileCoordinate &coord) const {
+  std::string filename;
+  tileFilename(coord, filename);
+
+  return filename;
+}
+
+void
+DirectoryTileStore::tileFilename(const TileCoordinate &coord, std::string &filename) const {
+  filename.assign(mDirname);
+  filename.append(osDirSep);
+  appendNumber(filename, coord.zoom);
+  filename.append(osDirSep);
+  appendNumber(filename, coord.x);
+  filename.append(osDirSep);
+  appendNumber(filename, coord.y);
+
+  if (!mExtension.empty()) {
+    filename.append(".");
+    filename.append(mExtension);
+  }
+}
+
+std::string
+DirectoryTileStore::createTileFilename(const TileCoordinate &coord) {
+  std::string filename;
+  createTileFilename(coord, filename);
+
+  return filename;
+}
+
+/**
+ * @details The names of the `{zoom}` and `{zoom}/{x}` directories are built
+ * up in the filename buffer itself.  Directory creation is serialised between threads so that
+ * two threads don't both try and create the same directory.
+ */
+void
+DirectoryTileStore::createTileFilename(const TileCoordinate &coord, std::string &filename) {
+  filename.assign(mDirname);
+  filename.append(osDirSep);
+  appendNumber(filename, coord.zoom);
+  const size_t zoomLength = filename.size();
+  filename.append(osDirSep);
+  appendNumber(filename, coord.x);
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    VSIStatBufL stat;
+
+    // Check whether the `{zoom}/{x}` directory exists or not
+    if (VSIStatExL(filename.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
+      filename.resize(zoomLength);
+      ensureDirectory(filename, "Could not create the zoom level directory");
+
+      filename.append(osDirSep);
+      appendNumber(filename, coord.x);
+      if (VSIMkdir(filename.c_str(), 0755))
+        throw CTBException("Could not create the x level directory");
+
+    } else if (!VSI_ISDIR(stat.st_mode)) {
+      throw CTBException("X level file path is not a directory");
+    }
+  }
+
+  tileFilename(coord, filename);
+}
+
+/**
+ * @details The tile is written to a temporary file which then replaces the
+ * tile file, so readers see either the previous tile or the whole of the new
+ * one.  This also replaces rather than overwrites a hard link shared with
+ * other tiles.  The filenames are built in buffers kept by each thread.
+ */
+void
+DirectoryTileStore::writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) {
+  static thread_local std::string filename, temp;
+  createTileFilename(coord, filename);
+  tempFilename(filename, temp);
+  VSILFILE *fp = VSIFOpenL(temp.c_str(), "wb");
+
+  if (fp == NULL) {
+    throw CTBException("Failed to open tile file");
+  }
+
+  if (VSIFWriteL(data, 1, size, fp) != size) {
+    VSIFCloseL(fp);
+    VSIUnlink(temp.c_str());
+    throw CTBException("Failed to write tile file");
+  }
+
+  if (VSIFCloseL(fp) != 0) {
+    VSIUnlink(temp.c_str());
+    throw CTBException("Failed to close tile file");
+  }
+
+  if (VSIRename(temp.c_str(), filename.c_str()) != 0) {
+    VSIUnlink(temp.c_str());
+    throw CTBException("Failed to replace tile file");
+  }
+}
+
+void
+DirectoryTileStore::writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                                   const unsigned char *data, size_t size) {
+  static thread_local std::string filename;
+  tileFilename(original, filename);
+  linkTile(coord, filename, data, size);
+}
+
+/**
+ * @details As with `writeTile` the link is made under a temporary name which
+ * then replaces the tile file.  A rename between two links to the same file
+ * does nothing, so the temporary link is always removed afterwards.
+ */
+void
+DirectoryTileStore::linkTile(const TileCoordinate &coord, const std::string &filename,
+                             const unsigned char *data, size_t size) {
+  static thread_local std::string linkname, temp;
+  createTileFilename(coord, linkname);
+  tempFilename(linkname, temp);
+  boost::system::error_code error;
+
+  boost::filesystem::create_hard_link(filename, temp, error);
+  if (!error) {
+    if (VSIRename(temp.c_str(), linkname.c_str()) != 0) {
+      error = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    VSIUnlink(temp.c_str());
+  }
+
+  // Links may not be supported by the filesystem, or cross filesystems
+  if (error) {
+    writeTile(coord, data, size);
+  }
+}
+
+bool
+DirectoryTileStore::readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const {
+  static thread_local std::string filename;
+  tileFilename(coord, filename);
+  VSILFILE *fp = VSIFOpenL(filename.c_str(), "rb");
+
+  if (fp == NULL) {
+    return false;
+  }
+
+  // Get the file size and read the whole file
+  VSIFSeekL(fp, 0, SEEK_END);
+  data.resize((size_t) VSIFTellL(fp));
+  VSIFSeekL(fp, 0, SEEK_SET);
+
+  if (VSIFReadL(data.data(), 1, data.size(), fp) != data.size()) {
+    VSIFCloseL(fp);
+    throw CTBException("Failed to read tile file");
+  }
+
+  VSIFCloseL(fp);
+  return true;
+}
@@ -0,0 +1,94 @@
+#ifndef DIRECTORYTILESTORE_HPP
+#define DIRECTORYTILESTORE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file DirectoryTileStore.hpp
+ * @brief This declares the `DirectoryTileStore` class
+ */
+
+#include <mutex>
+
+#include "TileStore.hpp"
+
+namespace ctb {
+  class DirectoryTileStore;
+}
+
+/**
+ * @brief Store tiles as files in a directory structure
+ *
+ * Tiles are stored as `{zoom}/{x}/{y}.{extension}` relative to the root
+ * directory, which is the layout served by Cesium and TMS clients.  Duplicate
+ * tiles are hard links to the file of the original tile, so tile files are
+ * always replaced rather than rewritten in place.
+ */
+class CTB_DLL ctb::DirectoryTileStore :
+  public TileStore
+{
+public:
+
+  /// Use a directory as a tile store
+  DirectoryTileStore(const std::string &dirname, const std::string &extension, bool writable);
+
+  void
+  writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) override;
+
+  /// Hard link the tile to the original, falling back to writing it
+  void
+  writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                 const unsigned char *data, size_t size) override;
+
+  /**
+   * @brief Hard link a tile to an existing file, falling back to writing it
+   *
+   * The file can be in another directory, which allows unchanged tiles to be
+   * copied between stores without rewriting them.
+   */
+  void
+  linkTile(const TileCoordinate &coord, const std::string &filename,
+           const unsigned char *data, size_t size);
+
+  bool
+  readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const override;
+
+  /// Get the filename of a tile
+  std::string
+  tileFilename(const TileCoordinate &coord) const;
+
+  /// Get the filename of a tile, creating its parent directories
+  std::string
+  createTileFilename(const TileCoordinate &coord);
+
+  /// Write the filename of a tile to a buffer which can be reused
+  void
+  tileFilename(const TileCoordinate &coord, std::string &filename) const;
+
+  /// Write the filename of a tile to a buffer which can be reused, creating
+  /// its parent directories
+  void
+  createTileFilename(const TileCoordinate &coord, std::string &filename);
+
+private:
+
+  std::string mDirname;         ///< The root directory
+  std::string mExtension;       ///< The tile file extension
+  std::mutex mMutex;            ///< Serialise directory creation
+};
+
+#endif /* DIRECTORYTILESTORE_HPP */
@@ -22,15 +22,23 @@
 #include "gdalwarper.h"
 
 #include "GDALTile.hpp"
+#include "ReprojectionContext.hpp"
 
 using namespace ctb;
 
 GDALTile::~GDALTile() {
+  // The dataset must be closed before the transformer it wraps is freed
   if (dataset != NULL) {
     GDALClose(dataset);
+  }
 
-    if (transformer != NULL) {
-      GDALDestroyGenImgProjTransformer(transformer);
+  if (transformer != NULL) {
+    if (context) {
+      context->destroyTransformer(transformer);
+    } else {
+      GDALDestroyTransformer(transformer);
     }
+  } else if (context) {
+    context->release();
   }
 }
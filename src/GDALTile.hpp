@@ -22,6 +22,8 @@
  * @brief This declares the `GDALTile` class
  */
 
+#include <memory>
+
 #include "gdal_priv.h"
 
 #include "config.hpp"           // for CTB_DLL
@@ -30,6 +32,7 @@
 namespace ctb {
   class GDALTile;
   class GDALTiler;              // forward declaration
+  class ReprojectionContext;    // forward declaration
 }
 
 /**
@@ -41,6 +44,10 @@ namespace ctb {
  * (`GDALApproxTransform`). In this case there is the top level transformer (the
  * linear approximation) which wraps an image transformer.  The VRT owns any top
  * level transformer, but we are responsible for the wrapped image transformer.
+ * A transformer created by a `ReprojectionContext` is destroyed by that
+ * context.  If the tile uses the context's own transformer then there is no
+ * transformer to destroy and the context is released instead once the VRT has
+ * been closed.
  */
 class CTB_DLL ctb::GDALTile :
   public Tile
@@ -53,6 +60,20 @@ public:
     transformer(transformer)
   {}
 
+  /**
+   * @brief Take ownership of a dataset and a transformer created by a context
+   *
+   * A `NULL` transformer means the dataset uses the transformer of the
+   * context, which the tile has acquired.
+   */
+  GDALTile(GDALDataset *dataset, void *transformer,
+           const std::shared_ptr<ReprojectionContext> &context):
+    Tile(),
+    dataset(dataset),
+    transformer(transformer),
+    context(context)
+  {}
+
   ~GDALTile();
 
   GDALDataset *dataset;
@@ -62,6 +83,9 @@ protected:
 
   /// The image to image transformer
   void *transformer;
+
+  /// The context which created or owns the transformer used by the dataset
+  std::shared_ptr<ReprojectionContext> context;
 };
 
 #endif /* GDALTILE_HPP */
@@ -22,6 +22,10 @@
 #include <cmath>                // std::abs
 #include <algorithm>            // std::minmax
 #include <string.h>             // strlen
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "gdal_priv.h"
 #include "gdalwarper.h"
@@ -30,7 +34,9 @@
 
 #include "config.hpp"
 #include "CTBException.hpp"
+#include "Cutline.hpp"
 #include "GDALTiler.hpp"
+#include "ReprojectionContext.hpp"
 
 using namespace ctb;
 
@@ -123,8 +129,10 @@ GDALTiler::GDALTiler(GDALDataset *poDataset, const Grid &grid, const TilerOption
 GDALTiler::GDALTiler(const GDALTiler &other):
   mGrid(other.mGrid),
   poDataset(other.poDataset),
+  options(other.options),
   mBounds(other.mBounds),
   mResolution(other.mResolution),
+  mCutline(other.mCutline),
   crsWKT(other.crsWKT)
 {
   if (poDataset != NULL) {
@@ -135,8 +143,10 @@ GDALTiler::GDALTiler(const GDALTiler &other):
 GDALTiler::GDALTiler(GDALTiler &other):
   mGrid(other.mGrid),
   poDataset(other.poDataset),
+  options(other.options),
   mBounds(other.mBounds),
   mResolution(other.mResolution),
+  mCutline(other.mCutline),
   crsWKT(other.crsWKT)
 {
   if (poDataset != NULL) {
@@ -148,6 +158,12 @@ GDALTiler &
 GDALTiler::operator=(const GDALTiler &other) {
   closeDataset();
 
+  // The contexts refer to the old dataset
+  {
+    std::lock_guard<std::mutex> lock(mContextsMutex);
+    mContexts.clear();
+  }
+
   mGrid = other.mGrid;
   poDataset = other.poDataset;
 
@@ -155,8 +171,10 @@ GDALTiler::operator=(const GDALTiler &other) {
     poDataset->Reference();     // increase the refcount of the dataset
   }
 
+  options = other.options;
   mBounds = other.mBounds;
   mResolution = other.mResolution;
+  mCutline = other.mCutline;
   crsWKT = other.crsWKT;
 
   return *this;
@@ -166,7 +184,33 @@ GDALTiler::~GDALTiler() {
   closeDataset();
 }
 
-GDALTile *
+void
+GDALTiler::clip(const CRSBounds &bounds) {
+  if (!mBounds.overlaps(bounds)) {
+    throw CTBException("The clipping region does not overlap the dataset");
+  }
+
+  mBounds = CRSBounds(std::max(mBounds.getMinX(), bounds.getMinX()),
+                      std::max(mBounds.getMinY(), bounds.getMinY()),
+                      std::min(mBounds.getMaxX(), bounds.getMaxX()),
+                      std::min(mBounds.getMaxY(), bounds.getMaxY()));
+}
+
+void
+GDALTiler::setCutline(std::shared_ptr<const Cutline> cutline) {
+  if (cutline) {
+    clip(cutline->bounds());
+  }
+  mCutline = cutline;
+}
+
+bool
+GDALTiler::overlaps(const CRSBounds &bounds) const {
+  return mBounds.overlaps(bounds)
+    && (!mCutline || mCutline->coverage(bounds) != Cutline::OUTSIDE);
+}
+
+std::unique_ptr<GDALTile>
 GDALTiler::createRasterTile(const TileCoordinate &coord) const {
   // Convert the tile bounds into a geo transform
   double adfGeoTransform[6],
@@ -180,7 +224,7 @@ GDALTiler::createRasterTile(const TileCoordinate &coord) const {
   adfGeoTransform[4] = 0;
   adfGeoTransform[5] = -resolution;
 
-  GDALTile *tile = createRasterTile(adfGeoTransform);
+  std::unique_ptr<GDALTile> tile = createRasterTile(adfGeoTransform);
   static_cast<TileCoordinate &>(*tile) = coord;
 
   // Set the shifted geo transform to the VRT
@@ -199,10 +243,14 @@ GDALTiler::createRasterTile(const TileCoordinate &coord) const {
  * is then encapsulated as a GDAL virtual raster (VRT) dataset and returned to
  * the caller.
  *
- * It is the caller's responsibility to call `GDALClose()` on the returned
- * dataset.
+ * The image to image transformer is taken from the thread's
+ * `ReprojectionContext` so that it is only set up once per thread rather than
+ * for every tile.  If that transformer is still in use by a previous tile then
+ * a new one is created for this tile instead.
+ *
+ * The returned tile owns the dataset and closes it when destroyed.
  */
-GDALTile *
+std::unique_ptr<GDALTile>
 GDALTiler::createRasterTile(double (&adfGeoTransform)[6]) const {
   if (poDataset == NULL) {
     throw CTBException("No GDAL dataset is set");
@@ -212,9 +260,6 @@ GDALTiler::createRasterTile(double (&adfGeoTransform)[6]) const {
   GDALDatasetH hSrcDS = (GDALDatasetH) dataset();
   GDALDatasetH hDstDS;
 
-  // The transformation option list
-  CPLStringList transformOptions;
-
   // The source, sink and grid srs
   const char *pszSrcWKT = GDALGetProjectionRef(hSrcDS),
     *pszGridWKT = pszSrcWKT;
@@ -222,90 +267,305 @@ GDALTiler::createRasterTile(double (&adfGeoTransform)[6]) const {
   if (!strlen(pszSrcWKT))
     throw CTBException("The source dataset no longer has a spatial reference system assigned");
 
-  // Populate the SRS WKT strings if we need to reproject
   if (requiresReprojection()) {
     pszGridWKT = crsWKT.c_str();
-    transformOptions.SetNameValue("SRC_SRS", pszSrcWKT);
-    transformOptions.SetNameValue("DST_SRS", pszGridWKT);
-  }
-
-  // Set the warp options
-  GDALWarpOptions *psWarpOptions = GDALCreateWarpOptions();
-  //psWarpOptions->eResampleAlg = eResampleAlg;
-  psWarpOptions->dfWarpMemoryLimit = options.warpMemoryLimit;
-  psWarpOptions->hSrcDS = hSrcDS;
-  psWarpOptions->nBandCount = poDataset->GetRasterCount();
-  psWarpOptions->panSrcBands =
-    (int *) CPLMalloc(sizeof(int) * psWarpOptions->nBandCount );
-  psWarpOptions->panDstBands =
-    (int *) CPLMalloc(sizeof(int) * psWarpOptions->nBandCount );
-
-  for (short unsigned int i = 0; i < psWarpOptions->nBandCount; ++i) {
-    psWarpOptions->panDstBands[i] = psWarpOptions->panSrcBands[i] = i + 1;
   }
 
-  // Create the image to image transformer
-  void *transformerArg = GDALCreateGenImgProjTransformer2(hSrcDS, NULL, transformOptions.List());
+  // Get the image to image transformer, preferably the cached one
+  std::shared_ptr<ReprojectionContext> context = reprojectionContext();
+  const bool shared = context->acquire();
+  void *transformerArg = shared ? context->transformer() : context->createTransformer();
   if(transformerArg == NULL) {
-    GDALDestroyWarpOptions(psWarpOptions);
     throw CTBException("Could not create image to image transformer");
   }
 
   // Specify the destination geotransform
-  GDALSetGenImgProjTransformerDstGeoTransform(transformerArg, adfGeoTransform );
-
-  // Decide if we are doing an approximate or exact transformation
-  if (options.errorThreshold) {
-    // approximate: wrap the transformer with a linear approximator
-    psWarpOptions->pTransformerArg =
-      GDALCreateApproxTransformer(GDALGenImgProjTransform, transformerArg, options.errorThreshold);
-
-    if (psWarpOptions->pTransformerArg == NULL) {
-      GDALDestroyWarpOptions(psWarpOptions);
-      GDALDestroyGenImgProjTransformer(transformerArg);
-      throw CTBException("Could not create linear approximator");
+  context->setDstGeoTransform(transformerArg, adfGeoTransform);
+
+  // Set the warp options, wrapping the transformer with a linear approximator
+  GDALWarpOptions *psWarpOptions;
+  try {
+    psWarpOptions = context->createWarpOptions(transformerArg);
+  } catch (CTBException &e) {
+    if (shared) {
+      context->release();
+    } else {
+      context->destroyTransformer(transformerArg);
     }
-
-    psWarpOptions->pfnTransformer = GDALApproxTransform;
-
-  } else {
-    // exact: no wrapping required
-    psWarpOptions->pTransformerArg = transformerArg;
-    psWarpOptions->pfnTransformer = GDALGenImgProjTransform;
+    throw;
   }
 
-  // Specify a multi threaded warp operation using all CPU cores
-  CPLStringList warpOptions(psWarpOptions->papszWarpOptions, false);
-  warpOptions.SetNameValue("NUM_THREADS", "ALL_CPUS");
-  psWarpOptions->papszWarpOptions = warpOptions.StealList();
-
   // The raster tile is represented as a VRT dataset
   hDstDS = GDALCreateWarpedVRT(hSrcDS, mGrid.tileSize(), mGrid.tileSize(), adfGeoTransform, psWarpOptions);
+
+  if (hDstDS == NULL) {
+    GDALDestroyApproxTransformer(psWarpOptions->pTransformerArg);
+  }
   GDALDestroyWarpOptions( psWarpOptions );
 
+  // The tile manages the base transformer, either by having the context destroy
+  // it or by releasing the context when it is destroyed
+  std::unique_ptr<GDALTile> tile(new GDALTile((GDALDataset *) hDstDS,
+                                               shared ? NULL : transformerArg,
+                                               context));
+
   if (hDstDS == NULL) {
-    GDALDestroyGenImgProjTransformer(transformerArg);
     throw CTBException("Could not create warped VRT");
   }
 
   // Set the projection information on the dataset. This will always be the grid
   // SRS.
   if (GDALSetProjection( hDstDS, pszGridWKT ) != CE_None) {
-    GDALClose(hDstDS);
-    if (transformerArg != NULL) {
-      GDALDestroyGenImgProjTransformer(transformerArg);
-    }
     throw CTBException("Could not set projection on VRT");
   }
 
   // If uncommenting the following line for debug purposes, you must also `#include "vrtdataset.h"`
   //std::cout << "VRT: " << CPLSerializeXMLTree(((VRTWarpedDataset *) hDstDS)->SerializeToXML(NULL)) << std::endl;
 
-  // Create the tile, passing it the base image transformer to manage if this is
-  // an approximate transform
-  return new GDALTile((GDALDataset *) hDstDS,
-                      (psWarpOptions->pfnTransformer == GDALApproxTransform)
-                      ? transformerArg : NULL);
+  return tile;
+}
+
+/**
+ * @details Contexts are created lazily, one for each thread calling this
+ * method, and live for as long as the tiler (or any tile still using them).
+ */
+std::shared_ptr<ReprojectionContext>
+GDALTiler::reprojectionContext() const {
+  std::lock_guard<std::mutex> lock(mContextsMutex);
+  std::shared_ptr<ReprojectionContext> &context = mContexts[std::this_thread::get_id()];
+
+  if (!context) {
+    context = std::make_shared<ReprojectionContext>(poDataset, crsWKT, options);
+  }
+
+  return context;
+}
+
+/**
+ * @details This reprojects the whole dataset to the grid spatial reference
+ * system at the resolution of the maximum zoom level and writes the result to
+ * a tiled GeoTIFF, with the extent snapped to the pixel grid of that zoom
+ * level.  A tiler created on the returned dataset does not require
+ * reprojection and so avoids setting up a reprojecting transformer for every
+ * tile.
+ *
+ * The output is divided into chunks of whole GeoTIFF blocks which are warped in
+ * parallel by `threadCount` threads.  Each thread opens its own handle on the
+ * source dataset and warps into a private buffer: only writing the buffers to
+ * the output is serialised.
+ *
+ * It is the caller's responsibility to call `GDALClose()` on the returned
+ * dataset.
+ */
+GDALDataset *
+GDALTiler::createPrewarpedDataset(const char *filename,
+                                  unsigned int threadCount,
+                                  GDALProgressFunc pfnProgress,
+                                  void *pProgressArg) const {
+  if (poDataset == NULL) {
+    throw CTBException("No GDAL dataset is set");
+  }
+
+  const int nBands = poDataset->GetRasterCount();
+  if (nBands < 1) {
+    throw CTBException("At least one band must be present in the GDAL dataset");
+  }
+
+  if (pfnProgress == NULL) {
+    pfnProgress = GDALDummyProgress;
+  }
+
+  // The source and sink SRS and the source filename which each thread opens
+  const std::string srcFilename = poDataset->GetDescription(),
+    srcWKT = poDataset->GetProjectionRef(),
+    gridWKT = requiresReprojection() ? crsWKT : srcWKT;
+
+  // Snap the dataset bounds to the pixel grid of the maximum zoom level
+  const double resolution = mGrid.resolution(maxZoomLevel());
+  const CRSBounds &extent = mGrid.getExtent();
+  const double minX = extent.getMinX() + std::floor((mBounds.getMinX() - extent.getMinX()) / resolution) * resolution,
+    maxX = extent.getMinX() + std::ceil((mBounds.getMaxX() - extent.getMinX()) / resolution) * resolution,
+    minY = extent.getMinY() + std::floor((mBounds.getMinY() - extent.getMinY()) / resolution) * resolution,
+    maxY = extent.getMinY() + std::ceil((mBounds.getMaxY() - extent.getMinY()) / resolution) * resolution;
+  const int xSize = (int) std::floor(((maxX - minX) / resolution) + 0.5),
+    ySize = (int) std::floor(((maxY - minY) / resolution) + 0.5);
+  double adfGeoTransform[6] = { minX, resolution, 0, maxY, 0, -resolution };
+
+  // The output takes its data type and nodata value from the first band
+  GDALRasterBand *poSrcBand = poDataset->GetRasterBand(1);
+  const GDALDataType eDataType = poSrcBand->GetRasterDataType();
+  const int typeSize = GDALGetDataTypeSizeBytes(eDataType);
+  int bHasNoData = FALSE;
+  const double dfNoData = poSrcBand->GetNoDataValue(&bHasNoData);
+
+  // Create the tiled output dataset
+  GDALDriverH hDriver = GDALGetDriverByName("GTiff");
+  if (hDriver == NULL) {
+    throw CTBException("Could not retrieve the GTiff driver");
+  }
+
+  const int blockSize = 256;
+  CPLStringList creationOptions;
+  creationOptions.SetNameValue("TILED", "YES");
+  creationOptions.SetNameValue("BLOCKXSIZE", CPLSPrintf("%d", blockSize));
+  creationOptions.SetNameValue("BLOCKYSIZE", CPLSPrintf("%d", blockSize));
+  creationOptions.SetNameValue("BIGTIFF", "IF_SAFER");
+  creationOptions.SetNameValue("SPARSE_OK", "TRUE");
+
+  GDALDatasetH hDstDS = GDALCreate(hDriver, filename, xSize, ySize, nBands, eDataType, creationOptions.List());
+  if (hDstDS == NULL) {
+    throw CTBException("Could not create the prewarped dataset");
+  }
+
+  if (GDALSetGeoTransform(hDstDS, adfGeoTransform) != CE_None
+      || GDALSetProjection(hDstDS, gridWKT.c_str()) != CE_None) {
+    GDALClose(hDstDS);
+    throw CTBException("Could not georeference the prewarped dataset");
+  }
+
+  if (bHasNoData) {
+    for (int i = 1; i <= nBands; ++i) {
+      GDALSetRasterNoDataValue(GDALGetRasterBand(hDstDS, i), dfNoData);
+    }
+  }
+
+  // Chunks are made up of whole blocks so no two threads ever write to the same
+  // block.  The chunk height is chosen so that the destination buffer takes
+  // about half of the warp memory.
+  const double memoryLimit = (options.warpMemoryLimit > 0) ? options.warpMemoryLimit : 64 * 1024 * 1024;
+  const int chunkXSize = std::min(xSize, blockSize * 16);
+  const int chunkYSize = std::max(blockSize, ((int) (memoryLimit / 2 / ((double) chunkXSize * nBands * typeSize)) / blockSize) * blockSize);
+  const int xChunks = (xSize + chunkXSize - 1) / chunkXSize,
+    chunkCount = xChunks * ((ySize + chunkYSize - 1) / chunkYSize);
+
+  std::atomic<int> nextChunk(0);
+  std::atomic<bool> failed(false);
+  std::mutex mutex;             // serialises output writes and progress
+  std::string error;
+  int chunksDone = 0;
+
+  // Record the first failure and stop the other threads
+  auto fail = [&](const char *message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!failed) {
+      error = message;
+      failed = true;
+    }
+  };
+
+  auto warpChunks = [&]() {
+    GDALDatasetH hSrcDS = GDALOpen(srcFilename.c_str(), GA_ReadOnly);
+    if (hSrcDS == NULL) {
+      return fail("Could not open the source dataset for prewarping");
+    }
+
+    CPLStringList transformOptions;
+    if (requiresReprojection()) {
+      transformOptions.SetNameValue("SRC_SRS", srcWKT.c_str());
+      transformOptions.SetNameValue("DST_SRS", gridWKT.c_str());
+    }
+
+    void *transformerArg = GDALCreateGenImgProjTransformer2(hSrcDS, NULL, transformOptions.List());
+    if (transformerArg == NULL) {
+      GDALClose(hSrcDS);
+      return fail("Could not create image to image transformer");
+    }
+    GDALSetGenImgProjTransformerDstGeoTransform(transformerArg, adfGeoTransform);
+
+    void *approxArg = NULL;
+    if (options.errorThreshold) {
+      approxArg = GDALCreateApproxTransformer(GDALGenImgProjTransform, transformerArg, options.errorThreshold);
+    }
+
+    // The destination is left unset as the operation only warps to buffers
+    GDALWarpOptions *psWarpOptions = GDALCreateWarpOptions();
+    psWarpOptions->dfWarpMemoryLimit = options.warpMemoryLimit;
+    psWarpOptions->eWorkingDataType = eDataType;
+    psWarpOptions->hSrcDS = hSrcDS;
+    psWarpOptions->nBandCount = nBands;
+    psWarpOptions->panSrcBands = (int *) CPLMalloc(sizeof(int) * nBands);
+    psWarpOptions->panDstBands = (int *) CPLMalloc(sizeof(int) * nBands);
+    for (int i = 0; i < nBands; ++i) {
+      psWarpOptions->panDstBands[i] = psWarpOptions->panSrcBands[i] = i + 1;
+    }
+
+    if (bHasNoData) {
+      psWarpOptions->padfSrcNoDataReal = (double *) CPLMalloc(sizeof(double) * nBands);
+      psWarpOptions->padfDstNoDataReal = (double *) CPLMalloc(sizeof(double) * nBands);
+      for (int i = 0; i < nBands; ++i) {
+        psWarpOptions->padfDstNoDataReal[i] = psWarpOptions->padfSrcNoDataReal[i] = dfNoData;
+      }
+    }
+
+    psWarpOptions->pfnTransformer = approxArg ? GDALApproxTransform : GDALGenImgProjTransform;
+    psWarpOptions->pTransformerArg = approxArg ? approxArg : transformerArg;
+    psWarpOptions->papszWarpOptions =
+      CSLSetNameValue(psWarpOptions->papszWarpOptions, "INIT_DEST", bHasNoData ? "NO_DATA" : "0");
+
+    {
+      GDALWarpOperation oOperation;
+
+      if ((approxArg == NULL && options.errorThreshold)
+          || oOperation.Initialize(psWarpOptions) != CE_None) {
+        fail("Could not initialise the prewarp operation");
+      } else {
+        std::vector<unsigned char> buffer((size_t) chunkXSize * chunkYSize * nBands * typeSize);
+
+        for (int chunk = nextChunk++; chunk < chunkCount && !failed; chunk = nextChunk++) {
+          const int xOff = (chunk % xChunks) * chunkXSize,
+            yOff = (chunk / xChunks) * chunkYSize,
+            width = std::min(chunkXSize, xSize - xOff),
+            height = std::min(chunkYSize, ySize - yOff);
+
+          if (oOperation.WarpRegionToBuffer(xOff, yOff, width, height, buffer.data(), eDataType) != CE_None) {
+            fail("Could not warp a region of the source dataset");
+            break;
+          }
+
+          std::lock_guard<std::mutex> lock(mutex);
+          for (int i = 0; i < nBands; ++i) {
+            unsigned char *bandData = buffer.data() + ((size_t) i * width * height * typeSize);
+            if (GDALRasterIO(GDALGetRasterBand(hDstDS, i + 1), GF_Write, xOff, yOff, width, height,
+                             bandData, width, height, eDataType, 0, 0) != CE_None) {
+              error = "Could not write to the prewarped dataset";
+              failed = true;
+            }
+          }
+
+          if (!failed && !pfnProgress(++chunksDone / (double) chunkCount, NULL, pProgressArg)) {
+            error = "The prewarp operation was cancelled";
+            failed = true;
+          }
+        }
+      }
+    }
+
+    GDALDestroyWarpOptions(psWarpOptions);
+    if (approxArg != NULL) {
+      GDALDestroyApproxTransformer(approxArg);
+    }
+    GDALDestroyGenImgProjTransformer(transformerArg);
+    GDALClose(hSrcDS);
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int i = 1; i < threadCount; ++i) {
+    threads.push_back(std::thread(warpChunks));
+  }
+  warpChunks();                 // this thread does its share of the work
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (failed) {
+    GDALClose(hDstDS);
+    VSIUnlink(filename);
+    throw CTBException(error.c_str());
+  }
+
+  GDALFlushCache(hDstDS);
+
+  return (GDALDataset *) hDstDS;
 }
 
 /**
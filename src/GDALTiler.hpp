@@ -23,6 +23,10 @@
  */
 
 #include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "TileCoordinate.hpp"
 #include "GlobalGeodetic.hpp"
@@ -32,6 +36,8 @@
 namespace ctb {
   struct TilerOptions;
   class GDALTiler;
+  class Cutline;
+  class ReprojectionContext;    // forward declaration
 }
 
 /// Options passed to a `GDALTiler`
@@ -40,6 +46,10 @@ struct ctb::TilerOptions {
   float errorThreshold = 0.125; // the `gdalwarp` default
   /// The memory limit of the warper in bytes
   double warpMemoryLimit = 0.0; // default to GDAL internal setting
+  /// Warp terrain heights via a warped VRT dataset instead of directly
+  bool useWarpedVRT = false;
+  /// Reproject between EPSG:4326 and EPSG:3857 without using PROJ
+  bool analyticTransform = true;
 };
 
 /**
@@ -87,7 +97,7 @@ public:
   ~GDALTiler();
 
   /// Create a tile from a tile coordinate
-  virtual Tile *
+  virtual std::unique_ptr<Tile>
   createTile(const TileCoordinate &coord) const = 0;
 
   /// Get the maximum zoom level for the dataset
@@ -141,24 +151,64 @@ public:
     return const_cast<const CRSBounds &>(mBounds);
   }
 
+  /**
+   * @brief Restrict tiling to a region of the grid CRS
+   *
+   * The tiler's bounds become the part of the dataset bounds within the
+   * region, so only tiles overlapping the region are iterated over.
+   */
+  void
+  clip(const CRSBounds &bounds);
+
+  /**
+   * @brief Restrict tiling to a polygon region in the grid CRS
+   *
+   * The tiler is clipped to the extent of the region.  Tiles which are only
+   * partly within the region can be tested with `overlaps`, and terrain tiles
+   * have the heights outside it set to sea level.
+   */
+  void
+  setCutline(std::shared_ptr<const Cutline> cutline);
+
+  /// Get the polygon region tiling is restricted to, if any
+  inline const std::shared_ptr<const Cutline> &
+  cutline() const {
+    return mCutline;
+  }
+
+  /// Does the region being tiled overlap an area, such as a tile?
+  bool
+  overlaps(const CRSBounds &bounds) const;
+
   /// Does the dataset require reprojecting to EPSG:4326?
   inline bool
   requiresReprojection() const {
     return crsWKT.size() > 0;
   }
 
+  /// Reproject the dataset to the grid once, writing the result to a file
+  GDALDataset *
+  createPrewarpedDataset(const char *filename,
+                         unsigned int threadCount = 1,
+                         GDALProgressFunc pfnProgress = NULL,
+                         void *pProgressArg = NULL) const;
+
 protected:
   /// Close the underlying dataset
   void closeDataset();
 
   /// Create a raster tile from a tile coordinate
-  virtual GDALTile *
+  virtual std::unique_ptr<GDALTile>
   createRasterTile(const TileCoordinate &coord) const;
 
   /// Create a raster tile from a geo transform
-  virtual GDALTile *
+  virtual std::unique_ptr<GDALTile>
   createRasterTile(double (&adfGeoTransform)[6]) const;
 
+  /// Get the reprojection context belonging to the calling thread
+  std::shared_ptr<ReprojectionContext>
+  reprojectionContext() const;
+
   /// The grid used for generating tiles
   Grid mGrid;
 
@@ -173,6 +223,9 @@ protected:
   /// The cell resolution of the underlying dataset
   double mResolution;
 
+  /// The polygon region tiling is restricted to, if any
+  std::shared_ptr<const Cutline> mCutline;
+
   /**
    * @brief The dataset projection in Well Known Text format
    *
@@ -180,6 +233,14 @@ protected:
    * reference system of the grid being used.
    */
   std::string crsWKT;
+
+private:
+
+  /// The reprojection contexts created by each thread using the tiler
+  mutable std::map<std::thread::id, std::shared_ptr<ReprojectionContext>> mContexts;
+
+  /// Guard access to the reprojection contexts
+  mutable std::mutex mContextsMutex;
 };
 
 #endif /* GDALTILER_HPP */
@@ -0,0 +1,247 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file GeodeticMercatorTransformer.cpp
+ * @brief This defines the `GeodeticMercatorTransformer` class
+ */
+
+#define _USE_MATH_DEFINES       // for M_PI
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>             // memcpy
+#include <vector>
+
+#include "cpl_conv.h"
+
+#include "GeodeticMercatorTransformer.hpp"
+
+using namespace ctb;
+
+/// The radius of the EPSG:3857 sphere in metres
+static const double cRadius = 6378137.0;
+
+/// Degrees to metres along the equator
+static const double cMetresPerDegree = cRadius * M_PI / 180.0;
+
+/// The latitude of the edges of the mercator profile, `atan(sinh(pi))`
+static const double cMaxMercatorLatitude = 85.0511287798066;
+
+/**
+ * @details PROJ computes `R asinh(tan(lat))` rather than `R atanh(sin(lat))`,
+ * which differ by up to about `1e-7` metres towards the edges of the profile.
+ */
+const double GeodeticMercatorTransformer::MAX_METRES_ERROR = 1e-6;
+const double GeodeticMercatorTransformer::MAX_DEGREES_ERROR = 1e-12;
+
+/**
+ * The state of a transformer
+ *
+ * Unlike GDAL transformers this doesn't start with a `GDALTransformerInfo`,
+ * which is private to GDAL.  The value initialised `bSrcIsGeodetic` coming
+ * first means GDAL can never mistake it for one of its own.
+ */
+struct GeodeticMercatorInfo {
+  /// Is the source in EPSG:4326?
+  bool bSrcIsGeodetic;
+
+  double adfSrcGeoTransform[6];
+  double adfSrcInvGeoTransform[6];
+  double adfDstGeoTransform[6];
+  double adfDstInvGeoTransform[6];
+};
+
+/// Apply a geotransform to coordinates in place
+static inline void
+applyGeoTransform(const double *gt, int nPointCount, double *x, double *y) {
+  const double g0 = gt[0], g1 = gt[1], g2 = gt[2], g3 = gt[3], g4 = gt[4], g5 = gt[5];
+
+  for (int i = 0; i < nPointCount; ++i) {
+    const double px = x[i], py = y[i];
+    x[i] = g0 + px * g1 + py * g2;
+    y[i] = g3 + px * g4 + py * g5;
+  }
+}
+
+/// Get the EPSG:4326 spatial reference system
+static const OGRSpatialReference &
+geodeticSRS() {
+  static const OGRSpatialReference srs = [] {
+    OGRSpatialReference s;
+    s.importFromEPSG(4326);
+    return s;
+  }();
+  return srs;
+}
+
+/// Get the EPSG:3857 spatial reference system
+static const OGRSpatialReference &
+mercatorSRS() {
+  static const OGRSpatialReference srs = [] {
+    OGRSpatialReference s;
+    s.importFromEPSG(3857);
+    return s;
+  }();
+  return srs;
+}
+
+bool
+GeodeticMercatorTransformer::supports(const OGRSpatialReference &srcSRS,
+                                      const OGRSpatialReference &dstSRS) {
+  return (srcSRS.IsSame(&geodeticSRS()) && dstSRS.IsSame(&mercatorSRS()))
+    || (srcSRS.IsSame(&mercatorSRS()) && dstSRS.IsSame(&geodeticSRS()));
+}
+
+void *
+GeodeticMercatorTransformer::create(GDALDatasetH hSrcDS, bool srcIsGeodetic) {
+  GeodeticMercatorInfo *psInfo = new GeodeticMercatorInfo();
+
+  if (GDALGetGeoTransform(hSrcDS, psInfo->adfSrcGeoTransform) != CE_None
+      || !GDALInvGeoTransform(psInfo->adfSrcGeoTransform, psInfo->adfSrcInvGeoTransform)) {
+    delete psInfo;
+    return NULL;
+  }
+
+  psInfo->bSrcIsGeodetic = srcIsGeodetic;
+
+  const double adfIdentity[6] = { 0, 1, 0, 0, 0, 1 };
+  setDstGeoTransform(psInfo, adfIdentity);
+
+  return psInfo;
+}
+
+void
+GeodeticMercatorTransformer::setDstGeoTransform(void *pTransformerArg, const double *padfGeoTransform) {
+  GeodeticMercatorInfo *psInfo = static_cast<GeodeticMercatorInfo *>(pTransformerArg);
+
+  memcpy(psInfo->adfDstGeoTransform, padfGeoTransform, sizeof(double) * 6);
+  if (!GDALInvGeoTransform(psInfo->adfDstGeoTransform, psInfo->adfDstInvGeoTransform)) {
+    memset(psInfo->adfDstInvGeoTransform, 0, sizeof(double) * 6);
+  }
+}
+
+/**
+ * @details Source pixel/line coordinates are georeferenced with the source
+ * geotransform, reprojected and converted to destination pixel/line
+ * coordinates using the inverse destination geotransform, or the reverse if
+ * `bDstToSrc` is set.  `z` is left unchanged as the profiles share a vertical
+ * datum.
+ */
+int
+GeodeticMercatorTransformer::transform(void *pTransformerArg, int bDstToSrc, int nPointCount,
+                                       double *x, double *y, double * /*z*/, int *panSuccess) {
+  const GeodeticMercatorInfo *psInfo = static_cast<GeodeticMercatorInfo *>(pTransformerArg);
+
+  // Going from the destination to the source reverses the direction
+  const bool toMercator = (psInfo->bSrcIsGeodetic != (bDstToSrc != 0));
+
+  applyGeoTransform(bDstToSrc ? psInfo->adfDstGeoTransform : psInfo->adfSrcGeoTransform,
+                    nPointCount, x, y);
+
+  if (toMercator) {
+    geodeticToMercator(nPointCount, x, y, panSuccess);
+  } else {
+    mercatorToGeodetic(nPointCount, x, y, panSuccess);
+  }
+
+  applyGeoTransform(bDstToSrc ? psInfo->adfSrcInvGeoTransform : psInfo->adfDstInvGeoTransform,
+                    nPointCount, x, y);
+
+  return TRUE;
+}
+
+void
+GeodeticMercatorTransformer::destroy(void *pTransformerArg) {
+  delete static_cast<GeodeticMercatorInfo *>(pTransformerArg);
+}
+
+/**
+ * @details The grid has 17 by 17 points including the edges and corners of
+ * the image, all of which are passed to each transformer in one call.
+ */
+double
+GeodeticMercatorTransformer::maxError(void *pTransformerArg, GDALTransformerFunc pfnOther, void *pOtherArg,
+                                      int nXSize, int nYSize) {
+  const GeodeticMercatorInfo *psInfo = static_cast<GeodeticMercatorInfo *>(pTransformerArg);
+  const int nSteps = 16, nPointCount = (nSteps + 1) * (nSteps + 1);
+  std::vector<double> x(nPointCount), y(nPointCount), z(nPointCount, 0.0);
+
+  for (int row = 0, i = 0; row <= nSteps; ++row) {
+    for (int column = 0; column <= nSteps; ++column, ++i) {
+      x[i] = (double) nXSize * column / nSteps;
+      y[i] = (double) nYSize * row / nSteps;
+    }
+  }
+
+  // The source latitudes, to skip points beyond the mercator profile
+  std::vector<double> lon(x), lat(y);
+  if (psInfo->bSrcIsGeodetic) {
+    applyGeoTransform(psInfo->adfSrcGeoTransform, nPointCount, &lon[0], &lat[0]);
+  } else {
+    std::fill(lat.begin(), lat.end(), 0.0);
+  }
+
+  std::vector<double> otherX(x), otherY(y), otherZ(z);
+  std::vector<int> success(nPointCount), otherSuccess(nPointCount);
+  transform(pTransformerArg, FALSE, nPointCount, &x[0], &y[0], &z[0], &success[0]);
+  if (!pfnOther(pOtherArg, FALSE, nPointCount, &otherX[0], &otherY[0], &otherZ[0], &otherSuccess[0])) {
+    return HUGE_VAL;
+  }
+
+  double error = -1;
+  for (int i = 0; i < nPointCount; ++i) {
+    if (success[i] && otherSuccess[i] && std::fabs(lat[i]) <= cMaxMercatorLatitude) {
+      const double dx = std::fabs(x[i] - otherX[i]), dy = std::fabs(y[i] - otherY[i]);
+      if (std::isnan(dx) || std::isnan(dy)) {
+        return HUGE_VAL;        // a NaN can't pass for agreement
+      }
+      error = std::max(error, std::max(dx, dy));
+    }
+  }
+
+  return (error < 0) ? HUGE_VAL : error;
+}
+
+/**
+ * @details This uses `y = R atanh(sin(lat))`, which is equivalent to the
+ * usual `R ln(tan(pi/4 + lat/2))`.  As with PROJ, longitudes beyond the
+ * antimeridian are wrapped into range.
+ */
+void
+GeodeticMercatorTransformer::geodeticToMercator(int nPointCount, double *x, double *y, int *panSuccess) {
+  const double radians = M_PI / 180.0;
+
+  for (int i = 0; i < nPointCount; ++i) {
+    const double lon = x[i], lat = y[i];
+    const double wrapped = (std::fabs(lon) > 180.0) ? lon - 360.0 * std::floor((lon + 180.0) / 360.0) : lon;
+
+    panSuccess[i] = std::fabs(lat) < 90.0;
+    x[i] = wrapped * cMetresPerDegree;
+    y[i] = cRadius * std::atanh(std::sin(lat * radians));
+  }
+}
+
+void
+GeodeticMercatorTransformer::mercatorToGeodetic(int nPointCount, double *x, double *y, int *panSuccess) {
+  const double degrees = 180.0 / M_PI;
+
+  for (int i = 0; i < nPointCount; ++i) {
+    panSuccess[i] = TRUE;
+    x[i] = x[i] / cMetresPerDegree;
+    y[i] = std::atan(std::sinh(y[i] / cRadius)) * degrees;
+  }
+}
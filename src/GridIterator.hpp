@@ -153,7 +153,7 @@ public:
   }
 
   /// Dereference the iterator to retrieve a `TileCoordinate`
-  virtual const TileCoordinate *
+  const TileCoordinate *
   operator*() const {
     return &currentTile;
   }
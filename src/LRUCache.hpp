@@ -0,0 +1,190 @@
+#ifndef LRUCACHE_HPP
+#define LRUCACHE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file LRUCache.hpp
+ * @brief This declares and defines the `LRUCache` class
+ */
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+namespace ctb {
+  template <class Key, class Value> class LRUCache;
+}
+
+/**
+ * @brief A thread safe cache which discards the least recently used values
+ *
+ * Each value is stored with a cost, such as its size in bytes, and the least
+ * recently used values are discarded when the total cost exceeds the capacity
+ * of the cache.  Values are shared, so a value which has been discarded
+ * remains valid for as long as it is still being used.
+ */
+template <class Key, class Value>
+class ctb::LRUCache {
+public:
+
+  /// A value held by the cache
+  typedef std::shared_ptr<const Value> Pointer;
+
+  /// Create a cache holding values with a total cost of up to `capacity`
+  LRUCache(size_t capacity):
+    mCapacity(capacity),
+    mCost(0),
+    mHits(0),
+    mMisses(0)
+  {}
+
+  /// Get a value, marking it as recently used, or nothing if it isn't cached
+  Pointer
+  get(const Key &key) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mIndex.find(key);
+
+    if (found == mIndex.end()) {
+      ++mMisses;
+      return Pointer();
+    }
+
+    ++mHits;
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    return found->second->value;
+  }
+
+  /// Is a value cached?  Unlike `get` this doesn't mark it as recently used
+  bool
+  contains(const Key &key) const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.find(key) != mIndex.end();
+  }
+
+  /**
+   * @brief Add a value, replacing any value with the same key
+   *
+   * Values which cost more than the capacity of the cache are not added.
+   */
+  void
+  put(const Key &key, Pointer value, size_t cost) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mIndex.find(key);
+
+    if (found != mIndex.end()) {
+      mCost -= found->second->cost;
+      mEntries.erase(found->second);
+      mIndex.erase(found);
+    }
+
+    if (cost > mCapacity) {
+      return;
+    }
+
+    mEntries.push_front(Entry(key, std::move(value), cost));
+    mIndex[key] = mEntries.begin();
+    mCost += cost;
+
+    while (mCost > mCapacity) {
+      const Entry &last = mEntries.back();
+      mCost -= last.cost;
+      mIndex.erase(last.key);
+      mEntries.pop_back();
+    }
+  }
+
+  /// Remove a value if it is cached
+  void
+  remove(const Key &key) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto found = mIndex.find(key);
+
+    if (found != mIndex.end()) {
+      mCost -= found->second->cost;
+      mEntries.erase(found->second);
+      mIndex.erase(found);
+    }
+  }
+
+  /// Get the number of values in the cache
+  size_t
+  count() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEntries.size();
+  }
+
+  /// Get the total cost of the values in the cache
+  size_t
+  cost() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCost;
+  }
+
+  /// Get the maximum total cost of the values in the cache
+  size_t
+  capacity() const {
+    return mCapacity;
+  }
+
+  /// Get the number of times `get` found a value
+  uint64_t
+  hits() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHits;
+  }
+
+  /// Get the number of times `get` didn't find a value
+  uint64_t
+  misses() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mMisses;
+  }
+
+private:
+
+  /// A cached value
+  struct Entry {
+    Entry(const Key &key, Pointer value, size_t cost):
+      key(key),
+      value(std::move(value)),
+      cost(cost)
+    {}
+
+    Key key;
+    Pointer value;
+    size_t cost;
+  };
+
+  const size_t mCapacity;       ///< The maximum total cost
+  size_t mCost;                 ///< The total cost of the values
+  uint64_t mHits, mMisses;
+
+  /// The values, ordered from the most to the least recently used
+  std::list<Entry> mEntries;
+
+  /// The position of each value in `mEntries`
+  std::unordered_map<Key, typename std::list<Entry>::iterator> mIndex;
+
+  mutable std::mutex mMutex;
+};
+
+#endif /* LRUCACHE_HPP */
@@ -0,0 +1,165 @@
+#ifndef LATENCYHISTOGRAM_HPP
+#define LATENCYHISTOGRAM_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file LatencyHistogram.hpp
+ * @brief This declares and defines the `LatencyHistogram` class
+ */
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.hpp"           // for CTB_DLL
+
+namespace ctb {
+  class LatencyHistogram;
+}
+
+/**
+ * @brief A histogram of latencies which can be updated from many threads
+ *
+ * Values (typically microseconds) are counted in logarithmic buckets: each
+ * power of two is split into eight linear sub-buckets, so a value is known to
+ * within 12.5% regardless of its magnitude.  Values below eight are counted
+ * exactly.  Recording a value is a couple of relaxed atomic increments, so it
+ * is cheap enough to do for every request.
+ */
+class CTB_DLL ctb::LatencyHistogram {
+public:
+
+  /// The number of sub-buckets each power of two is split into
+  static const unsigned int SUB_BUCKETS = 8;
+
+  /// The total number of buckets, enough for any 64 bit value
+  static const unsigned int BUCKET_COUNT = (64 - 2) * SUB_BUCKETS;
+
+  LatencyHistogram():
+    mCount(0),
+    mTotal(0),
+    mMax(0)
+  {
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+      mBuckets[i] = 0;
+    }
+  }
+
+  /// Count a value
+  void
+  record(uint64_t value) {
+    mBuckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mTotal.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = mMax.load(std::memory_order_relaxed);
+    while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+  }
+
+  /// Get the number of values counted
+  uint64_t
+  count() const {
+    return mCount.load(std::memory_order_relaxed);
+  }
+
+  /// Get the mean of the values counted
+  double
+  mean() const {
+    const uint64_t n = count();
+    return n ? mTotal.load(std::memory_order_relaxed) / (double) n : 0;
+  }
+
+  /// Get the largest value counted
+  uint64_t
+  max() const {
+    return mMax.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Get the value below which a fraction of the values fall
+   *
+   * For example `percentile(0.99)` is the 99th percentile.  The upper bound
+   * of the bucket containing the percentile is returned.
+   */
+  uint64_t
+  percentile(double fraction) const {
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+      total += bucketCount(i);
+    }
+    if (total == 0) {
+      return 0;
+    }
+
+    uint64_t target = (uint64_t) (fraction * total + 0.5), seen = 0;
+    if (target < 1) target = 1;
+
+    for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+      seen += bucketCount(i);
+      if (seen >= target) {
+        const uint64_t bound = bucketUpperBound(i);
+        return (bound < max()) ? bound : max();
+      }
+    }
+
+    return max();
+  }
+
+  /// Get the number of values counted in a bucket
+  uint64_t
+  bucketCount(unsigned int index) const {
+    return mBuckets[index].load(std::memory_order_relaxed);
+  }
+
+  /// Get the largest value counted in a bucket
+  static uint64_t
+  bucketUpperBound(unsigned int index) {
+    if (index < SUB_BUCKETS) {
+      return index;
+    }
+
+    const unsigned int shift = index / SUB_BUCKETS - 1;
+    const uint64_t next = SUB_BUCKETS + index % SUB_BUCKETS + 1;
+    return (next << shift) - 1;     // wraps to the maximum for the last bucket
+  }
+
+  /// Get the bucket a value is counted in
+  static unsigned int
+  bucketIndex(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return (unsigned int) value;
+    }
+
+    // Find the number of bits beyond the three used for the sub-bucket
+    unsigned int shift = 0;
+    while ((value >> shift) >= 2 * SUB_BUCKETS) {
+      ++shift;
+    }
+
+    return (shift + 1) * SUB_BUCKETS + (unsigned int) ((value >> shift) - SUB_BUCKETS);
+  }
+
+private:
+
+  std::atomic<uint64_t> mBuckets[BUCKET_COUNT]; ///< The count of each bucket
+  std::atomic<uint64_t> mCount;                 ///< The number of values
+  std::atomic<uint64_t> mTotal;                 ///< The sum of the values
+  std::atomic<uint64_t> mMax;                   ///< The largest value
+};
+
+#endif /* LATENCYHISTOGRAM_HPP */
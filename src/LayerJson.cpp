@@ -0,0 +1,171 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file LayerJson.cpp
+ * @brief This defines the `LayerJson` class
+ */
+
+#include <sstream>
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "LayerJson.hpp"
+#include "TileIndex.hpp"
+
+using namespace ctb;
+
+/// Escape a string for use in JSON
+static std::string
+jsonString(const std::string &value) {
+  std::ostringstream stream;
+  stream << '"';
+
+  for (const char c: value) {
+    switch (c) {
+    case '"': stream << "\\\""; break;
+    case '\\': stream << "\\\\"; break;
+    case '\n': stream << "\\n"; break;
+    case '\t': stream << "\\t"; break;
+    default:
+      if ((unsigned char) c < 0x20) {
+        static const char hex[] = "0123456789abcdef";
+        stream << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+      } else {
+        stream << c;
+      }
+    }
+  }
+
+  stream << '"';
+  return stream.str();
+}
+
+LayerJson::LayerJson(const std::string &name, const std::string &projection):
+  mName(name),
+  mProjection(projection)
+{}
+
+void
+LayerJson::addAvailable(i_zoom zoom, const TileBounds &bounds) {
+  if (zoom >= mAvailable.size()) {
+    mAvailable.resize(zoom + 1);
+  }
+
+  mAvailable[zoom].push_back(bounds);
+}
+
+void
+LayerJson::addAvailable(const TileIndex &index) {
+  if (index.empty()) {
+    return;
+  }
+
+  for (i_zoom zoom = index.minZoom(); zoom <= index.maxZoom(); ++zoom) {
+    for (const TileBounds &bounds: index.ranges(zoom)) {
+      addAvailable(zoom, bounds);
+    }
+  }
+}
+
+const std::vector<TileBounds> &
+LayerJson::available(i_zoom zoom) const {
+  static const std::vector<TileBounds> none;
+  return (zoom < mAvailable.size()) ? mAvailable[zoom] : none;
+}
+
+int
+LayerJson::maxZoom() const {
+  for (size_t zoom = mAvailable.size(); zoom > 0; --zoom) {
+    if (!mAvailable[zoom - 1].empty()) {
+      return (int) zoom - 1;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @details The `available` array has an entry for every zoom level from `0`
+ * up to the highest level with tiles, as Cesium expects.  Each rectangle is
+ * written on its own line to keep large files readable.
+ */
+std::string
+LayerJson::toString() const {
+  const bool mercator = (mProjection == "EPSG:3857");
+  std::ostringstream stream;
+
+  stream
+    << "{\n"
+    << "  \"tilejson\": \"2.1.0\",\n"
+    << "  \"name\": " << jsonString(mName) << ",\n"
+    << "  \"version\": \"1.0.0\",\n"
+    << "  \"format\": \"heightmap-1.0\",\n"
+    << "  \"scheme\": \"tms\",\n"
+    << "  \"tiles\": [\"{z}/{x}/{y}.terrain?v={version}\"],\n"
+    << "  \"projection\": " << jsonString(mProjection) << ",\n"
+    << "  \"bounds\": "
+    << (mercator ? "[-180.0, -85.0511287798066, 180.0, 85.0511287798066]" : "[-180.0, -90.0, 180.0, 90.0]")
+    << ",\n"
+    << "  \"available\": [";
+
+  const int levels = maxZoom() + 1;
+  for (int zoom = 0; zoom < levels; ++zoom) {
+    const std::vector<TileBounds> &ranges = mAvailable[zoom];
+    stream << ((zoom > 0) ? ",\n    [" : "\n    [");
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      stream
+        << ((i > 0) ? ",\n      " : "\n      ")
+        << "{\"startX\": " << ranges[i].getMinX()
+        << ", \"startY\": " << ranges[i].getMinY()
+        << ", \"endX\": " << ranges[i].getMaxX()
+        << ", \"endY\": " << ranges[i].getMaxY() << "}";
+    }
+
+    stream << (ranges.empty() ? "]" : "\n    ]");
+  }
+
+  stream << ((levels > 0) ? "\n  ]\n}\n" : "]\n}\n");
+  return stream.str();
+}
+
+/**
+ * @details The metadata is written to a temporary file which is then renamed,
+ * so clients never see a partially written file.
+ */
+void
+LayerJson::writeFile(const std::string &filename) const {
+  const std::string json = toString(),
+    tmpFilename = filename + ".tmp";
+
+  VSILFILE *fp = VSIFOpenL(tmpFilename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the layer.json file");
+  }
+
+  const bool failed = VSIFWriteL(json.data(), 1, json.size(), fp) != json.size();
+  if (VSIFCloseL(fp) != 0 || failed) {
+    VSIUnlink(tmpFilename.c_str());
+    throw CTBException("Failed to write the layer.json file");
+  }
+
+  if (VSIRename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    VSIUnlink(tmpFilename.c_str());
+    throw CTBException("Failed to replace the layer.json file");
+  }
+}
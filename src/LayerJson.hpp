@@ -0,0 +1,87 @@
+#ifndef LAYERJSON_HPP
+#define LAYERJSON_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file LayerJson.hpp
+ * @brief This declares the `LayerJson` class
+ */
+
+#include <string>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+
+namespace ctb {
+  class LayerJson;
+  class TileIndex;
+}
+
+/**
+ * @brief The `layer.json` metadata describing a terrain tileset
+ *
+ * Cesium reads `layer.json` from the root of a terrain tileset to find out
+ * how the tiles are named and which tiles are available.  The tiles available
+ * at each zoom level are listed as rectangles of tile coordinates, so that
+ * clients don't request tiles which don't exist.
+ *
+ * The rectangles are best taken from a `TileIndex`, which merges the tiles
+ * present into a compact set of rectangles, or added directly when the
+ * tiles are known to cover a rectangle.
+ */
+class CTB_DLL ctb::LayerJson {
+public:
+
+  /// Describe a tileset in a spatial reference system such as `EPSG:4326`
+  LayerJson(const std::string &name, const std::string &projection = "EPSG:4326");
+
+  /// Record that all tiles within a rectangle are available at a zoom level
+  void
+  addAvailable(i_zoom zoom, const TileBounds &bounds);
+
+  /// Record that all tiles in an index are available
+  void
+  addAvailable(const TileIndex &index);
+
+  /// Get the rectangles of tiles available at a zoom level
+  const std::vector<TileBounds> &
+  available(i_zoom zoom) const;
+
+  /// Get the highest zoom level with tiles available, or `-1` if there are none
+  int
+  maxZoom() const;
+
+  /// Get the metadata as JSON text
+  std::string
+  toString() const;
+
+  /// Write the metadata to a file, replacing it atomically
+  void
+  writeFile(const std::string &filename) const;
+
+private:
+
+  std::string mName;            ///< The name of the tileset
+  std::string mProjection;      ///< The spatial reference system of the tiles
+
+  /// The rectangles of tiles available, indexed by zoom level
+  std::vector<std::vector<TileBounds>> mAvailable;
+};
+
+#endif /* LAYERJSON_HPP */
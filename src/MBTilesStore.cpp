@@ -0,0 +1,388 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file MBTilesStore.cpp
+ * @brief This defines the `MBTilesStore` class
+ */
+
+#include <chrono>
+
+#include "config.hpp"           // for CTB_HAVE_SQLITE
+
+#ifdef CTB_HAVE_SQLITE
+#include "sqlite3.h"
+#endif
+
+#include "CTBException.hpp"
+#include "MBTilesStore.hpp"
+#include "TileHash.hpp"
+
+using namespace ctb;
+
+#ifdef CTB_HAVE_SQLITE
+
+/// The maximum number of tiles waiting to be written before writers block
+static const size_t cMaxQueued = MBTilesStore::BATCH_SIZE * 4;
+
+/// Execute SQL, throwing an exception on failure
+static void
+execute(sqlite3 *db, const char *sql, const char *error) {
+  if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    throw CTBException(error);
+  }
+}
+
+/// Get the name of a tileset from the filename, without the directory or extension
+static std::string
+tilesetName(const std::string &filename) {
+  const size_t start = filename.find_last_of("/\\"),
+    begin = (start == std::string::npos) ? 0 : start + 1,
+    end = filename.rfind('.');
+
+  return filename.substr(begin, (end == std::string::npos || end < begin) ? std::string::npos : end - begin);
+}
+
+MBTilesStore::MBTilesStore(const std::string &filename, const std::string &format, bool writable):
+  mFilename(filename),
+  mWriteDB(NULL),
+  mInsertMap(NULL),
+  mInsertImage(NULL),
+  mReadDB(NULL),
+  mSelect(NULL),
+  mClosing(!writable)
+{
+  if (!writable) {
+    if (sqlite3_open_v2(mFilename.c_str(), &mReadDB, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+      sqlite3_close(mReadDB);
+      mReadDB = NULL;
+      throw CTBException("Could not open the MBTiles database");
+    }
+    return;
+  }
+
+  if (sqlite3_open_v2(mFilename.c_str(), &mWriteDB,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+    sqlite3_close(mWriteDB);
+    mWriteDB = NULL;
+    throw CTBException("Could not create the MBTiles database");
+  }
+
+  try {
+    // WAL mode means a commit doesn't require a sync of the whole database
+    execute(mWriteDB, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;",
+            "Could not configure the MBTiles database");
+    execute(mWriteDB,
+            "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name);"
+            "CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row);"
+            "CREATE TABLE IF NOT EXISTS images (tile_data BLOB, tile_id TEXT);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);"
+            "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level,"
+            " map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data"
+            " FROM map JOIN images ON images.tile_id = map.tile_id;",
+            "Could not create the MBTiles schema");
+
+    sqlite3_stmt *metadata;
+    if (sqlite3_prepare_v2(mWriteDB, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)",
+                           -1, &metadata, NULL) != SQLITE_OK) {
+      throw CTBException("Could not prepare the MBTiles metadata statement");
+    }
+
+    const std::string name = tilesetName(mFilename);
+    const char *entries[][2] = {
+      {"name", name.c_str()},
+      {"format", format.c_str()},
+      {"scheme", "tms"}
+    };
+
+    bool failed = false;
+    for (const auto &entry: entries) {
+      sqlite3_bind_text(metadata, 1, entry[0], -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(metadata, 2, entry[1], -1, SQLITE_TRANSIENT);
+      failed = failed || (sqlite3_step(metadata) != SQLITE_DONE);
+      sqlite3_reset(metadata);
+    }
+    sqlite3_finalize(metadata);
+
+    if (failed) {
+      throw CTBException("Could not write the MBTiles metadata");
+    }
+
+    if (sqlite3_prepare_v2(mWriteDB,
+                           "INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?)",
+                           -1, &mInsertMap, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(mWriteDB, "INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES (?, ?)",
+                              -1, &mInsertImage, NULL) != SQLITE_OK) {
+      throw CTBException("Could not prepare the MBTiles insert statements");
+    }
+
+    // A separate connection for reads so they don't interfere with the writer
+    if (sqlite3_open_v2(mFilename.c_str(), &mReadDB, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+      throw CTBException("Could not open the MBTiles database for reading");
+    }
+  } catch (...) {
+    sqlite3_close(mReadDB);
+    sqlite3_finalize(mInsertImage);
+    sqlite3_finalize(mInsertMap);
+    sqlite3_close(mWriteDB);
+    throw;
+  }
+
+  mWriter = std::thread(&MBTilesStore::writeQueue, this);
+}
+
+MBTilesStore::~MBTilesStore() {
+  try {
+    close();
+  } catch (CTBException &) {
+    // errors can only be reported by calling `close` explicitly
+  }
+
+  sqlite3_finalize(mSelect);
+  sqlite3_close(mReadDB);
+}
+
+/**
+ * @details The data is copied into the write queue, blocking if the writer
+ * thread has fallen too far behind.  Errors encountered by the writer are
+ * raised by the next call.
+ */
+void
+MBTilesStore::writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) {
+  PendingTile tile = {coord, TileHash::toString(TileHash::digest(data, size)),
+                      std::vector<unsigned char>(data, data + size)};
+  enqueue(tile);
+}
+
+/**
+ * @details The original is ahead of the duplicate in the queue, so its image
+ * will have been inserted by the time the duplicate is.
+ */
+void
+MBTilesStore::writeDuplicate(const TileCoordinate &coord, const TileCoordinate & /*original*/,
+                             const unsigned char *data, size_t size) {
+  PendingTile tile = {coord, TileHash::toString(TileHash::digest(data, size)), std::vector<unsigned char>()};
+  enqueue(tile);
+}
+
+void
+MBTilesStore::enqueue(PendingTile &tile) {
+  std::unique_lock<std::mutex> lock(mQueueMutex);
+  mQueueChanged.wait(lock, [this] { return mQueue.size() < cMaxQueued || !mError.empty() || mClosing; });
+
+  if (!mError.empty()) {
+    throw CTBException(mError.c_str());
+  } else if (mClosing) {
+    throw CTBException("The MBTiles database is not open for writing");
+  }
+
+  mQueue.push_back(std::move(tile));
+  if (mQueue.size() >= BATCH_SIZE) {
+    mQueueChanged.notify_all();
+  }
+}
+
+bool
+MBTilesStore::readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const {
+  std::lock_guard<std::mutex> lock(mReadMutex);
+
+  if (mSelect == NULL
+      && sqlite3_prepare_v2(mReadDB,
+                            "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+                            -1, &mSelect, NULL) != SQLITE_OK) {
+    throw CTBException("Could not prepare the MBTiles select statement");
+  }
+
+  sqlite3_bind_int(mSelect, 1, coord.zoom);
+  sqlite3_bind_int64(mSelect, 2, coord.x);
+  sqlite3_bind_int64(mSelect, 3, coord.y);
+
+  const int result = sqlite3_step(mSelect);
+  if (result == SQLITE_ROW) {
+    const unsigned char *blob = static_cast<const unsigned char *>(sqlite3_column_blob(mSelect, 0));
+    data.assign(blob, blob + sqlite3_column_bytes(mSelect, 0));
+  }
+  sqlite3_reset(mSelect);
+
+  if (result != SQLITE_ROW && result != SQLITE_DONE) {
+    throw CTBException("Failed to read a tile from the MBTiles database");
+  }
+
+  return result == SQLITE_ROW;
+}
+
+/**
+ * @details Once the queue has been written, images which no longer belong
+ * to any tile are deleted.  These are left behind when a tile is replaced by
+ * a different one, as when a tileset is updated.
+ */
+void
+MBTilesStore::close() {
+  {
+    std::lock_guard<std::mutex> lock(mQueueMutex);
+    mClosing = true;
+  }
+  mQueueChanged.notify_all();
+
+  if (mWriter.joinable()) {
+    mWriter.join();
+  }
+
+  bool failed = false;
+  if (mWriteDB) {
+    sqlite3_finalize(mInsertImage);
+    mInsertImage = NULL;
+    sqlite3_finalize(mInsertMap);
+    mInsertMap = NULL;
+
+    // Replacing a tile can leave its previous image unused
+    failed = sqlite3_exec(mWriteDB, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);",
+                          NULL, NULL, NULL) != SQLITE_OK;
+
+    sqlite3_close(mWriteDB);
+    mWriteDB = NULL;
+  }
+
+  std::lock_guard<std::mutex> lock(mQueueMutex);
+  if (failed && mError.empty()) {
+    mError = "Could not remove unused images from the MBTiles database";
+  }
+  if (!mError.empty()) {
+    throw CTBException(mError.c_str());
+  }
+}
+
+/**
+ * @details Tiles are taken off the queue in batches.  The writer waits for a
+ * full batch to accumulate so that each transaction amortises its commit over
+ * many tiles, but doesn't wait more than a second so that tiles become
+ * readable in a timely manner.
+ */
+void
+MBTilesStore::writeQueue() {
+  std::vector<PendingTile> batch;
+  batch.reserve(BATCH_SIZE);
+
+  std::unique_lock<std::mutex> lock(mQueueMutex);
+  while (true) {
+    mQueueChanged.wait_for(lock, std::chrono::seconds(1),
+                           [this] { return mQueue.size() >= BATCH_SIZE || mClosing; });
+
+    if (mQueue.empty()) {
+      if (mClosing) break;
+      continue;
+    }
+
+    while (!mQueue.empty() && batch.size() < BATCH_SIZE) {
+      batch.push_back(std::move(mQueue.front()));
+      mQueue.pop_front();
+    }
+
+    // Allow blocked writers to continue while the batch is inserted
+    lock.unlock();
+    mQueueChanged.notify_all();
+
+    std::string error;
+    try {
+      insertBatch(batch);
+    } catch (CTBException &e) {
+      error = e.what();
+    }
+    batch.clear();
+
+    lock.lock();
+    if (!error.empty()) {
+      mError = error;
+      mQueue.clear();
+      mQueueChanged.notify_all();
+      break;
+    }
+  }
+}
+
+void
+MBTilesStore::insertBatch(std::vector<PendingTile> &batch) {
+  execute(mWriteDB, "BEGIN", "Could not begin an MBTiles transaction");
+
+  for (const PendingTile &tile: batch) {
+    int result = SQLITE_DONE;
+
+    if (!tile.data.empty()) {
+      sqlite3_bind_text(mInsertImage, 1, tile.id.c_str(), (int) tile.id.size(), SQLITE_STATIC);
+      sqlite3_bind_blob(mInsertImage, 2, tile.data.data(), (int) tile.data.size(), SQLITE_STATIC);
+      result = sqlite3_step(mInsertImage);
+      sqlite3_reset(mInsertImage);
+    }
+
+    if (result == SQLITE_DONE) {
+      sqlite3_bind_int(mInsertMap, 1, tile.coord.zoom);
+      sqlite3_bind_int64(mInsertMap, 2, tile.coord.x);
+      sqlite3_bind_int64(mInsertMap, 3, tile.coord.y);
+      sqlite3_bind_text(mInsertMap, 4, tile.id.c_str(), (int) tile.id.size(), SQLITE_STATIC);
+      result = sqlite3_step(mInsertMap);
+      sqlite3_reset(mInsertMap);
+    }
+
+    if (result != SQLITE_DONE) {
+      sqlite3_exec(mWriteDB, "ROLLBACK", NULL, NULL, NULL);
+      throw CTBException("Failed to write a tile to the MBTiles database");
+    }
+  }
+
+  execute(mWriteDB, "COMMIT", "Could not commit an MBTiles transaction");
+}
+
+#else
+
+MBTilesStore::MBTilesStore(const std::string &, const std::string &, bool):
+  mWriteDB(NULL),
+  mInsertMap(NULL),
+  mInsertImage(NULL),
+  mReadDB(NULL),
+  mSelect(NULL),
+  mClosing(true)
+{
+  throw CTBException("MBTiles support is not available in this build");
+}
+
+MBTilesStore::~MBTilesStore() {}
+
+void
+MBTilesStore::writeTile(const TileCoordinate &, const unsigned char *, size_t) {}
+
+void
+MBTilesStore::writeDuplicate(const TileCoordinate &, const TileCoordinate &, const unsigned char *, size_t) {}
+
+void
+MBTilesStore::enqueue(PendingTile &) {}
+
+bool
+MBTilesStore::readTile(const TileCoordinate &, std::vector<unsigned char> &) const {
+  return false;
+}
+
+void
+MBTilesStore::close() {}
+
+void
+MBTilesStore::writeQueue() {}
+
+void
+MBTilesStore::insertBatch(std::vector<PendingTile> &) {}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef MBTILESSTORE_HPP
+#define MBTILESSTORE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file MBTilesStore.hpp
+ * @brief This declares the `MBTilesStore` class
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "TileStore.hpp"
+
+struct sqlite3;                 // forward declarations
+struct sqlite3_stmt;
+
+namespace ctb {
+  class MBTilesStore;
+}
+
+/**
+ * @brief Store tiles in a single SQLite database
+ *
+ * The database follows the [MBTiles](https://github.com/mapbox/mbtiles-spec)
+ * layout: tiles are read from a `tiles` view keyed by `zoom_level`,
+ * `tile_column` and `tile_row`, and a `metadata` table records the tile
+ * format.  The view joins a `map` table of tile coordinates to an `images`
+ * table of tile data identified by its 128 bit `TileHash` digest, so identical tiles are
+ * only stored once.  Images left unused when tiles are replaced are removed
+ * when the store is closed.  MBTiles rows are numbered from the bottom of the
+ * grid as in TMS, which is the scheme used by `TileCoordinate`, so
+ * coordinates are stored without flipping.
+ *
+ * Keeping tiles in one file avoids the overheads of millions of small files.
+ * Writes are queued and inserted by a dedicated writer thread in large
+ * transactions with the database in WAL mode, so tiles written by
+ * `writeTile` aren't visible to `readTile` until their transaction has been
+ * committed.
+ */
+class CTB_DLL ctb::MBTilesStore :
+  public TileStore
+{
+public:
+
+  /// Open a database, creating it if `writable` is `true`
+  MBTilesStore(const std::string &filename, const std::string &format, bool writable);
+
+  /// Flush outstanding writes and close the database
+  ~MBTilesStore();
+
+  void
+  writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) override;
+
+  /// Map the tile to the image of the original without storing the data
+  void
+  writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                 const unsigned char *data, size_t size) override;
+
+  bool
+  readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const override;
+
+  void
+  close() override;
+
+  /// The maximum number of tiles inserted in one transaction
+  static const size_t BATCH_SIZE = 4096;
+
+private:
+
+  /// A tile waiting to be inserted
+  struct PendingTile {
+    TileCoordinate coord;
+    std::string id;             ///< The image identifier
+    std::vector<unsigned char> data; ///< Empty if the image already exists
+  };
+
+  /// Add a tile to the queue
+  void
+  enqueue(PendingTile &tile);
+
+  /// Insert queued tiles until the store is closed
+  void
+  writeQueue();
+
+  /// Insert a batch of tiles in a single transaction
+  void
+  insertBatch(std::vector<PendingTile> &batch);
+
+  std::string mFilename;        ///< The database file
+  sqlite3 *mWriteDB;            ///< The connection used by the writer thread
+  sqlite3_stmt *mInsertMap;     ///< The map insert statement
+  sqlite3_stmt *mInsertImage;   ///< The image insert statement
+  mutable sqlite3 *mReadDB;     ///< The connection used for reading tiles
+  mutable sqlite3_stmt *mSelect; ///< The tile select statement
+  mutable std::mutex mReadMutex; ///< Serialise reads
+
+  std::deque<PendingTile> mQueue; ///< Tiles waiting to be inserted
+  std::mutex mQueueMutex;       ///< Guard the queue and the writer state
+  std::condition_variable mQueueChanged; ///< Signal queue changes
+  bool mClosing;                ///< Has the store been closed?
+  std::string mError;           ///< Any error raised by the writer thread
+  std::thread mWriter;          ///< The writer thread
+};
+
+#endif /* MBTILESSTORE_HPP */
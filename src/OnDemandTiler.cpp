@@ -0,0 +1,405 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file OnDemandTiler.cpp
+ * @brief This defines the `OnDemandTiler` class
+ */
+
+#include "gdal_priv.h"
+
+#include "CTBException.hpp"
+#include "OnDemandTiler.hpp"
+#include "TerrainTiler.hpp"
+#include "TileCodec.hpp"
+#include "TileStore.hpp"
+
+using namespace ctb;
+
+/// The most tiles waiting to be prefetched: older requests are dropped
+static const size_t cMaxPrefetchQueue = 256;
+
+struct ctb::OnDemandTiler::Worker {
+  Worker(GDALDataset *poDataset, const Grid &grid, const TilerOptions &options):
+    poDataset(poDataset),
+    tile(TileCoordinate())
+  {
+    try {
+      tiler.reset(new TerrainTiler(poDataset, grid, options));
+    } catch (...) {
+      GDALClose(poDataset);
+      throw;
+    }
+  }
+
+  ~Worker() {
+    tiler.reset();              // release the dataset before closing it
+    GDALClose(poDataset);
+  }
+
+  GDALDataset *poDataset;
+  std::unique_ptr<TerrainTiler> tiler;
+  TerrainTile tile;             ///< Reused for every tile the worker creates
+};
+
+/**
+ * @details The dataset is opened up front to find its extent, so an exception
+ * is thrown straight away if it can't be used.
+ */
+OnDemandTiler::OnDemandTiler(const std::string &sourceFilename,
+                             const Grid &grid,
+                             const TilerOptions &options,
+                             const TileCodec &codec,
+                             size_t cacheSize,
+                             std::unique_ptr<TileStore> diskCache,
+                             unsigned int prefetchThreads,
+                             unsigned int tileThreads):
+  mSourceFilename(sourceFilename),
+  mGrid(grid),
+  mOptions(options),
+  mCodec(codec),
+  mCache(cacheSize),
+  mDiskCache(std::move(diskCache)),
+  mStopping(false),
+  mCreated(0),
+  mDiskHits(0),
+  mCoalesced(0),
+  mPrefetched(0)
+{
+  const Worker &first = worker();   // check the dataset can be used
+  mBounds = first.tiler->bounds();
+  mMaxZoom = first.tiler->maxZoomLevel();
+
+  for (unsigned int i = 0; i < prefetchThreads; ++i) {
+    mPrefetchThreads.push_back(std::thread(&OnDemandTiler::prefetch, this));
+  }
+  for (unsigned int i = 0; i < tileThreads; ++i) {
+    mTileThreads.push_back(std::thread(&OnDemandTiler::createRequested, this));
+  }
+}
+
+/**
+ * @details Requests which are still queued are abandoned without calling
+ * back.
+ */
+OnDemandTiler::~OnDemandTiler() {
+  {
+    std::lock(mPrefetchMutex, mRequestMutex);
+    std::lock_guard<std::mutex> prefetchLock(mPrefetchMutex, std::adopt_lock),
+      requestLock(mRequestMutex, std::adopt_lock);
+    mStopping = true;
+  }
+  mPrefetchReady.notify_all();
+  mRequestReady.notify_all();
+
+  for (auto &thread: mPrefetchThreads) {
+    thread.join();
+  }
+  for (auto &thread: mTileThreads) {
+    thread.join();
+  }
+}
+
+/**
+ * @details The memory cache is checked first, then tiles already being
+ * created by another thread are waited for.  Otherwise the calling thread
+ * reads the tile from the disk cache or creates it, and any threads
+ * requesting it in the meantime wait for the result.
+ */
+OnDemandTiler::Data
+OnDemandTiler::getTile(const TileCoordinate &coord) {
+  return getTile(coord, false);
+}
+
+OnDemandTiler::Data
+OnDemandTiler::getTile(const TileCoordinate &coord, bool prefetching) {
+  if (!contains(coord)) {
+    return Data();
+  }
+
+  const uint64_t key = TileStore::tileKey(coord);
+  Data data = mCache.get(key);
+  if (data) {
+    return data;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mPendingMutex);
+    auto pending = mPending.find(key);
+
+    if (pending != mPending.end()) {
+      std::shared_future<Data> result = pending->second.result;
+      lock.unlock();
+
+      ++mCoalesced;
+      return result.get();
+    }
+
+    // The tile may have been cached since the cache was checked
+    if (mCache.contains(key) && (data = mCache.get(key))) {
+      return data;
+    }
+
+    Pending &created = mPending[key];
+    created.result = created.promise.get_future().share();
+  }
+
+  return finishTile(coord, prefetching);
+}
+
+/**
+ * @details This checks the memory cache and any tile being created in the
+ * same way as `getTile`, but queues the tile for a tile thread rather than
+ * creating it.
+ */
+bool
+OnDemandTiler::requestTile(const TileCoordinate &coord, Data &data, Callback callback) {
+  if (mTileThreads.empty()) {
+    data = getTile(coord, false);
+    return true;
+  }
+
+  const uint64_t key = TileStore::tileKey(coord);
+  if (!contains(coord) || (data = mCache.get(key))) {
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mPendingMutex);
+    auto pending = mPending.find(key);
+
+    if (pending != mPending.end()) {
+      pending->second.callbacks.push_back(std::move(callback));
+      ++mCoalesced;
+      return false;
+    }
+
+    if (mCache.contains(key) && (data = mCache.get(key))) {
+      return true;
+    }
+
+    Pending &created = mPending[key];
+    created.result = created.promise.get_future().share();
+    created.callbacks.push_back(std::move(callback));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mRequestMutex);
+    mRequestQueue.push_back(coord);
+  }
+  mRequestReady.notify_one();
+
+  return false;
+}
+
+/**
+ * @details The tile is cached before it stops being pending, so it is always
+ * found by later requests.  Once it is no longer pending no more callbacks
+ * can be added, so those taken are called without holding the lock.
+ */
+OnDemandTiler::Data
+OnDemandTiler::finishTile(const TileCoordinate &coord, bool prefetching) {
+  const uint64_t key = TileStore::tileKey(coord);
+  Data data;
+  std::exception_ptr error;
+
+  try {
+    data = loadTile(coord, prefetching);
+    mCache.put(key, data, data->size());
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  Pending finished;
+  {
+    std::lock_guard<std::mutex> lock(mPendingMutex);
+    auto pending = mPending.find(key);
+    finished = std::move(pending->second);
+    mPending.erase(pending);
+  }
+
+  if (error) {
+    finished.promise.set_exception(error);
+  } else {
+    finished.promise.set_value(data);
+  }
+
+  for (const Callback &callback: finished.callbacks) {
+    callback(data, error);
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  return data;
+}
+
+OnDemandTiler::Data
+OnDemandTiler::loadTile(const TileCoordinate &coord, bool prefetching) {
+  std::shared_ptr<std::vector<unsigned char>> data = std::make_shared<std::vector<unsigned char>>();
+
+  if (mDiskCache && mDiskCache->readTile(coord, *data)) {
+    ++mDiskHits;
+    return data;
+  }
+
+  Worker &current = worker();
+  current.tiler->createTerrainTile(coord, current.tile);
+  current.tile.encode(*data, mCodec);
+  ++(prefetching ? mPrefetched : mCreated);
+
+  if (mDiskCache) {
+    mDiskCache->writeTile(coord, data->data(), data->size());
+  }
+
+  return data;
+}
+
+/**
+ * @details Requests for children which are outside the dataset or already
+ * cached are ignored.  If the queue is full the oldest requests are dropped,
+ * as the client has probably moved on from them.
+ */
+void
+OnDemandTiler::prefetchChildren(const TileCoordinate &coord) {
+  if (mPrefetchThreads.empty() || coord.zoom >= mMaxZoom) {
+    return;
+  }
+
+  std::vector<TileCoordinate> children;
+  for (i_tile dy = 0; dy < 2; ++dy) {
+    for (i_tile dx = 0; dx < 2; ++dx) {
+      const TileCoordinate child(coord.zoom + 1, coord.x * 2 + dx, coord.y * 2 + dy);
+
+      if (contains(child) && !mCache.contains(TileStore::tileKey(child))) {
+        children.push_back(child);
+      }
+    }
+  }
+
+  if (children.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mPrefetchMutex);
+    mPrefetchQueue.insert(mPrefetchQueue.end(), children.begin(), children.end());
+
+    if (mPrefetchQueue.size() > cMaxPrefetchQueue) {
+      mPrefetchQueue.erase(mPrefetchQueue.begin(),
+                           mPrefetchQueue.end() - cMaxPrefetchQueue);
+    }
+  }
+  mPrefetchReady.notify_all();
+}
+
+/**
+ * @details The most recently requested tiles are prefetched first.  Errors
+ * are ignored: they are reported if the tile is actually requested.
+ */
+void
+OnDemandTiler::prefetch() {
+  while (true) {
+    TileCoordinate coord;
+    {
+      std::unique_lock<std::mutex> lock(mPrefetchMutex);
+      mPrefetchReady.wait(lock, [this] { return mStopping || !mPrefetchQueue.empty(); });
+
+      if (mStopping) {
+        return;
+      }
+
+      coord = mPrefetchQueue.back();
+      mPrefetchQueue.pop_back();
+    }
+
+    try {
+      getTile(coord, true);
+    } catch (CTBException &) {
+    }
+  }
+}
+
+/**
+ * @details Tiles are created in the order they were requested.  Errors are
+ * passed to the callbacks rather than being thrown.
+ */
+void
+OnDemandTiler::createRequested() {
+  while (true) {
+    TileCoordinate coord;
+    {
+      std::unique_lock<std::mutex> lock(mRequestMutex);
+      mRequestReady.wait(lock, [this] { return mStopping || !mRequestQueue.empty(); });
+
+      if (mStopping) {
+        return;
+      }
+
+      coord = mRequestQueue.front();
+      mRequestQueue.pop_front();
+    }
+
+    try {
+      finishTile(coord, false);
+    } catch (...) {
+    }
+  }
+}
+
+bool
+OnDemandTiler::contains(const TileCoordinate &coord) const {
+  if (coord.zoom > mMaxZoom) {
+    return false;
+  }
+
+  const TileBounds bounds = tileBoundsForZoom(coord.zoom);
+  return coord.x >= bounds.getMinX() && coord.x <= bounds.getMaxX()
+    && coord.y >= bounds.getMinY() && coord.y <= bounds.getMaxY();
+}
+
+TileBounds
+OnDemandTiler::tileBoundsForZoom(i_zoom zoom) const {
+  return TileBounds(mGrid.crsToTile(mBounds.getLowerLeft(), zoom),
+                    mGrid.crsToTile(mBounds.getUpperRight(), zoom));
+}
+
+/**
+ * @details The dataset is opened the first time a thread needs a worker.
+ */
+OnDemandTiler::Worker &
+OnDemandTiler::worker() {
+  std::lock_guard<std::mutex> lock(mWorkersMutex);
+  std::unique_ptr<Worker> &current = mWorkers[std::this_thread::get_id()];
+
+  if (!current) {
+    GDALDataset *poDataset = (GDALDataset *) GDALOpen(mSourceFilename.c_str(), GA_ReadOnly);
+    if (poDataset == NULL) {
+      mWorkers.erase(std::this_thread::get_id());
+      throw CTBException("Could not open GDAL dataset");
+    }
+
+    try {
+      current.reset(new Worker(poDataset, mGrid, mOptions));
+    } catch (...) {
+      mWorkers.erase(std::this_thread::get_id());
+      throw;
+    }
+  }
+
+  return *current;
+}
@@ -0,0 +1,260 @@
+#ifndef ONDEMANDTILER_HPP
+#define ONDEMANDTILER_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file OnDemandTiler.hpp
+ * @brief This declares the `OnDemandTiler` class
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "GDALTiler.hpp"        // for TilerOptions
+#include "Grid.hpp"
+#include "LRUCache.hpp"
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class OnDemandTiler;
+  class TerrainTiler;
+  class TileCodec;
+  class TileStore;
+}
+
+/**
+ * @brief Create encoded terrain tiles from a GDAL dataset when requested
+ *
+ * Rather than creating every tile of a dataset in advance, this creates each
+ * tile the first time it is requested and keeps the encoded tile in a memory
+ * cache of a fixed size in bytes.  Tiles can also be kept in a disk cache, in
+ * which case a tile is only ever created once.
+ *
+ * `getTile` can be called from any number of threads.  GDAL datasets can't be
+ * shared between threads, so each thread creating tiles opens the dataset
+ * and has a `TerrainTiler` of its own.  Threads requesting a tile which is
+ * already being created wait for it rather than creating it again.
+ *
+ * Threads which mustn't block, such as those running an event loop, can use
+ * `requestTile` instead, which hands tiles that aren't cached to a pool of
+ * tile threads and calls back once they have been created.
+ *
+ * Clients zooming in on a tile will usually request its children next, so
+ * these can be created in advance by background threads using
+ * `prefetchChildren`.
+ */
+class CTB_DLL ctb::OnDemandTiler {
+public:
+
+  /// An encoded terrain tile
+  typedef std::shared_ptr<const std::vector<unsigned char>> Data;
+
+  /**
+   * @brief Create tiles from a dataset
+   *
+   * @param sourceFilename The GDAL dataset to create tiles from
+   * @param grid The grid defining the tiles
+   * @param options The options used when creating tiles
+   * @param codec The codec used to encode tiles
+   * @param cacheSize The size of the memory cache in bytes
+   * @param diskCache A store in which tiles are kept, or none
+   * @param prefetchThreads The number of threads creating tiles in advance
+   * @param tileThreads The number of threads creating tiles for `requestTile`
+   */
+  OnDemandTiler(const std::string &sourceFilename,
+                const Grid &grid,
+                const TilerOptions &options,
+                const TileCodec &codec,
+                size_t cacheSize,
+                std::unique_ptr<TileStore> diskCache = nullptr,
+                unsigned int prefetchThreads = 0,
+                unsigned int tileThreads = 0);
+
+  /// Stop creating tiles and close the datasets
+  ~OnDemandTiler();
+
+  /**
+   * @brief Called with a tile requested by `requestTile`
+   *
+   * The tile is empty if it is outside the dataset, and the error is set if
+   * it couldn't be created.
+   */
+  typedef std::function<void(const Data &data, std::exception_ptr error)> Callback;
+
+  /**
+   * @brief Get an encoded tile, creating it if need be
+   *
+   * Nothing is returned for tiles outside the dataset.  An exception is
+   * thrown if the tile can't be created.
+   */
+  Data
+  getTile(const TileCoordinate &coord);
+
+  /**
+   * @brief Get an encoded tile without blocking while it is created
+   *
+   * If the tile is cached or outside the dataset this sets `data` and
+   * returns `true`.  Otherwise the tile is created by a tile thread, or
+   * waited for if it is already being created, and `false` is returned:
+   * `callback` is then called from another thread once the tile is ready.
+   * Without any tile threads the tile is created by the calling thread.
+   */
+  bool
+  requestTile(const TileCoordinate &coord, Data &data, Callback callback);
+
+  /// Create the children of a tile in the background, if they aren't cached
+  void
+  prefetchChildren(const TileCoordinate &coord);
+
+  /// Is a tile within the dataset?
+  bool
+  contains(const TileCoordinate &coord) const;
+
+  /// Get the tiles within the dataset at a zoom level
+  TileBounds
+  tileBoundsForZoom(i_zoom zoom) const;
+
+  /// Get the maximum zoom level for the dataset
+  i_zoom
+  maxZoomLevel() const {
+    return mMaxZoom;
+  }
+
+  /// Get the grid defining the tiles
+  const Grid &
+  grid() const {
+    return mGrid;
+  }
+
+  /// Get the memory cache
+  const LRUCache<uint64_t, std::vector<unsigned char>> &
+  cache() const {
+    return mCache;
+  }
+
+  /// Get the number of tiles created from the dataset when requested
+  uint64_t
+  createdCount() const {
+    return mCreated;
+  }
+
+  /// Get the number of tiles read from the disk cache
+  uint64_t
+  diskHitCount() const {
+    return mDiskHits;
+  }
+
+  /// Get the number of requests which waited for a tile being created
+  uint64_t
+  coalescedCount() const {
+    return mCoalesced;
+  }
+
+  /// Get the number of tiles created from the dataset in advance
+  uint64_t
+  prefetchedCount() const {
+    return mPrefetched;
+  }
+
+private:
+
+  /// A dataset and tiler belonging to one thread
+  struct Worker;
+
+  /// Get the worker belonging to the calling thread
+  Worker &
+  worker();
+
+  /// Get a tile, noting whether it is being created in advance
+  Data
+  getTile(const TileCoordinate &coord, bool prefetching);
+
+  /// Get the tile from the disk cache or create it
+  Data
+  loadTile(const TileCoordinate &coord, bool prefetching);
+
+  /// Load a pending tile, passing it to everything waiting for it
+  Data
+  finishTile(const TileCoordinate &coord, bool prefetching);
+
+  /// Create tiles in advance until the tiler is destroyed
+  void
+  prefetch();
+
+  /// Create requested tiles until the tiler is destroyed
+  void
+  createRequested();
+
+  const std::string mSourceFilename;
+  const Grid mGrid;
+  const TilerOptions mOptions;
+  const TileCodec &mCodec;
+
+  CRSBounds mBounds;            ///< The dataset extent in the grid CRS
+  i_zoom mMaxZoom;              ///< The maximum zoom level of the dataset
+
+  /// Encoded tiles kept in memory, keyed by `TileStore::tileKey`
+  LRUCache<uint64_t, std::vector<unsigned char>> mCache;
+
+  std::unique_ptr<TileStore> mDiskCache;
+
+  /// A tile being created and everything waiting for it
+  struct Pending {
+    std::promise<Data> promise;
+    std::shared_future<Data> result; ///< Waited for by `getTile`
+    std::vector<Callback> callbacks; ///< Called back for `requestTile`
+  };
+
+  /// The tiles being created, which other threads can wait for
+  std::unordered_map<uint64_t, Pending> mPending;
+  std::mutex mPendingMutex;
+
+  /// The worker of each thread which has created tiles
+  std::map<std::thread::id, std::unique_ptr<Worker>> mWorkers;
+  std::mutex mWorkersMutex;
+
+  /// The tiles waiting to be prefetched, most recently requested last
+  std::vector<TileCoordinate> mPrefetchQueue;
+  std::mutex mPrefetchMutex;
+  std::condition_variable mPrefetchReady;
+  std::vector<std::thread> mPrefetchThreads;
+
+  /// The tiles requested with `requestTile`, oldest first
+  std::deque<TileCoordinate> mRequestQueue;
+  std::mutex mRequestMutex;
+  std::condition_variable mRequestReady;
+  std::vector<std::thread> mTileThreads;
+
+  bool mStopping;               ///< Set while holding both queue locks
+
+  std::atomic<uint64_t> mCreated, mDiskHits, mCoalesced, mPrefetched;
+};
+
+#endif /* ONDEMANDTILER_HPP */
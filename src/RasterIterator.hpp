@@ -35,9 +35,8 @@ namespace ctb {
  * @brief This forward iterates over all tiles in a `RasterTiler`
  *
  * Instances of this class take a `RasterTiler` in the constructor and are used
- * to forward iterate over all tiles in the tiler, returning a `GDALTile *` when
- * dereferenced.  It is the caller's responsibility to call `delete` on the
- * tile.
+ * to forward iterate over all tiles in the tiler, returning a newly created
+ * `GDALTile` when dereferenced.
  */
 class ctb::RasterIterator :
   public TilerIterator
@@ -54,9 +53,10 @@ public:
     TilerIterator(tiler, startZoom, endZoom)
   {}
 
-  virtual GDALTile *
-  operator*() const override {
-    return static_cast<GDALTile *>(TilerIterator::operator*());
+  /// Override the dereference operator to return a `GDALTile`
+  std::unique_ptr<GDALTile>
+  operator*() const {
+    return static_cast<const RasterTiler &>(tiler).createRasterTile(coordinate());
   }
 };
 
@@ -52,11 +52,14 @@ public:
     return *this;
   }
 
-  /// Override to return a covariant data type
-  virtual GDALTile *
+  /// Create a tile from a tile coordinate
+  virtual std::unique_ptr<Tile>
   createTile(const TileCoordinate &coord) const override {
     return createRasterTile(coord);
   }
+
+  /// Raster tiles can be created directly
+  using GDALTiler::createRasterTile;
 };
 
 #endif /* RASTERTILER_HPP */
@@ -0,0 +1,275 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file ReprojectionContext.cpp
+ * @brief This defines the `ReprojectionContext` class
+ */
+
+#include "cpl_error.h"
+#include "ogr_spatialref.h"
+
+#include "CTBException.hpp"
+#include "GeodeticMercatorTransformer.hpp"
+#include "ReprojectionContext.hpp"
+
+using namespace ctb;
+
+/**
+ * Does the analytic transformer agree with the GDAL transformer for a dataset?
+ *
+ * Both transformers keep the identity destination geotransform, so the
+ * difference between them is in metres or degrees.  A warning is issued if
+ * they disagree.
+ */
+static bool
+analyticAgrees(GDALDatasetH hSrcDS, bool srcIsGeodetic, char **papszTransformOptions) {
+  void *analyticArg = GeodeticMercatorTransformer::create(hSrcDS, srcIsGeodetic);
+  void *gdalArg = GDALCreateGenImgProjTransformer2(hSrcDS, NULL, papszTransformOptions);
+  bool agrees = false;
+
+  if (analyticArg != NULL && gdalArg != NULL) {
+    const double error = GeodeticMercatorTransformer::maxError(analyticArg, GDALGenImgProjTransform, gdalArg,
+                                                               GDALGetRasterXSize(hSrcDS),
+                                                               GDALGetRasterYSize(hSrcDS));
+    const double bound = srcIsGeodetic
+      ? GeodeticMercatorTransformer::MAX_METRES_ERROR
+      : GeodeticMercatorTransformer::MAX_DEGREES_ERROR;
+
+    agrees = (error <= bound);
+    if (!agrees) {
+      CPLError(CE_Warning, CPLE_AppDefined,
+               "The analytic transformation differs from GDAL by %g %s, so GDAL is used instead",
+               error, srcIsGeodetic ? "metres" : "degrees");
+    }
+  }
+
+  if (analyticArg != NULL) {
+    GeodeticMercatorTransformer::destroy(analyticArg);
+  }
+  if (gdalArg != NULL) {
+    GDALDestroyGenImgProjTransformer(gdalArg);
+  }
+
+  return agrees;
+}
+
+ReprojectionContext::ReprojectionContext(GDALDataset *poDataset,
+                                         const std::string &gridWKT,
+                                         const TilerOptions &options):
+  mSrcDS((GDALDatasetH) poDataset),
+  mErrorThreshold(options.errorThreshold),
+  mAnalytic(false),
+  mSrcIsGeodetic(false),
+  mpfnTransformer(GDALGenImgProjTransform),
+  mTransformerArg(NULL),
+  mWarpOptions(NULL),
+  mApproxArg(NULL),
+  mWarpedVRT(NULL),
+  mAcquired(false)
+{
+  // Only specify the SRS if we need to reproject
+  if (gridWKT.size() > 0) {
+    mTransformOptions.SetNameValue("SRC_SRS", GDALGetProjectionRef(mSrcDS));
+    mTransformOptions.SetNameValue("DST_SRS", gridWKT.c_str());
+
+    // Check for the analytic transformation between the profiles
+    if (options.analyticTransform) {
+      OGRSpatialReference srcSRS(GDALGetProjectionRef(mSrcDS)),
+        gridSRS(gridWKT.c_str());
+
+      if (GeodeticMercatorTransformer::supports(srcSRS, gridSRS)) {
+        OGRSpatialReference geodeticSRS;
+        geodeticSRS.importFromEPSG(4326);
+
+        mSrcIsGeodetic = srcSRS.IsSame(&geodeticSRS);
+        mAnalytic = analyticAgrees(mSrcDS, mSrcIsGeodetic, mTransformOptions.List());
+        if (mAnalytic) {
+          mpfnTransformer = GeodeticMercatorTransformer::transform;
+        }
+      }
+    }
+  }
+
+  mTransformerArg = createTransformer();
+  if (mTransformerArg == NULL) {
+    throw CTBException("Could not create image to image transformer");
+  }
+
+  // Set the warp options common to all tiles
+  const int nBandCount = GDALGetRasterCount(mSrcDS);
+  mWarpOptions = GDALCreateWarpOptions();
+  mWarpOptions->dfWarpMemoryLimit = options.warpMemoryLimit;
+  mWarpOptions->hSrcDS = mSrcDS;
+  mWarpOptions->nBandCount = nBandCount;
+  mWarpOptions->panSrcBands = (int *) CPLMalloc(sizeof(int) * nBandCount);
+  mWarpOptions->panDstBands = (int *) CPLMalloc(sizeof(int) * nBandCount);
+
+  for (int i = 0; i < nBandCount; ++i) {
+    mWarpOptions->panDstBands[i] = mWarpOptions->panSrcBands[i] = i + 1;
+  }
+
+  // Specify a multi threaded warp operation using all CPU cores.  This
+  // requires the transformer to be cloned for each thread, which the analytic
+  // transformer doesn't support.
+  if (!mAnalytic) {
+    mWarpOptions->papszWarpOptions =
+      CSLSetNameValue(mWarpOptions->papszWarpOptions, "NUM_THREADS", "ALL_CPUS");
+  }
+}
+
+ReprojectionContext::~ReprojectionContext() {
+  // The VRT owns the approximate transformer wrapping the cached transformer
+  if (mWarpedVRT != NULL) {
+    GDALClose(mWarpedVRT);
+  }
+  mWarpOperation.reset();
+  if (mApproxArg != NULL) {
+    GDALDestroyApproxTransformer(mApproxArg);
+  }
+  GDALDestroyWarpOptions(mWarpOptions);
+  destroyTransformer(mTransformerArg);
+}
+
+void *
+ReprojectionContext::createTransformer() const {
+  if (mAnalytic) {
+    return GeodeticMercatorTransformer::create(mSrcDS, mSrcIsGeodetic);
+  }
+
+  // This is the expensive bit: the SRS are parsed and the coordinate
+  // transformation between them is set up
+  return GDALCreateGenImgProjTransformer2(mSrcDS, NULL, const_cast<CPLStringList &>(mTransformOptions).List());
+}
+
+void
+ReprojectionContext::destroyTransformer(void *transformerArg) const {
+  if (mAnalytic) {
+    GeodeticMercatorTransformer::destroy(transformerArg);
+  } else {
+    GDALDestroyGenImgProjTransformer(transformerArg);
+  }
+}
+
+void
+ReprojectionContext::setDstGeoTransform(void *transformerArg, const double *padfGeoTransform) const {
+  if (mAnalytic) {
+    GeodeticMercatorTransformer::setDstGeoTransform(transformerArg, padfGeoTransform);
+  } else {
+    GDALSetGenImgProjTransformerDstGeoTransform(transformerArg, padfGeoTransform);
+  }
+}
+
+/**
+ * @details An approximate transformer with a threshold of `0` passes all
+ * points through to the wrapped transformer, so wrapping the transformer in all
+ * cases means whoever destroys the warp options' transformer never destroys
+ * the cached transformer.
+ */
+GDALWarpOptions *
+ReprojectionContext::createWarpOptions(void *transformerArg) const {
+  void *approxArg = GDALCreateApproxTransformer(mpfnTransformer, transformerArg, mErrorThreshold);
+  if (approxArg == NULL) {
+    throw CTBException("Could not create linear approximator");
+  }
+
+  GDALWarpOptions *psWarpOptions = GDALCloneWarpOptions(mWarpOptions);
+  psWarpOptions->pfnTransformer = GDALApproxTransform;
+  psWarpOptions->pTransformerArg = approxArg;
+
+  return psWarpOptions;
+}
+
+/**
+ * @details The buffer is initialised to `0` before warping, as is done by
+ * `GDALCreateWarpedVRT`, and the remaining warp options are the same as those
+ * used for warped VRTs so the output is identical to reading the VRT.
+ */
+void
+ReprojectionContext::warpToBuffer(double (&adfGeoTransform)[6], int nXSize, int nYSize, float *pafBuffer) {
+  if (!mWarpOperation) {
+    GDALWarpOptions *psWarpOptions = createWarpOptions(mTransformerArg);
+
+    // Only the heights are needed.  The buffers are small and tiles are
+    // already created in parallel, so don't use a thread pool for them.
+    psWarpOptions->nBandCount = 1;
+    psWarpOptions->eWorkingDataType = GDT_Float32;
+    psWarpOptions->papszWarpOptions =
+      CSLSetNameValue(psWarpOptions->papszWarpOptions, "INIT_DEST", "0");
+    psWarpOptions->papszWarpOptions =
+      CSLSetNameValue(psWarpOptions->papszWarpOptions, "NUM_THREADS", "1");
+
+    // The operation takes a copy of the options, but not of the transformer
+    GDALWarpOperation *poOperation = new GDALWarpOperation();
+    if (poOperation->Initialize(psWarpOptions) != CE_None) {
+      delete poOperation;
+      GDALDestroyApproxTransformer(psWarpOptions->pTransformerArg);
+      GDALDestroyWarpOptions(psWarpOptions);
+      throw CTBException("Could not initialise the warp operation");
+    }
+
+    mApproxArg = psWarpOptions->pTransformerArg;
+    mWarpOperation.reset(poOperation);
+    GDALDestroyWarpOptions(psWarpOptions);
+  }
+
+  setDstGeoTransform(mTransformerArg, adfGeoTransform);
+
+  // An empty source window means the warper works out the window itself
+  if (mWarpOperation->WarpRegionToBuffer(0, 0, nXSize, nYSize, pafBuffer, GDT_Float32) != CE_None) {
+    throw CTBException("Could not warp heights into the buffer");
+  }
+}
+
+/**
+ * @details A VRT is only recreated if the buffer is a different size.  The
+ * block cache of the VRT is flushed once the geotransforms have been changed,
+ * so the next read warps the new area.
+ */
+void
+ReprojectionContext::readWarpedVRT(double (&adfGeoTransform)[6], int nXSize, int nYSize, float *pafBuffer) {
+  if (mWarpedVRT != NULL
+      && (GDALGetRasterXSize(mWarpedVRT) != nXSize || GDALGetRasterYSize(mWarpedVRT) != nYSize)) {
+    GDALClose(mWarpedVRT);
+    mWarpedVRT = NULL;
+  }
+
+  setDstGeoTransform(mTransformerArg, adfGeoTransform);
+
+  if (mWarpedVRT == NULL) {
+    GDALWarpOptions *psWarpOptions = createWarpOptions(mTransformerArg);
+    mWarpedVRT = GDALCreateWarpedVRT(mSrcDS, nXSize, nYSize, adfGeoTransform, psWarpOptions);
+
+    if (mWarpedVRT == NULL) {
+      GDALDestroyApproxTransformer(psWarpOptions->pTransformerArg);
+    }
+    GDALDestroyWarpOptions(psWarpOptions);
+
+    if (mWarpedVRT == NULL) {
+      throw CTBException("Could not create warped VRT");
+    }
+  } else {
+    if (GDALSetGeoTransform(mWarpedVRT, adfGeoTransform) != CE_None) {
+      throw CTBException("Could not set geo transform on VRT");
+    }
+    GDALFlushCache(mWarpedVRT);
+  }
+
+  if (GDALRasterIO(GDALGetRasterBand(mWarpedVRT, 1), GF_Read, 0, 0, nXSize, nYSize,
+                   pafBuffer, nXSize, nYSize, GDT_Float32, 0, 0) != CE_None) {
+    throw CTBException("Could not read heights from raster");
+  }
+}
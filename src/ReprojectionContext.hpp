@@ -0,0 +1,162 @@
+#ifndef REPROJECTIONCONTEXT_HPP
+#define REPROJECTIONCONTEXT_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file ReprojectionContext.hpp
+ * @brief This declares the `ReprojectionContext` class
+ */
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "gdalwarper.h"
+#include "cpl_string.h"
+
+#include "config.hpp"           // for CTB_DLL
+#include "GDALTiler.hpp"
+
+namespace ctb {
+  class ReprojectionContext;
+}
+
+/**
+ * @brief Transformation state shared by the tiles of a tiler
+ *
+ * Creating an image to image transformer involves parsing the source and grid
+ * spatial reference systems and setting up the coordinate transformation
+ * between them.  This is the same for every tile created from a dataset: only
+ * the destination geotransform differs.  A `ReprojectionContext` creates the
+ * transformer and a prototype of the warp options once so that each tile only
+ * needs to update the destination geotransform.  When reprojecting between
+ * the geodetic and mercator profiles a `GeodeticMercatorTransformer` is used
+ * rather than the general GDAL transformer, provided that it agrees with the
+ * GDAL transformer over the dataset.
+ *
+ * The transformer is stateful, so it can only be used by one tile at a time:
+ * a tile must `acquire` the context before using the transformer and
+ * `release` it once it has finished with it.  A context is not meant to be
+ * shared between threads (see `GDALTiler::reprojectionContext`).
+ */
+class CTB_DLL ctb::ReprojectionContext {
+public:
+
+  /// Create the context for a dataset and the grid WKT (empty if the same)
+  ReprojectionContext(GDALDataset *poDataset, const std::string &gridWKT,
+                      const TilerOptions &options);
+
+  /// The destructor
+  ~ReprojectionContext();
+
+  /// Take exclusive use of the transformer, returning `false` if it is in use
+  inline bool
+  acquire() {
+    return !mAcquired.exchange(true);
+  }
+
+  /// Give up exclusive use of the transformer
+  inline void
+  release() {
+    mAcquired = false;
+  }
+
+  /// Get the image to image transformer
+  inline void *
+  transformer() const {
+    return mTransformerArg;
+  }
+
+  /// Create a new image to image transformer with the same settings
+  void *
+  createTransformer() const;
+
+  /**
+   * @brief Destroy a transformer returned by `createTransformer`
+   *
+   * This must be used rather than `GDALDestroyTransformer`, which can't
+   * destroy a `GeodeticMercatorTransformer`.
+   */
+  void
+  destroyTransformer(void *transformerArg) const;
+
+  /// Set the destination geotransform of a transformer from this context
+  void
+  setDstGeoTransform(void *transformerArg, const double *padfGeoTransform) const;
+
+  /**
+   * @brief Create warp options for a tile
+   *
+   * The options are a copy of the prototype options with the transformer set
+   * to a linear approximation of `transformerArg`.  The approximation is
+   * exact if the error threshold is `0`.  The caller is responsible for the
+   * returned options and the approximate transformer they reference.
+   */
+  GDALWarpOptions *
+  createWarpOptions(void *transformerArg) const;
+
+  /**
+   * @brief Warp the first band of the dataset into a buffer
+   *
+   * This uses the cached transformer to warp directly into `pafBuffer`,
+   * avoiding the creation of a warped VRT dataset.  The warp operation is
+   * created on first use and reused for subsequent calls.  The context must
+   * have been acquired by the caller.
+   *
+   * @param adfGeoTransform The geotransform of the buffer in the grid SRS
+   * @param nXSize The width of the buffer in pixels
+   * @param nYSize The height of the buffer in pixels
+   * @param pafBuffer Receives the `nXSize * nYSize` warped values
+   */
+  void
+  warpToBuffer(double (&adfGeoTransform)[6], int nXSize, int nYSize, float *pafBuffer);
+
+  /**
+   * @brief Read the first band of the dataset warped by a VRT into a buffer
+   *
+   * This gives the same result as `warpToBuffer` by way of a warped VRT
+   * dataset, as tiles were originally created.  The VRT is created on first
+   * use and is pointed at each new geotransform rather than being recreated,
+   * so only its block cache is emptied between calls.  The VRT uses the
+   * cached transformer, so the context must have been acquired by the caller
+   * and `warpToBuffer` should not be used with the same context.
+   */
+  void
+  readWarpedVRT(double (&adfGeoTransform)[6], int nXSize, int nYSize, float *pafBuffer);
+
+private:
+
+  /// Contexts are not copyable as they own the transformer
+  ReprojectionContext(const ReprojectionContext &);
+  ReprojectionContext &operator=(const ReprojectionContext &);
+
+  GDALDatasetH mSrcDS;          ///< The source dataset
+  CPLStringList mTransformOptions; ///< The transformer creation options
+  double mErrorThreshold;       ///< The approximation error in pixels
+  bool mAnalytic;               ///< Use a `GeodeticMercatorTransformer`?
+  bool mSrcIsGeodetic;          ///< Is the source in EPSG:4326?
+  GDALTransformerFunc mpfnTransformer; ///< The image transformer function
+  void *mTransformerArg;        ///< The cached image to image transformer
+  GDALWarpOptions *mWarpOptions; ///< The prototype warp options
+  std::unique_ptr<GDALWarpOperation> mWarpOperation; ///< Warps to buffers
+  void *mApproxArg;             ///< The transformer used by `mWarpOperation`
+  GDALDatasetH mWarpedVRT;      ///< The VRT read by `readWarpedVRT`
+  std::atomic<bool> mAcquired;  ///< Is the transformer in use?
+};
+
+#endif /* REPROJECTIONCONTEXT_HPP */
@@ -0,0 +1,309 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file SourceFingerprint.cpp
+ * @brief This defines the `SourceFingerprint` class
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string.h>             // for memcmp, strcmp
+
+#include "cpl_error.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "RasterTiler.hpp"
+#include "SourceFingerprint.hpp"
+#include "TileHash.hpp"
+#include "TileStore.hpp"
+
+using namespace ctb;
+
+/// The magic bytes at the start of a manifest
+static const char cFingerprintMagic[] = "CTBSRCF1";
+
+/// The most cells along each side of the grid indexing the files
+static const size_t cMaxCells = 256;
+
+/// Get the hash of a file's name, size and modification time
+static uint64_t
+hashFile(const char *filename) {
+  std::ostringstream identity;
+  identity << filename;
+
+  VSIStatBufL stat;
+  if (VSIStatL(filename, &stat) == 0) {
+    identity << '\0' << (uint64_t) stat.st_size << '\0' << (int64_t) stat.st_mtime;
+  }
+
+  const std::string text = identity.str();
+  return TileHash::hash((const unsigned char *) text.data(), text.size());
+}
+
+/**
+ * @brief Get the area a raster file affects in the grid CRS
+ *
+ * The extent is widened by two of the raster's own pixels, which covers the
+ * pixels read around an area by the resampling kernels.
+ */
+static bool
+locateFile(const char *filename, const Grid &grid, CRSBounds &extent) {
+  CPLPushErrorHandler(CPLQuietErrorHandler);
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(filename, GA_ReadOnly);
+  CPLPopErrorHandler();
+
+  if (poDataset == NULL) {
+    return false;
+  }
+
+  bool located = true;
+  try {
+    const CRSBounds bounds = RasterTiler(poDataset, grid).bounds();
+    const double xMargin = 2 * bounds.getWidth() / poDataset->GetRasterXSize(),
+      yMargin = 2 * bounds.getHeight() / poDataset->GetRasterYSize();
+
+    extent = CRSBounds(bounds.getMinX() - xMargin, bounds.getMinY() - yMargin,
+                       bounds.getMaxX() + xMargin, bounds.getMaxY() + yMargin);
+  } catch (CTBException &) {
+    located = false;            // it isn't georeferenced
+  }
+
+  GDALClose(poDataset);
+  return located;
+}
+
+/**
+ * @details A VRT is left out when it references other files, as it covers
+ * every tile: the files it references decide which tiles change.  The index
+ * has a cell for about every file.
+ */
+void
+SourceFingerprint::indexSource(GDALDataset *poDataset, const Grid &grid, uint64_t settings) {
+  mFiles.clear();
+  mCells.clear();
+  mColumns = mRows = 0;
+
+  char **filenames = poDataset->GetFileList();
+  const bool isVRT = poDataset->GetDriver() != NULL
+    && strcmp(poDataset->GetDriver()->GetDescription(), "VRT") == 0;
+  const int count = CSLCount(filenames);
+
+  std::vector<uint64_t> unlocated(1, settings);
+  for (int i = (isVRT && count > 1) ? 1 : 0; i < count; ++i) {
+    File file;
+    file.hash = hashFile(filenames[i]);
+
+    if (locateFile(filenames[i], grid, file.extent)) {
+      mFiles.push_back(file);
+    } else {
+      unlocated.push_back(file.hash);
+    }
+  }
+  CSLDestroy(filenames);
+
+  mSeed = TileHash::hash((const unsigned char *) unlocated.data(), unlocated.size() * sizeof(uint64_t));
+
+  if (mFiles.empty()) {
+    return;
+  }
+
+  // Index the files by the cells of a grid over their extents
+  double minX = HUGE_VAL, minY = HUGE_VAL, maxX = -HUGE_VAL, maxY = -HUGE_VAL;
+  for (const File &file: mFiles) {
+    minX = std::min(minX, file.extent.getMinX());
+    minY = std::min(minY, file.extent.getMinY());
+    maxX = std::max(maxX, file.extent.getMaxX());
+    maxY = std::max(maxY, file.extent.getMaxY());
+  }
+
+  mExtent = CRSBounds(minX, minY, maxX, maxY);
+  mColumns = mRows = std::min(cMaxCells, (size_t) std::ceil(std::sqrt((double) mFiles.size())));
+  mCells.resize(mColumns * mRows);
+
+  for (uint32_t i = 0; i < mFiles.size(); ++i) {
+    size_t minColumn, minRow, maxColumn, maxRow;
+    cells(mFiles[i].extent, minColumn, minRow, maxColumn, maxRow);
+
+    for (size_t row = minRow; row <= maxRow; ++row) {
+      for (size_t column = minColumn; column <= maxColumn; ++column) {
+        mCells[row * mColumns + column].push_back(i);
+      }
+    }
+  }
+}
+
+/**
+ * @details Terrain tiles sample a pixel beyond their bounds, so the files
+ * within a pixel of the tile are included.  The child flags depend on the
+ * extent of the tiler and the maximum zoom level rather than on any file.
+ */
+uint64_t
+SourceFingerprint::fingerprint(const GDALTiler &tiler, const TileCoordinate &coord) const {
+  const Grid &grid = tiler.grid();
+  const CRSBounds tileBounds = grid.tileBounds(coord);
+
+  uint64_t flags = 0;
+  if (coord.zoom == tiler.maxZoomLevel()) {
+    flags = 1;
+  } else if (tiler.bounds().overlaps(tileBounds)) {
+    flags = (tiler.overlaps(tileBounds.getSW()) ? 2 : 0)
+      | (tiler.overlaps(tileBounds.getNW()) ? 4 : 0)
+      | (tiler.overlaps(tileBounds.getNE()) ? 8 : 0)
+      | (tiler.overlaps(tileBounds.getSE()) ? 16 : 0);
+  }
+
+  const double pixel = grid.resolution(coord.zoom);
+  std::vector<uint32_t> files;
+  overlapping(CRSBounds(tileBounds.getMinX() - pixel, tileBounds.getMinY() - pixel,
+                        tileBounds.getMaxX() + pixel, tileBounds.getMaxY() + pixel), files);
+
+  std::vector<uint64_t> values;
+  values.reserve(files.size() + 2);
+  values.push_back(TileStore::tileKey(coord));
+  values.push_back(flags);
+  for (uint32_t index: files) {
+    values.push_back(mFiles[index].hash);
+  }
+
+  return TileHash::hash((const unsigned char *) values.data(), values.size() * sizeof(uint64_t), mSeed);
+}
+
+bool
+SourceFingerprint::unchanged(const TileCoordinate &coord, uint64_t fingerprint) const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  const auto found = mFingerprints.find(TileStore::tileKey(coord));
+  return found != mFingerprints.end() && found->second == fingerprint;
+}
+
+void
+SourceFingerprint::record(const TileCoordinate &coord, uint64_t fingerprint) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mFingerprints[TileStore::tileKey(coord)] = fingerprint;
+}
+
+/**
+ * @details The manifest is the magic bytes, the number of tiles and then a
+ * tile key and fingerprint for each tile, all as 64 bit integers.  A missing
+ * or unreadable manifest simply means every tile is treated as changed.
+ */
+void
+SourceFingerprint::load(const std::string &filename) {
+  VSILFILE *fp = VSIFOpenL(filename.c_str(), "rb");
+  if (fp == NULL) {
+    return;
+  }
+
+  char magic[8];
+  uint64_t count;
+  if (VSIFReadL(magic, 1, 8, fp) != 8 || memcmp(magic, cFingerprintMagic, 8) != 0
+      || VSIFReadL(&count, sizeof(count), 1, fp) != 1) {
+    VSIFCloseL(fp);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  uint64_t entry[2];
+  for (uint64_t i = 0; i < count && VSIFReadL(entry, sizeof(entry), 1, fp) == 1; ++i) {
+    mFingerprints[entry[0]] = entry[1];
+  }
+
+  VSIFCloseL(fp);
+}
+
+/**
+ * @details The manifest is written to a temporary file which then replaces
+ * the previous manifest, so an interrupted session leaves the previous
+ * manifest intact.
+ */
+void
+SourceFingerprint::save(const std::string &filename) const {
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    entries.assign(mFingerprints.begin(), mFingerprints.end());
+  }
+  std::sort(entries.begin(), entries.end());
+
+  const std::string tempFilename = filename + ".tmp";
+  VSILFILE *fp = VSIFOpenL(tempFilename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the source fingerprint manifest");
+  }
+
+  const uint64_t count = entries.size();
+  bool failed = (VSIFWriteL(cFingerprintMagic, 1, 8, fp) != 8)
+    || (VSIFWriteL(&count, sizeof(count), 1, fp) != 1);
+
+  for (const auto &entry: entries) {
+    const uint64_t values[2] = {entry.first, entry.second};
+    failed = failed || (VSIFWriteL(values, sizeof(values), 1, fp) != 1);
+  }
+
+  failed = (VSIFCloseL(fp) != 0) || failed;
+  if (failed || VSIRename(tempFilename.c_str(), filename.c_str()) != 0) {
+    VSIUnlink(tempFilename.c_str());
+    throw CTBException("Failed to write the source fingerprint manifest");
+  }
+}
+
+void
+SourceFingerprint::overlapping(const CRSBounds &bounds, std::vector<uint32_t> &files) const {
+  files.clear();
+
+  size_t minColumn, minRow, maxColumn, maxRow;
+  if (!cells(bounds, minColumn, minRow, maxColumn, maxRow)) {
+    return;
+  }
+
+  for (size_t row = minRow; row <= maxRow; ++row) {
+    for (size_t column = minColumn; column <= maxColumn; ++column) {
+      for (uint32_t index: mCells[row * mColumns + column]) {
+        if (mFiles[index].extent.overlaps(bounds)) {
+          files.push_back(index);
+        }
+      }
+    }
+  }
+
+  // Files spanning several cells are found more than once
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+}
+
+bool
+SourceFingerprint::cells(const CRSBounds &bounds, size_t &minColumn, size_t &minRow,
+                         size_t &maxColumn, size_t &maxRow) const {
+  if (mColumns == 0 || !mExtent.overlaps(bounds)) {
+    return false;
+  }
+
+  const double cellWidth = mExtent.getWidth() / mColumns,
+    cellHeight = mExtent.getHeight() / mRows;
+  auto clamp = [](double position, size_t count) {
+    return (position <= 0) ? 0 : std::min(count - 1, (size_t) position);
+  };
+
+  minColumn = clamp(std::floor((bounds.getMinX() - mExtent.getMinX()) / cellWidth), mColumns);
+  maxColumn = clamp(std::floor((bounds.getMaxX() - mExtent.getMinX()) / cellWidth), mColumns);
+  minRow = clamp(std::floor((bounds.getMinY() - mExtent.getMinY()) / cellHeight), mRows);
+  maxRow = clamp(std::floor((bounds.getMaxY() - mExtent.getMinY()) / cellHeight), mRows);
+
+  return true;
+}
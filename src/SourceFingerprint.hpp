@@ -0,0 +1,139 @@
+#ifndef SOURCEFINGERPRINT_HPP
+#define SOURCEFINGERPRINT_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file SourceFingerprint.hpp
+ * @brief This declares the `SourceFingerprint` class
+ */
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gdal_priv.h"
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class GDALTiler;
+  class Grid;
+  class SourceFingerprint;
+}
+
+/**
+ * @brief Find the tiles whose source data is unchanged since they were created
+ *
+ * The files a dataset is read from are each identified by their name, size
+ * and modification time, and located in the coordinate reference system of
+ * the tile grid.  The fingerprint of a tile hashes the files overlapping it
+ * along with everything else which decides its contents, such as its child
+ * flags, so a tile whose fingerprint is the same as when it was created
+ * doesn't need creating again.  Nothing about what has changed needs to be
+ * known up front, and no source data is read.
+ *
+ * This is most useful for mosaics such as VRTs, where only the tiles covering
+ * the files which have changed get a new fingerprint.  The fingerprints of
+ * the tiles created are kept in a manifest for the next session.  Tiles can be
+ * checked and recorded from many threads at once.
+ */
+class CTB_DLL ctb::SourceFingerprint {
+public:
+
+  SourceFingerprint():
+    mSeed(0),
+    mColumns(0),
+    mRows(0)
+  {}
+
+  /**
+   * @brief Index the files a dataset is read from
+   *
+   * This replaces any files already indexed, keeping the fingerprints
+   * recorded.  `settings` should hash anything else which changes the tiles
+   * created, and is mixed into every fingerprint.  Files which can't be
+   * located, such as overviews and metadata, change every fingerprint when
+   * they change.  No fingerprints may be taken whilst indexing.
+   */
+  void
+  indexSource(GDALDataset *poDataset, const Grid &grid, uint64_t settings = 0);
+
+  /// Get the fingerprint of a tile created by a tiler
+  uint64_t
+  fingerprint(const GDALTiler &tiler, const TileCoordinate &coord) const;
+
+  /// Has a tile been recorded with the same fingerprint?
+  bool
+  unchanged(const TileCoordinate &coord, uint64_t fingerprint) const;
+
+  /// Record the fingerprint of a tile once it has been created
+  void
+  record(const TileCoordinate &coord, uint64_t fingerprint);
+
+  /// Load the fingerprints in a manifest, if it exists
+  void
+  load(const std::string &filename);
+
+  /// Save the fingerprints to a manifest, replacing any existing manifest
+  void
+  save(const std::string &filename) const;
+
+  /// Get the number of files located in the grid
+  size_t
+  fileCount() const {
+    return mFiles.size();
+  }
+
+private:
+
+  /// A file located in the grid
+  struct File {
+    CRSBounds extent;           ///< The area the file affects
+    uint64_t hash;              ///< The hash of its name, size and time
+  };
+
+  /// Find the files whose extents overlap an area, in index order
+  void
+  overlapping(const CRSBounds &bounds, std::vector<uint32_t> &files) const;
+
+  /// Get the range of cells covering an area, returning `false` if none
+  bool
+  cells(const CRSBounds &bounds, size_t &minColumn, size_t &minRow,
+        size_t &maxColumn, size_t &maxRow) const;
+
+  std::vector<File> mFiles;
+
+  /// The settings and the files which couldn't be located
+  uint64_t mSeed;
+
+  /// The files overlapping each cell of a regular grid over their extents,
+  /// stored by row from the south west corner
+  std::vector<std::vector<uint32_t>> mCells;
+  CRSBounds mExtent;
+  size_t mColumns, mRows;
+
+  /// The fingerprint of each tile keyed by `TileStore::tileKey`
+  std::unordered_map<uint64_t, uint64_t> mFingerprints;
+  mutable std::mutex mMutex;
+};
+
+#endif /* SOURCEFINGERPRINT_HPP */
@@ -4,104 +4,254 @@
 * @brief This defines the `TerrainDataset` class
 */
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <string>
-#include <boost/filesystem.hpp>
-#include <boost/lexical_cast.hpp>
-
-#include "cpl_vsi.h"
+#include <utility>
 
 #include "config.hpp"
 #include "CTBException.hpp"
+#include "DirectoryTileStore.hpp"
 #include "TerrainDataset.hpp"
+#include "TerrainTile.hpp"
+#include "TileCodec.hpp"
+#include "TileStore.hpp"
 
 using namespace std;
-using namespace boost::filesystem;
 using namespace ctb;
 
+const char *const TerrainDataset::INDEX_FILENAME = ".tileindex";
+
+/// The number of heights in a terrain tile
+static const size_t cHeightCount = TILE_SIZE * TILE_SIZE;
+
 TerrainDataset::TerrainDataset()
 : mMinLevel(0)
 , mMaxLevel(0)
-, mMinX(0)
-, mMaxX(0)
-, mMinY(0)
-, mMaxY(0)
+, mGrid(TILE_SIZE)
+, mFormat(TileCodec::FORMAT_UNKNOWN)
+, mCache(new LRUCache<uint64_t, Heights>(DEFAULT_CACHE_SIZE))
 {}
 
-TerrainDataset::TerrainDataset(string rootDirectory)
-: mMinLevel(0)
+/**
+* @details The saved index is used if it is still current, otherwise the tree
+* is scanned in parallel and the index saved for next time.  The directory is
+* opened as a tile store here rather than for every tile read.
+*/
+TerrainDataset::TerrainDataset(string rootDirectory, bool useIndexFile, unsigned int threadCount)
+: mRootDirectory(rootDirectory)
+, mMinLevel(0)
 , mMaxLevel(0)
-, mMinX(0)
-, mMaxX(0)
-, mMinY(0)
-, mMaxY(0)
-, mRootDirectory(rootDirectory)
+, mGrid(TILE_SIZE)
+, mFormat(TileCodec::recorded(rootDirectory))
+, mStore(make_shared<const DirectoryTileStore>(rootDirectory, "terrain", false))
+, mCache(new LRUCache<uint64_t, Heights>(DEFAULT_CACHE_SIZE))
 {
-  path p(rootDirectory);
+  const string indexFilename = rootDirectory + "/" + INDEX_FILENAME;
 
-  try {
-    TerrainDataset::findMinMax(p, this->mMinLevel, this->mMaxLevel);
+  if (!useIndexFile
+      || !this->mIndex.load(rootDirectory, indexFilename)
+      || this->mIndex.isStale(threadCount)) {
+    this->mIndex = TileIndex::scan(rootDirectory, "terrain", threadCount);
 
-    if (this->mMinLevel >= 0) {
-      p /= to_string(this->mMinLevel);
-      TerrainDataset::findMinMax(p, this->mMinX, this->mMaxX);
+    if (useIndexFile) {
+      try {
+        this->mIndex.save(indexFilename);
+      }
+      catch (CTBException &) {
+        // the tree may be read only, in which case it is scanned every time
+      }
     }
+  }
+
+  if (this->mIndex.empty()) {
+    throw CTBException("Could not find TMS like directory tree.");
+  }
+
+  this->mMinLevel = this->mIndex.minZoom();
+  this->mMaxLevel = this->mIndex.maxZoom();
+}
+
+TerrainDataset::~TerrainDataset()
+{}
+
+double
+TerrainDataset::getHeight(double longitude, double latitude, int level) const
+{
+  const CRSPoint point(longitude, latitude);
+  TileCoordinate coord;
+
+  if (!this->findTile(point, level, coord)) {
+    return numeric_limits<double>::quiet_NaN();
+  }
 
-    if (this->mMinX >= 0) {
-      p /= to_string(this->mMinX);
-      TerrainDataset::findMinMax(p, this->mMinY, this->mMaxY);
+  return interpolate(*this->getTileHeights(coord), this->mGrid.tileBounds(coord), point);
+}
+
+/**
+* @details The points are sorted by tile key, so the points in a tile are
+* queried together and nearby tiles are queried one after another.
+*/
+void
+TerrainDataset::getHeights(const vector<CRSPoint> &points, vector<double> &heights, int level) const
+{
+  heights.assign(points.size(), numeric_limits<double>::quiet_NaN());
+
+  vector<pair<uint64_t, size_t>> order;
+  vector<TileCoordinate> coords(points.size());
+  order.reserve(points.size());
+
+  for (size_t i = 0; i < points.size(); ++i) {
+    if (this->findTile(points[i], level, coords[i])) {
+      order.push_back(make_pair(TileStore::tileKey(coords[i]), i));
     }
   }
-  catch (const filesystem_error& ex) {
-    cerr << ex.what() << endl;
+
+  sort(order.begin(), order.end());
+
+  for (size_t i = 0; i < order.size();) {
+    const uint64_t key = order[i].first;
+    const TileCoordinate &coord = coords[order[i].second];
+    const shared_ptr<const Heights> tile = this->getTileHeights(coord);
+    const CRSBounds bounds = this->mGrid.tileBounds(coord);
+
+    for (; i < order.size() && order[i].first == key; ++i) {
+      heights[order[i].second] = interpolate(*tile, bounds, points[order[i].second]);
+    }
   }
 }
 
-void TerrainDataset::findMinMax(boost::filesystem::path& p, int& min, int& max)
+void
+TerrainDataset::getProfile(const vector<CRSPoint> &line,
+                           vector<CRSPoint> &points,
+                           vector<double> &heights,
+                           double spacing,
+                           int level) const
 {
-  min = -1;
-  max = -1;
-
-  if (exists(p)) {
-    if (is_directory(p)) {
-      typedef vector<path> vec;
-      vec v;
-
-      copy(directory_iterator(p), directory_iterator(), back_inserter(v));
-      sort(v.begin(), v.end());
-
-      for (vec::const_iterator it(v.begin()); it != v.end(); ++it) {
-
-        int i;
-        try {
-          i = boost::lexical_cast<int>((*it).stem().string());
-          if (min == -1) {
-            min = i;
-          }
-          if (i < min) {
-            min = i;
-          }
-          if (i > max) {
-            max = i;
-          }
-        }
-        catch (boost::bad_lexical_cast & e) {
-          //cout << "Exception caught : " << e.what() << endl;
-        }
-      }
+  if (spacing <= 0) {
+    spacing = this->mGrid.resolution((level < 0 || level > this->mMaxLevel) ? this->mMaxLevel : level);
+  }
 
-      if (min == -1) {
-        throw CTBException("Could not find TMS like directory tree.");
-      }
+  points.clear();
+  for (size_t i = 0; i + 1 < line.size(); ++i) {
+    const CRSPoint &start = line[i], &end = line[i + 1];
+    const double dx = end.x - start.x, dy = end.y - start.y;
+    const size_t steps = max<size_t>(1, (size_t) ceil(sqrt(dx * dx + dy * dy) / spacing));
+
+    for (size_t step = 0; step < steps; ++step) {
+      const double fraction = (double) step / steps;
+      points.push_back(CRSPoint(start.x + dx * fraction, start.y + dy * fraction));
     }
-    else {
-      throw CTBException((p.string() + " exists, but is not a directory.").c_str());
+  }
+
+  if (!line.empty()) {
+    points.push_back(line.back());
+  }
+
+  this->getHeights(points, heights, level);
+}
+
+void
+TerrainDataset::setCacheSize(size_t bytes)
+{
+  this->mCache.reset(new LRUCache<uint64_t, Heights>(bytes));
+}
+
+/**
+* @details Points on the east or north edge of the world belong to the last
+* tile rather than one beyond it.
+*/
+bool
+TerrainDataset::findTile(const CRSPoint &point, int level, TileCoordinate &coord) const
+{
+  const CRSBounds &extent = this->mGrid.getExtent();
+  if (!(point.x >= extent.getMinX() && point.x <= extent.getMaxX()
+        && point.y >= extent.getMinY() && point.y <= extent.getMaxY())) {
+    return false;               // this also rejects NaN
+  }
+
+  if (level < 0 || level > this->mMaxLevel) {
+    level = this->mMaxLevel;
+  }
+
+  for (; level >= this->mMinLevel; --level) {
+    coord = this->mGrid.crsToTile(point, (i_zoom) level);
+
+    const CRSBounds bounds = this->mGrid.tileBounds(coord);
+    if (coord.x > 0 && bounds.getMinX() >= extent.getMaxX()) {
+      --coord.x;
+    }
+    if (coord.y > 0 && bounds.getMinY() >= extent.getMaxY()) {
+      --coord.y;
+    }
+
+    if (this->hasTile(level, coord.x, coord.y)) {
+      return true;
     }
   }
-  else {
-    throw CTBException((p.string() + " does not exist.").c_str());
+
+  return false;
+}
+
+/**
+* @details Only the heights are decoded from the tile: the child flags and
+* water mask which follow them are skipped.  Two threads may decode the same
+* tile at once, in which case the result of one replaces the other.  The
+* encoded tile is read into a buffer kept by each thread.
+*/
+shared_ptr<const TerrainDataset::Heights>
+TerrainDataset::getTileHeights(const TileCoordinate &coord) const
+{
+  const uint64_t key = TileStore::tileKey(coord);
+  shared_ptr<const Heights> cached = this->mCache->get(key);
+
+  if (cached) {
+    return cached;
+  }
+
+  static thread_local vector<unsigned char> data;
+  if (!this->mStore->readTile(coord, data)) {
+    throw CTBException("The terrain tile no longer exists");
+  }
+
+  unsigned char buffer[cHeightCount * 2];
+  const TileCodec::Format format = (this->mFormat == TileCodec::FORMAT_UNKNOWN)
+    ? Terrain::detectFormat(data.data(), data.size()) : this->mFormat;
+
+  if (TileCodec::decodePrefix(data.data(), data.size(), buffer, sizeof(buffer), format) != sizeof(buffer)) {
+    throw CTBException("Data has too few bytes to be a valid terrain");
   }
+
+  // The heights are little endian
+  shared_ptr<Heights> heights = make_shared<Heights>(cHeightCount);
+  for (size_t i = 0; i < cHeightCount; ++i) {
+    (*heights)[i] = (i_terrain_height) (buffer[i * 2] | (buffer[i * 2 + 1] << 8));
+  }
+
+  this->mCache->put(key, heights, cHeightCount * sizeof(i_terrain_height));
+  return heights;
 }
 
-TerrainDataset::~TerrainDataset()
-{}
+/**
+* @details The heights are samples from the west to the east edge of the tile
+* and from the north to the south edge, as Cesium interprets them.  Stored
+* heights are the height in metres plus 1000, multiplied by 5.
+*/
+double
+TerrainDataset::interpolate(const Heights &heights, const CRSBounds &bounds, const CRSPoint &point)
+{
+  const double last = TILE_SIZE - 1;
+  const double u = min(max((point.x - bounds.getMinX()) / bounds.getWidth() * last, 0.0), last),
+    v = min(max((bounds.getMaxY() - point.y) / bounds.getHeight() * last, 0.0), last);
+
+  const size_t column = min((size_t) u, (size_t) TILE_SIZE - 2),
+    row = min((size_t) v, (size_t) TILE_SIZE - 2);
+  const double du = u - column, dv = v - row;
+
+  const i_terrain_height *cell = &heights[row * TILE_SIZE + column];
+  const double north = cell[0] + (cell[1] - cell[0]) * du,
+    south = cell[TILE_SIZE] + (cell[TILE_SIZE + 1] - cell[TILE_SIZE]) * du;
+
+  return (north + (south - north) * dv) / 5.0 - 1000.0;
+}
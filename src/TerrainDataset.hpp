@@ -6,19 +6,39 @@
 * @brief This declares the `TerrainDataset` class
 */
 
-#include <boost\filesystem.hpp>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "config.hpp"           // for CTB_DLL
+#include "DirectoryTileStore.hpp"
+#include "GlobalGeodetic.hpp"
+#include "LRUCache.hpp"
+#include "TileCodec.hpp"
+#include "TileIndex.hpp"
+#include "types.hpp"
 
 namespace ctb {
   class TerrainDataset;
 }
 
-
+/**
+* @brief A tree of terrain tiles in a directory
+*
+* The tiles present are recorded in a `TileIndex`.  The index is saved in the
+* root directory as `.tileindex` and reused for as long as the tree is
+* unchanged, so only the first use of a tree has to scan it.
+*
+* Heights can be queried at points or along lines in degrees of longitude and
+* latitude.  The heights of the tiles read are kept in a cache shared by all
+* threads, so the query methods can be called concurrently.
+*/
 class CTB_DLL ctb::TerrainDataset
 {
 public:
   TerrainDataset();
-  TerrainDataset(std::string rootDirectory);
+  TerrainDataset(std::string rootDirectory, bool useIndexFile = true, unsigned int threadCount = 0);
 
   int getMinLevel() {
     return this->mMinLevel;
@@ -28,38 +48,111 @@ public:
   }
 
   int getMinX(int level) {
-    return this->mMinX;
+    return this->hasLevel(level) ? this->mIndex.bounds(level).getMinX() : -1;
   }
   int getMaxX(int level) {
-    return this->mMaxX;
+    return this->hasLevel(level) ? this->mIndex.bounds(level).getMaxX() : -1;
   }
 
   int getMinY(int level) {
-    return this->mMinY;
+    return this->hasLevel(level) ? this->mIndex.bounds(level).getMinY() : -1;
   }
   int getMaxY(int level) {
-    return this->mMaxY;
+    return this->hasLevel(level) ? this->mIndex.bounds(level).getMaxY() : -1;
+  }
+
+  /// Are there any tiles at a level?
+  bool hasLevel(int level) const {
+    return level >= 0 && this->mIndex.hasLevel(level);
+  }
+
+  /// Is a tile present?  This doesn't touch the filesystem.
+  bool hasTile(int level, int x, int y) const {
+    return level >= 0 && x >= 0 && y >= 0 && this->mIndex.contains(level, x, y);
+  }
+
+  const TileIndex &getIndex() const {
+    return this->mIndex;
   }
 
   std::string getTileFilename(int level, int x, int y) {
-    return static_cast<std::ostringstream*>(&(std::ostringstream() << this->mRootDirectory << "\\" << level << "\\" << x << "\\" << y << ".terrain"))->str();
+    std::ostringstream stream;
+    stream << this->mRootDirectory << "/" << level << "/" << x << "/" << y << ".terrain";
+    return stream.str();
   }
 
+  /**
+  * @brief Get the height at a point, or NaN where there is no terrain
+  *
+  * The heights of the tile at `level` covering the point are bilinearly
+  * interpolated.  Where that tile isn't present the deepest tile above it
+  * is used instead.  A `level` of `-1` uses the maximum level.
+  */
+  double getHeight(double longitude, double latitude, int level = -1) const;
+
+  /**
+  * @brief Get the heights at many points
+  *
+  * The points are grouped by tile before being queried, so each tile is
+  * read from the cache or decoded once however many points fall in it.
+  */
+  void getHeights(const std::vector<CRSPoint> &points, std::vector<double> &heights, int level = -1) const;
+
+  /**
+  * @brief Get the heights along a line
+  *
+  * The line is sampled at each vertex and every `spacing` degrees in between.
+  * A `spacing` of `0` uses the resolution of the tiles at `level`.  The
+  * points sampled are written to `points` and their heights to `heights`.
+  */
+  void getProfile(const std::vector<CRSPoint> &line,
+                  std::vector<CRSPoint> &points,
+                  std::vector<double> &heights,
+                  double spacing = 0,
+                  int level = -1) const;
+
+  /// Set the memory used to cache the heights of tiles, emptying the cache
+  void setCacheSize(size_t bytes);
+
+  /// The memory used to cache the heights of tiles by default
+  static const size_t DEFAULT_CACHE_SIZE = 64 * 1024 * 1024;
+
+  /// The name of the index file in the root directory
+  static const char *const INDEX_FILENAME;
+
   virtual ~TerrainDataset();
 
 private:
-  static void findMinMax(boost::filesystem::path& p, int& min, int& max);
+  /// The heights of a tile as they are stored
+  typedef std::vector<i_terrain_height> Heights;
+
+  /// Find the tile to query for a point
+  bool findTile(const CRSPoint &point, int level, TileCoordinate &coord) const;
+
+  /// Get the heights of a tile from the cache, decoding them if need be
+  std::shared_ptr<const Heights> getTileHeights(const TileCoordinate &coord) const;
+
+  /// Interpolate the height at a point within a tile
+  static double interpolate(const Heights &heights, const CRSBounds &bounds, const CRSPoint &point);
 
   std::string mRootDirectory;
 
   int mMinLevel;
   int mMaxLevel;
 
-  int mMinX;
-  int mMaxX;
+  TileIndex mIndex;
+
+  /// Terrain tiles use the geodetic profile
+  GlobalGeodetic mGrid;
+
+  /// The compression recorded for the tiles
+  TileCodec::Format mFormat;
+
+  /// The tiles in the root directory, opened once for all the tiles read
+  std::shared_ptr<const DirectoryTileStore> mStore;
 
-  int mMinY;
-  int mMaxY;
+  /// The heights of tiles recently queried
+  std::shared_ptr<LRUCache<uint64_t, Heights>> mCache;
 };
 
 #endif /* CTBTERRAINDATASET_HPP */
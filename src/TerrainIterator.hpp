@@ -22,6 +22,7 @@
  * @brief This declares the `TerrainIterator` class
  */
 
+#include "TilerIterator.hpp"
 #include "TerrainTile.hpp"
 #include "TerrainTiler.hpp"
 
@@ -33,9 +34,11 @@ namespace ctb {
  * @brief This forward iterates over all `TerrainTile`s in a `TerrainTiler`
  *
  * Instances of this class take a `TerrainTiler` in the constructor and are used
- * to forward iterate over all tiles in the tiler, returning a `TerrainTile *`
- * when dereferenced.  It is the caller's responsibility to call `delete` on the
- * tile.
+ * to forward iterate over all tiles in the tiler, returning a newly created
+ * `TerrainTile` when dereferenced.  Alternatively an existing tile can be
+ * filled with the current tile using `TerrainIterator::fill`, which avoids
+ * allocating a new `TerrainTile` on every iteration, although creating the
+ * tile may still allocate (see `TerrainTiler::createTerrainTile`).
  */
 class ctb::TerrainIterator :
   public TilerIterator
@@ -52,9 +55,16 @@ public:
     TilerIterator(tiler, startZoom, endZoom)
   {}
 
-  virtual TerrainTile *
-  operator*() const override {
-    return static_cast<TerrainTile *>(TilerIterator::operator*());
+  /// Override the dereference operator to return a `TerrainTile`
+  std::unique_ptr<TerrainTile>
+  operator*() const {
+    return static_cast<const TerrainTiler &>(tiler).createTerrainTile(coordinate());
+  }
+
+  /// Overwrite an existing tile with the current tile
+  void
+  fill(TerrainTile &tile) const {
+    static_cast<const TerrainTiler &>(tiler).createTerrainTile(coordinate(), tile);
   }
 };
 
@@ -21,7 +21,6 @@
 
 #include <string.h>             // for memcpy
 
-#include "zlib.h"
 #include "ogr_spatialref.h"
 
 #include "CTBException.hpp"
@@ -86,28 +85,85 @@ Terrain::Terrain(FILE *fp):
 }
 
 /**
- * @details This reads gzipped terrain data from a file.
+ * @details This reads compressed terrain data from a file.  The compression
+ * is detected from the data (see `Terrain::decode`).
  */
 void
 Terrain::readFile(const char *fileName) {
-  unsigned char inflateBuffer[MAX_TERRAIN_SIZE];
-  unsigned int inflatedBytes;
-  gzFile terrainFile = gzopen(fileName, "rb");
+  FILE *fp = fopen(fileName, "rb");
 
-  if (terrainFile == NULL) {
+  if (fp == NULL) {
     throw CTBException("Failed to open file");
   }
 
-  // Uncompress the file into the buffer
-  inflatedBytes = gzread(terrainFile, inflateBuffer, MAX_TERRAIN_SIZE);
-  if (gzread(terrainFile, inflateBuffer, 1) != 0) {
-    gzclose(terrainFile);
-    throw CTBException("File has too many bytes to be a valid terrain");
+  // Read the compressed file into memory
+  std::vector<unsigned char> compressed;
+  unsigned char chunk[BUFSIZ];
+  size_t bytesRead;
+  while ((bytesRead = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    compressed.insert(compressed.end(), chunk, chunk + bytesRead);
+  }
+
+  if (ferror(fp)) {
+    fclose(fp);
+    throw CTBException("Failed to read file");
+  }
+  fclose(fp);
+
+  decode(compressed.data(), compressed.size());
+}
+
+/**
+ * @details The compression is detected from the data unless it is given.
+ * Uncompressed data is read in place, otherwise it is decompressed into a
+ * stack buffer.
+ */
+void
+Terrain::decode(const unsigned char *data, size_t size, TileCodec::Format format) {
+  if (format == TileCodec::FORMAT_UNKNOWN) {
+    format = detectFormat(data, size);
+  }
+
+  if (format == TileCodec::FORMAT_NONE) {
+    deserialise(data, size);
+    return;
+  }
+
+  unsigned char inflateBuffer[MAX_TERRAIN_SIZE];
+  size_t inflatedBytes;
+  try {
+    inflatedBytes = TileCodec::decode(data, size, inflateBuffer, MAX_TERRAIN_SIZE, format);
+  } catch (CTBException &e) {
+    throw CTBException("Data is not a valid compressed terrain");
+  }
+
+  deserialise(inflateBuffer, inflatedBytes);
+}
+
+/**
+ * @details The contents of `buffer` are replaced by the encoded terrain.
+ * Reusing the same buffer for many tiles avoids reallocating it.
+ */
+void
+Terrain::encode(std::vector<unsigned char> &buffer, const TileCodec &codec) const {
+  if (codec.format() == TileCodec::FORMAT_NONE) {
+    buffer.resize(MAX_TERRAIN_SIZE);
+    buffer.resize(serialise(buffer.data()));
+    return;
   }
-  gzclose(terrainFile);
 
+  unsigned char serialised[MAX_TERRAIN_SIZE];
+  codec.encode(serialised, serialise(serialised), buffer);
+}
+
+/**
+ * @details The buffer is the uncompressed terrain format: the little endian
+ * heights followed by the child flags and the water mask.
+ */
+void
+Terrain::deserialise(const unsigned char *buffer, size_t size) {
   // Check the water mask type
-  switch(inflatedBytes) {
+  switch(size) {
   case MAX_TERRAIN_SIZE:      // a water mask is present
     mMaskLength = MASK_CELL_SIZE;
     break;
@@ -121,14 +177,37 @@ Terrain::readFile(const char *fileName) {
   // Get the height data
   short int byteCount = 0;
   for (short int i = 0; i < TILE_CELL_SIZE; i++, byteCount = i * 2) {
-    mHeights[i] = inflateBuffer[byteCount] | (inflateBuffer[byteCount + 1]<<8);
+    mHeights[i] = buffer[byteCount] | (buffer[byteCount + 1]<<8);
   }
 
   // Get the child flag
-  mChildren = inflateBuffer[byteCount]; // byte 8451
+  mChildren = buffer[byteCount]; // byte 8451
 
   // Get the water mask
-  memcpy(mMask, &(inflateBuffer[++byteCount]), mMaskLength);
+  memcpy(mMask, &(buffer[++byteCount]), mMaskLength);
+}
+
+/**
+ * @details This is the inverse of `Terrain::deserialise`.  The buffer must
+ * have space for `MAX_TERRAIN_SIZE` bytes.
+ */
+size_t
+Terrain::serialise(unsigned char *buffer) const {
+  size_t byteCount = 0;
+
+  // Write the height data
+  for (unsigned short int i = 0; i < TILE_CELL_SIZE; i++) {
+    buffer[byteCount++] = mHeights[i] & 0xFF;
+    buffer[byteCount++] = (mHeights[i] >> 8) & 0xFF;
+  }
+
+  // Write the child flags
+  buffer[byteCount++] = mChildren;
+
+  // Write the water mask
+  memcpy(&(buffer[byteCount]), mMask, mMaskLength);
+
+  return byteCount + mMaskLength;
 }
 
 /**
@@ -144,41 +223,33 @@ Terrain::writeFile(FILE *fp) const {
 /**
  * @details This writes gzipped terrain data to a file.
  */
-void 
+void
 Terrain::writeFile(const char *fileName) const {
-  gzFile terrainFile = gzopen(fileName, "wb");
+  writeFile(fileName, TileCodec::defaultCodec());
+}
 
-  if (terrainFile == NULL) {
-    throw CTBException("Failed to open file");
-  }
+/**
+ * @details This writes terrain data to a file after compressing it with
+ * `codec` (see `Terrain::encode`).
+ */
+void
+Terrain::writeFile(const char *fileName, const TileCodec &codec) const {
+  std::vector<unsigned char> compressed;
+  encode(compressed, codec);
 
-  // Write the height data
-  if (gzwrite(terrainFile, mHeights.data(), TILE_CELL_SIZE * 2) == 0) {
-    gzclose(terrainFile);
-    throw CTBException("Failed to write height data");
-  }
+  FILE *fp = fopen(fileName, "wb");
 
-  // Write the child flags
-  if (gzputc(terrainFile, mChildren) == -1) {
-    gzclose(terrainFile);
-    throw CTBException("Failed to write child flags");
+  if (fp == NULL) {
+    throw CTBException("Failed to open file");
   }
 
-  // Write the water mask
-  if (gzwrite(terrainFile, mMask, mMaskLength) == 0) {
-    gzclose(terrainFile);
-    throw CTBException("Failed to write water mask");
+  if (fwrite(compressed.data(), 1, compressed.size(), fp) != compressed.size()) {
+    fclose(fp);
+    throw CTBException("Failed to write terrain data");
   }
 
   // Try and close the file
-  switch (gzclose(terrainFile)) {
-  case Z_OK:
-    break;
-  case Z_STREAM_ERROR:
-  case Z_ERRNO:
-  case Z_MEM_ERROR:
-  case Z_BUF_ERROR:
-  default:
+  if (fclose(fp) != 0) {
     throw CTBException("Failed to close file");
   }
 }
@@ -195,6 +266,45 @@ Terrain::hasChildren() const {
   return mChildren;
 }
 
+/**
+ * @details The child flags follow the heights in the uncompressed data, so
+ * the flags are the last byte of the decompressed prefix.
+ */
+char
+Terrain::decodeChildren(const unsigned char *data, size_t size, TileCodec::Format format) {
+  unsigned char prefix[(TILE_CELL_SIZE * 2) + 1];
+  size_t inflatedBytes;
+
+  if (format == TileCodec::FORMAT_UNKNOWN) {
+    format = detectFormat(data, size);
+  }
+
+  try {
+    inflatedBytes = TileCodec::decodePrefix(data, size, prefix, sizeof(prefix), format);
+  } catch (CTBException &e) {
+    throw CTBException("Data is not a valid compressed terrain");
+  }
+
+  if (inflatedBytes != sizeof(prefix)) {
+    throw CTBException("Data has too few bytes to be a valid terrain");
+  }
+
+  return (char) prefix[TILE_CELL_SIZE * 2];
+}
+
+/**
+ * @details The sizes are checked before the magic bytes, as the heights of an
+ * uncompressed tile can begin with the same bytes as compressed data.
+ */
+TileCodec::Format
+Terrain::detectFormat(const unsigned char *data, size_t size) {
+  if (size == MAX_TERRAIN_SIZE || size == (TILE_CELL_SIZE * 2) + 2) {
+    return TileCodec::FORMAT_NONE;
+  }
+
+  return TileCodec::detect(data, (size < 4) ? size : 4);
+}
+
 bool
 Terrain::hasChildSW() const {
   return ((mChildren & TERRAIN_CHILD_SW) == TERRAIN_CHILD_SW);
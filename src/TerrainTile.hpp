@@ -28,6 +28,7 @@
 
 #include "config.hpp"
 #include "Tile.hpp"
+#include "TileCodec.hpp"
 #include "TileCoordinate.hpp"
 
 namespace ctb {
@@ -44,6 +45,19 @@ namespace ctb {
 class CTB_DLL ctb::Terrain {
 public:
 
+  /**
+   * @brief Bit flags defining child tile existence
+   *
+   * There is a good discussion on bitflags
+   * [here](http://www.dylanleigh.net/notes/c-cpp-tricks.html#Using_"Bitflags").
+   */
+  enum Children {
+    TERRAIN_CHILD_SW = 1,       // 2^0, bit 0
+    TERRAIN_CHILD_SE = 2,       // 2^1, bit 1
+    TERRAIN_CHILD_NW = 4,       // 2^2, bit 2
+    TERRAIN_CHILD_NE = 8        // 2^3, bit 3
+  };
+
   /// Create an empty terrain object
   Terrain();
 
@@ -57,14 +71,33 @@ public:
   void
   readFile(const char *fileName);
 
+  /**
+   * @brief Read terrain data from memory, compressed with any `TileCodec`
+   *
+   * The format should be the one recorded for the tileset, if there is one
+   * (see `TileCodec::recorded`), as detecting it can be mistaken.
+   */
+  void
+  decode(const unsigned char *data, size_t size,
+         TileCodec::Format format = TileCodec::FORMAT_UNKNOWN);
+
+  /// Write terrain data to memory compressed with a codec
+  void
+  encode(std::vector<unsigned char> &buffer,
+         const TileCodec &codec = TileCodec::defaultCodec()) const;
+
   /// Write terrain data to a file handle
   void
   writeFile(FILE *fp) const;
 
-  /// Write terrain data to the filesystem
+  /// Write gzipped terrain data to the filesystem
   void
   writeFile(const char *fileName) const;
 
+  /// Write terrain data to the filesystem compressed with a codec
+  void
+  writeFile(const char *fileName, const TileCodec &codec) const;
+
   /// Get the water mask as a boolean mask
   std::vector<bool>
   mask();
@@ -73,6 +106,26 @@ public:
   bool
   hasChildren() const;
 
+  /**
+   * @brief Get the child flags of encoded terrain data
+   *
+   * Only the heights preceding the flags are decompressed, so this is much
+   * cheaper than decoding the whole tile.
+   */
+  static char
+  decodeChildren(const unsigned char *data, size_t size,
+                 TileCodec::Format format = TileCodec::FORMAT_UNKNOWN);
+
+  /**
+   * @brief Detect the compression of encoded terrain data of `size` bytes
+   *
+   * Data of exactly the size of an uncompressed tile is taken to be
+   * uncompressed, whatever its first bytes, otherwise the format is detected
+   * from the magic bytes.  Only the first four bytes of `data` are read.
+   */
+  static TileCodec::Format
+  detectFormat(const unsigned char *data, size_t size);
+
   /// Does the terrain tile have a south west child tile?
   bool
   hasChildSW() const;
@@ -156,22 +209,17 @@ protected:
 
 private:
 
+  /// Write the uncompressed terrain data to a buffer, returning its size
+  size_t
+  serialise(unsigned char *buffer) const;
+
+  /// Read uncompressed terrain data from a buffer
+  void
+  deserialise(const unsigned char *buffer, size_t size);
+
   char mChildren;               ///< The child flags
   char mMask[MASK_CELL_SIZE];   ///< The water mask
   size_t mMaskLength;           ///< What size is the water mask?
-
-  /**
-   * @brief Bit flags defining child tile existence
-   *
-   * There is a good discussion on bitflags
-   * [here](http://www.dylanleigh.net/notes/c-cpp-tricks.html#Using_"Bitflags").
-   */
-  enum Children {
-    TERRAIN_CHILD_SW = 1,       // 2^0, bit 0
-    TERRAIN_CHILD_SE = 2,       // 2^1, bit 1
-    TERRAIN_CHILD_NW = 4,       // 2^2, bit 2
-    TERRAIN_CHILD_NE = 8        // 2^3, bit 3
-  };
 };
 
 /**
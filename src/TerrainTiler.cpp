@@ -20,88 +20,146 @@
  */
 
 #include "CTBException.hpp"
+#include "Cutline.hpp"
 #include "TerrainTiler.hpp"
+#include "ReprojectionContext.hpp"
 
 using namespace ctb;
 
-TerrainTile *
-ctb::TerrainTiler::createTile(const TileCoordinate &coord) const {
-  // Get a terrain tile represented by the tile coordinate
-  TerrainTile *terrainTile = new TerrainTile(coord);
-  GDALTile *rasterTile = createRasterTile(coord); // the raster associated with this tile coordinate
-  GDALRasterBand *heightsBand = rasterTile->dataset->GetRasterBand(1);
+std::unique_ptr<TerrainTile>
+ctb::TerrainTiler::createTerrainTile(const TileCoordinate &coord) const {
+  std::unique_ptr<TerrainTile> terrainTile(new TerrainTile(coord));
+  createTerrainTile(coord, *terrainTile);
 
-  // Copy the raster data into an array
+  return terrainTile;
+}
+
+/**
+ * @details The tile is reset before being filled, so a single tile can be
+ * reused for creating many tiles rather than allocating a `TerrainTile` and
+ * its heights for each one.  The heights are warped by the thread's
+ * `ReprojectionContext`, either straight into a stack buffer or through the
+ * thread's warped VRT, and the cutline mask is kept by each thread, so once a
+ * thread has created a tile no more memory is allocated with `new` for
+ * further tiles (as checked by `test/allocations.cpp`).  GDAL itself still
+ * allocates the working buffers of each warp with `CPLMalloc`.  A `GDALTile`
+ * is only created if the thread's context is in use elsewhere.
+ */
+void
+ctb::TerrainTiler::createTerrainTile(const TileCoordinate &coord, TerrainTile &terrainTile) const {
+  // Point the terrain tile at the tile coordinate
+  static_cast<TileCoordinate &>(terrainTile) = coord;
+  terrainTile.setAllChildren(false);
+  terrainTile.setIsLand();
+
+  // Copy the raster data into an array, preferably warping directly into it
   float rasterHeights[TerrainTile::TILE_CELL_SIZE];
-  if (heightsBand->RasterIO(GF_Read, 0, 0, TILE_SIZE, TILE_SIZE,
-                            (void *) rasterHeights, TILE_SIZE, TILE_SIZE, GDT_Float32,
-                            0, 0) != CE_None) {
-    throw CTBException("Could not read heights from raster");
+  std::shared_ptr<ReprojectionContext> context;
+
+  if (poDataset != NULL) {
+    context = reprojectionContext();
   }
 
-  delete rasterTile;
+  if (context && context->acquire()) {
+    // Ensure we have some data from which to create a tile
+    if (poDataset->GetRasterCount() < 1) {
+      context->release();
+      throw CTBException("At least one band must be present in the GDAL dataset");
+    }
+
+    double adfGeoTransform[6];
+    terrainGeoTransform(coord, adfGeoTransform);
+
+    try {
+      if (options.useWarpedVRT) {
+        context->readWarpedVRT(adfGeoTransform, TILE_SIZE, TILE_SIZE, rasterHeights);
+      } else {
+        context->warpToBuffer(adfGeoTransform, TILE_SIZE, TILE_SIZE, rasterHeights);
+      }
+    } catch (CTBException &e) {
+      context->release();
+      throw;
+    }
+    context->release();
+  } else {
+    std::unique_ptr<GDALTile> rasterTile = createRasterTile(coord); // the raster associated with this tile coordinate
+    GDALRasterBand *heightsBand = rasterTile->dataset->GetRasterBand(1);
+
+    if (heightsBand->RasterIO(GF_Read, 0, 0, TILE_SIZE, TILE_SIZE,
+                              (void *) rasterHeights, TILE_SIZE, TILE_SIZE, GDT_Float32,
+                              0, 0) != CE_None) {
+      throw CTBException("Could not read heights from raster");
+    }
+  }
 
   // Copy the raster data into the terrain tile heights
   // TODO: try doing this using a VRT derived band:
   // (http://www.gdal.org/gdal_vrttut.html)
   for (unsigned short int i = 0; i < TerrainTile::TILE_CELL_SIZE; i++) {
-    terrainTile->mHeights[i] = (i_terrain_height) ((rasterHeights[i] + 1000) * 5);
+    terrainTile.mHeights[i] = (i_terrain_height) ((rasterHeights[i] + 1000) * 5);
+  }
+
+  // Heights outside the cutline are set to sea level
+  if (mCutline) {
+    double adfGeoTransform[6];
+    terrainGeoTransform(coord, adfGeoTransform);
+
+    double resolution;
+    if (mCutline->coverage(terrainTileBounds(coord, resolution)) != Cutline::INSIDE) {
+      static thread_local std::vector<bool> inside;
+      mCutline->mask(adfGeoTransform, TILE_SIZE, TILE_SIZE, inside);
+
+      for (unsigned short int i = 0; i < TerrainTile::TILE_CELL_SIZE; i++) {
+        if (!inside[i]) {
+          terrainTile.mHeights[i] = (i_terrain_height) (1000 * 5);
+        }
+      }
+    }
   }
 
   // If we are not at the maximum zoom level we need to set child flags on the
-  // tile where child tiles overlap the dataset bounds.
+  // tile where child tiles overlap the region being tiled.
   if (coord.zoom != maxZoomLevel()) {
     CRSBounds tileBounds = mGrid.tileBounds(coord);
 
     if (! (bounds().overlaps(tileBounds))) {
-      terrainTile->setAllChildren(false);
+      terrainTile.setAllChildren(false);
     } else {
-      if (bounds().overlaps(tileBounds.getSW())) {
-        terrainTile->setChildSW();
+      if (overlaps(tileBounds.getSW())) {
+        terrainTile.setChildSW();
       }
-      if (bounds().overlaps(tileBounds.getNW())) {
-        terrainTile->setChildNW();
+      if (overlaps(tileBounds.getNW())) {
+        terrainTile.setChildNW();
       }
-      if (bounds().overlaps(tileBounds.getNE())) {
-        terrainTile->setChildNE();
+      if (overlaps(tileBounds.getNE())) {
+        terrainTile.setChildNE();
       }
-      if (bounds().overlaps(tileBounds.getSE())) {
-        terrainTile->setChildSE();
+      if (overlaps(tileBounds.getSE())) {
+        terrainTile.setChildSE();
       }
     }
   }
-
-  return terrainTile;
 }
 
-GDALTile *
+std::unique_ptr<GDALTile>
 ctb::TerrainTiler::createRasterTile(const TileCoordinate &coord) const {
   // Ensure we have some data from which to create a tile
   if (poDataset && poDataset->GetRasterCount() < 1) {
     throw CTBException("At least one band must be present in the GDAL dataset");
   }
 
-  // Get the bounds and resolution for a tile coordinate which represents the
-  // data overlap requested by the terrain specification.
-  double resolution;
-  CRSBounds tileBounds = terrainTileBounds(coord, resolution);
-
-  // Convert the tile bounds into a geo transform
+  // Get the geotransform for the data overlap required by the terrain
+  // specification
   double adfGeoTransform[6];
-  adfGeoTransform[0] = tileBounds.getMinX(); // min longitude
-  adfGeoTransform[1] = resolution;
-  adfGeoTransform[2] = 0;
-  adfGeoTransform[3] = tileBounds.getMaxY(); // max latitude
-  adfGeoTransform[4] = 0;
-  adfGeoTransform[5] = -resolution;
+  terrainGeoTransform(coord, adfGeoTransform);
 
-  GDALTile *tile = GDALTiler::createRasterTile(adfGeoTransform);
+  std::unique_ptr<GDALTile> tile = GDALTiler::createRasterTile(adfGeoTransform);
 
   // The previous geotransform represented the data with an overlap as required
   // by the terrain specification.  This now needs to be overwritten so that
   // the data is shifted to the bounds defined by tile itself.
-  tileBounds = mGrid.tileBounds(coord);
-  resolution = mGrid.resolution(coord.zoom);
+  CRSBounds tileBounds = mGrid.tileBounds(coord);
+  double resolution = mGrid.resolution(coord.zoom);
   adfGeoTransform[0] = tileBounds.getMinX(); // min longitude
   adfGeoTransform[1] = resolution;
   adfGeoTransform[2] = 0;
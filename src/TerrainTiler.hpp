@@ -57,14 +57,25 @@ public:
   TerrainTiler &
   operator=(const TerrainTiler &other);
 
-  /// Override to return a covariant data type
-  TerrainTile *
-  createTile(const TileCoordinate &coord) const override;
+  /// Create a tile from a tile coordinate
+  std::unique_ptr<Tile>
+  createTile(const TileCoordinate &coord) const override {
+    return createTerrainTile(coord);
+  }
+
+  /// Create a terrain tile from a tile coordinate
+  std::unique_ptr<TerrainTile>
+  createTerrainTile(const TileCoordinate &coord) const;
+
+  /// Overwrite an existing terrain tile with the tile at a tile coordinate,
+  /// reusing its memory
+  void
+  createTerrainTile(const TileCoordinate &coord, TerrainTile &tile) const;
 
 protected:
 
   /// Create a `GDALTile` representing the required terrain tile data
-  virtual GDALTile *
+  virtual std::unique_ptr<GDALTile>
   createRasterTile(const TileCoordinate &coord) const override;
 
   /**
@@ -97,6 +108,21 @@ protected:
 
     return tile;
   }
+
+  /// Get the geotransform of the terrain bounds of a tile
+  inline void
+  terrainGeoTransform(const TileCoordinate &coord,
+                      double (&adfGeoTransform)[6]) const {
+    double resolution;
+    CRSBounds tileBounds = terrainTileBounds(coord, resolution);
+
+    adfGeoTransform[0] = tileBounds.getMinX(); // min longitude
+    adfGeoTransform[1] = resolution;
+    adfGeoTransform[2] = 0;
+    adfGeoTransform[3] = tileBounds.getMaxY(); // max latitude
+    adfGeoTransform[4] = 0;
+    adfGeoTransform[5] = -resolution;
+  }
 };
 
 #endif /* TERRAINTILER_HPP */
@@ -0,0 +1,532 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileCodec.cpp
+ * @brief This defines the `TileCodec` class
+ */
+
+#include <stdlib.h>             // for atoi
+#include <string.h>             // for memcpy
+
+#include "zlib.h"
+
+#include "config.hpp"           // for the optional compression libraries
+
+#ifdef CTB_HAVE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+
+#ifdef CTB_HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "TileCodec.hpp"
+#include "TileStore.hpp"
+
+using namespace ctb;
+
+namespace {
+
+  /// A deflate stream which is kept between calls on the same thread
+  struct DeflateStream {
+    z_stream stream;
+    int level = -2;             // no stream initialised
+
+    ~DeflateStream() {
+      if (level != -2) deflateEnd(&stream);
+    }
+
+    /// Get a stream ready to compress at a certain level
+    z_stream &
+    reset(int newLevel) {
+      if (level == newLevel) {
+        deflateReset(&stream);
+        return stream;
+      }
+
+      if (level != -2) deflateEnd(&stream);
+      level = -2;
+
+      memset(&stream, 0, sizeof(stream));
+      // 15 window bits plus 16 to write a gzip header and trailer
+      if (deflateInit2(&stream, newLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw CTBException("Could not initialise zlib compression");
+      }
+      level = newLevel;
+
+      return stream;
+    }
+  };
+
+  /// An inflate stream which is kept between calls on the same thread
+  struct InflateStream {
+    z_stream stream;
+    bool initialised = false;
+
+    ~InflateStream() {
+      if (initialised) inflateEnd(&stream);
+    }
+
+    z_stream &
+    reset() {
+      if (initialised) {
+        inflateReset(&stream);
+        return stream;
+      }
+
+      memset(&stream, 0, sizeof(stream));
+      // Only accept gzip data
+      if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+        throw CTBException("Could not initialise zlib decompression");
+      }
+      initialised = true;
+
+      return stream;
+    }
+  };
+
+  /// gzip compression using zlib
+  class ZlibCodec : public TileCodec {
+  public:
+    ZlibCodec(int level):
+      mLevel(level)
+    {}
+
+    std::string
+    spec() const override {
+      return (mLevel == Z_DEFAULT_COMPRESSION) ? "gzip" : "gzip:" + std::to_string(mLevel);
+    }
+
+    Format
+    format() const override {
+      return FORMAT_GZIP;
+    }
+
+    void
+    encode(const unsigned char *data, size_t size, std::vector<unsigned char> &output) const override {
+      static thread_local DeflateStream cache;
+      z_stream &stream = cache.reset(mLevel);
+
+      output.resize(deflateBound(&stream, size));
+      stream.next_in = const_cast<Bytef *>(data);
+      stream.avail_in = size;
+      stream.next_out = output.data();
+      stream.avail_out = output.size();
+
+      if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        throw CTBException("Failed to compress tile data with zlib");
+      }
+
+      output.resize(stream.total_out);
+    }
+
+  private:
+    int mLevel;
+  };
+
+#ifdef CTB_HAVE_LIBDEFLATE
+  /// gzip compression using libdeflate
+  class LibdeflateCodec : public TileCodec {
+  public:
+    LibdeflateCodec(int level):
+      mLevel(level)
+    {}
+
+    std::string
+    spec() const override {
+      return "libdeflate:" + std::to_string(mLevel);
+    }
+
+    Format
+    format() const override {
+      return FORMAT_GZIP;
+    }
+
+    void
+    encode(const unsigned char *data, size_t size, std::vector<unsigned char> &output) const override {
+      // Compressors are expensive to allocate so keep one per thread
+      static thread_local struct Compressor {
+        libdeflate_compressor *compressor = NULL;
+        int level = 0;
+
+        ~Compressor() {
+          if (compressor) libdeflate_free_compressor(compressor);
+        }
+      } cache;
+
+      if (cache.compressor == NULL || cache.level != mLevel) {
+        if (cache.compressor) libdeflate_free_compressor(cache.compressor);
+        cache.compressor = libdeflate_alloc_compressor(mLevel);
+        if (cache.compressor == NULL) {
+          throw CTBException("Could not allocate a libdeflate compressor");
+        }
+        cache.level = mLevel;
+      }
+
+      output.resize(libdeflate_gzip_compress_bound(cache.compressor, size));
+      size_t written = libdeflate_gzip_compress(cache.compressor, data, size, output.data(), output.size());
+      if (written == 0) {
+        throw CTBException("Failed to compress tile data with libdeflate");
+      }
+
+      output.resize(written);
+    }
+
+  private:
+    int mLevel;
+  };
+#endif
+
+#ifdef CTB_HAVE_ZSTD
+  /// zstd compression
+  class ZstdCodec : public TileCodec {
+  public:
+    ZstdCodec(int level):
+      mLevel(level)
+    {}
+
+    std::string
+    spec() const override {
+      return "zstd:" + std::to_string(mLevel);
+    }
+
+    Format
+    format() const override {
+      return FORMAT_ZSTD;
+    }
+
+    void
+    encode(const unsigned char *data, size_t size, std::vector<unsigned char> &output) const override {
+      static thread_local struct Context {
+        ZSTD_CCtx *context = ZSTD_createCCtx();
+
+        ~Context() {
+          ZSTD_freeCCtx(context);
+        }
+      } cache;
+
+      output.resize(ZSTD_compressBound(size));
+      size_t written = ZSTD_compressCCtx(cache.context, output.data(), output.size(), data, size, mLevel);
+      if (ZSTD_isError(written)) {
+        throw CTBException("Failed to compress tile data with zstd");
+      }
+
+      output.resize(written);
+    }
+
+  private:
+    int mLevel;
+  };
+#endif
+
+  /// No compression
+  class NullCodec : public TileCodec {
+  public:
+    std::string
+    spec() const override {
+      return "none";
+    }
+
+    Format
+    format() const override {
+      return FORMAT_NONE;
+    }
+
+    void
+    encode(const unsigned char *data, size_t size, std::vector<unsigned char> &output) const override {
+      output.assign(data, data + size);
+    }
+  };
+
+  /// Parse the level from a codec specification, checking it is in range
+  int
+  parseLevel(const std::string &level, int defaultLevel, int minLevel, int maxLevel) {
+    if (level.empty()) {
+      return defaultLevel;
+    }
+
+    int value = atoi(level.c_str());
+    if (value < minLevel || value > maxLevel || level.find_first_not_of("0123456789") != std::string::npos) {
+      throw CTBException("The compression level is out of range for the codec");
+    }
+
+    return value;
+  }
+}
+
+/**
+ * @details gzip data is recognised by its ID bytes and the deflate compression
+ * method, and zstd data by its frame magic number.
+ */
+TileCodec::Format
+TileCodec::detect(const unsigned char *data, size_t size) {
+  if (size >= 3 && data[0] == 0x1f && data[1] == 0x8b && data[2] == 0x08) {
+    return FORMAT_GZIP;
+  }
+
+  if (size >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd) {
+    return FORMAT_ZSTD;
+  }
+
+  return FORMAT_NONE;
+}
+
+size_t
+TileCodec::decode(const unsigned char *data, size_t size, unsigned char *buffer, size_t capacity,
+                  Format format) {
+  switch ((format == FORMAT_UNKNOWN) ? detect(data, size) : format) {
+  case FORMAT_GZIP: {
+#ifdef CTB_HAVE_LIBDEFLATE
+    static thread_local struct Decompressor {
+      libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+
+      ~Decompressor() {
+        libdeflate_free_decompressor(decompressor);
+      }
+    } cache;
+
+    size_t inflated;
+    switch (libdeflate_gzip_decompress(cache.decompressor, data, size, buffer, capacity, &inflated)) {
+    case LIBDEFLATE_SUCCESS:
+      return inflated;
+    case LIBDEFLATE_INSUFFICIENT_SPACE:
+      throw CTBException("Data has too many bytes to be a valid tile");
+    default:
+      throw CTBException("Failed to decompress gzipped tile data");
+    }
+#else
+    static thread_local InflateStream cache;
+    z_stream &stream = cache.reset();
+
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = size;
+    stream.next_out = buffer;
+    stream.avail_out = capacity;
+
+    switch (inflate(&stream, Z_FINISH)) {
+    case Z_STREAM_END:
+      return stream.total_out;
+    case Z_BUF_ERROR:
+      if (stream.avail_out == 0) {
+        throw CTBException("Data has too many bytes to be a valid tile");
+      }
+      // fall through
+    default:
+      throw CTBException("Failed to decompress gzipped tile data");
+    }
+#endif
+  }
+
+  case FORMAT_ZSTD: {
+#ifdef CTB_HAVE_ZSTD
+    static thread_local struct Context {
+      ZSTD_DCtx *context = ZSTD_createDCtx();
+
+      ~Context() {
+        ZSTD_freeDCtx(context);
+      }
+    } cache;
+
+    size_t inflated = ZSTD_decompressDCtx(cache.context, buffer, capacity, data, size);
+    if (ZSTD_isError(inflated)) {
+      throw CTBException("Failed to decompress zstd tile data");
+    }
+
+    return inflated;
+#else
+    throw CTBException("Cannot decompress zstd tile data as zstd support is not available");
+#endif
+  }
+
+  case FORMAT_NONE:
+  default:
+    if (size > capacity) {
+      throw CTBException("Data has too many bytes to be a valid tile");
+    }
+
+    memcpy(buffer, data, size);
+    return size;
+  }
+}
+
+/**
+ * @details gzip and zstd data is decompressed as a stream which is stopped
+ * once `length` bytes are available.  libdeflate can't decompress part of a
+ * stream so zlib is always used for gzip.
+ */
+size_t
+TileCodec::decodePrefix(const unsigned char *data, size_t size, unsigned char *buffer, size_t length,
+                        Format format) {
+  switch ((format == FORMAT_UNKNOWN) ? detect(data, size) : format) {
+  case FORMAT_GZIP: {
+    static thread_local InflateStream cache;
+    z_stream &stream = cache.reset();
+
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = size;
+    stream.next_out = buffer;
+    stream.avail_out = length;
+
+    switch (inflate(&stream, Z_SYNC_FLUSH)) {
+    case Z_OK:
+    case Z_STREAM_END:
+      return stream.total_out;
+    case Z_BUF_ERROR:
+      if (stream.avail_out == 0 || stream.avail_in == 0) {
+        return stream.total_out;
+      }
+      // fall through
+    default:
+      throw CTBException("Failed to decompress gzipped tile data");
+    }
+  }
+
+  case FORMAT_ZSTD: {
+#ifdef CTB_HAVE_ZSTD
+    static thread_local struct Context {
+      ZSTD_DStream *context = ZSTD_createDStream();
+
+      ~Context() {
+        ZSTD_freeDStream(context);
+      }
+    } cache;
+
+    ZSTD_initDStream(cache.context);
+    ZSTD_inBuffer input = { data, size, 0 };
+    ZSTD_outBuffer output = { buffer, length, 0 };
+
+    while (output.pos < output.size && input.pos < input.size) {
+      size_t result = ZSTD_decompressStream(cache.context, &output, &input);
+      if (ZSTD_isError(result)) {
+        throw CTBException("Failed to decompress zstd tile data");
+      } else if (result == 0) {
+        break;                  // the end of the frame
+      }
+    }
+
+    return output.pos;
+#else
+    throw CTBException("Cannot decompress zstd tile data as zstd support is not available");
+#endif
+  }
+
+  case FORMAT_NONE:
+  default: {
+    const size_t copied = (size < length) ? size : length;
+    memcpy(buffer, data, copied);
+    return copied;
+  }
+  }
+}
+
+/**
+ * @details The specification is the codec name optionally followed by a colon
+ * and the compression level.
+ */
+std::unique_ptr<TileCodec>
+TileCodec::create(const std::string &spec) {
+  const size_t colon = spec.find(':');
+  const std::string name = spec.substr(0, colon),
+    level = (colon == std::string::npos) ? "" : spec.substr(colon + 1);
+
+  if (name == "gzip") {
+    return std::unique_ptr<TileCodec>(new ZlibCodec(parseLevel(level, Z_DEFAULT_COMPRESSION, 1, 9)));
+  } else if (name == "libdeflate") {
+#ifdef CTB_HAVE_LIBDEFLATE
+    return std::unique_ptr<TileCodec>(new LibdeflateCodec(parseLevel(level, 6, 1, 12)));
+#else
+    throw CTBException("The libdeflate codec is not available in this build");
+#endif
+  } else if (name == "zstd") {
+#ifdef CTB_HAVE_ZSTD
+    return std::unique_ptr<TileCodec>(new ZstdCodec(parseLevel(level, 3, 1, 22)));
+#else
+    throw CTBException("The zstd codec is not available in this build");
+#endif
+  } else if (name == "none" && level.empty()) {
+    return std::unique_ptr<TileCodec>(new NullCodec());
+  }
+
+  throw CTBException("Unknown compression codec");
+}
+
+/**
+ * @details The record is kept inside directories and alongside containers, as
+ * with the other files describing a tileset.
+ */
+std::string
+TileCodec::recordFilename(const std::string &path) {
+  return path + (TileStore::isContainer(path) ? ".tilecodec" : "/.tilecodec");
+}
+
+/**
+ * @details The record is the codec specification on a single line.  It is
+ * written to a temporary file which then replaces any previous record.
+ */
+void
+TileCodec::record(const std::string &path) const {
+  const std::string filename = recordFilename(path),
+    tempFilename = filename + ".tmp",
+    line = spec() + "\n";
+
+  VSILFILE *fp = VSIFOpenL(tempFilename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the tile codec record");
+  }
+
+  bool failed = (VSIFWriteL(line.data(), 1, line.size(), fp) != line.size());
+  failed = (VSIFCloseL(fp) != 0) || failed;
+  if (failed || VSIRename(tempFilename.c_str(), filename.c_str()) != 0) {
+    VSIUnlink(tempFilename.c_str());
+    throw CTBException("Failed to write the tile codec record");
+  }
+}
+
+TileCodec::Format
+TileCodec::recorded(const std::string &path) {
+  try {
+    std::unique_ptr<TileCodec> codec = createRecorded(path);
+    return codec ? codec->format() : FORMAT_UNKNOWN;
+  } catch (CTBException &) {
+    return FORMAT_UNKNOWN;      // the codec isn't available in this build
+  }
+}
+
+std::unique_ptr<TileCodec>
+TileCodec::createRecorded(const std::string &path) {
+  VSILFILE *fp = VSIFOpenL(recordFilename(path).c_str(), "rb");
+  if (fp == NULL) {
+    return std::unique_ptr<TileCodec>();
+  }
+
+  char line[64];
+  const size_t length = VSIFReadL(line, 1, sizeof(line) - 1, fp);
+  VSIFCloseL(fp);
+
+  std::string spec(line, length);
+  spec.erase(spec.find_last_not_of(" \r\n") + 1);
+  return create(spec);
+}
+
+const TileCodec &
+TileCodec::defaultCodec() {
+  static const ZlibCodec codec(Z_DEFAULT_COMPRESSION);
+  return codec;
+}
@@ -0,0 +1,139 @@
+#ifndef TILECODEC_HPP
+#define TILECODEC_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileCodec.hpp
+ * @brief This declares the `TileCodec` class
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+
+namespace ctb {
+  class TileCodec;
+}
+
+/**
+ * @brief Compress and decompress tile data held in memory
+ *
+ * A codec encodes tile data using a particular compression library and level.
+ * The following codecs are available, depending on the libraries present at
+ * build time:
+ *
+ * - `gzip[:level]`: gzip using zlib with a level from `1` to `9`
+ * - `libdeflate[:level]`: gzip using libdeflate with a level from `1` to `12`
+ * - `zstd[:level]`: zstd with a level from `1` to `22`
+ * - `none`: no compression
+ *
+ * Cesium expects terrain to be gzipped, so `zstd` and `none` are only suitable
+ * for tiles which are stored internally.  The codec a tileset was encoded with
+ * is recorded alongside it (see `record`) and passed to the decoders.  Without
+ * a record the compression is detected from the magic bytes of the data,
+ * which can't always tell uncompressed data from compressed data.
+ *
+ * Codecs are thread safe: the compression state is cached per thread and
+ * reused between calls.
+ */
+class CTB_DLL ctb::TileCodec {
+public:
+
+  /// The compression formats that can be produced
+  enum Format {
+    FORMAT_NONE,
+    FORMAT_GZIP,
+    FORMAT_ZSTD,
+    FORMAT_UNKNOWN              ///< Detect the format from the data
+  };
+
+  virtual ~TileCodec() {}
+
+  /// Get the codec specification e.g. `gzip:6`
+  virtual std::string
+  spec() const = 0;
+
+  /// Get the format produced by the codec
+  virtual Format
+  format() const = 0;
+
+  /// Compress `size` bytes of `data`, replacing the contents of `output`
+  virtual void
+  encode(const unsigned char *data, size_t size, std::vector<unsigned char> &output) const = 0;
+
+  /**
+   * @brief Decompress data encoded by any codec
+   *
+   * The decompressed data is written to `buffer`, returning the number of
+   * bytes written.  An exception is thrown if the data doesn't fit in
+   * `capacity` bytes.  The format is detected from the data if it isn't known.
+   */
+  static size_t
+  decode(const unsigned char *data, size_t size, unsigned char *buffer, size_t capacity,
+         Format format = FORMAT_UNKNOWN);
+
+  /**
+   * @brief Decompress the start of data encoded by any codec
+   *
+   * Only the first `length` bytes are decompressed to `buffer`, which is
+   * cheaper than decompressing everything when only a header is needed.  The
+   * number of bytes written is returned, which is less than `length` if the
+   * data is shorter.
+   */
+  static size_t
+  decodePrefix(const unsigned char *data, size_t size, unsigned char *buffer, size_t length,
+               Format format = FORMAT_UNKNOWN);
+
+  /**
+   * @brief Detect the compression format of encoded data from its magic bytes
+   *
+   * Uncompressed data which happens to start with the magic bytes of a format
+   * is misdetected, so this is only a fallback for when the format of a
+   * tileset hasn't been recorded.
+   */
+  static Format
+  detect(const unsigned char *data, size_t size);
+
+  /// Get the file recording the codec of the tiles in a directory or container
+  static std::string
+  recordFilename(const std::string &path);
+
+  /// Record this codec as the one the tiles at a path are encoded with
+  void
+  record(const std::string &path) const;
+
+  /// Get the format recorded for the tiles at a path, or `FORMAT_UNKNOWN`
+  static Format
+  recorded(const std::string &path);
+
+  /// Get the codec recorded for the tiles at a path, or `NULL` if there isn't one
+  static std::unique_ptr<TileCodec>
+  createRecorded(const std::string &path);
+
+  /// Create a codec from a specification such as `gzip:9`
+  static std::unique_ptr<TileCodec>
+  create(const std::string &spec);
+
+  /// Get the codec used for terrain tiles by default: gzip at zlib's default level
+  static const TileCodec &
+  defaultCodec();
+};
+
+#endif /* TILECODEC_HPP */
@@ -0,0 +1,147 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileHash.cpp
+ * @brief This defines the `TileHash` class
+ */
+
+#include "TileHash.hpp"
+
+using namespace ctb;
+
+static const uint64_t cPrime1 = 11400714785074694791ULL;
+static const uint64_t cPrime2 = 14029467366897019727ULL;
+static const uint64_t cPrime3 = 1609587929392839161ULL;
+static const uint64_t cPrime4 = 9650029242287828579ULL;
+static const uint64_t cPrime5 = 2870177450012600261ULL;
+
+static inline uint64_t
+rotl(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/// Read a little endian 64 bit value
+static inline uint64_t
+read64(const unsigned char *p) {
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+    | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+/// Read a little endian 32 bit value
+static inline uint64_t
+read32(const unsigned char *p) {
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24);
+}
+
+static inline uint64_t
+round(uint64_t acc, uint64_t input) {
+  acc += input * cPrime2;
+  acc = rotl(acc, 31);
+  return acc * cPrime1;
+}
+
+static inline uint64_t
+mergeRound(uint64_t acc, uint64_t value) {
+  acc ^= round(0, value);
+  return acc * cPrime1 + cPrime4;
+}
+
+uint64_t
+TileHash::hash(const unsigned char *data, size_t size, uint64_t seed) {
+  const unsigned char *p = data, *end = data + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    const unsigned char *limit = end - 32;
+    uint64_t v1 = seed + cPrime1 + cPrime2,
+      v2 = seed + cPrime2,
+      v3 = seed,
+      v4 = seed - cPrime1;
+
+    do {
+      v1 = round(v1, read64(p)); p += 8;
+      v2 = round(v2, read64(p)); p += 8;
+      v3 = round(v3, read64(p)); p += 8;
+      v4 = round(v4, read64(p)); p += 8;
+    } while (p <= limit);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = mergeRound(h, v1);
+    h = mergeRound(h, v2);
+    h = mergeRound(h, v3);
+    h = mergeRound(h, v4);
+  } else {
+    h = seed + cPrime5;
+  }
+
+  h += (uint64_t) size;
+
+  while (p + 8 <= end) {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * cPrime1 + cPrime4;
+    p += 8;
+  }
+
+  if (p + 4 <= end) {
+    h ^= read32(p) * cPrime1;
+    h = rotl(h, 23) * cPrime2 + cPrime3;
+    p += 4;
+  }
+
+  while (p < end) {
+    h ^= (*p) * cPrime5;
+    h = rotl(h, 11) * cPrime1;
+    ++p;
+  }
+
+  h ^= h >> 33;
+  h *= cPrime2;
+  h ^= h >> 29;
+  h *= cPrime3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+std::string
+TileHash::toString(uint64_t hash) {
+  static const char digits[] = "0123456789abcdef";
+  char buffer[16];
+
+  for (int i = 15; i >= 0; --i) {
+    buffer[i] = digits[hash & 0xf];
+    hash >>= 4;
+  }
+
+  return std::string(buffer, 16);
+}
+
+/**
+ * @details The second hash is seeded with the first, so two pieces of data
+ * only share a digest if they also collide under a seed chosen by their data.
+ */
+TileHash::Digest
+TileHash::digest(const unsigned char *data, size_t size) {
+  const uint64_t first = hash(data, size);
+  const Digest digest = {first, hash(data, size, first)};
+  return digest;
+}
+
+std::string
+TileHash::toString(const Digest &digest) {
+  return toString(digest.first) + toString(digest.second);
+}
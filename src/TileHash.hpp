@@ -0,0 +1,83 @@
+#ifndef TILEHASH_HPP
+#define TILEHASH_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileHash.hpp
+ * @brief This declares the `TileHash` class
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "config.hpp"           // for CTB_DLL
+
+namespace ctb {
+  class TileHash;
+}
+
+/**
+ * @brief Hash encoded tile data
+ *
+ * This is an implementation of the 64 bit
+ * [xxHash](https://github.com/Cyan4973/xxHash) algorithm (XXH64), which
+ * hashes data at memory bandwidth.  The hash is stable across platforms and
+ * versions so it can be persisted.
+ *
+ * Where data is identified by its hash alone a 128 bit `Digest` is used
+ * instead, as collisions of the 64 bit hash can't be ruled out across the
+ * millions of tiles in a tileset.
+ */
+class CTB_DLL ctb::TileHash {
+public:
+
+  /// A 128 bit digest of some data
+  struct Digest {
+    uint64_t first;             ///< The XXH64 hash of the data
+    uint64_t second;            ///< The XXH64 hash seeded with `first`
+
+    bool
+    operator==(const Digest &other) const {
+      return first == other.first && second == other.second;
+    }
+
+    bool
+    operator!=(const Digest &other) const {
+      return !(*this == other);
+    }
+  };
+
+  /// Get the XXH64 hash of some data
+  static uint64_t
+  hash(const unsigned char *data, size_t size, uint64_t seed = 0);
+
+  /// Get the 128 bit digest of some data
+  static Digest
+  digest(const unsigned char *data, size_t size);
+
+  /// Format a hash as 16 hexadecimal digits
+  static std::string
+  toString(uint64_t hash);
+
+  /// Format a digest as 32 hexadecimal digits
+  static std::string
+  toString(const Digest &digest);
+};
+
+#endif /* TILEHASH_HPP */
@@ -0,0 +1,383 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileHeightIndex.cpp
+ * @brief This defines the `TileHeightIndex` class
+ */
+
+#include <algorithm>
+#include <string.h>             // for memcmp
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "TerrainTile.hpp"
+#include "TileHeightIndex.hpp"
+#include "TileStore.hpp"
+
+using namespace ctb;
+
+/// The magic bytes at the start of a saved index
+static const char cHeightIndexMagic[] = "CTBTHGT1";
+
+/// The bits of a tile key holding the Morton code
+static const uint64_t cMortonMask = (((uint64_t) 1) << 58) - 1;
+
+/// The bytes stored for each tile in a saved index
+static const uint64_t cEntrySize = sizeof(uint64_t) + 4 * sizeof(i_terrain_height) + sizeof(uint32_t);
+
+/// Convert a terrain tile height to metres
+static inline double
+toMetres(i_terrain_height height) {
+  return (height / 5.0) - 1000;
+}
+
+/// Get the Morton code of a tile, as in `TileStore::tileKey`
+static inline uint64_t
+mortonCode(const TileCoordinate &coord) {
+  return TileStore::tileKey(coord) & cMortonMask;
+}
+
+/// Get the coordinate of a tile from its Morton code
+static TileCoordinate
+fromMortonCode(i_zoom zoom, uint64_t morton) {
+  i_tile x = 0, y = 0;
+  for (unsigned int bit = 0; bit < 29; ++bit) {
+    x |= (i_tile) ((morton >> (2 * bit)) & 1) << bit;
+    y |= (i_tile) ((morton >> (2 * bit + 1)) & 1) << bit;
+  }
+  return TileCoordinate(zoom, x, y);
+}
+
+/**
+ * @details Only the range of heights is kept, so the tile can be reused once
+ * this returns.
+ */
+void
+TileHeightIndex::add(const TileCoordinate &coord, const Terrain &terrain, size_t size) {
+  const std::vector<i_terrain_height> &heights = terrain.getHeights();
+  if (heights.empty()) {
+    return;
+  }
+
+  const auto range = std::minmax_element(heights.begin(), heights.end());
+  const Record record = {
+    TileStore::tileKey(coord), *range.first, *range.second,
+    (uint32_t) std::min<size_t>(size, UINT32_MAX)
+  };
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mAdded.push_back(record);
+}
+
+/**
+ * @details The tiles of the other index are added as records, so they are only
+ * merged into this index by `rollUp`.
+ */
+void
+TileHeightIndex::merge(const TileHeightIndex &other) {
+  std::vector<Record> records;
+  {
+    std::lock_guard<std::mutex> lock(other.mMutex);
+    for (size_t zoom = 0; zoom < other.mLevels.size(); ++zoom) {
+      const Level &level = other.mLevels[zoom];
+      for (size_t i = 0; i < level.keys.size(); ++i) {
+        const Record record = {
+          (((uint64_t) zoom) << 58) | level.keys[i],
+          level.minHeights[i], level.maxHeights[i], level.sizes[i]
+        };
+        records.push_back(record);
+      }
+    }
+    records.insert(records.end(), other.mAdded.begin(), other.mAdded.end());
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mAdded.insert(mAdded.end(), records.begin(), records.end());
+}
+
+/**
+ * @details The tiles added are merged into the columns of each level, with a
+ * tile added more than once taking its latest record.  The subtree ranges are
+ * then recalculated from the deepest level upwards: the children of a tile
+ * have consecutive Morton codes, so they are found with a binary search of the
+ * level below.
+ */
+void
+TileHeightIndex::rollUp() {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (!mAdded.empty()) {
+    std::stable_sort(mAdded.begin(), mAdded.end(), [](const Record &a, const Record &b) {
+        return a.key < b.key;
+      });
+
+    for (auto it = mAdded.begin(); it != mAdded.end(); ) {
+      const i_zoom zoom = (i_zoom) (it->key >> 58);
+      auto end = it;
+      while (end != mAdded.end() && (end->key >> 58) == zoom) ++end;
+
+      if (mLevels.size() <= zoom) {
+        mLevels.resize(zoom + 1);
+      }
+
+      const Level &old = mLevels[zoom];
+      Level merged;
+      size_t i = 0;
+
+      auto append = [&merged](uint64_t key, i_terrain_height minHeight, i_terrain_height maxHeight, uint32_t size) {
+        merged.keys.push_back(key);
+        merged.minHeights.push_back(minHeight);
+        merged.maxHeights.push_back(maxHeight);
+        merged.sizes.push_back(size);
+      };
+
+      for (; it != end; ++it) {
+        const uint64_t key = it->key & cMortonMask;
+
+        // Only the last record of a tile is kept
+        if (it + 1 != end && ((it + 1)->key & cMortonMask) == key) {
+          continue;
+        }
+
+        for (; i < old.keys.size() && old.keys[i] < key; ++i) {
+          append(old.keys[i], old.minHeights[i], old.maxHeights[i], old.sizes[i]);
+        }
+        if (i < old.keys.size() && old.keys[i] == key) {
+          ++i;
+        }
+
+        append(key, it->minHeight, it->maxHeight, it->size);
+      }
+
+      for (; i < old.keys.size(); ++i) {
+        append(old.keys[i], old.minHeights[i], old.maxHeights[i], old.sizes[i]);
+      }
+
+      mLevels[zoom] = std::move(merged);
+    }
+
+    mAdded.clear();
+  }
+
+  for (size_t zoom = mLevels.size(); zoom > 0; --zoom) {
+    Level &level = mLevels[zoom - 1];
+    level.subtreeMinHeights = level.minHeights;
+    level.subtreeMaxHeights = level.maxHeights;
+
+    if (zoom == mLevels.size()) continue;
+    const Level &below = mLevels[zoom];
+    if (below.keys.empty()) continue;
+
+    auto child = below.keys.begin();
+    for (size_t i = 0; i < level.keys.size(); ++i) {
+      const uint64_t first = level.keys[i] << 2;
+      child = std::lower_bound(child, below.keys.end(), first);
+
+      for (; child != below.keys.end() && *child <= first + 3; ++child) {
+        const size_t j = child - below.keys.begin();
+        level.subtreeMinHeights[i] = std::min(level.subtreeMinHeights[i], below.subtreeMinHeights[j]);
+        level.subtreeMaxHeights[i] = std::max(level.subtreeMaxHeights[i], below.subtreeMaxHeights[j]);
+      }
+    }
+  }
+}
+
+bool
+TileHeightIndex::find(const TileCoordinate &coord, Entry &entry) const {
+  if (coord.zoom >= mLevels.size()) {
+    return false;
+  }
+
+  const Level &level = mLevels[coord.zoom];
+  const uint64_t key = mortonCode(coord);
+  const auto found = std::lower_bound(level.keys.begin(), level.keys.end(), key);
+  if (found == level.keys.end() || *found != key) {
+    return false;
+  }
+
+  const size_t i = found - level.keys.begin();
+  entry.minHeight = toMetres(level.minHeights[i]);
+  entry.maxHeight = toMetres(level.maxHeights[i]);
+  entry.subtreeMinHeight = toMetres(level.subtreeMinHeights[i]);
+  entry.subtreeMaxHeight = toMetres(level.subtreeMaxHeights[i]);
+  entry.size = level.sizes[i];
+  return true;
+}
+
+/**
+ * @details A tile is returned if any of its heights lie within the range, so
+ * `query(12, 2000, 10000)` finds the zoom level 12 tiles reaching above 2000
+ * metres.  Only the height columns of the level are scanned.
+ */
+std::vector<TileCoordinate>
+TileHeightIndex::query(i_zoom zoom, double minHeight, double maxHeight) const {
+  std::vector<TileCoordinate> tiles;
+  if (zoom >= mLevels.size()) {
+    return tiles;
+  }
+
+  const Level &level = mLevels[zoom];
+  for (size_t i = 0; i < level.keys.size(); ++i) {
+    if (toMetres(level.maxHeights[i]) >= minHeight && toMetres(level.minHeights[i]) <= maxHeight) {
+      tiles.push_back(fromMortonCode(zoom, level.keys[i]));
+    }
+  }
+
+  return tiles;
+}
+
+bool
+TileHeightIndex::levelRange(i_zoom zoom, double &minHeight, double &maxHeight) const {
+  if (zoom >= mLevels.size() || mLevels[zoom].keys.empty()) {
+    return false;
+  }
+
+  const Level &level = mLevels[zoom];
+  minHeight = toMetres(*std::min_element(level.minHeights.begin(), level.minHeights.end()));
+  maxHeight = toMetres(*std::max_element(level.maxHeights.begin(), level.maxHeights.end()));
+  return true;
+}
+
+size_t
+TileHeightIndex::count() const {
+  size_t total = 0;
+  for (const Level &level: mLevels) {
+    total += level.keys.size();
+  }
+  return total;
+}
+
+/**
+ * @details The file contains the magic bytes, the number of levels and then
+ * for each level the number of tiles followed by each column in turn, using
+ * the byte order of the host.  It is written to a temporary file which is then
+ * renamed, so readers never see a partially written index.
+ */
+void
+TileHeightIndex::save(const std::string &filename) {
+  rollUp();
+
+  const std::string tmpFilename = filename + ".tmp";
+  VSILFILE *fp = VSIFOpenL(tmpFilename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the tile height index file");
+  }
+
+  bool failed = false;
+  auto write = [&](const void *data, size_t size) {
+    failed = failed || (size > 0 && VSIFWriteL(data, 1, size, fp) != size);
+  };
+
+  const uint32_t levelCount = (uint32_t) mLevels.size();
+  write(cHeightIndexMagic, 8);
+  write(&levelCount, sizeof(levelCount));
+
+  for (const Level &level: mLevels) {
+    const uint64_t count = level.keys.size();
+    write(&count, sizeof(count));
+    write(level.keys.data(), count * sizeof(uint64_t));
+    write(level.minHeights.data(), count * sizeof(i_terrain_height));
+    write(level.maxHeights.data(), count * sizeof(i_terrain_height));
+    write(level.subtreeMinHeights.data(), count * sizeof(i_terrain_height));
+    write(level.subtreeMaxHeights.data(), count * sizeof(i_terrain_height));
+    write(level.sizes.data(), count * sizeof(uint32_t));
+  }
+
+  if (VSIFCloseL(fp) != 0 || failed) {
+    VSIUnlink(tmpFilename.c_str());
+    throw CTBException("Failed to write the tile height index file");
+  }
+
+  if (VSIRename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    VSIUnlink(tmpFilename.c_str());
+    throw CTBException("Failed to replace the tile height index file");
+  }
+}
+
+/**
+ * @details Tiles added but not yet rolled up are kept, and are merged into
+ * the loaded index by the next `rollUp`.
+ */
+bool
+TileHeightIndex::load(const std::string &filename) {
+  VSIStatBufL stat;
+  if (VSIStatL(filename.c_str(), &stat) != 0) {
+    return false;
+  }
+
+  VSILFILE *fp = VSIFOpenL(filename.c_str(), "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool failed = false;
+  auto read = [&](void *data, size_t size) {
+    failed = failed || (size > 0 && VSIFReadL(data, 1, size, fp) != size);
+  };
+
+  char magic[8];
+  uint32_t levelCount = 0;
+  read(magic, 8);
+  failed = failed || memcmp(magic, cHeightIndexMagic, 8) != 0;
+  read(&levelCount, sizeof(levelCount));
+  failed = failed || levelCount > 29;
+
+  uint64_t remaining = stat.st_size;
+  std::vector<Level> levels(failed ? 0 : levelCount);
+  for (size_t zoom = 0; zoom < levels.size(); ++zoom) {
+    Level &level = levels[zoom];
+    uint64_t count = 0;
+    read(&count, sizeof(count));
+
+    // Check the size before allocating anything
+    if (failed || count > remaining / cEntrySize) {
+      failed = true;
+      break;
+    }
+    remaining -= count * cEntrySize;
+
+    level.keys.resize(count);
+    level.minHeights.resize(count);
+    level.maxHeights.resize(count);
+    level.subtreeMinHeights.resize(count);
+    level.subtreeMaxHeights.resize(count);
+    level.sizes.resize(count);
+    read(level.keys.data(), count * sizeof(uint64_t));
+    read(level.minHeights.data(), count * sizeof(i_terrain_height));
+    read(level.maxHeights.data(), count * sizeof(i_terrain_height));
+    read(level.subtreeMinHeights.data(), count * sizeof(i_terrain_height));
+    read(level.subtreeMaxHeights.data(), count * sizeof(i_terrain_height));
+    read(level.sizes.data(), count * sizeof(uint32_t));
+
+    // The tiles must be ordered and lie within the level, which may be two
+    // tiles wide at the top
+    const uint64_t limit = ((uint64_t) 1) << (2 * zoom + 2);
+    for (size_t i = 0; !failed && i < count; ++i) {
+      failed = level.keys[i] >= limit || (i > 0 && level.keys[i] <= level.keys[i - 1]);
+    }
+  }
+
+  VSIFCloseL(fp);
+  if (failed) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mLevels.swap(levels);
+  return true;
+}
@@ -0,0 +1,127 @@
+#ifndef TILEHEIGHTINDEX_HPP
+#define TILEHEIGHTINDEX_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileHeightIndex.hpp
+ * @brief This declares the `TileHeightIndex` class
+ */
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class Terrain;
+  class TileHeightIndex;
+}
+
+/**
+ * @brief Record the range of heights and the size of each terrain tile
+ *
+ * This lets the heights of a tileset be queried without reading any tiles,
+ * for instance to create bounding volumes or to find the tiles above a
+ * height.  For each tile the minimum and maximum height are recorded along
+ * with the size of the encoded tile.  These are rolled up the quadtree so that
+ * each tile also records the range of heights of the tile and all the tiles
+ * below it.
+ *
+ * The index is stored in columns for each zoom level, ordered by tile key
+ * (see `TileStore::tileKey`), with heights quantised as they are in terrain
+ * tiles.  Each tile takes 20 bytes.
+ *
+ * Tiles can be added from many threads at once.  They are merged into the
+ * index by `rollUp`, which must be called before the index is queried.
+ */
+class CTB_DLL ctb::TileHeightIndex {
+public:
+
+  /// What is recorded about a tile
+  struct Entry {
+    double minHeight;           ///< The lowest height in the tile in metres
+    double maxHeight;           ///< The highest height in the tile in metres
+    double subtreeMinHeight;    ///< The lowest height in the tile or below it
+    double subtreeMaxHeight;    ///< The highest height in the tile or below it
+    uint32_t size;              ///< The size of the encoded tile in bytes
+  };
+
+  /// Record a tile, replacing anything already recorded about it
+  void
+  add(const TileCoordinate &coord, const Terrain &terrain, size_t size);
+
+  /// Add every tile recorded in another index, replacing what is recorded here
+  void
+  merge(const TileHeightIndex &other);
+
+  /// Merge the tiles added into the index and roll up their heights
+  void
+  rollUp();
+
+  /// Get what is recorded about a tile, returning `false` if it isn't present
+  bool
+  find(const TileCoordinate &coord, Entry &entry) const;
+
+  /// Get the tiles at a zoom level with heights within a range
+  std::vector<TileCoordinate>
+  query(i_zoom zoom, double minHeight, double maxHeight) const;
+
+  /// Get the range of heights at a zoom level, returning `false` if it is empty
+  bool
+  levelRange(i_zoom zoom, double &minHeight, double &maxHeight) const;
+
+  /// Get the number of tiles in the index
+  size_t
+  count() const;
+
+  /// Load an index, returning `false` if it doesn't exist or isn't valid
+  bool
+  load(const std::string &filename);
+
+  /// Roll up the index and save it to a file, replacing it atomically
+  void
+  save(const std::string &filename);
+
+private:
+
+  /// A tile added but not yet merged into the index
+  struct Record {
+    uint64_t key;
+    i_terrain_height minHeight, maxHeight;
+    uint32_t size;
+  };
+
+  /// The columns of the tiles at a zoom level, ordered by `keys`
+  struct Level {
+    std::vector<uint64_t> keys; ///< The Morton codes of the tiles
+    std::vector<i_terrain_height> minHeights, maxHeights;
+    std::vector<i_terrain_height> subtreeMinHeights, subtreeMaxHeights;
+    std::vector<uint32_t> sizes;
+  };
+
+  std::vector<Level> mLevels;   ///< The tiles indexed by zoom level
+
+  std::vector<Record> mAdded;   ///< The tiles waiting to be merged
+  mutable std::mutex mMutex;
+};
+
+#endif /* TILEHEIGHTINDEX_HPP */
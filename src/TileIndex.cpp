@@ -0,0 +1,526 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileIndex.cpp
+ * @brief This defines the `TileIndex` class
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string.h>             // for memcmp
+#include <thread>
+#include <time.h>
+
+#include <boost/filesystem.hpp>
+
+#include "cpl_vsi.h"
+
+#include "CTBException.hpp"
+#include "TileIndex.hpp"
+
+using namespace ctb;
+
+/// The magic bytes at the start of a saved index
+static const char cIndexMagic[] = "CTBTIDX1";
+
+/// A column of tiles, such as a directory found when scanning
+struct ctb::TileIndex::Column {
+  i_zoom zoom;
+  i_tile x;
+  std::vector<i_tile> rows;     ///< The rows of the tiles in ascending order
+};
+
+/**
+ * Call a function for each index up to `count` using several threads
+ *
+ * The first exception thrown by the function is rethrown once all threads
+ * have finished.
+ */
+template <typename Function> static void
+parallelFor(size_t count, unsigned int threadCount, Function function) {
+  if (threadCount == 0) {
+    threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  threadCount = (unsigned int) std::min<size_t>(threadCount, count);
+
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex errorMutex;
+
+  auto worker = [&]() {
+    try {
+      for (size_t i = next++; i < count; i = next++) {
+        function(i);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error) error = std::current_exception();
+      next = count;             // stop the other threads early
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int i = 1; i < threadCount; ++i) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+
+  for (std::thread &thread: threads) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Parse a tile number from a file name
+ *
+ * The name must be the number followed by the suffix, if any.
+ */
+static bool
+parseNumber(const std::string &name, const std::string &suffix, i_tile &value) {
+  const size_t digits = name.size() - suffix.size();
+  if (name.size() <= suffix.size() || digits > 9
+      || name.compare(digits, std::string::npos, suffix) != 0) {
+    return false;
+  }
+
+  value = 0;
+  for (size_t i = 0; i < digits; ++i) {
+    if (name[i] < '0' || name[i] > '9') {
+      return false;
+    }
+    value = value * 10 + (name[i] - '0');
+  }
+
+  return true;
+}
+
+/// List the numbered entries of a directory
+static std::vector<i_tile>
+listNumbered(const std::string &dirname, const std::string &suffix) {
+  std::vector<i_tile> numbers;
+  boost::system::error_code error;
+  i_tile number;
+
+  for (boost::filesystem::directory_iterator it(dirname, error), end; !error && it != end; it.increment(error)) {
+    if (parseNumber(it->path().filename().string(), suffix, number)) {
+      numbers.push_back(number);
+    }
+  }
+
+  std::sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+/// Get the path of a directory in the tree
+static std::string
+directoryName(const std::string &root, i_zoom zoom) {
+  return root + "/" + std::to_string(zoom);
+}
+
+static std::string
+directoryName(const std::string &root, i_zoom zoom, i_tile x) {
+  return directoryName(root, zoom) + "/" + std::to_string(x);
+}
+
+TileIndex::TileIndex():
+  mScanTime(0)
+{}
+
+/**
+ * @details The zoom level directories are listed first, then each `{zoom}/{x}`
+ * directory is listed by the next free thread.
+ */
+TileIndex
+TileIndex::scan(const std::string &root, const std::string &extension, unsigned int threadCount) {
+  TileIndex index;
+  index.mRoot = root;
+  index.mExtension = extension;
+  index.mScanTime = time(NULL);
+
+  VSIStatBufL stat;
+  if (VSIStatL(root.c_str(), &stat) != 0 || !VSI_ISDIR(stat.st_mode)) {
+    throw CTBException("The tile directory does not exist");
+  }
+
+  // Find the columns at each zoom level
+  const std::vector<i_tile> zooms = listNumbered(root, "");
+  std::vector<std::vector<i_tile>> zoomColumns(zooms.size());
+
+  parallelFor(zooms.size(), threadCount, [&](size_t i) {
+      zoomColumns[i] = listNumbered(directoryName(root, zooms[i]), "");
+    });
+
+  std::vector<Column> columns;
+  for (size_t i = 0; i < zooms.size(); ++i) {
+    for (i_tile x: zoomColumns[i]) {
+      const Column column = {(i_zoom) zooms[i], x, std::vector<i_tile>()};
+      columns.push_back(column);
+    }
+  }
+
+  // Find the tiles in each column
+  const std::string suffix = extension.empty() ? "" : "." + extension;
+  parallelFor(columns.size(), threadCount, [&](size_t i) {
+      columns[i].rows = listNumbered(directoryName(root, columns[i].zoom, columns[i].x), suffix);
+    });
+
+  index.addColumns(columns);
+  return index;
+}
+
+/**
+ * @details The tiles are sorted into columns, so they can be in any order.
+ * Duplicate tiles are only indexed once.
+ */
+TileIndex
+TileIndex::build(std::vector<TileCoordinate> tiles) {
+  std::sort(tiles.begin(), tiles.end(), [](const TileCoordinate &a, const TileCoordinate &b) {
+      return (a.zoom != b.zoom) ? a.zoom < b.zoom : (a.x != b.x) ? a.x < b.x : a.y < b.y;
+    });
+
+  std::vector<Column> columns;
+  for (const TileCoordinate &coord: tiles) {
+    if (columns.empty() || columns.back().zoom != coord.zoom || columns.back().x != coord.x) {
+      const Column column = {coord.zoom, coord.x, std::vector<i_tile>()};
+      columns.push_back(column);
+    }
+
+    std::vector<i_tile> &rows = columns.back().rows;
+    if (rows.empty() || rows.back() != coord.y) {
+      rows.push_back(coord.y);
+    }
+  }
+
+  TileIndex index;
+  index.addColumns(columns);
+  return index;
+}
+
+/**
+ * @details The columns must be ordered by zoom level and then by `x`.  Runs of
+ * rows are built for each column, and columns without tiles have no runs.
+ */
+void
+TileIndex::addColumns(const std::vector<Column> &columns) {
+  if (!columns.empty()) {
+    mLevels.resize(columns.back().zoom + 1);
+  }
+
+  for (std::vector<Column>::const_iterator it = columns.begin(); it != columns.end(); ) {
+    const i_zoom zoom = it->zoom;
+    std::vector<Column>::const_iterator end = it;
+    while (end != columns.end() && end->zoom == zoom) ++end;
+
+    Level &level = mLevels[zoom];
+    bool first = true;
+    for (std::vector<Column>::const_iterator column = it; column != end; ++column) {
+      if (column->rows.empty()) continue;
+
+      if (first) {
+        level.minX = column->x;
+        level.minY = column->rows.front();
+        level.maxY = column->rows.back();
+        first = false;
+      }
+      level.maxX = column->x;
+      level.minY = std::min(level.minY, column->rows.front());
+      level.maxY = std::max(level.maxY, column->rows.back());
+
+      // Columns without tiles have no runs
+      while (level.columns.size() <= column->x - level.minX) {
+        level.columns.push_back(level.runs.size() / 2);
+      }
+
+      for (size_t i = 0; i < column->rows.size(); ++i) {
+        if (i == 0 || column->rows[i] != column->rows[i - 1] + 1) {
+          level.runs.push_back(column->rows[i]);
+          level.runs.push_back(column->rows[i]);
+        } else {
+          level.runs.back() = column->rows[i];
+        }
+      }
+      level.count += column->rows.size();
+    }
+
+    if (!first) {
+      level.columns.push_back(level.runs.size() / 2);
+    }
+
+    it = end;
+  }
+}
+
+bool
+TileIndex::contains(i_zoom zoom, i_tile x, i_tile y) const {
+  if (zoom >= mLevels.size()) {
+    return false;
+  }
+
+  const Level &level = mLevels[zoom];
+  if (level.count == 0 || x < level.minX || x > level.maxX || y < level.minY || y > level.maxY) {
+    return false;
+  }
+
+  // Binary search the runs in the column for the last one starting before `y`
+  size_t low = level.columns[x - level.minX], high = level.columns[x - level.minX + 1];
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (level.runs[middle * 2] <= y) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low > level.columns[x - level.minX] && y <= level.runs[(low - 1) * 2 + 1];
+}
+
+i_zoom
+TileIndex::minZoom() const {
+  for (size_t zoom = 0; zoom < mLevels.size(); ++zoom) {
+    if (mLevels[zoom].count > 0) {
+      return (i_zoom) zoom;
+    }
+  }
+
+  throw CTBException("The tile index is empty");
+}
+
+i_zoom
+TileIndex::maxZoom() const {
+  for (size_t zoom = mLevels.size(); zoom > 0; --zoom) {
+    if (mLevels[zoom - 1].count > 0) {
+      return (i_zoom) (zoom - 1);
+    }
+  }
+
+  throw CTBException("The tile index is empty");
+}
+
+TileBounds
+TileIndex::bounds(i_zoom zoom) const {
+  if (!hasLevel(zoom)) {
+    throw CTBException("The tile index has no tiles at the zoom level");
+  }
+
+  const Level &level = mLevels[zoom];
+  return TileBounds(level.minX, level.minY, level.maxX, level.maxY);
+}
+
+/**
+ * @details The columns are swept from west to east.  A rectangle is extended
+ * into the next column while that column has a run with exactly the same
+ * rows, otherwise a new rectangle is started.  The runs in each column are
+ * sorted, as are the open rectangles, so this is a single merge per column.
+ */
+std::vector<TileBounds>
+TileIndex::ranges(i_zoom zoom) const {
+  std::vector<TileBounds> ranges;
+  if (!hasLevel(zoom)) {
+    return ranges;
+  }
+
+  const Level &level = mLevels[zoom];
+  std::vector<size_t> open, extended; // rectangles reaching the previous column, by row
+
+  for (i_tile x = level.minX; x <= level.maxX; ++x) {
+    const size_t first = level.columns[x - level.minX], last = level.columns[x - level.minX + 1];
+    size_t candidate = 0;
+    extended.clear();
+
+    for (size_t run = first; run < last; ++run) {
+      const i_tile start = level.runs[run * 2], end = level.runs[run * 2 + 1];
+
+      while (candidate < open.size() && ranges[open[candidate]].getMinY() < start) {
+        ++candidate;
+      }
+
+      if (candidate < open.size()
+          && ranges[open[candidate]].getMinY() == start
+          && ranges[open[candidate]].getMaxY() == end) {
+        ranges[open[candidate]].setMaxX(x);
+        extended.push_back(open[candidate++]);
+      } else {
+        ranges.push_back(TileBounds(x, start, x, end));
+        extended.push_back(ranges.size() - 1);
+      }
+    }
+
+    open.swap(extended);
+  }
+
+  return ranges;
+}
+
+uint64_t
+TileIndex::count() const {
+  uint64_t total = 0;
+  for (const Level &level: mLevels) {
+    total += level.count;
+  }
+  return total;
+}
+
+/**
+ * @details The root directory is listed rather than checked for modification
+ * so that saving the index in the root doesn't make it stale.
+ */
+bool
+TileIndex::isStale(unsigned int threadCount) const {
+  for (i_tile zoom: listNumbered(mRoot, "")) {
+    if (!hasLevel((i_zoom) zoom)) {
+      return true;
+    }
+  }
+
+  std::vector<std::string> dirnames;
+
+  for (size_t zoom = 0; zoom < mLevels.size(); ++zoom) {
+    const Level &level = mLevels[zoom];
+    if (level.count == 0) continue;
+
+    dirnames.push_back(directoryName(mRoot, (i_zoom) zoom));
+    for (size_t i = 0; i + 1 < level.columns.size(); ++i) {
+      if (level.columns[i] != level.columns[i + 1]) {
+        dirnames.push_back(directoryName(mRoot, (i_zoom) zoom, level.minX + (i_tile) i));
+      }
+    }
+  }
+
+  // A directory modified in the same second as the scan may have been
+  // modified after it, so is treated as stale
+  std::atomic<bool> stale(false);
+  parallelFor(dirnames.size(), threadCount, [&](size_t i) {
+      VSIStatBufL stat;
+      if (!stale && (VSIStatL(dirnames[i].c_str(), &stat) != 0 || (int64_t) stat.st_mtime >= mScanTime)) {
+        stale = true;
+      }
+    });
+
+  return stale;
+}
+
+/**
+ * @details The file contains the magic bytes, the scan time, the extension and
+ * then the levels, using the byte order of the host.
+ */
+void
+TileIndex::save(const std::string &filename) const {
+  VSILFILE *fp = VSIFOpenL(filename.c_str(), "wb");
+  if (fp == NULL) {
+    throw CTBException("Could not create the tile index file");
+  }
+
+  bool failed = false;
+  auto write = [&](const void *data, size_t size) {
+    failed = failed || (size > 0 && VSIFWriteL(data, 1, size, fp) != size);
+  };
+
+  const uint32_t extensionSize = (uint32_t) mExtension.size(),
+    levelCount = (uint32_t) mLevels.size();
+  write(cIndexMagic, 8);
+  write(&mScanTime, sizeof(mScanTime));
+  write(&extensionSize, sizeof(extensionSize));
+  write(mExtension.data(), extensionSize);
+  write(&levelCount, sizeof(levelCount));
+
+  for (const Level &level: mLevels) {
+    const uint32_t header[6] = {
+      level.minX, level.maxX, level.minY, level.maxY,
+      (uint32_t) level.columns.size(), (uint32_t) level.runs.size()
+    };
+    write(header, sizeof(header));
+    write(&level.count, sizeof(level.count));
+    write(level.columns.data(), level.columns.size() * sizeof(uint32_t));
+    write(level.runs.data(), level.runs.size() * sizeof(i_tile));
+  }
+
+  if (VSIFCloseL(fp) != 0 || failed) {
+    throw CTBException("Failed to write the tile index file");
+  }
+}
+
+bool
+TileIndex::load(const std::string &root, const std::string &filename) {
+  VSILFILE *fp = VSIFOpenL(filename.c_str(), "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  bool failed = false;
+  auto read = [&](void *data, size_t size) {
+    failed = failed || (size > 0 && VSIFReadL(data, 1, size, fp) != size);
+  };
+
+  char magic[8];
+  int64_t scanTime = 0;
+  uint32_t extensionSize = 0, levelCount = 0;
+  read(magic, 8);
+  failed = failed || memcmp(magic, cIndexMagic, 8) != 0;
+  read(&scanTime, sizeof(scanTime));
+  read(&extensionSize, sizeof(extensionSize));
+
+  std::string extension(failed || extensionSize > 255 ? 0 : extensionSize, '\0');
+  read(&extension[0], extension.size());
+  read(&levelCount, sizeof(levelCount));
+  failed = failed || levelCount > 64;
+
+  std::vector<Level> levels(failed ? 0 : levelCount);
+  for (Level &level: levels) {
+    uint32_t header[6];
+    read(header, sizeof(header));
+    read(&level.count, sizeof(level.count));
+
+    // Check the sizes before allocating anything
+    const uint64_t columnCount = (level.count == 0 || header[1] < header[0]) ? 0 : (uint64_t) header[1] - header[0] + 2;
+    if (failed || header[4] != columnCount || header[5] % 2 != 0 || header[5] > 2 * level.count) {
+      failed = true;
+      break;
+    }
+
+    level.minX = header[0];
+    level.maxX = header[1];
+    level.minY = header[2];
+    level.maxY = header[3];
+    level.columns.resize(header[4]);
+    level.runs.resize(header[5]);
+    read(level.columns.data(), level.columns.size() * sizeof(uint32_t));
+    read(level.runs.data(), level.runs.size() * sizeof(i_tile));
+
+    // The runs of each column must lie within the runs
+    for (size_t i = 0; !failed && i < level.columns.size(); ++i) {
+      failed = (i > 0 && level.columns[i] < level.columns[i - 1])
+        || level.columns[i] > level.runs.size() / 2;
+    }
+  }
+
+  VSIFCloseL(fp);
+  if (failed) {
+    return false;
+  }
+
+  mRoot = root;
+  mExtension = extension;
+  mScanTime = scanTime;
+  mLevels.swap(levels);
+  return true;
+}
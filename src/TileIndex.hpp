@@ -0,0 +1,181 @@
+#ifndef TILEINDEX_HPP
+#define TILEINDEX_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileIndex.hpp
+ * @brief This declares the `TileIndex` class
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class TileIndex;
+}
+
+/**
+ * @brief Record which tiles are present in a tile directory tree
+ *
+ * The index covers a `{zoom}/{x}/{y}.{extension}` directory tree.  For each
+ * zoom level it stores the bounds of the tiles present and, for each column
+ * within the bounds, the runs of consecutive rows which are present.  Tiles
+ * in a tileset are mostly contiguous so there are usually only one or two
+ * runs per column: the index is small and a lookup is effectively constant
+ * time, regardless of the number of tiles.
+ *
+ * Building an index lists every directory in the tree, which is done in
+ * parallel.  The index can then be saved and loaded again much more quickly
+ * than the tree can be scanned, with `isStale` checking that the tree hasn't
+ * been modified in the meantime.
+ */
+class CTB_DLL ctb::TileIndex {
+public:
+
+  /// Create an empty index
+  TileIndex();
+
+  /**
+   * @brief Build an index by scanning a directory tree
+   *
+   * Only files named `{y}.{extension}` in directories named `{zoom}/{x}` are
+   * indexed.  The directories are listed using `threadCount` threads,
+   * defaulting to the number of CPUs.
+   */
+  static TileIndex
+  scan(const std::string &root, const std::string &extension, unsigned int threadCount = 0);
+
+  /// Build an index of a list of tiles, such as the tiles written to a store
+  static TileIndex
+  build(std::vector<TileCoordinate> tiles);
+
+  /// Load an index of the tree at `root` saved with `save`, returning `false` if it can't be read
+  bool
+  load(const std::string &root, const std::string &filename);
+
+  /// Save the index to a file
+  void
+  save(const std::string &filename) const;
+
+  /**
+   * @brief Has the directory tree been modified since the index was built?
+   *
+   * This compares the modification time of the zoom and column directories
+   * in the tree with the time of the scan.  Only directories are checked, not
+   * tiles, so this is much quicker than scanning the tree again.
+   */
+  bool
+  isStale(unsigned int threadCount = 0) const;
+
+  /// Is a tile present?
+  bool
+  contains(i_zoom zoom, i_tile x, i_tile y) const;
+
+  /// Is a tile present?
+  inline bool
+  contains(const TileCoordinate &coord) const {
+    return contains(coord.zoom, coord.x, coord.y);
+  }
+
+  /// Are there no tiles?
+  inline bool
+  empty() const {
+    return count() == 0;
+  }
+
+  /// Are there any tiles at a zoom level?
+  inline bool
+  hasLevel(i_zoom zoom) const {
+    return zoom < mLevels.size() && mLevels[zoom].count > 0;
+  }
+
+  /// Get the lowest zoom level with tiles
+  i_zoom
+  minZoom() const;
+
+  /// Get the highest zoom level with tiles
+  i_zoom
+  maxZoom() const;
+
+  /// Get the extent of the tiles at a zoom level
+  TileBounds
+  bounds(i_zoom zoom) const;
+
+  /**
+   * @brief Get the tiles at a zoom level as a list of rectangles
+   *
+   * The rectangles don't overlap and together cover exactly the tiles
+   * present.  Identical runs of rows in neighbouring columns are merged, so a
+   * contiguous block of tiles is a single rectangle however large it is.
+   */
+  std::vector<TileBounds>
+  ranges(i_zoom zoom) const;
+
+  /// Get the number of tiles at a zoom level
+  inline uint64_t
+  count(i_zoom zoom) const {
+    return (zoom < mLevels.size()) ? mLevels[zoom].count : 0;
+  }
+
+  /// Get the total number of tiles
+  uint64_t
+  count() const;
+
+  /// Get the root directory of the tree
+  inline const std::string &
+  root() const {
+    return mRoot;
+  }
+
+private:
+
+  /// A column of tiles at a zoom level
+  struct Column;
+
+  /// Index columns of tiles, ordered by zoom level and then by `x`
+  void
+  addColumns(const std::vector<Column> &columns);
+
+  /// The tiles present at a zoom level
+  struct Level {
+    Level():
+      minX(0), maxX(0), minY(0), maxY(0), count(0)
+    {}
+
+    i_tile minX, maxX, minY, maxY; ///< The extent of the tiles
+    uint64_t count;             ///< The number of tiles
+
+    /// The first run of each column from `minX`, followed by the total
+    std::vector<uint32_t> columns;
+
+    /// The first and last rows of each run of tiles
+    std::vector<i_tile> runs;
+  };
+
+  std::string mRoot;            ///< The root of the directory tree
+  std::string mExtension;       ///< The tile file extension
+  int64_t mScanTime;            ///< When the tree was scanned
+  std::vector<Level> mLevels;   ///< The zoom levels, indexed by zoom
+};
+
+#endif /* TILEINDEX_HPP */
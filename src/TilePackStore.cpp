@@ -0,0 +1,315 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TilePackStore.cpp
+ * @brief This defines the `TilePackStore` class
+ */
+
+#include <algorithm>
+#include <string.h>             // for memcmp, memcpy, strncpy
+
+#include "CTBException.hpp"
+#include "TilePackStore.hpp"
+
+using namespace ctb;
+
+/// The magic bytes at the start of a pack
+static const char cHeaderMagic[] = "CTBPACK1";
+
+/// The magic bytes at the end of a pack
+static const char cTrailerMagic[] = "CTBINDEX";
+
+/// The size of the header in bytes
+static const size_t cHeaderSize = 16;
+
+/// The size of the trailer in bytes
+static const size_t cTrailerSize = 24;
+
+/// Order entries by key
+static inline bool
+compareKeys(const TilePackStore::Entry &entry, uint64_t key) {
+  return entry.key < key;
+}
+
+/// Sort entries by key, keeping the last entry for each key
+static void
+sortEntries(std::vector<TilePackStore::Entry> &entries) {
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const TilePackStore::Entry &a, const TilePackStore::Entry &b) {
+                     return a.key < b.key;
+                   });
+
+  std::vector<TilePackStore::Entry>::iterator last = entries.begin();
+  for (const TilePackStore::Entry &entry: entries) {
+    if (last != entries.begin() && (last - 1)->key == entry.key) {
+      *(last - 1) = entry;
+    } else {
+      *last++ = entry;
+    }
+  }
+  entries.erase(last, entries.end());
+}
+
+TilePackStore::TilePackStore(const std::string &filename, const std::string &format, bool writable):
+  mFilename(filename),
+  mFormat(format),
+  mFile(NULL),
+  mOffset(0),
+  mEntries(NULL),
+  mEntryCount(0)
+{
+  if (writable) {
+    char header[cHeaderSize] = {0};
+    memcpy(header, cHeaderMagic, 8);
+    strncpy(header + 8, mFormat.c_str(), 8);
+
+    mTempFilename = mFilename + ".tmp";
+    mFile = VSIFOpenL(mTempFilename.c_str(), "wb");
+    if (mFile == NULL) {
+      throw CTBException("Could not create the tile pack");
+    }
+
+    if (VSIFWriteL(header, 1, cHeaderSize, mFile) != cHeaderSize) {
+      VSIFCloseL(mFile);
+      VSIUnlink(mTempFilename.c_str());
+      throw CTBException("Failed to write the tile pack header");
+    }
+
+    mOffset = cHeaderSize;
+    return;
+  }
+
+  try {
+    mMapping.open(mFilename);
+  } catch (std::exception &) {
+    throw CTBException("Could not open the tile pack");
+  }
+
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(mMapping.data());
+  const size_t size = mMapping.size();
+
+  if (size < cHeaderSize + cTrailerSize || memcmp(data, cHeaderMagic, 8) != 0) {
+    throw CTBException("The file is not a tile pack");
+  }
+
+  const char *packFormat = reinterpret_cast<const char *>(data) + 8;
+  mFormat.assign(packFormat, std::find(packFormat, packFormat + 8, '\0'));
+
+  uint64_t trailer[3];
+  memcpy(trailer, data + size - cTrailerSize, cTrailerSize);
+  const uint64_t indexOffset = trailer[0], entryCount = trailer[1];
+
+  if (memcmp(&trailer[2], cTrailerMagic, 8) != 0
+      || indexOffset % 8 != 0
+      || indexOffset < cHeaderSize
+      || indexOffset > size - cTrailerSize
+      || entryCount != (size - cTrailerSize - indexOffset) / sizeof(Entry)) {
+    throw CTBException("The tile pack index is invalid");
+  }
+
+  // The mapping is page aligned so the index is suitably aligned for access
+  mEntries = reinterpret_cast<const Entry *>(data + indexOffset);
+  mEntryCount = entryCount;
+}
+
+TilePackStore::~TilePackStore() {
+  try {
+    close();
+  } catch (CTBException &) {
+    // errors can only be reported by calling `close` explicitly
+  }
+}
+
+void
+TilePackStore::writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) {
+  if (mFile == NULL) {
+    throw CTBException("The tile pack is not open for writing");
+  } else if (size > UINT32_MAX) {
+    throw CTBException("The tile is too large to be packed");
+  }
+
+  Staging *staging;
+  {
+    std::lock_guard<std::mutex> lock(mStagingMutex);
+    std::unique_ptr<Staging> &threadStaging = mStaging[std::this_thread::get_id()];
+    if (!threadStaging) {
+      threadStaging.reset(new Staging());
+      threadStaging->data.reserve(STAGING_SIZE);
+    }
+    staging = threadStaging.get();
+  }
+
+  const Entry entry = {tileKey(coord), staging->data.size(), (uint32_t) size, 0};
+  staging->entries.push_back(entry);
+  staging->data.insert(staging->data.end(), data, data + size);
+
+  if (staging->data.size() >= STAGING_SIZE) {
+    flush(*staging);
+  }
+}
+
+/**
+ * @details Only the key of the original is recorded: the entry is completed
+ * from the original's entry when the index is written.
+ */
+void
+TilePackStore::writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                              const unsigned char * /*data*/, size_t /*size*/) {
+  if (mFile == NULL) {
+    throw CTBException("The tile pack is not open for writing");
+  }
+
+  std::lock_guard<std::mutex> lock(mFileMutex);
+  mDuplicates.push_back(std::make_pair(tileKey(coord), tileKey(original)));
+}
+
+void
+TilePackStore::flush(Staging &staging) {
+  if (staging.entries.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mFileMutex);
+
+  if (VSIFWriteL(staging.data.data(), 1, staging.data.size(), mFile) != staging.data.size()) {
+    throw CTBException("Failed to write to the tile pack");
+  }
+
+  for (Entry &entry: staging.entries) {
+    entry.offset += mOffset;
+  }
+  mIndex.insert(mIndex.end(), staging.entries.begin(), staging.entries.end());
+  mOffset += staging.data.size();
+
+  staging.data.clear();
+  staging.entries.clear();
+}
+
+/**
+ * @details This must only be called once all threads have finished writing.
+ * When a tile has been written more than once the last copy flushed wins,
+ * although duplicates take precedence over tiles written directly.  The
+ * temporary file is only renamed over the pack once it is complete, and is
+ * removed if anything fails.
+ */
+void
+TilePackStore::close() {
+  if (mFile == NULL) {
+    return;
+  }
+
+  VSILFILE *fp = mFile;
+  try {
+    {
+      std::lock_guard<std::mutex> lock(mStagingMutex);
+      for (auto &staging: mStaging) {
+        flush(*staging.second);
+      }
+      mStaging.clear();
+    }
+
+    sortEntries(mIndex);
+
+    // Point duplicate tiles at the data of their originals
+    if (!mDuplicates.empty()) {
+      const size_t written = mIndex.size();
+      for (const auto &duplicate: mDuplicates) {
+        const std::vector<Entry>::const_iterator end = mIndex.begin() + written,
+          original = std::lower_bound(mIndex.cbegin(), end, duplicate.second, compareKeys);
+
+        if (original == end || original->key != duplicate.second) {
+          throw CTBException("The original of a duplicate tile is missing from the tile pack");
+        }
+
+        Entry entry = *original;
+        entry.key = duplicate.first;
+        mIndex.push_back(entry);
+      }
+
+      mDuplicates.clear();
+      sortEntries(mIndex);
+    }
+
+    // Align the index and write it followed by the trailer
+    const char padding[8] = {0};
+    const size_t paddingSize = (8 - mOffset % 8) % 8;
+    const uint64_t trailer[3] = {mOffset + paddingSize, mIndex.size(), 0};
+    char trailerBytes[cTrailerSize];
+    memcpy(trailerBytes, trailer, 16);
+    memcpy(trailerBytes + 16, cTrailerMagic, 8);
+
+    const size_t indexSize = mIndex.size() * sizeof(Entry);
+    if (VSIFWriteL(padding, 1, paddingSize, fp) != paddingSize
+        || VSIFWriteL(mIndex.data(), 1, indexSize, fp) != indexSize
+        || VSIFWriteL(trailerBytes, 1, cTrailerSize, fp) != cTrailerSize) {
+      throw CTBException("Failed to write the tile pack index");
+    }
+  } catch (CTBException &) {
+    mFile = NULL;
+    VSIFCloseL(fp);
+    VSIUnlink(mTempFilename.c_str());
+    throw;
+  }
+
+  mFile = NULL;
+  mIndex.clear();
+  if (VSIFCloseL(fp) != 0) {
+    VSIUnlink(mTempFilename.c_str());
+    throw CTBException("Failed to close the tile pack");
+  }
+
+  if (VSIRename(mTempFilename.c_str(), mFilename.c_str()) != 0) {
+    VSIUnlink(mTempFilename.c_str());
+    throw CTBException("Failed to replace the tile pack");
+  }
+}
+
+bool
+TilePackStore::findTile(const TileCoordinate &coord, const unsigned char *&data, size_t &size) const {
+  if (mEntries == NULL) {
+    throw CTBException("The tile pack is not open for reading");
+  }
+
+  const uint64_t key = tileKey(coord);
+  const Entry *end = mEntries + mEntryCount,
+    *entry = std::lower_bound(mEntries, end, key, compareKeys);
+
+  if (entry == end || entry->key != key) {
+    return false;
+  }
+
+  if (entry->offset + entry->size > mMapping.size()) {
+    throw CTBException("The tile pack index is invalid");
+  }
+
+  data = reinterpret_cast<const unsigned char *>(mMapping.data()) + entry->offset;
+  size = entry->size;
+  return true;
+}
+
+bool
+TilePackStore::readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const {
+  const unsigned char *tileData;
+  size_t size;
+
+  if (!findTile(coord, tileData, size)) {
+    return false;
+  }
+
+  data.assign(tileData, tileData + size);
+  return true;
+}
@@ -0,0 +1,153 @@
+#ifndef TILEPACKSTORE_HPP
+#define TILEPACKSTORE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TilePackStore.hpp
+ * @brief This declares the `TilePackStore` class
+ */
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "cpl_vsi.h"
+
+#include "TileStore.hpp"
+
+namespace ctb {
+  class TilePackStore;
+}
+
+/**
+ * @brief Store tiles in a single memory mappable pack file
+ *
+ * A pack is an append only file of encoded tiles followed by an index.  The
+ * layout is:
+ *
+ * - A 16 byte header: the magic `CTBPACK1` followed by the tile format (e.g.
+ *   `terrain`) padded with nulls to 8 bytes.
+ * - The tile data, one blob after another.
+ * - The index, aligned to 8 bytes: an `Entry` for each tile sorted by key.
+ * - A 24 byte trailer: the offset of the index, the number of entries and the
+ *   magic `CTBINDEX`.
+ *
+ * Integers are stored in the byte order of the host, which is little endian
+ * on all supported platforms.  Entries are keyed by `TileStore::tileKey`, so
+ * tiles which are near each other spatially are near each other in the index.
+ * Duplicate tiles share the same data.
+ *
+ * When writing, each thread appends tiles to its own staging buffer which is
+ * flushed to the file in large blocks, and the index is written when the
+ * store is closed.  The pack is written to a temporary file alongside it
+ * which replaces any existing pack once it is complete, so readers which
+ * have the existing pack mapped never see it change.  When reading, the whole
+ * file is memory mapped and tiles are found by binary search of the index, so
+ * no system calls are made per tile.
+ */
+class CTB_DLL ctb::TilePackStore :
+  public TileStore
+{
+public:
+
+  /// An index entry
+  struct Entry {
+    uint64_t key;               ///< The tile key (see `TileStore::tileKey`)
+    uint64_t offset;            ///< The offset of the tile data in the file
+    uint32_t size;              ///< The size of the tile data in bytes
+    uint32_t reserved;          ///< Padding, set to zero
+  };
+
+  /// Open a pack for reading or create a new pack for writing
+  TilePackStore(const std::string &filename, const std::string &format, bool writable);
+
+  /// Write the index if required and close the pack
+  ~TilePackStore();
+
+  void
+  writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) override;
+
+  /// Reference the data of the original tile rather than writing it again
+  void
+  writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                 const unsigned char *data, size_t size) override;
+
+  bool
+  readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const override;
+
+  /// Packs are always rewritten from scratch
+  bool
+  preservesTiles() const override {
+    return false;
+  }
+
+  /// Write out any staged tiles and the index, then replace the pack
+  void
+  close() override;
+
+  /**
+   * @brief Find a tile in a pack opened for reading without copying it
+   *
+   * `data` points into the mapped file, so it is only valid for the lifetime
+   * of the store.
+   */
+  bool
+  findTile(const TileCoordinate &coord, const unsigned char *&data, size_t &size) const;
+
+  /// Get the tile format recorded in the pack
+  const std::string &
+  format() const {
+    return mFormat;
+  }
+
+  /// The size at which staged tiles are flushed to the file
+  static const size_t STAGING_SIZE = 4 * 1024 * 1024;
+
+private:
+
+  /// Tiles written by a thread which are waiting to be flushed
+  struct Staging {
+    std::vector<unsigned char> data;
+    std::vector<Entry> entries; ///< Offsets are relative to `data`
+  };
+
+  /// Append staged tiles to the file
+  void
+  flush(Staging &staging);
+
+  std::string mFilename;        ///< The pack file
+  std::string mTempFilename;    ///< The file written, which replaces the pack
+  std::string mFormat;          ///< The tile format
+
+  VSILFILE *mFile;              ///< The file being written
+  uint64_t mOffset;             ///< The end of the data written so far
+  std::vector<Entry> mIndex;    ///< The entries for the data written so far
+  std::vector<std::pair<uint64_t, uint64_t>> mDuplicates; ///< Keys of duplicates and their originals
+  std::mutex mFileMutex;        ///< Serialise writes to the file
+  std::map<std::thread::id, std::unique_ptr<Staging>> mStaging; ///< Per thread staging
+  std::mutex mStagingMutex;     ///< Guard `mStaging`
+
+  boost::iostreams::mapped_file_source mMapping; ///< The pack being read
+  const Entry *mEntries;        ///< The index in the mapped file
+  uint64_t mEntryCount;         ///< The number of index entries
+};
+
+#endif /* TILEPACKSTORE_HPP */
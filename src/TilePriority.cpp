@@ -0,0 +1,240 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TilePriority.cpp
+ * @brief This defines the `TilePriority` class
+ */
+
+#include <algorithm>
+#include <ctype.h>              // for isdigit
+#include <fstream>
+#include <memory>
+#include <stdlib.h>             // for strtoul
+
+#include "gdal_priv.h"
+#include "ogrsf_frmts.h"
+
+#include "CTBException.hpp"
+#include "GDALTiler.hpp"
+#include "TilePriority.hpp"
+#include "TileStore.hpp"
+
+using namespace ctb;
+
+void
+TilePriority::addRequest(const TileCoordinate &coord, double weight) {
+  TileCoordinate ancestor = coord;
+
+  while (true) {
+    Weight &entry = mWeights.insert(std::make_pair(TileStore::tileKey(ancestor), Weight{ancestor, 0})).first->second;
+    entry.weight += weight;
+
+    if (ancestor.zoom == 0) break;
+    ancestor = TileCoordinate(ancestor.zoom - 1, ancestor.x / 2, ancestor.y / 2);
+  }
+}
+
+void
+TilePriority::addRegion(const Cutline &region, double weight) {
+  mRegions.push_back(Region{region, weight});
+}
+
+size_t
+TilePriority::loadAccessLog(const std::string &filename) {
+  std::ifstream log(filename.c_str());
+  if (!log) {
+    throw CTBException("Could not open the access log");
+  }
+
+  size_t count = 0;
+  std::string line;
+  TileCoordinate coord;
+
+  while (std::getline(log, line)) {
+    if (parseLogLine(line, coord)) {
+      addRequest(coord);
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * @details Features whose polygons don't enclose any area are ignored.
+ */
+void
+TilePriority::loadRegions(const std::string &filename, const OGRSpatialReference &srs,
+                          const std::string &field) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpenEx(filename.c_str(), GDAL_OF_VECTOR, NULL, NULL, NULL);
+  if (poDataset == NULL) {
+    throw CTBException("Could not open the priority regions dataset");
+  }
+
+  OGRSpatialReference targetSRS(srs);
+  const char *error = NULL;
+
+  for (int i = 0; error == NULL && i < poDataset->GetLayerCount(); ++i) {
+    OGRLayer *poLayer = poDataset->GetLayer(i);
+    OGRSpatialReference *layerSRS = poLayer->GetSpatialRef();
+    const int fieldIndex = poLayer->GetLayerDefn()->GetFieldIndex(field.c_str());
+
+    // Reproject the polygons if the layer is in another spatial reference system
+    std::unique_ptr<OGRCoordinateTransformation> transformer;
+    if (layerSRS != NULL && !layerSRS->IsSame(&targetSRS)) {
+      transformer.reset(OGRCreateCoordinateTransformation(layerSRS, &targetSRS));
+      if (!transformer) {
+        error = "The priority region to tile grid coordinate transformation could not be created";
+        break;
+      }
+    }
+
+    poLayer->ResetReading();
+    OGRFeature *poFeature;
+    while (error == NULL && (poFeature = poLayer->GetNextFeature()) != NULL) {
+      OGRGeometry *geometry = poFeature->GetGeometryRef();
+      const double weight = (fieldIndex < 0) ? 1 : poFeature->GetFieldAsDouble(fieldIndex);
+
+      if (geometry != NULL && weight > 0) {
+        std::vector<Cutline::Ring> rings;
+
+        if (transformer && geometry->transform(transformer.get()) != OGRERR_NONE) {
+          error = "Could not transform a priority region to the tile spatial reference system";
+        } else {
+          Cutline::addRings(geometry, rings);
+        }
+
+        try {
+          if (!rings.empty()) {
+            addRegion(Cutline(rings), weight);
+          }
+        } catch (CTBException &) {
+          // the polygons have no area
+        }
+      }
+
+      OGRFeature::DestroyFeature(poFeature);
+    }
+  }
+
+  GDALClose(poDataset);
+
+  if (error != NULL) {
+    throw CTBException(error);
+  }
+}
+
+/**
+ * @details The tiles overlapping each region are found at every zoom level,
+ * so a large region at a high zoom level can give a lot of tiles.
+ */
+std::vector<TileCoordinate>
+TilePriority::schedule(const GDALTiler &tiler, i_zoom startZoom, i_zoom endZoom) const {
+  const Grid &grid = tiler.grid();
+  std::unordered_map<uint64_t, Weight> weights;
+
+  // Is a tile one which the tiler creates?
+  auto creates = [&](const TileCoordinate &coord) {
+    const TileBounds tiles = tiler.tileBoundsForZoom(coord.zoom);
+    return coord.zoom >= endZoom && coord.zoom <= startZoom
+      && coord.x >= tiles.getMinX() && coord.x <= tiles.getMaxX()
+      && coord.y >= tiles.getMinY() && coord.y <= tiles.getMaxY()
+      && (!tiler.cutline() || tiler.cutline()->coverage(grid.tileBounds(coord)) != Cutline::OUTSIDE);
+  };
+
+  for (const auto &entry: mWeights) {
+    if (creates(entry.second.coord)) {
+      weights.insert(entry);
+    }
+  }
+
+  for (const Region &region: mRegions) {
+    const CRSBounds &bounds = region.region.bounds();
+
+    for (i_zoom zoom = endZoom; zoom <= startZoom; ++zoom) {
+      const TileBounds tiles = tiler.tileBoundsForZoom(zoom);
+      const TileCoordinate ll = grid.crsToTile(bounds.getLowerLeft(), zoom),
+        ur = grid.crsToTile(bounds.getUpperRight(), zoom);
+
+      for (i_tile x = std::max(ll.x, tiles.getMinX()); x <= std::min(ur.x, tiles.getMaxX()); ++x) {
+        for (i_tile y = std::max(ll.y, tiles.getMinY()); y <= std::min(ur.y, tiles.getMaxY()); ++y) {
+          const TileCoordinate coord(zoom, x, y);
+
+          if (region.region.coverage(grid.tileBounds(coord)) != Cutline::OUTSIDE && creates(coord)) {
+            Weight &entry = weights.insert(std::make_pair(TileStore::tileKey(coord), Weight{coord, 0})).first->second;
+            entry.weight += region.weight;
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<Weight> ordered;
+  ordered.reserve(weights.size());
+  for (const auto &entry: weights) {
+    ordered.push_back(entry.second);
+  }
+
+  std::sort(ordered.begin(), ordered.end(), [](const Weight &a, const Weight &b) {
+      if (a.weight != b.weight) return a.weight > b.weight;
+      if (a.coord.zoom != b.coord.zoom) return a.coord.zoom < b.coord.zoom;
+      return TileStore::tileKey(a.coord) < TileStore::tileKey(b.coord);
+    });
+
+  std::vector<TileCoordinate> tiles;
+  tiles.reserve(ordered.size());
+  for (const Weight &entry: ordered) {
+    tiles.push_back(entry.coord);
+  }
+
+  return tiles;
+}
+
+bool
+TilePriority::parseLogLine(const std::string &line, TileCoordinate &coord) {
+  const size_t end = line.rfind(".terrain");
+  if (end == std::string::npos) {
+    return false;
+  }
+
+  // Step back over the three path segments
+  size_t start = end;
+  for (int i = 0; i < 3; ++i) {
+    if (start == 0 || (start = line.rfind('/', start - 1)) == std::string::npos) {
+      return false;
+    }
+  }
+
+  unsigned long values[3];
+  const char *position = line.c_str() + start;
+  for (int i = 0; i < 3; ++i) {
+    char *next;
+    if (*position != '/' || !isdigit((unsigned char) position[1])) {
+      return false;
+    }
+
+    values[i] = strtoul(position + 1, &next, 10);
+    position = next;
+  }
+
+  if (position != line.c_str() + end || values[0] > 32) {
+    return false;
+  }
+
+  coord = TileCoordinate((i_zoom) values[0], (i_tile) values[1], (i_tile) values[2]);
+  return true;
+}
@@ -0,0 +1,125 @@
+#ifndef TILEPRIORITY_HPP
+#define TILEPRIORITY_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TilePriority.hpp
+ * @brief This declares the `TilePriority` class
+ */
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ogr_spatialref.h"
+
+#include "config.hpp"           // for CTB_DLL
+#include "Cutline.hpp"
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class GDALTiler;
+  class TilePriority;
+}
+
+/**
+ * @brief Weigh up which tiles are most important to create first
+ *
+ * Tiles are weighted by how often they were requested in an access log and
+ * by weighted polygons covering the areas of interest.  A tile requested from
+ * a log also adds its weight to each of its ancestors, as clients have to
+ * load those first, so ancestors always come before their descendants.
+ *
+ * `schedule` lists the weighted tiles of a tiler in order of importance, so a
+ * build can create these first and be useful for the most requested areas
+ * long before it finishes.
+ */
+class CTB_DLL ctb::TilePriority {
+public:
+
+  /// Add weight to a tile and all of its ancestors
+  void
+  addRequest(const TileCoordinate &coord, double weight = 1);
+
+  /// Add weight to every tile overlapping a region
+  void
+  addRegion(const Cutline &region, double weight);
+
+  /// Add the tiles requested in an access log, returning the number of requests
+  size_t
+  loadAccessLog(const std::string &filename);
+
+  /**
+   * @brief Add the polygons in a vector dataset as weighted regions
+   *
+   * Each polygon is weighted by the numeric `field` of its feature, or by `1`
+   * if there is no such field.  Polygons are reprojected to the given spatial
+   * reference system if their layer has a different one.
+   */
+  void
+  loadRegions(const std::string &filename, const OGRSpatialReference &srs,
+              const std::string &field = "priority");
+
+  /// Are there no weighted tiles or regions?
+  bool
+  empty() const {
+    return mWeights.empty() && mRegions.empty();
+  }
+
+  /**
+   * @brief Get the weighted tiles of a tiler between two zoom levels
+   *
+   * The tiles are ordered from the heaviest to the lightest, with lower zoom
+   * levels first when weights are equal.  Only tiles the tiler would create
+   * are included, and requests beyond the start zoom level count towards
+   * their ancestors.
+   */
+  std::vector<TileCoordinate>
+  schedule(const GDALTiler &tiler, i_zoom startZoom, i_zoom endZoom) const;
+
+  /**
+   * @brief Get the tile requested in a line of an access log
+   *
+   * The tile is found from the last `/{zoom}/{x}/{y}.terrain` in the line, so
+   * any log format which includes the request path can be used.
+   */
+  static bool
+  parseLogLine(const std::string &line, TileCoordinate &coord);
+
+private:
+
+  /// A tile and its weight
+  struct Weight {
+    TileCoordinate coord;
+    double weight;
+  };
+
+  /// A region and its weight
+  struct Region {
+    Cutline region;
+    double weight;
+  };
+
+  /// The weight of requested tiles, keyed by `TileStore::tileKey`
+  std::unordered_map<uint64_t, Weight> mWeights;
+
+  std::vector<Region> mRegions;
+};
+
+#endif /* TILEPRIORITY_HPP */
@@ -0,0 +1,79 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileStore.cpp
+ * @brief This defines the `TileStore` class
+ */
+
+#include <ctype.h>              // for tolower
+
+#include "TileStore.hpp"
+#include "DirectoryTileStore.hpp"
+#include "MBTilesStore.hpp"
+#include "TilePackStore.hpp"
+
+using namespace ctb;
+
+/// Does a string end with a suffix, ignoring case?
+static bool
+endsWith(const std::string &value, const std::string &suffix) {
+  if (suffix.size() > value.size()) {
+    return false;
+  }
+
+  for (size_t i = 0, offset = value.size() - suffix.size(); i < suffix.size(); ++i) {
+    if (tolower(value[offset + i]) != tolower(suffix[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/// Spread the lower 32 bits of a value out over the even bits
+static inline uint64_t
+spreadBits(uint64_t value) {
+  value &= 0xffffffffULL;
+  value = (value | (value << 16)) & 0x0000ffff0000ffffULL;
+  value = (value | (value << 8)) & 0x00ff00ff00ff00ffULL;
+  value = (value | (value << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  value = (value | (value << 2)) & 0x3333333333333333ULL;
+  value = (value | (value << 1)) & 0x5555555555555555ULL;
+  return value;
+}
+
+uint64_t
+TileStore::tileKey(const TileCoordinate &coord) {
+  const uint64_t morton = spreadBits(coord.x) | (spreadBits(coord.y) << 1);
+  return ((uint64_t) coord.zoom << 58) | (morton & ((1ULL << 58) - 1));
+}
+
+bool
+TileStore::isContainer(const std::string &path) {
+  return endsWith(path, ".mbtiles") || endsWith(path, ".ctbpack");
+}
+
+std::unique_ptr<TileStore>
+TileStore::open(const std::string &path, const std::string &format, bool writable) {
+  if (endsWith(path, ".mbtiles")) {
+    return std::unique_ptr<TileStore>(new MBTilesStore(path, format, writable));
+  } else if (endsWith(path, ".ctbpack")) {
+    return std::unique_ptr<TileStore>(new TilePackStore(path, format, writable));
+  }
+
+  return std::unique_ptr<TileStore>(new DirectoryTileStore(path, format, writable));
+}
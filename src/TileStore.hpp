@@ -0,0 +1,112 @@
+#ifndef TILESTORE_HPP
+#define TILESTORE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file TileStore.hpp
+ * @brief This declares the `TileStore` class
+ */
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "TileCoordinate.hpp"
+
+namespace ctb {
+  class TileStore;
+}
+
+/**
+ * @brief An abstract base class for somewhere encoded tiles are kept
+ *
+ * A tile store maps tile coordinates to the encoded bytes of a tile, such as a
+ * gzipped terrain tile or a PNG image.  Implementations are the traditional
+ * `{zoom}/{x}/{y}.{extension}` directory structure (see `DirectoryTileStore`),
+ * a single SQLite database (see `MBTilesStore`) and a single memory mappable
+ * pack file (see `TilePackStore`).  `TileStore::open`
+ * chooses the implementation from the path.
+ *
+ * `writeTile` and `readTile` can be called concurrently from multiple threads.
+ * Writes may be buffered until the store is closed or destroyed.
+ */
+class CTB_DLL ctb::TileStore {
+public:
+
+  virtual ~TileStore() {}
+
+  /// Store the encoded data for a tile, replacing any existing tile
+  virtual void
+  writeTile(const TileCoordinate &coord, const unsigned char *data, size_t size) = 0;
+
+  /**
+   * @brief Store a tile whose data is identical to a tile already written
+   *
+   * Stores can use this to share the data between the tiles rather than
+   * storing it twice.  By default the data is simply written again.
+   */
+  virtual void
+  writeDuplicate(const TileCoordinate &coord, const TileCoordinate &original,
+                 const unsigned char *data, size_t size) {
+    (void) original;
+    writeTile(coord, data, size);
+  }
+
+  /// Retrieve the encoded data for a tile, returning `false` if it is absent
+  virtual bool
+  readTile(const TileCoordinate &coord, std::vector<unsigned char> &data) const = 0;
+
+  /// Flush any buffered writes, throwing an exception if they failed
+  virtual void
+  close() {}
+
+  /// Are existing tiles kept when the store is reopened for writing?
+  virtual bool
+  preservesTiles() const {
+    return true;
+  }
+
+  /**
+   * @brief Get a key which orders tiles by zoom level and then spatially
+   *
+   * The key is the zoom level in the top 6 bits followed by the Morton code
+   * (bit interleaving) of the x and y coordinates.
+   */
+  static uint64_t
+  tileKey(const TileCoordinate &coord);
+
+  /**
+   * @brief Open a tile store at a path
+   *
+   * A path ending in `.mbtiles` opens an `MBTilesStore` and one ending in
+   * `.ctbpack` opens a `TilePackStore`.  Anything else is treated as a
+   * directory.  `format` is the file extension of the tiles,
+   * for instance `terrain` or `png`.  Stores are created if `writable` is
+   * `true`.
+   */
+  static std::unique_ptr<TileStore>
+  open(const std::string &path, const std::string &format, bool writable);
+
+  /// Is the path one that `TileStore::open` treats as a tile container?
+  static bool
+  isContainer(const std::string &path);
+};
+
+#endif /* TILESTORE_HPP */
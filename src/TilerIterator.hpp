@@ -34,8 +34,8 @@ namespace ctb {
  *
  * Instances of this class take a `GDALTiler` (or derived class) in the
  * constructor and are used to forward iterate over all tiles in the tiler,
- * returning a `Tile *` when dereferenced.  It is the caller's responsibility to
- * call `delete` on the tile.
+ * returning a `std::unique_ptr` owning a newly created `Tile` when
+ * dereferenced.
  */
 class ctb::TilerIterator :
   public GridIterator
@@ -53,9 +53,15 @@ public:
   {}
 
   /// Override the dereference operator to return a Tile
-  virtual Tile *
+  std::unique_ptr<Tile>
   operator*() const {
-    return tiler.createTile(*(GridIterator::operator*()));
+    return tiler.createTile(coordinate());
+  }
+
+  /// Get the coordinate of the current tile
+  const TileCoordinate &
+  coordinate() const {
+    return *(GridIterator::operator*());
   }
 
 protected:
@@ -0,0 +1,382 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file WorkQueue.cpp
+ * @brief This defines the `WorkQueue` class
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdio.h>              // for sscanf
+
+#include <boost/filesystem.hpp>
+
+#include "cpl_multiproc.h"      // for CPLGetPID
+
+#include "CTBException.hpp"
+#include "GDALTiler.hpp"
+#include "WorkQueue.hpp"
+
+using namespace ctb;
+
+/// Get the name of the file of a unit
+static std::string
+unitName(const WorkQueue::Unit &unit) {
+  std::ostringstream name;
+  name << unit.zoom << '-' << unit.tiles.getMinX() << '-' << unit.tiles.getMinY()
+       << '-' << unit.tiles.getMaxX() << '-' << unit.tiles.getMaxY();
+  return name.str();
+}
+
+/// Get the unit from the name of its file, returning `false` if it isn't one
+static bool
+parseUnitName(const std::string &name, WorkQueue::Unit &unit) {
+  unsigned int zoom, minX, minY, maxX, maxY;
+  char end;
+  if (sscanf(name.c_str(), "%u-%u-%u-%u-%u%c", &zoom, &minX, &minY, &maxX, &maxY, &end) != 5) {
+    return false;
+  }
+
+  unit.zoom = (i_zoom) zoom;
+  unit.tiles = TileBounds(minX, minY, maxX, maxY);
+  return true;
+}
+
+/// List the names of the files in a directory
+static std::vector<std::string>
+listFiles(const std::string &dirname) {
+  std::vector<std::string> names;
+  boost::system::error_code error;
+
+  for (boost::filesystem::directory_iterator it(dirname, error), end; !error && it != end; it.increment(error)) {
+    names.push_back(it->path().filename().string());
+  }
+
+  return names;
+}
+
+/// Is a directory empty?  A directory which can't be listed counts as empty.
+static bool
+isEmpty(const std::string &dirname) {
+  boost::system::error_code error;
+  return boost::filesystem::directory_iterator(dirname, error) == boost::filesystem::directory_iterator();
+}
+
+/**
+ * Touch a file which must already exist
+ *
+ * A byte is written to the file so that the filesystem sets its modification
+ * time from its own clock.  Unlike setting the time explicitly this doesn't
+ * depend on the clock of this machine.
+ */
+static bool
+touch(const std::string &filename) {
+  FILE *fp = fopen(filename.c_str(), "r+b");
+  if (fp == NULL) {
+    return false;
+  }
+
+  const bool written = (fputc('\n', fp) != EOF);
+  return (fclose(fp) == 0) && written;
+}
+
+/// Read the job description of a queue, returning `false` if there isn't one
+static bool
+readJob(const std::string &dirname, std::string &job) {
+  std::ifstream file((dirname + "/job").c_str());
+  if (!file) {
+    return false;
+  }
+
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  job = contents.str();
+  return true;
+}
+
+/**
+ * @details The worker is named after the process and a random number, as
+ * processes on different machines can have the same ID.
+ */
+WorkQueue::WorkQueue(const std::string &dirname, const std::string &job,
+                     const std::vector<Unit> &units, unsigned int leaseSeconds):
+  mDirname(dirname),
+  mLeaseSeconds(std::max(1u, leaseSeconds)),
+  mRenewed(0)
+{
+  std::random_device random;
+  std::ostringstream worker;
+  worker << CPLGetPID() << '-' << std::hex << random() << random();
+  mWorker = worker.str();
+
+  create(job, units);
+  mProbeFilename = mDirname + "/clock@" + mWorker;
+}
+
+WorkQueue::~WorkQueue() {
+  release();
+
+  boost::system::error_code error;
+  boost::filesystem::remove(mProbeFilename, error);
+}
+
+/**
+ * @details Each zoom level is split into bands of whole rows, so a unit is a
+ * contiguous part of the tiles the `GridIterator` of the tiler goes through.
+ */
+std::vector<WorkQueue::Unit>
+WorkQueue::partition(const GDALTiler &tiler, i_zoom startZoom, i_zoom endZoom, size_t unitTiles) {
+  std::vector<Unit> units;
+
+  for (i_zoom zoom = startZoom; ; --zoom) {
+    const TileBounds tiles = tiler.tileBoundsForZoom(zoom);
+    const size_t columns = (size_t) tiles.getMaxX() - tiles.getMinX() + 1;
+    const i_tile rows = (i_tile) std::max<size_t>(1, unitTiles / columns);
+
+    for (i_tile y = tiles.getMinY(); y <= tiles.getMaxY(); y += rows) {
+      const i_tile maxY = (tiles.getMaxY() - y < rows) ? tiles.getMaxY() : y + rows - 1;
+      units.push_back(Unit{zoom, TileBounds(tiles.getMinX(), y, tiles.getMaxX(), maxY)});
+
+      if (maxY == tiles.getMaxY()) break;
+    }
+
+    if (zoom == endZoom) break;
+  }
+
+  return units;
+}
+
+/**
+ * @details A worker starts at a random pending unit so that workers starting
+ * together don't all race for the same unit.
+ */
+bool
+WorkQueue::claim(Unit &unit) {
+  if (!mUnitName.empty()) {
+    throw CTBException("A work queue unit is already held");
+  }
+
+  std::vector<std::string> names = listFiles(mDirname + "/pending");
+  if (!names.empty()) {
+    std::random_device random;
+    std::rotate(names.begin(), names.begin() + (random() % names.size()), names.end());
+  }
+
+  for (const std::string &name: names) {
+    if (parseUnitName(name, unit) && lease(mDirname + "/pending/" + name, name)) {
+      return true;
+    }
+  }
+
+  // Take over any unit whose lease has expired
+  const std::vector<std::string> leased = listFiles(mDirname + "/leased");
+  const time_t now = leased.empty() ? 0 : filesystemTime();
+  for (const std::string &name: leased) {
+    const std::string filename = mDirname + "/leased/" + name;
+    const std::string unitName = name.substr(0, name.find('@'));
+    boost::system::error_code error;
+    const time_t modified = boost::filesystem::last_write_time(filename, error);
+
+    if (!error && modified + (time_t) mLeaseSeconds < now
+        && parseUnitName(unitName, unit) && lease(filename, unitName)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+WorkQueue::renew() {
+  if (mUnitName.empty()) {
+    return false;
+  }
+
+  const time_t now = time(NULL);
+  if (now - mRenewed < (time_t) mLeaseSeconds / 3) {
+    return true;
+  }
+
+  if (!touch(mLeaseFilename)) {
+    mUnitName.clear();          // another worker has the file now
+    mLeaseFilename.clear();
+    return false;
+  }
+
+  mRenewed = now;
+  return true;
+}
+
+bool
+WorkQueue::complete() {
+  if (mUnitName.empty()) {
+    return false;
+  }
+
+  boost::system::error_code error;
+  boost::filesystem::rename(mLeaseFilename, mDirname + "/done/" + mUnitName, error);
+  mUnitName.clear();
+  mLeaseFilename.clear();
+
+  return !error;
+}
+
+void
+WorkQueue::release() {
+  if (mUnitName.empty()) {
+    return;
+  }
+
+  boost::system::error_code error;
+  boost::filesystem::rename(mLeaseFilename, mDirname + "/pending/" + mUnitName, error);
+  mUnitName.clear();
+  mLeaseFilename.clear();
+}
+
+bool
+WorkQueue::finished() const {
+  return isEmpty(mDirname + "/pending") && isEmpty(mDirname + "/leased");
+}
+
+bool
+WorkQueue::finish() {
+  if (!finished()) {
+    return false;
+  }
+
+  boost::system::error_code error;
+  boost::filesystem::rename(mDirname + "/unfinished", mDirname + "/finished@" + mWorker, error);
+  return !error;
+}
+
+std::string
+WorkQueue::resultFilename(const Unit &unit) const {
+  return mDirname + "/results/" + unitName(unit);
+}
+
+std::vector<std::string>
+WorkQueue::resultFilenames() const {
+  std::vector<std::string> filenames;
+  Unit unit;
+
+  for (const std::string &name: listFiles(mDirname + "/results")) {
+    if (parseUnitName(name, unit)) {
+      filenames.push_back(mDirname + "/results/" + name);
+    }
+  }
+
+  return filenames;
+}
+
+/**
+ * @details The queue is filled in a temporary directory which is then renamed
+ * into place, so a worker never sees a partly created queue and only one of
+ * the workers starting together creates it.
+ */
+void
+WorkQueue::create(const std::string &job, const std::vector<Unit> &units) {
+  namespace fs = boost::filesystem;
+  boost::system::error_code error;
+
+  if (!fs::exists(mDirname + "/job", error)) {
+    const std::string tempDirname = mDirname + ".tmp-" + mWorker;
+    const char *subdirectories[] = {"pending", "leased", "done", "results"};
+
+    bool failed = false;
+    for (const char *subdirectory: subdirectories) {
+      fs::create_directories(tempDirname + "/" + subdirectory, error);
+      failed = failed || error;
+    }
+
+    for (size_t i = 0; !failed && i < units.size(); ++i) {
+      std::ofstream file((tempDirname + "/pending/" + unitName(units[i])).c_str());
+      failed = !file;
+    }
+
+    if (!failed) {
+      std::ofstream marker((tempDirname + "/unfinished").c_str());
+      std::ofstream file((tempDirname + "/job").c_str());
+      failed = !marker || !(file << job);
+    }
+
+    if (failed) {
+      fs::remove_all(tempDirname, error);
+      throw CTBException("Could not create the work queue");
+    }
+
+    // Another worker may have created the queue in the meantime
+    fs::rename(tempDirname, mDirname, error);
+    if (error) {
+      fs::remove_all(tempDirname, error);
+    }
+  }
+
+  std::string existingJob;
+  if (!readJob(mDirname, existingJob)) {
+    throw CTBException("Could not open the work queue");
+  }
+  if (existingJob != job) {
+    throw CTBException("The work queue was created for a different job");
+  }
+}
+
+/**
+ * @details The file is touched before it is renamed, as a rename keeps the
+ * modification time and the lease must not look expired once it is held.
+ */
+bool
+WorkQueue::lease(const std::string &filename, const std::string &unitName) {
+  if (!touch(filename)) {
+    return false;
+  }
+
+  boost::system::error_code error;
+  const std::string leaseFilename = mDirname + "/leased/" + unitName + "@" + mWorker;
+  boost::filesystem::rename(filename, leaseFilename, error);
+  if (error) {
+    return false;
+  }
+
+  mUnitName = unitName;
+  mLeaseFilename = leaseFilename;
+  mRenewed = time(NULL);
+  return true;
+}
+
+/**
+ * @details The probe file is written so that the filesystem stamps it with
+ * its current time, which is then read back.
+ */
+time_t
+WorkQueue::filesystemTime() const {
+  std::ofstream probe(mProbeFilename.c_str(), std::ios::out | std::ios::trunc);
+  probe << '\n';
+  probe.close();
+  if (!probe) {
+    throw CTBException("Could not write the work queue clock file");
+  }
+
+  boost::system::error_code error;
+  const time_t now = boost::filesystem::last_write_time(mProbeFilename, error);
+  if (error) {
+    throw CTBException("Could not read the work queue clock file");
+  }
+
+  return now;
+}
@@ -0,0 +1,167 @@
+#ifndef WORKQUEUE_HPP
+#define WORKQUEUE_HPP
+
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file WorkQueue.hpp
+ * @brief This declares the `WorkQueue` class
+ */
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "config.hpp"           // for CTB_DLL
+#include "types.hpp"
+
+namespace ctb {
+  class GDALTiler;
+  class WorkQueue;
+}
+
+/**
+ * @brief Share the tiles of a tileset between processes using lease files
+ *
+ * The tiles are split into units, each a band of rows at a zoom level, which
+ * are kept as files in a queue directory.  A unit moves from `pending/` to
+ * `leased/` when a worker claims it and on to `done/` when the worker
+ * completes it.  Every move is a rename, which only one worker can win, so
+ * any number of processes can work on a queue at once, including processes
+ * on other machines sharing the directory over a network filesystem.
+ *
+ * A lease lasts for a number of seconds after its file was last modified.  A
+ * worker renews its lease by touching the file, and a unit whose lease has
+ * expired, such as one whose worker died, can be claimed by another worker.
+ * Files are touched by writing to them, so their modification times come from
+ * the clock of the filesystem, and expiry is judged against a probe file
+ * written in the same way.  The clocks of the machines sharing a queue
+ * therefore don't need to agree.
+ *
+ * Each `WorkQueue` is a single worker holding at most one lease, so each
+ * thread working on a queue should have its own.
+ */
+class CTB_DLL ctb::WorkQueue {
+public:
+
+  /// A band of tiles at a zoom level
+  struct Unit {
+    i_zoom zoom;
+    TileBounds tiles;
+  };
+
+  /**
+   * @brief Open a queue, creating it if the directory doesn't exist
+   *
+   * `job` describes the work, so that a queue created for other work is
+   * never joined: a queue created with a different description throws an
+   * exception.
+   */
+  WorkQueue(const std::string &dirname, const std::string &job,
+            const std::vector<Unit> &units, unsigned int leaseSeconds = 300);
+
+  /// Releases any lease still held
+  ~WorkQueue();
+
+  /// Split the tiles of a tiler into units of about `unitTiles` tiles
+  static std::vector<Unit>
+  partition(const GDALTiler &tiler, i_zoom startZoom, i_zoom endZoom, size_t unitTiles);
+
+  /**
+   * @brief Claim a unit, returning `false` if none is available
+   *
+   * Pending units are claimed before expired leases.  No unit may be held
+   * already.
+   */
+  bool
+  claim(Unit &unit);
+
+  /**
+   * @brief Renew the lease on the unit held if it is due
+   *
+   * This only touches the lease file once a third of the lease has passed, so
+   * it can be called after every tile.  It returns `false` if the lease has
+   * been lost to another worker, in which case the unit is no longer held.
+   */
+  bool
+  renew();
+
+  /// Complete the unit held, returning `false` if the lease had been lost
+  bool
+  complete();
+
+  /// Give up the unit held so that another worker can claim it
+  void
+  release();
+
+  /// Has every unit been completed?
+  bool
+  finished() const;
+
+  /**
+   * @brief Claim the work left once every unit is complete
+   *
+   * Only one worker ever wins this, so that work such as merging the results
+   * is done once.
+   */
+  bool
+  finish();
+
+  /// Get the name of a file in which to keep the results of a unit
+  std::string
+  resultFilename(const Unit &unit) const;
+
+  /// Get the names of the result files of every unit
+  std::vector<std::string>
+  resultFilenames() const;
+
+  /// Get the number of seconds a lease lasts
+  unsigned int
+  leaseSeconds() const {
+    return mLeaseSeconds;
+  }
+
+private:
+
+  /// Create the queue directory with its units, unless it already exists
+  void
+  create(const std::string &job, const std::vector<Unit> &units);
+
+  /// Try to lease the unit in a file, touching it first to start the lease
+  bool
+  lease(const std::string &filename, const std::string &unitName);
+
+  /// Get the current time according to the clock of the filesystem
+  time_t
+  filesystemTime() const;
+
+  const std::string mDirname;
+  const unsigned int mLeaseSeconds;
+
+  /// The name of this worker, unique across processes and machines
+  std::string mWorker;
+
+  /// The unit held, its lease file and when the lease was last renewed
+  /// according to the clock of this machine
+  std::string mUnitName, mLeaseFilename;
+  time_t mRenewed;
+
+  /// The file written to read the time of the filesystem
+  std::string mProbeFilename;
+};
+
+#endif /* WORKQUEUE_HPP */
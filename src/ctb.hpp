@@ -92,22 +92,41 @@
 #include "ctb/Bounds.hpp"
 #include "ctb/Coordinate.hpp"
 #include "ctb/CRSBoundsIterator.hpp"
+#include "ctb/Cutline.hpp"
+#include "ctb/DeduplicatingTileStore.hpp"
+#include "ctb/DirectoryTileStore.hpp"
 #include "ctb/GDALTile.hpp"
 #include "ctb/GDALTiler.hpp"
+#include "ctb/GeodeticMercatorTransformer.hpp"
 #include "ctb/GlobalGeodetic.hpp"
 #include "ctb/GlobalMercator.hpp"
 #include "ctb/Grid.hpp"
 #include "ctb/GridIterator.hpp"
+#include "ctb/LatencyHistogram.hpp"
+#include "ctb/LayerJson.hpp"
+#include "ctb/LRUCache.hpp"
+#include "ctb/MBTilesStore.hpp"
+#include "ctb/OnDemandTiler.hpp"
 #include "ctb/RasterIterator.hpp"
 #include "ctb/CTBException.hpp"
 #include "ctb/RasterTiler.hpp"
+#include "ctb/ReprojectionContext.hpp"
+#include "ctb/SourceFingerprint.hpp"
 #include "ctb/TerrainIterator.hpp"
 #include "ctb/TerrainTile.hpp"
 #include "ctb/TerrainTiler.hpp"
 #include "ctb/Tile.hpp"
+#include "ctb/TileCodec.hpp"
 #include "ctb/TileCoordinate.hpp"
 #include "ctb/TileCoordinateIterator.hpp"
+#include "ctb/TileHash.hpp"
+#include "ctb/TileHeightIndex.hpp"
+#include "ctb/TileIndex.hpp"
+#include "ctb/TilePackStore.hpp"
+#include "ctb/TilePriority.hpp"
+#include "ctb/TileStore.hpp"
 #include "ctb/TilerIterator.hpp"
 #include "ctb/types.hpp"
+#include "ctb/WorkQueue.hpp"
 
 #endif /* CTB_HPP */
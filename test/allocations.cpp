@@ -0,0 +1,258 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file allocations.cpp
+ * @brief Check that creating terrain tiles doesn't allocate in a steady state
+ *
+ * `operator new` is replaced with a version counting allocations, and terrain
+ * tiles are created from an in memory dataset, encoded and given filenames in
+ * a `DirectoryTileStore` as `ctb-tile` does.  Once every tile has been created
+ * once to warm up the buffers kept by the thread, creating them all again must
+ * not allocate.  This is checked with and without a cutline, and with and
+ * without reprojection.
+ *
+ * Memory allocated by GDAL with `CPLMalloc` isn't counted, and neither is
+ * writing the tiles, as GDAL allocates a handle for every file opened.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "gdal_priv.h"
+#include "ogr_spatialref.h"
+
+#include "CTBException.hpp"
+#include "Cutline.hpp"
+#include "DirectoryTileStore.hpp"
+#include "GlobalGeodetic.hpp"
+#include "GlobalMercator.hpp"
+#include "TerrainTiler.hpp"
+
+using namespace std;
+using namespace ctb;
+
+/// Are allocations being counted?
+static atomic<bool> counting(false);
+
+/// The number of allocations made while counting
+static atomic<size_t> allocations(0);
+
+void *
+operator new(size_t size) {
+  if (counting) {
+    ++allocations;
+  }
+
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void *
+operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *
+operator new(size_t size, const nothrow_t &) noexcept {
+  if (counting) {
+    ++allocations;
+  }
+
+  return malloc(size ? size : 1);
+}
+
+void *
+operator new[](size_t size, const nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void
+operator delete(void *p) noexcept {
+  free(p);
+}
+
+void
+operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void
+operator delete(void *p, const nothrow_t &) noexcept {
+  free(p);
+}
+
+void
+operator delete[](void *p, const nothrow_t &) noexcept {
+  free(p);
+}
+
+/// The size of the dataset in pixels
+static const int cDatasetSize = 1025;
+
+/**
+ * Create a dataset in memory covering 1 degree with hills of heights
+ *
+ * The dataset is in EPSG:4326 so that tiling it in the geodetic grid doesn't
+ * reproject it and tiling it in the mercator grid does.
+ */
+static GDALDataset *
+createDataset() {
+  GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+  if (poDriver == NULL) {
+    throw CTBException("The MEM driver is not available");
+  }
+
+  GDALDataset *poDataset = poDriver->Create("", cDatasetSize, cDatasetSize, 1, GDT_Float32, NULL);
+  if (poDataset == NULL) {
+    throw CTBException("Could not create the dataset");
+  }
+
+  double adfGeoTransform[6] = {
+    -1.0, 1.0 / cDatasetSize, 0,
+    51.5, 0, -1.0 / cDatasetSize
+  };
+  poDataset->SetGeoTransform(adfGeoTransform);
+
+  OGRSpatialReference srs;
+  char *wkt = NULL;
+  srs.importFromEPSG(4326);
+  srs.exportToWkt(&wkt);
+  poDataset->SetProjection(wkt);
+  CPLFree(wkt);
+
+  vector<float> heights((size_t) cDatasetSize * cDatasetSize);
+  for (int row = 0; row < cDatasetSize; ++row) {
+    for (int col = 0; col < cDatasetSize; ++col) {
+      heights[(size_t) row * cDatasetSize + col] =
+        (float) (500 + 400 * sin(col / 37.0) * cos(row / 53.0));
+    }
+  }
+
+  if (poDataset->GetRasterBand(1)->RasterIO(GF_Write, 0, 0, cDatasetSize, cDatasetSize,
+                                            heights.data(), cDatasetSize, cDatasetSize,
+                                            GDT_Float32, 0, 0) != CE_None) {
+    GDALClose(poDataset);
+    throw CTBException("Could not write the heights to the dataset");
+  }
+
+  return poDataset;
+}
+
+/// Create a diamond cutline touching the middle of each side of the bounds
+static shared_ptr<const Cutline>
+createCutline(const CRSBounds &bounds) {
+  const double midX = (bounds.getMinX() + bounds.getMaxX()) / 2,
+    midY = (bounds.getMinY() + bounds.getMaxY()) / 2;
+  Cutline::Ring ring;
+
+  ring.push_back(CRSPoint(midX, bounds.getMinY()));
+  ring.push_back(CRSPoint(bounds.getMaxX(), midY));
+  ring.push_back(CRSPoint(midX, bounds.getMaxY()));
+  ring.push_back(CRSPoint(bounds.getMinX(), midY));
+
+  return make_shared<const Cutline>(vector<Cutline::Ring>(1, ring));
+}
+
+/**
+ * Create, encode and name every tile at the maximum zoom twice, returning the
+ * number of allocations made the second time
+ */
+static size_t
+countAllocations(TerrainTiler &tiler, DirectoryTileStore &store) {
+  const i_zoom zoom = tiler.maxZoomLevel();
+  const TileBounds bounds = tiler.tileBoundsForZoom(zoom);
+  vector<TileCoordinate> coords;
+
+  for (i_tile y = bounds.getMinY(); y <= bounds.getMaxY(); ++y) {
+    for (i_tile x = bounds.getMinX(); x <= bounds.getMaxX(); ++x) {
+      coords.push_back(TileCoordinate(zoom, x, y));
+    }
+  }
+
+  TerrainTile tile(coords.front());
+  vector<unsigned char> encoded;
+  string filename;
+
+  for (int pass = 0; pass < 2; ++pass) {
+    allocations = 0;
+    counting = (pass == 1);
+
+    for (const TileCoordinate &coord: coords) {
+      tiler.createTerrainTile(coord, tile);
+      tile.encode(encoded);
+      store.createTileFilename(coord, filename);
+    }
+
+    counting = false;
+  }
+
+  cout << coords.size() << " tiles: ";
+  return allocations;
+}
+
+int
+main() {
+  GDALAllRegister();
+
+  const boost::filesystem::path directory =
+    boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  int failures = 0;
+
+  try {
+    DirectoryTileStore store(directory.string(), "terrain", true);
+    GDALDataset *poDataset = createDataset();
+    const GlobalGeodetic geodetic(65);
+    const GlobalMercator spherical(65);
+
+    for (int mercator = 0; mercator < 2; ++mercator) {
+      for (int cutline = 0; cutline < 2; ++cutline) {
+        TerrainTiler tiler(poDataset, mercator ? (const Grid &) spherical : (const Grid &) geodetic);
+        if (cutline) {
+          tiler.setCutline(createCutline(tiler.bounds()));
+        }
+
+        cout << (mercator ? "Mercator" : "Geodetic")
+             << (cutline ? " with a cutline, " : ", ");
+        const size_t count = countAllocations(tiler, store);
+        cout << count << " allocations" << endl;
+
+        failures += (count != 0);
+      }
+    }
+
+    GDALClose(poDataset);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    failures++;
+  }
+
+  boost::filesystem::remove_all(directory);
+
+  return failures ? 1 : 0;
+}
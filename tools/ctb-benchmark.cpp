@@ -0,0 +1,446 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file ctb-benchmark.cpp
+ * @brief Compare and time the alternative ways the library does things
+ *
+ * This tool runs a benchmark named on the command line:
+ *
+ * - `warp` creates terrain tiles from a GDAL dataset by warping the heights
+ *   directly into each tile and by reading them from a warped VRT, checking
+ *   that both give the same heights and timing each.
+ * - `transform` transforms points over a GDAL dataset in EPSG:4326 or
+ *   EPSG:3857 to the other with the `GeodeticMercatorTransformer` and with the
+ *   GDAL transformer, timing each and checking they agree.
+ * - `query` queries the heights at points in a directory of terrain tiles
+ *   with a `TerrainDataset`, timing the queries with and without the tiles
+ *   cached.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>             // for atoi
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cpl_string.h"
+#include "gdal_alg.h"
+#include "gdal_priv.h"
+#include "ogr_spatialref.h"
+#include "commander.hpp"        // for cli parsing
+
+#include "config.hpp"
+#include "CTBException.hpp"
+#include "GeodeticMercatorTransformer.hpp"
+#include "GlobalGeodetic.hpp"
+#include "GlobalMercator.hpp"
+#include "TerrainDataset.hpp"
+#include "TerrainTiler.hpp"
+
+using namespace std;
+using namespace ctb;
+
+/// Handle the benchmark CLI options
+class TerrainBenchmark : public Command {
+public:
+  TerrainBenchmark(const char *name, const char *version) :
+    Command(name, version),
+    profile("geodetic"),
+    zoom(-1),
+    count(-1),
+    tolerance(0)
+  {}
+
+  void
+  check() const {
+    switch(command->argc) {
+    case 2:
+      return;
+    case 0:
+    case 1:
+      cerr << "  Error: The benchmark and its target must be specified" << endl;
+      break;
+    default:
+      cerr << "  Error: Only two command line arguments must be specified" << endl;
+      break;
+    }
+
+    help();                   // print help and exit
+  }
+
+  static void
+  setProfile(command_t *command) {
+    static_cast<TerrainBenchmark *>(Command::self(command))->profile = command->arg;
+  }
+
+  static void
+  setZoom(command_t *command) {
+    static_cast<TerrainBenchmark *>(Command::self(command))->zoom = atoi(command->arg);
+  }
+
+  static void
+  setCount(command_t *command) {
+    static_cast<TerrainBenchmark *>(Command::self(command))->count = atoi(command->arg);
+  }
+
+  static void
+  setTolerance(command_t *command) {
+    static_cast<TerrainBenchmark *>(Command::self(command))->tolerance = atof(command->arg);
+  }
+
+  const char *
+  getBenchmark() const {
+    return command->argv[0];
+  }
+
+  const char *
+  getTarget() const {
+    return command->argv[1];
+  }
+
+  const char *profile;
+
+  int zoom,
+    count;
+
+  double tolerance;
+};
+
+/// Get the seconds taken to call a function
+template <typename Function> static double
+timeCall(Function function) {
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  function();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/// Report the time taken to do something a number of times
+static void
+reportTime(const char *name, size_t count, const char *unit, double seconds) {
+  cout << name << ": " << count << ' ' << unit << " in " << seconds << " s ("
+       << (seconds * 1e6 / max<size_t>(count, 1)) << " us each)" << endl;
+}
+
+/// Get the number of things to do, or a default if it wasn't given
+static size_t
+getCount(const TerrainBenchmark &command, size_t defaultCount) {
+  return (command.count < 0) ? defaultCount : (size_t) command.count;
+}
+
+/**
+ * Compare warping terrain heights directly with reading a warped VRT
+ *
+ * The first `count` tiles at the zoom level are created in rows from the
+ * south west.  An untimed pass over the tiles first fills the GDAL block
+ * cache, so neither timed pass pays for reading the source.  The heights are
+ * compared once quantised as they are stored in terrain tiles, so the
+ * difference is reported in steps of 0.2 metres.
+ */
+static int
+benchmarkWarp(const TerrainBenchmark &command, const Grid &grid) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(command.getTarget(), GA_ReadOnly);
+  if (poDataset == NULL) {
+    cerr << "Error: Could not open the GDAL dataset: " << command.getTarget() << endl;
+    return 1;
+  }
+
+  TilerOptions vrtOptions;
+  vrtOptions.useWarpedVRT = true;
+  const TerrainTiler direct(poDataset, grid, TilerOptions()),
+    vrt(poDataset, grid, vrtOptions);
+
+  const i_zoom zoom = (command.zoom >= 0) ? (i_zoom) command.zoom : direct.maxZoomLevel();
+  const TileBounds bounds = direct.tileBoundsForZoom(zoom);
+  const size_t count = getCount(command, 1000);
+  vector<TileCoordinate> coords;
+
+  for (i_tile y = bounds.getMinY(); y <= bounds.getMaxY() && coords.size() < count; ++y) {
+    for (i_tile x = bounds.getMinX(); x <= bounds.getMaxX() && coords.size() < count; ++x) {
+      coords.push_back(TileCoordinate(zoom, x, y));
+    }
+  }
+
+  if (coords.empty()) {
+    cerr << "Error: There are no tiles to create" << endl;
+    GDALClose(poDataset);
+    return 1;
+  }
+
+  // Create every tile with a tiler, keeping the heights
+  TerrainTile tile(coords.front());
+  const auto createTiles = [&](const TerrainTiler &tiler, vector<i_terrain_height> &heights) {
+    heights.clear();
+    for (const TileCoordinate &coord: coords) {
+      tiler.createTerrainTile(coord, tile);
+      heights.insert(heights.end(), tile.getHeights().begin(), tile.getHeights().end());
+    }
+  };
+
+  vector<i_terrain_height> directHeights, vrtHeights;
+  double directSeconds, vrtSeconds;
+
+  try {
+    createTiles(direct, directHeights);
+    directSeconds = timeCall([&] { createTiles(direct, directHeights); });
+    vrtSeconds = timeCall([&] { createTiles(vrt, vrtHeights); });
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    GDALClose(poDataset);
+    return 1;
+  }
+
+  GDALClose(poDataset);
+
+  size_t differences = 0;
+  int maxDifference = 0;
+  for (size_t i = 0; i < directHeights.size(); ++i) {
+    const int difference = abs((int) directHeights[i] - (int) vrtHeights[i]);
+    differences += (difference != 0);
+    maxDifference = max(maxDifference, difference);
+  }
+
+  reportTime("Direct warp", coords.size(), "tiles", directSeconds);
+  reportTime("Warped VRT ", coords.size(), "tiles", vrtSeconds);
+  cout << "Speed up:    " << (vrtSeconds / directSeconds) << "x" << endl
+       << "Differences: " << differences << " of " << directHeights.size()
+       << " heights, by at most " << (maxDifference / 5.0) << " m" << endl;
+
+  return (maxDifference / 5.0 > command.tolerance) ? 1 : 0;
+}
+
+/// The number of points passed to a transformer at once, about a warp chunk row
+static const int cTransformBatch = 1024;
+
+/**
+ * Compare the analytic transformer with the GDAL transformer
+ *
+ * Random pixel/line coordinates spread over the dataset are transformed to
+ * georeferenced coordinates in the other SRS, which is what a warp asks of a
+ * transformer.  Points are passed in batches, as a warp does, and each batch
+ * is copied into scratch arrays before being transformed in place.
+ */
+static int
+benchmarkTransform(const TerrainBenchmark &command) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(command.getTarget(), GA_ReadOnly);
+  if (poDataset == NULL) {
+    cerr << "Error: Could not open the GDAL dataset: " << command.getTarget() << endl;
+    return 1;
+  }
+
+  const GDALDatasetH hDS = (GDALDatasetH) poDataset;
+  OGRSpatialReference srcSRS(poDataset->GetProjectionRef()), geodeticSRS, mercatorSRS;
+  geodeticSRS.importFromEPSG(4326);
+  mercatorSRS.importFromEPSG(3857);
+
+  const bool srcIsGeodetic = srcSRS.IsSame(&geodeticSRS);
+  const OGRSpatialReference &dstSRS = srcIsGeodetic ? mercatorSRS : geodeticSRS;
+  if (!GeodeticMercatorTransformer::supports(srcSRS, dstSRS)) {
+    cerr << "Error: The dataset must be in EPSG:4326 or EPSG:3857: " << command.getTarget() << endl;
+    GDALClose(poDataset);
+    return 1;
+  }
+
+  char *pszDstWKT = NULL;
+  dstSRS.exportToWkt(&pszDstWKT);
+  CPLStringList transformOptions;
+  transformOptions.SetNameValue("SRC_SRS", poDataset->GetProjectionRef());
+  transformOptions.SetNameValue("DST_SRS", pszDstWKT);
+  CPLFree(pszDstWKT);
+
+  void *analyticArg = GeodeticMercatorTransformer::create(hDS, srcIsGeodetic);
+  void *gdalArg = GDALCreateGenImgProjTransformer2(hDS, NULL, transformOptions.List());
+  if (analyticArg == NULL || gdalArg == NULL) {
+    cerr << "Error: Could not create the transformers" << endl;
+    if (analyticArg != NULL) GeodeticMercatorTransformer::destroy(analyticArg);
+    if (gdalArg != NULL) GDALDestroyGenImgProjTransformer(gdalArg);
+    GDALClose(poDataset);
+    return 1;
+  }
+
+  const int nXSize = poDataset->GetRasterXSize(), nYSize = poDataset->GetRasterYSize();
+  const size_t count = getCount(command, 1000000);
+  vector<double> pointsX(count), pointsY(count);
+  mt19937 random(1);
+  uniform_real_distribution<double> columns(0, nXSize), rows(0, nYSize);
+  for (size_t i = 0; i < count; ++i) {
+    pointsX[i] = columns(random);
+    pointsY[i] = rows(random);
+  }
+
+  // Transform every point in batches with a transformer
+  vector<double> x(cTransformBatch), y(cTransformBatch), z(cTransformBatch);
+  vector<int> success(cTransformBatch);
+  const auto transformPoints = [&](GDALTransformerFunc pfnTransformer, void *pTransformerArg) {
+    for (size_t start = 0; start < count; start += cTransformBatch) {
+      const int nPointCount = (int) min<size_t>(cTransformBatch, count - start);
+      copy(pointsX.begin() + start, pointsX.begin() + start + nPointCount, x.begin());
+      copy(pointsY.begin() + start, pointsY.begin() + start + nPointCount, y.begin());
+      fill(z.begin(), z.begin() + nPointCount, 0.0);
+      pfnTransformer(pTransformerArg, FALSE, nPointCount, &x[0], &y[0], &z[0], &success[0]);
+    }
+  };
+
+  const double analyticSeconds = timeCall([&] {
+      transformPoints(GeodeticMercatorTransformer::transform, analyticArg);
+    });
+  const double gdalSeconds = timeCall([&] {
+      transformPoints(GDALGenImgProjTransform, gdalArg);
+    });
+  const double error = GeodeticMercatorTransformer::maxError(analyticArg, GDALGenImgProjTransform, gdalArg,
+                                                             nXSize, nYSize);
+  const double bound = srcIsGeodetic
+    ? GeodeticMercatorTransformer::MAX_METRES_ERROR
+    : GeodeticMercatorTransformer::MAX_DEGREES_ERROR;
+
+  GeodeticMercatorTransformer::destroy(analyticArg);
+  GDALDestroyGenImgProjTransformer(gdalArg);
+  GDALClose(poDataset);
+
+  reportTime("Analytic transformer", count, "points", analyticSeconds);
+  reportTime("GDAL transformer    ", count, "points", gdalSeconds);
+  cout << "Speed up:             " << (gdalSeconds / analyticSeconds) << "x" << endl
+       << "Largest difference:   " << error << (srcIsGeodetic ? " m" : " degrees")
+       << " (the bound is " << bound << ")" << endl;
+
+  return (error <= bound) ? 0 : 1;
+}
+
+/**
+ * Time querying heights in a directory of terrain tiles
+ *
+ * Random points spread over the tiles at the zoom level are queried in one
+ * batch with `getHeights`, first with an empty cache, so each tile touched is
+ * read and decoded, and then again with the tiles cached.  They are then
+ * queried one at a time with `getHeight`.  Points are only cached throughout
+ * if the tiles touched fit in the cache.
+ */
+static int
+benchmarkQuery(const TerrainBenchmark &command) {
+  unique_ptr<TerrainDataset> dataset;
+  try {
+    dataset.reset(new TerrainDataset(command.getTarget()));
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << command.getTarget() << endl;
+    return 1;
+  }
+
+  const int level = (command.zoom < 0) ? dataset->getMaxLevel() : command.zoom;
+  if (!dataset->hasLevel(level)) {
+    cerr << "Error: There are no tiles at zoom level " << level << endl;
+    return 1;
+  }
+
+  // The extent of the tiles at the level in degrees
+  const GlobalGeodetic grid(65);
+  const CRSBounds sw = grid.tileBounds(TileCoordinate(level, dataset->getMinX(level), dataset->getMinY(level))),
+    ne = grid.tileBounds(TileCoordinate(level, dataset->getMaxX(level), dataset->getMaxY(level)));
+
+  const size_t count = getCount(command, 1000000);
+  vector<CRSPoint> points(count);
+  mt19937 random(1);
+  uniform_real_distribution<double> longitudes(sw.getMinX(), ne.getMaxX()),
+    latitudes(sw.getMinY(), ne.getMaxY());
+  for (size_t i = 0; i < count; ++i) {
+    points[i].x = longitudes(random);
+    points[i].y = latitudes(random);
+  }
+
+  vector<double> heights, single(count);
+  double coldSeconds, warmSeconds, singleSeconds;
+  try {
+    coldSeconds = timeCall([&] {
+        dataset->getHeights(points, heights, level);
+      });
+    warmSeconds = timeCall([&] {
+        dataset->getHeights(points, heights, level);
+      });
+    singleSeconds = timeCall([&] {
+        for (size_t i = 0; i < count; ++i) {
+          single[i] = dataset->getHeight(points[i].x, points[i].y, level);
+        }
+      });
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+
+  // Both ways of querying must give the same heights
+  size_t missing = 0, differing = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (isnan(heights[i])) {
+      ++missing;
+      differing += !isnan(single[i]);
+    } else {
+      differing += (heights[i] != single[i]);
+    }
+  }
+
+  reportTime("Batch, reading tiles", count, "points", coldSeconds);
+  reportTime("Batch, cached tiles ", count, "points", warmSeconds);
+  reportTime("One at a time       ", count, "points", singleSeconds);
+  cout << "Points per second:    " << (count / warmSeconds) << " in batches, "
+       << (count / singleSeconds) << " one at a time" << endl
+       << "Points without terrain: " << missing << endl
+       << "Points differing:       " << differing << endl;
+
+  return differing ? 1 : 0;
+}
+
+int
+main(int argc, char *argv[]) {
+  // Specify the command line interface
+  TerrainBenchmark command(argv[0], version.cstr);
+  command.setUsage("[options] warp|transform GDAL_DATASET | query TILE_DIRECTORY");
+  command.option("-p", "--profile <profile>", "specify the TMS profile of the tiles. This is either `geodetic` (the default) or `mercator`", TerrainBenchmark::setProfile);
+  command.option("-z", "--zoom <zoom>", "specify the zoom level of the tiles created or queried. Defaults to the maximum zoom of the dataset", TerrainBenchmark::setZoom);
+  command.option("-n", "--count <count>", "specify the number of tiles created by `warp` (defaults to 1000) or points transformed by `transform` or queried by `query` (defaults to 1000000)", TerrainBenchmark::setCount);
+  command.option("-t", "--tolerance <metres>", "specify the largest difference in height between the two ways of warping which passes (defaults to 0)", TerrainBenchmark::setTolerance);
+
+  // Parse and check the arguments
+  command.parse(argc, argv);
+  command.check();
+
+  // Define the grid the tiles belong to
+  Grid grid;
+  if (strcmp(command.profile, "geodetic") == 0) {
+    grid = GlobalGeodetic(65);
+  } else if (strcmp(command.profile, "mercator") == 0) {
+    grid = GlobalMercator(65);
+  } else {
+    cerr << "Error: Unknown profile: " << command.profile << endl;
+    return 1;
+  }
+
+  GDALAllRegister();
+
+  if (strcmp(command.getBenchmark(), "warp") == 0) {
+    return benchmarkWarp(command, grid);
+  } else if (strcmp(command.getBenchmark(), "transform") == 0) {
+    return benchmarkTransform(command);
+  } else if (strcmp(command.getBenchmark(), "query") == 0) {
+    return benchmarkQuery(command);
+  }
+
+  cerr << "Error: Unknown benchmark: " << command.getBenchmark() << endl;
+  return 1;
+}
@@ -33,6 +33,7 @@
 #include "config.hpp"
 #include "CTBException.hpp"
 #include "TerrainTile.hpp"
+#include "TileStore.hpp"
 #include "GlobalGeodetic.hpp"
 
 using namespace std;
@@ -151,7 +152,7 @@ main(int argc, char *argv[]) {
   TerrainExport command = TerrainExport(argv[0], version.cstr);
 
   command.setUsage("-i TERRAIN_FILE -z ZOOM_LEVEL -x TILE_X -y TILE_Y -o OUTPUT_FILE ");
-  command.option("-i", "--input-filename <filename>", "the terrain tile file to convert", TerrainExport::setInputFilename);
+  command.option("-i", "--input-filename <filename>", "the terrain tile file to convert, or an MBTiles file or tile pack containing the tile", TerrainExport::setInputFilename);
   command.option("-z", "--zoom-level <int>", "the zoom level represented by the tile", TerrainExport::setZoomLevel);
   command.option("-x", "--tile-x <int>", "the tile x coordinate", TerrainExport::setTileX);
   command.option("-y", "--tile-y <int>", "the tile y coordinate", TerrainExport::setTileY);
@@ -167,9 +168,19 @@ main(int argc, char *argv[]) {
   const TileCoordinate coord(command.zoom, command.tx, command.ty);
   TerrainTile terrain(coord);
 
-  // Read the data into the tile from the filesystem
+  // Read the data into the tile from the filesystem or a tile container
   try {
-    terrain.readFile(command.inputFilename);
+    if (TileStore::isContainer(command.inputFilename)) {
+      const std::unique_ptr<TileStore> store = TileStore::open(command.inputFilename, "terrain", false);
+      std::vector<unsigned char> data;
+
+      if (!store->readTile(coord, data)) {
+        throw CTBException("The tile does not exist in the container");
+      }
+      terrain.decode(data.data(), data.size(), TileCodec::recorded(command.inputFilename));
+    } else {
+      terrain.readFile(command.inputFilename);
+    }
   } catch (CTBException &e) {
     cerr << "Error: " << e.what() << endl;
   }
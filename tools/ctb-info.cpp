@@ -23,6 +23,7 @@
  */
 
 #include <iostream>
+#include <stdlib.h>             // for atoi
 
 #include "gdal_priv.h"
 #include "commander.hpp"
@@ -30,6 +31,7 @@
 #include "config.hpp"
 #include "CTBException.hpp"
 #include "TerrainTile.hpp"
+#include "TileStore.hpp"
 
 using namespace std;
 using namespace ctb;
@@ -41,13 +43,20 @@ public:
     Command(name, version),
     mShowHeights(false),
     mShowChildren(true),
-    mShowType(true)
+    mShowType(true),
+    mZoom(-1),
+    mTileX(-1),
+    mTileY(-1)
   {}
 
   void
   check() const {
     switch(command->argc) {
     case 1:
+      if (isContainer() && (mZoom < 0 || mTileX < 0 || mTileY < 0)) {
+        cerr << "  Error: The tile coordinate must be specified for tile containers" << endl;
+        break;
+      }
       return;
     case 0:
       cerr << "  Error: The terrain file must be specified" << endl;
@@ -75,24 +84,51 @@ public:
     static_cast<TerrainInfo *>(Command::self(command))->mShowType = false;
   }
 
+  static void
+  setZoomLevel(command_t *command) {
+    static_cast<TerrainInfo *>(Command::self(command))->mZoom = atoi(command->arg);
+  }
+
+  static void
+  setTileX(command_t *command) {
+    static_cast<TerrainInfo *>(Command::self(command))->mTileX = atoi(command->arg);
+  }
+
+  static void
+  setTileY(command_t *command) {
+    static_cast<TerrainInfo *>(Command::self(command))->mTileY = atoi(command->arg);
+  }
+
   const char *
   getInputFilename() const {
     return  (command->argc == 1) ? command->argv[0] : NULL;
   }
 
+  /// Is the input a container of many tiles rather than a single tile?
+  bool
+  isContainer() const {
+    return TileStore::isContainer(getInputFilename());
+  }
+
   bool mShowHeights;
   bool mShowChildren;
   bool mShowType;
+  int mZoom;
+  int mTileX;
+  int mTileY;
 };
 
 int
 main(int argc, char *argv[]) {
   // Set up the command interface
   TerrainInfo command = TerrainInfo(argv[0], version.cstr);
-  command.setUsage("[options] TERRAIN_FILE");
+  command.setUsage("[options] TERRAIN_FILE|TILE_CONTAINER");
   command.option("-e", "--show-heights", "show the height information as an ASCII raster", TerrainInfo::showHeights);
   command.option("-c", "--no-child", "hide information about child tiles", TerrainInfo::hideChildInfo);
   command.option("-t", "--no-type", "hide information about the tile type (i.e. water/land)", TerrainInfo::hideType);
+  command.option("-z", "--zoom-level <int>", "the zoom level of the tile to read from an MBTiles file or tile pack", TerrainInfo::setZoomLevel);
+  command.option("-x", "--tile-x <int>", "the x coordinate of the tile to read from an MBTiles file or tile pack", TerrainInfo::setTileX);
+  command.option("-y", "--tile-y <int>", "the y coordinate of the tile to read from an MBTiles file or tile pack", TerrainInfo::setTileY);
 
   // Parse and check the arguments
   command.parse(argc, argv);
@@ -100,10 +136,21 @@ main(int argc, char *argv[]) {
 
   GDALAllRegister();
 
-  // Read the terrain data from the filesystem
+  // Read the terrain data from the filesystem or a tile container
   Terrain terrain;
   try {
-    terrain = Terrain(command.getInputFilename());
+    if (command.isContainer()) {
+      const TileCoordinate coord(command.mZoom, command.mTileX, command.mTileY);
+      const std::unique_ptr<TileStore> store = TileStore::open(command.getInputFilename(), "terrain", false);
+      std::vector<unsigned char> data;
+
+      if (!store->readTile(coord, data)) {
+        throw CTBException("The tile does not exist in the container");
+      }
+      terrain.decode(data.data(), data.size(), TileCodec::recorded(command.getInputFilename()));
+    } else {
+      terrain = Terrain(command.getInputFilename());
+    }
   } catch (CTBException &e) {
     cerr << "Error: " << e.what() << endl;
     return 1;
@@ -0,0 +1,719 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file ctb-loadtest.cpp
+ * @brief Measure the throughput and latency of serving terrain tiles
+ *
+ * This tool requests terrain tiles as fast as possible using a number of
+ * concurrent connections and reports the throughput and latency
+ * percentiles.  The tiles requested are either replayed from an access log
+ * or follow synthetic camera flights, which zoom in to a random point, pan
+ * around and zoom out again as a user viewing the terrain would.
+ *
+ * Tiles are requested from a tile server over HTTP or, with no network
+ * involved, read directly from a tileset or created on demand from a GDAL
+ * dataset using the library.
+ */
+
+#include <math.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>             // for atoi
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gdal_priv.h"
+#include "commander.hpp"        // for cli parsing
+
+#include "config.hpp"
+#include "CTBException.hpp"
+#include "GlobalGeodetic.hpp"
+#include "GlobalMercator.hpp"
+#include "LatencyHistogram.hpp"
+#include "OnDemandTiler.hpp"
+#include "TileCodec.hpp"
+#include "TilePriority.hpp"
+#include "TileStore.hpp"
+
+using namespace std;
+using namespace ctb;
+
+/// Handle the load test CLI options
+class TerrainLoadTest : public Command {
+public:
+  TerrainLoadTest(const char *name, const char *version) :
+    Command(name, version),
+    logFilename(NULL),
+    writeFilename(NULL),
+    bounds(NULL),
+    profile("geodetic"),
+    requestCount(10000),
+    maxZoom(-1),
+    seed(1),
+    connections(8),
+    cacheSize(256),
+    generate(false),
+    verbosity(1)
+  {}
+
+  void
+  check() const {
+    switch(command->argc) {
+    case 1:
+      return;
+    case 0:
+      cerr << "  Error: The target must be specified" << endl;
+      break;
+    default:
+      cerr << "  Error: Only one command line argument must be specified" << endl;
+      break;
+    }
+
+    help();                   // print help and exit
+  }
+
+  static void
+  setLogFilename(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->logFilename = command->arg;
+  }
+
+  static void
+  setWriteFilename(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->writeFilename = command->arg;
+  }
+
+  static void
+  setBounds(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->bounds = command->arg;
+  }
+
+  static void
+  setProfile(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->profile = command->arg;
+  }
+
+  static void
+  setRequestCount(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->requestCount = atoi(command->arg);
+  }
+
+  static void
+  setMaxZoom(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->maxZoom = atoi(command->arg);
+  }
+
+  static void
+  setSeed(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->seed = atoi(command->arg);
+  }
+
+  static void
+  setConnections(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->connections = atoi(command->arg);
+  }
+
+  static void
+  setCacheSize(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->cacheSize = atoi(command->arg);
+  }
+
+  static void
+  setGenerate(command_t *command) {
+    static_cast<TerrainLoadTest *>(Command::self(command))->generate = true;
+  }
+
+  static void
+  setQuiet(command_t *command) {
+    --(static_cast<TerrainLoadTest *>(Command::self(command))->verbosity);
+  }
+
+  static void
+  setVerbose(command_t *command) {
+    ++(static_cast<TerrainLoadTest *>(Command::self(command))->verbosity);
+  }
+
+  const char *
+  getTarget() const {
+    return (command->argc == 1) ? command->argv[0] : NULL;
+  }
+
+  const char *logFilename,
+    *writeFilename,
+    *bounds,
+    *profile;
+
+  int requestCount,
+    maxZoom,
+    seed,
+    connections,
+    cacheSize;
+
+  bool generate;
+
+  int verbosity;
+};
+
+/// The outcome of requesting a tile, using HTTP status codes
+enum Status {
+  STATUS_FAILED = 0,            ///< The request couldn't be made
+  STATUS_OK = 200,
+  STATUS_NOT_FOUND = 404
+};
+
+/// Something which tiles are requested from, used by one thread at a time
+class Client {
+public:
+
+  virtual ~Client() {}
+
+  /// Request a tile, setting the number of bytes received
+  virtual int
+  get(const TileCoordinate &coord, size_t &bytes) = 0;
+};
+
+/// Request tiles from a tile server over a persistent HTTP connection
+class HttpClient : public Client {
+public:
+
+  /// Connect to a URL such as `http://localhost:8000/terrain`
+  HttpClient(const string &url):
+    mFd(-1)
+  {
+    const string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) {
+      throw CTBException("Only http:// URLs are supported");
+    }
+
+    const size_t hostEnd = url.find('/', scheme.size());
+    const string authority = url.substr(scheme.size(), hostEnd - scheme.size());
+    const size_t colon = authority.rfind(':');
+
+    mHost = authority.substr(0, colon);
+    mPort = (colon == string::npos) ? "80" : authority.substr(colon + 1);
+    mPrefix = (hostEnd == string::npos) ? "" : url.substr(hostEnd);
+
+    while (!mPrefix.empty() && mPrefix[mPrefix.size() - 1] == '/') {
+      mPrefix.erase(mPrefix.size() - 1);
+    }
+  }
+
+  ~HttpClient() {
+    disconnect();
+  }
+
+  int
+  get(const TileCoordinate &coord, size_t &bytes) override {
+    bytes = 0;
+
+    // Reconnect once if a kept alive connection has been closed
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      const bool reused = (mFd >= 0);
+      if (!reused && !connect()) {
+        return STATUS_FAILED;
+      }
+
+      const int status = request(coord, bytes);
+      if (status != STATUS_FAILED || !reused) {
+        return status;
+      }
+    }
+
+    return STATUS_FAILED;
+  }
+
+private:
+
+  /// Open a connection to the server
+  bool
+  connect() {
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &addresses) != 0) {
+      return false;
+    }
+
+    for (struct addrinfo *ai = addresses; ai != NULL && mFd < 0; ai = ai->ai_next) {
+      mFd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (mFd >= 0 && ::connect(mFd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        close(mFd);
+        mFd = -1;
+      }
+    }
+
+    freeaddrinfo(addresses);
+
+    if (mFd < 0) {
+      return false;
+    }
+
+    const int on = 1;
+    setsockopt(mFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    mBuffer.clear();
+    return true;
+  }
+
+  void
+  disconnect() {
+    if (mFd >= 0) {
+      close(mFd);
+      mFd = -1;
+    }
+  }
+
+  /// Receive more data into the buffer, returning `false` if the connection closed
+  bool
+  receive() {
+    char buffer[16384];
+    const ssize_t length = recv(mFd, buffer, sizeof(buffer), 0);
+
+    if (length <= 0) {
+      return false;
+    }
+
+    mBuffer.append(buffer, (size_t) length);
+    return true;
+  }
+
+  /// Send a request and read the response on the current connection
+  int
+  request(const TileCoordinate &coord, size_t &bytes) {
+    ostringstream stream;
+    stream << "GET " << mPrefix << "/" << coord.zoom << "/" << coord.x << "/" << coord.y << ".terrain HTTP/1.1\r\n"
+           << "Host: " << mHost << "\r\n"
+           << "Accept-Encoding: gzip\r\n\r\n";
+    const string request = stream.str();
+
+    if (send(mFd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t) request.size()) {
+      disconnect();
+      return STATUS_FAILED;
+    }
+
+    size_t headerEnd;
+    while ((headerEnd = mBuffer.find("\r\n\r\n")) == string::npos) {
+      if (!receive()) {
+        disconnect();
+        return STATUS_FAILED;
+      }
+    }
+
+    string header = mBuffer.substr(0, headerEnd + 2);
+    mBuffer.erase(0, headerEnd + 4);
+
+    for (char &c: header) {
+      c = (char) tolower(c);
+    }
+
+    int status = 0;
+    if (sscanf(header.c_str(), "http/1.%*d %d", &status) != 1) {
+      disconnect();
+      return STATUS_FAILED;
+    }
+
+    const size_t length = header.find("\r\ncontent-length:");
+    const size_t contentLength = (length == string::npos) ? 0 : strtoul(header.c_str() + length + 17, NULL, 10);
+
+    while (mBuffer.size() < contentLength) {
+      if (!receive()) {
+        disconnect();
+        return STATUS_FAILED;
+      }
+    }
+
+    mBuffer.erase(0, contentLength);
+    bytes = contentLength;
+
+    if (header.find("\r\nconnection: close") != string::npos) {
+      disconnect();
+    }
+
+    return status;
+  }
+
+  string mHost, mPort, mPrefix;
+  int mFd;
+  string mBuffer;               ///< Data received but not yet read
+};
+
+/// Read tiles directly from a tileset
+class StoreClient : public Client {
+public:
+
+  StoreClient(const TileStore &store):
+    mStore(store)
+  {}
+
+  int
+  get(const TileCoordinate &coord, size_t &bytes) override {
+    if (!mStore.readTile(coord, mData)) {
+      bytes = 0;
+      return STATUS_NOT_FOUND;
+    }
+
+    bytes = mData.size();
+    return STATUS_OK;
+  }
+
+private:
+
+  const TileStore &mStore;
+  vector<unsigned char> mData;  ///< Reused for every tile
+};
+
+/// Create tiles on demand from a GDAL dataset
+class TilerClient : public Client {
+public:
+
+  TilerClient(OnDemandTiler &tiler):
+    mTiler(tiler)
+  {}
+
+  int
+  get(const TileCoordinate &coord, size_t &bytes) override {
+    OnDemandTiler::Data data = mTiler.getTile(coord);
+    bytes = data ? data->size() : 0;
+    return data ? STATUS_OK : STATUS_NOT_FOUND;
+  }
+
+private:
+
+  OnDemandTiler &mTiler;
+};
+
+/// Read the tiles requested in an access log
+static vector<TileCoordinate>
+readLog(const char *filename) {
+  ifstream log(filename);
+  if (!log) {
+    throw CTBException("Could not open the log file");
+  }
+
+  vector<TileCoordinate> requests;
+  string line;
+  TileCoordinate coord;
+
+  while (getline(log, line)) {
+    if (TilePriority::parseLogLine(line, coord)) {
+      requests.push_back(coord);
+    }
+  }
+
+  return requests;
+}
+
+/**
+ * Create the tiles requested by synthetic camera flights
+ *
+ * Each flight starts at a random point within the bounds, zooms in one level
+ * at a time to the maximum zoom, pans in a meandering direction and then
+ * zooms out again.  At each step the tiles in view are requested: these are
+ * the tiles around the one below the camera.  The camera moves half a tile
+ * width per step when panning, using the tile bounds from the grid.
+ */
+static vector<TileCoordinate>
+flyCamera(const Grid &grid, const CRSBounds &bounds, i_zoom maxZoom, size_t count, unsigned int seed) {
+  static const int cViewWidth = 2, // tiles either side of the centre
+    cViewHeight = 1,               // tiles above and below the centre
+    cPanSteps = 32;                // steps spent panning at the maximum zoom
+
+  mt19937 random(seed);
+  uniform_real_distribution<double> unit(0, 1);
+  normal_distribution<double> turn(0, 0.3);
+
+  vector<TileCoordinate> requests;
+  requests.reserve(count);
+
+  while (requests.size() < count) {
+    CRSPoint camera(bounds.getMinX() + unit(random) * bounds.getWidth(),
+                    bounds.getMinY() + unit(random) * bounds.getHeight());
+    double heading = unit(random) * 2 * M_PI;
+
+    // Zoom in, pan and then zoom out
+    const int steps = 2 * maxZoom + cPanSteps;
+    for (int step = 0; step <= steps && requests.size() < count; ++step) {
+      const i_zoom zoom = (step <= (int) maxZoom) ? step
+        : (step >= steps - (int) maxZoom) ? steps - step
+        : maxZoom;
+
+      const TileCoordinate centre = grid.crsToTile(camera, zoom);
+      const TileBounds extent = grid.getTileExtent(zoom);
+
+      for (int dy = -cViewHeight; dy <= cViewHeight; ++dy) {
+        for (int dx = -cViewWidth; dx <= cViewWidth; ++dx) {
+          const long x = (long) centre.x + dx, y = (long) centre.y + dy;
+
+          if (x >= (long) extent.getMinX() && x <= (long) extent.getMaxX()
+              && y >= (long) extent.getMinY() && y <= (long) extent.getMaxY()) {
+            requests.push_back(TileCoordinate(zoom, (i_tile) x, (i_tile) y));
+          }
+        }
+      }
+
+      // Pan at the maximum zoom, turning back when leaving the bounds
+      if (zoom == maxZoom) {
+        const double distance = grid.tileBounds(centre).getWidth() / 2;
+        CRSPoint next(camera.x + cos(heading) * distance, camera.y + sin(heading) * distance);
+
+        if (next.x < bounds.getMinX() || next.x > bounds.getMaxX()
+            || next.y < bounds.getMinY() || next.y > bounds.getMaxY()) {
+          heading += M_PI;
+        } else {
+          camera = next;
+        }
+
+        heading += turn(random);
+      }
+    }
+  }
+
+  requests.resize(count);
+  return requests;
+}
+
+/// The results of a load test
+struct Results {
+  Results():
+    ok(0),
+    notFound(0),
+    failed(0),
+    bytes(0)
+  {}
+
+  LatencyHistogram latency;     ///< Request times in microseconds
+  atomic<uint64_t> ok, notFound, failed, bytes;
+};
+
+/// Make requests with a client until there are none left
+static void
+runClient(Client &client, const vector<TileCoordinate> &requests, atomic<size_t> &next,
+          Results &results, int verbosity) {
+  size_t index;
+
+  while ((index = next++) < requests.size()) {
+    const TileCoordinate &coord = requests[index];
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t bytes = 0;
+    int status;
+
+    try {
+      status = client.get(coord, bytes);
+    } catch (CTBException &e) {
+      status = STATUS_FAILED;
+    }
+
+    results.latency.record(chrono::duration_cast<chrono::microseconds>
+                           (chrono::steady_clock::now() - start).count());
+    results.bytes += bytes;
+
+    if (status == STATUS_OK) {
+      results.ok++;
+    } else if (status == STATUS_NOT_FOUND) {
+      results.notFound++;
+    } else {
+      results.failed++;
+    }
+
+    if (verbosity > 1 && status != STATUS_OK) {
+      ostringstream stream;
+      stream << (status ? to_string(status) : string("failed"))
+             << " /" << coord.zoom << "/" << coord.x << "/" << coord.y << ".terrain\n";
+      cerr << stream.str() << flush;
+    }
+  }
+}
+
+/// Write the results of a load test
+static void
+report(const Results &results, size_t count, int connections, double seconds) {
+  const double milliseconds = 1000.0;
+  const LatencyHistogram &latency = results.latency;
+
+  cout << fixed << setprecision(2)
+       << "Requests:    " << count << " (" << results.ok << " ok, " << results.notFound << " not found, "
+       << results.failed << " failed) using " << connections << " connections\n"
+       << "Elapsed:     " << seconds << " s\n"
+       << "Throughput:  " << count / seconds << " requests/s, "
+       << results.bytes / seconds / (1024 * 1024) << " MB/s\n"
+       << "Latency:     mean " << latency.mean() / milliseconds
+       << " ms, p50 " << latency.percentile(0.5) / milliseconds
+       << " ms, p99 " << latency.percentile(0.99) / milliseconds
+       << " ms, p999 " << latency.percentile(0.999) / milliseconds
+       << " ms, max " << latency.max() / milliseconds << " ms" << endl;
+}
+
+int
+main(int argc, char *argv[]) {
+  // Specify the command line interface
+  TerrainLoadTest command(argv[0], version.cstr);
+  command.setUsage("[options] URL|TILESET|GDAL_DATASET");
+  command.option("-l", "--log <file>", "replay the tiles requested in an access log instead of flying a synthetic camera", TerrainLoadTest::setLogFilename);
+  command.option("-n", "--requests <count>", "specify the number of requests made by synthetic camera flights (defaults to 10000)", TerrainLoadTest::setRequestCount);
+  command.option("-b", "--bounds <minx,miny,maxx,maxy>", "specify the area camera flights start within, in the units of the profile. Defaults to the dataset extent with --generate or the whole world otherwise", TerrainLoadTest::setBounds);
+  command.option("-z", "--max-zoom <zoom>", "specify the zoom level camera flights zoom in to. Defaults to the maximum zoom of the dataset with --generate or 14 otherwise", TerrainLoadTest::setMaxZoom);
+  command.option("-s", "--seed <seed>", "specify the random seed for camera flights (defaults to 1)", TerrainLoadTest::setSeed);
+  command.option("-w", "--write-requests <file>", "write the tiles requested to a file which can be replayed using --log", TerrainLoadTest::setWriteFilename);
+  command.option("-c", "--connections <count>", "specify the number of concurrent connections or threads making requests (defaults to 8)", TerrainLoadTest::setConnections);
+  command.option("-p", "--profile <profile>", "specify the TMS profile of the tiles. This is either `geodetic` (the default) or `mercator`", TerrainLoadTest::setProfile);
+  command.option("-g", "--generate", "create tiles on demand from a GDAL dataset in this process instead of requesting them", TerrainLoadTest::setGenerate);
+  command.option("-M", "--cache-size <megabytes>", "specify the size of the memory cache of generated tiles (defaults to 256)", TerrainLoadTest::setCacheSize);
+  command.option("-q", "--quiet", "only output the results", TerrainLoadTest::setQuiet);
+  command.option("-v", "--verbose", "output requests which fail", TerrainLoadTest::setVerbose);
+
+  // Parse and check the arguments
+  command.parse(argc, argv);
+  command.check();
+
+  const string target = command.getTarget();
+  const int connections = max(command.connections, 1);
+
+  // Define the grid the tiles belong to
+  Grid grid;
+  if (strcmp(command.profile, "geodetic") == 0) {
+    grid = GlobalGeodetic(65);
+  } else if (strcmp(command.profile, "mercator") == 0) {
+    grid = GlobalMercator(65);
+  } else {
+    cerr << "Error: Unknown profile: " << command.profile << endl;
+    return 1;
+  }
+
+  // Open the target, creating a client for each connection
+  unique_ptr<TileStore> store;
+  unique_ptr<OnDemandTiler> tiler;
+  vector<unique_ptr<Client>> clients;
+
+  try {
+    for (int i = 0; i < connections; ++i) {
+      if (command.generate) {
+        if (!tiler) {
+          GDALAllRegister();
+          tiler.reset(new OnDemandTiler(target, grid, TilerOptions(), TileCodec::defaultCodec(),
+                                        (size_t) max(command.cacheSize, 0) * 1024 * 1024));
+        }
+        clients.emplace_back(new TilerClient(*tiler));
+      } else if (target.compare(0, 7, "http://") == 0) {
+        clients.emplace_back(new HttpClient(target));
+      } else {
+        if (!store) {
+          store = TileStore::open(target, "terrain", false);
+        }
+        clients.emplace_back(new StoreClient(*store));
+      }
+    }
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << target << endl;
+    return 1;
+  }
+
+  // Work out the tiles to request
+  vector<TileCoordinate> requests;
+
+  if (command.logFilename != NULL) {
+    try {
+      requests = readLog(command.logFilename);
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.logFilename << endl;
+      return 1;
+    }
+  } else {
+    CRSBounds bounds = grid.getExtent();
+    i_zoom maxZoom = 14;
+
+    // Fly over the tiles of the dataset at its maximum zoom
+    if (tiler) {
+      maxZoom = tiler->maxZoomLevel();
+      const TileBounds extent = tiler->tileBoundsForZoom(maxZoom);
+      bounds = CRSBounds(grid.tileBounds(TileCoordinate(maxZoom, extent.getLowerLeft())).getLowerLeft(),
+                         grid.tileBounds(TileCoordinate(maxZoom, extent.getUpperRight())).getUpperRight());
+    }
+
+    if (command.bounds != NULL) {
+      double minx, miny, maxx, maxy;
+      if (sscanf(command.bounds, "%lf,%lf,%lf,%lf", &minx, &miny, &maxx, &maxy) != 4
+          || minx >= maxx || miny >= maxy) {
+        cerr << "Error: The bounds must be in the form minx,miny,maxx,maxy: " << command.bounds << endl;
+        return 1;
+      }
+      bounds = CRSBounds(minx, miny, maxx, maxy);
+    }
+
+    if (command.maxZoom >= 0) {
+      maxZoom = (i_zoom) command.maxZoom;
+    }
+
+    requests = flyCamera(grid, bounds, maxZoom, (size_t) max(command.requestCount, 0), (unsigned int) command.seed);
+  }
+
+  if (requests.empty()) {
+    cerr << "Error: There are no tiles to request" << endl;
+    return 1;
+  }
+
+  if (command.writeFilename != NULL) {
+    ofstream output(command.writeFilename);
+    for (const auto &coord: requests) {
+      output << "/" << coord.zoom << "/" << coord.x << "/" << coord.y << ".terrain\n";
+    }
+
+    if (!output) {
+      cerr << "Error: Could not write the requests: " << command.writeFilename << endl;
+      return 1;
+    }
+  }
+
+  if (command.verbosity > 0) {
+    cerr << "Requesting " << requests.size() << " tiles from " << target << endl;
+  }
+
+  // Make the requests concurrently, each thread using its own client
+  Results results;
+  atomic<size_t> next(0);
+  vector<thread> threads;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  for (auto &client: clients) {
+    threads.push_back(thread(runClient, ref(*client), cref(requests), ref(next), ref(results), command.verbosity));
+  }
+
+  for (auto &thread: threads) {
+    thread.join();
+  }
+
+  const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  report(results, requests.size(), connections, seconds);
+
+  return results.failed ? 1 : 0;
+}
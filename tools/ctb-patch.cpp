@@ -3,26 +3,35 @@
  * @brief The terrain patch tool
  *
  * This tool takes a terrain directory and patch children switch on all tiles.
+ * The children present are looked up in the tile index of the terrain
+ * directory, and the tiles are patched in parallel.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 
+#include "cpl_multiproc.h"      // for CPLGetNumCPUs
 #include "gdal_priv.h"
 #include "commander.hpp"
 
 #include "config.hpp"
 #include "CTBException.hpp"
+#include "DirectoryTileStore.hpp"
+#include "LayerJson.hpp"
 #include "TerrainTile.hpp"
 #include "TerrainDataset.hpp"
-#include "GlobalGeodetic.hpp"
 
 using namespace std;
 using namespace boost::filesystem;
@@ -37,7 +46,8 @@ public:
     outputDirectory("./patched"),
     simulate(false),
     verbose(false),
-    quiet(false)
+    quiet(false),
+    threadCount(-1)
   {}
 
   static void
@@ -68,6 +78,11 @@ public:
       self->membersSet |= TT_SIMULATE;
   }
 
+  static void
+    setThreadCount(command_t *command) {
+      static_cast<TerrainPatch *>(Command::self(command))->threadCount = atoi(command->arg);
+  }
+
   static void
     setVerbose(command_t *command) {
       TerrainPatch *self = static_cast<TerrainPatch *>(Command::self(command));
@@ -132,13 +147,14 @@ public:
   boost::function<void(string)> info;
   boost::function<void(string)> warn;
   boost::function<void(string)> err;
-  boost::function<void(string, TerrainTile)> logPatch;
+  boost::function<void(string, const TileCoordinate &)> logPatch;
 
   string inputDirectory;
   string outputDirectory;
   bool simulate;
   bool verbose;
   bool quiet;
+  int threadCount;
 
 private:
   char membersSet;
@@ -160,132 +176,162 @@ private:
 
   static void noLog(string label, string message) {}
 
-  static void consoleLogPatch(const TerrainPatch *command, string label, TerrainTile &tile) {
+  static void consoleLogPatch(const TerrainPatch *command, string label, const TileCoordinate &coord) {
     if (command->verbose) {
-      cout << "[" << label << "] z: " << tile.zoom << " x: " << tile.x << " y: " << tile.y << endl;
+      // Write whole lines so that the output of threads doesn't interleave
+      stringstream stream;
+      stream << "[" << label << "] z: " << coord.zoom << " x: " << coord.x << " y: " << coord.y << "\n";
+      cout << stream.str() << flush;
     }
   }
 
-  static void noLogPatch(string label, TerrainTile tile) {}
+  static void noLogPatch(string label, const TileCoordinate &coord) {}
 };
 
-int tileCount = 0;
-int tilePatchedCount = 0;
+std::atomic<long long> tileCount(0);
+std::atomic<long long> tilePatchedCount(0);
+std::atomic<long long> tileErrorCount(0);
 TerrainPatch *command = NULL;
 
-/**
-* Create a filename for a tile coordinate
-*
-* This also creates the tile directory structure.
-*/
-static string
-getTileFilename(const TileCoordinate *coord, const path& dir, const char *extension) {
-  static mutex mutex;
-  path filename(dir);
-  filename /= to_string(coord->zoom);
-  filename /= to_string(coord->x);
+/// The tiles waiting to be patched, shared between the worker threads
+struct PatchQueue {
+  std::mutex mutex;
+  std::condition_variable ready;
+  vector<TileCoordinate> pending; ///< Taken last in first out to bound its size
+  int active = 0;                 ///< The number of tiles being patched
+};
 
-  lock_guard<std::mutex> lock(mutex);
+/// The child flags and the child quadrant names, in the order they are logged
+static const struct {
+  Terrain::Children flag;
+  const char *name;
+  i_tile dx, dy;
+} cChildren[] = {
+  { Terrain::TERRAIN_CHILD_SW, "SW", 0, 0 },
+  { Terrain::TERRAIN_CHILD_SE, "SE", 1, 0 },
+  { Terrain::TERRAIN_CHILD_NW, "NW", 0, 1 },
+  { Terrain::TERRAIN_CHILD_NE, "NE", 1, 1 }
+};
 
-  if (!command->simulate) {
-    // Ensure the `{zoom}/{x}` directory exists
-    create_directories(filename);
-  }
+/// The child flags which are understood
+static const char cChildMask = Terrain::TERRAIN_CHILD_SW | Terrain::TERRAIN_CHILD_SE
+  | Terrain::TERRAIN_CHILD_NW | Terrain::TERRAIN_CHILD_NE;
+
+/**
+ * Get the child flags of a tile from the tiles in the dataset index
+ *
+ * The children present are appended to `children`.  Tile rows increase
+ * northwards, so the south west child has the lowest coordinates.
+ */
+static char
+indexedChildren(const TerrainDataset &terrain, const TileCoordinate &coord, vector<TileCoordinate> &children) {
+  char flags = 0;
 
-  // Create the filename itself, adding the extension if required
-  filename /= to_string(coord->y);
-  if (extension != NULL) {
-    filename.replace_extension(extension);
+  for (const auto &child: cChildren) {
+    const TileCoordinate childCoord(coord.zoom + 1, (coord.x << 1) + child.dx, (coord.y << 1) + child.dy);
+
+    if (terrain.hasTile(childCoord.zoom, childCoord.x, childCoord.y)) {
+      flags |= child.flag;
+      children.push_back(childCoord);
+    }
   }
 
-  return filename.string();
+  return flags;
 }
 
-void
-patchTerrainTile(TerrainDataset &terrain, TerrainTile &tile, const path &outputDirectory) {
-  bool needPatch = false;
-
+/**
+ * Patch the child flags of a single tile
+ *
+ * Only the start of the tile is decompressed to read the current flags.  If
+ * they are correct the tile is hard linked (or copied) to the output
+ * unchanged, otherwise it is decoded, patched and re-encoded with `codec`.
+ * `format` is the format recorded for the input tiles.  `output` is `NULL`
+ * when simulating.
+ */
+static void
+patchTile(const TileCoordinate &coord, char flags, const DirectoryTileStore &input,
+          DirectoryTileStore *output, bool inPlace, const TileCodec &codec, TileCodec::Format format,
+          vector<unsigned char> &data, vector<unsigned char> &encoded) {
   tileCount++;
 
-  // NE
-  try {
-    TerrainTile *childNE = new TerrainTile(terrain.getTileFilename(tile.zoom + 1, tile.x << 1, tile.y << 1).c_str(), TileCoordinate(tile.zoom + 1, tile.x << 1, tile.y << 1));
-    if (!tile.hasChildNE()) {
-      command->logPatch("+NE", tile);
-      tile.setChildNE();
-      needPatch = true;
-    }
-    patchTerrainTile(terrain, *childNE, outputDirectory);
-  }
-  catch (CTBException) {
-    if (tile.hasChildNE()) {
-      command->logPatch("-NE", tile);
-      tile.setChildNE(false);
-      needPatch = true;
-    }
+  if (!input.readTile(coord, data)) {
+    throw CTBException("The tile file could not be opened");
   }
 
-  // NW
-  try {
-    TerrainTile *childNW = new TerrainTile(terrain.getTileFilename(tile.zoom + 1, (tile.x << 1) + 1, tile.y << 1).c_str(), TileCoordinate(tile.zoom + 1, (tile.x << 1) + 1, tile.y << 1));
-    if (!tile.hasChildNW()) {
-      command->logPatch("+NW", tile);
-      tile.setChildNW();
-      needPatch = true;
-    }
-    patchTerrainTile(terrain, *childNW, outputDirectory);
-  }
-  catch (CTBException) {
-    if (tile.hasChildNW()) {
-      command->logPatch("-NW", tile);
-      tile.setChildNW(false);
-      needPatch = true;
+  const char current = Terrain::decodeChildren(data.data(), data.size(), format) & cChildMask;
+
+  if (current == flags) {
+    if (output != NULL && !inPlace) {
+      output->linkTile(coord, input.tileFilename(coord), data.data(), data.size());
     }
+    return;
   }
 
-  // SE
-  try {
-    TerrainTile *childSE = new TerrainTile(terrain.getTileFilename(tile.zoom + 1, tile.x << 1, (tile.y << 1) + 1).c_str(), TileCoordinate(tile.zoom + 1, tile.x << 1, (tile.y << 1) + 1));
-    if (!tile.hasChildSE()) {
-      command->logPatch("+SE", tile);
-      tile.setChildSE();
-      needPatch = true;
+  tilePatchedCount++;
+  for (const auto &child: cChildren) {
+    if ((current & child.flag) != (flags & child.flag)) {
+      command->logPatch(string((flags & child.flag) ? "+" : "-") + child.name, coord);
     }
-    patchTerrainTile(terrain, *childSE, outputDirectory);
   }
-  catch (CTBException) {
-    if (tile.hasChildSE()) {
-      command->logPatch("-SE", tile);
-      tile.setChildSE(false);
-      needPatch = true;
-    }
+
+  if (output == NULL) {
+    return;
   }
 
-  // SW
-  try {
-    TerrainTile *childSW = new TerrainTile(terrain.getTileFilename(tile.zoom + 1, (tile.x << 1) + 1, (tile.y << 1) + 1).c_str(), TileCoordinate(tile.zoom + 1, (tile.x << 1) + 1, (tile.y << 1) + 1));
-    if (!tile.hasChildSW()) {
-      command->logPatch("+SW", tile);
-      tile.setChildSW();
-      needPatch = true;
+  Terrain terrain;
+  terrain.decode(data.data(), data.size(), format);
+  terrain.setChildSW((flags & Terrain::TERRAIN_CHILD_SW) != 0);
+  terrain.setChildSE((flags & Terrain::TERRAIN_CHILD_SE) != 0);
+  terrain.setChildNW((flags & Terrain::TERRAIN_CHILD_NW) != 0);
+  terrain.setChildNE((flags & Terrain::TERRAIN_CHILD_NE) != 0);
+
+  terrain.encode(encoded, codec);
+  output->writeTile(coord, encoded.data(), encoded.size());
+}
+
+/**
+ * Patch tiles from the queue until no more are left
+ *
+ * The children of each tile are added to the queue, so threads share out the
+ * subtrees between them as they go.
+ */
+static void
+patchWorker(PatchQueue &queue, const TerrainDataset &terrain, const DirectoryTileStore &input,
+            DirectoryTileStore *output, bool inPlace, const TileCodec &codec, TileCodec::Format format) {
+  vector<unsigned char> data, encoded;
+  vector<TileCoordinate> children;
+  unique_lock<std::mutex> lock(queue.mutex);
+
+  while (true) {
+    queue.ready.wait(lock, [&queue] { return !queue.pending.empty() || queue.active == 0; });
+    if (queue.pending.empty()) {
+      break;                    // no tile is being patched which could add more
     }
-    patchTerrainTile(terrain, *childSW, outputDirectory);
-  }
-  catch (CTBException) {
-    if (tile.hasChildSW()) {
-      command->logPatch("-SW", tile);
-      tile.setChildSW(false);
-      needPatch = true;
+
+    const TileCoordinate coord = queue.pending.back();
+    queue.pending.pop_back();
+    queue.active++;
+    lock.unlock();
+
+    children.clear();
+    const char flags = indexedChildren(terrain, coord, children);
+
+    try {
+      patchTile(coord, flags, input, output, inPlace, codec, format, data, encoded);
+    } catch (CTBException &e) {
+      tileErrorCount++;
+      stringstream stream;
+      stream << input.tileFilename(coord) << ": " << e.what();
+      command->err(stream.str());
     }
-  }
 
-  if (needPatch) {
-    tilePatchedCount++;
-  }
+    lock.lock();
+    queue.active--;
+    queue.pending.insert(queue.pending.end(), children.begin(), children.end());
 
-  string filename = getTileFilename(&tile, outputDirectory, "terrain");
-  if (!command->simulate) {
-    tile.writeFile(filename.c_str());
+    if (!children.empty() || queue.active == 0) {
+      queue.ready.notify_all();
+    }
   }
 }
 
@@ -293,8 +339,7 @@ patchTerrainTile(TerrainDataset &terrain, TerrainTile &tile, const path &outputD
 * Patch the terrain with good children switches
 */
 void
-patchTerrain(TerrainDataset &terrain, const string &outputDirectory) {
-  path outputDir(outputDirectory);
+patchTerrain(TerrainDataset &terrain, const string &outputDirectory, int threadCount) {
   int minLevel = terrain.getMinLevel();
 
   if (minLevel != 0) {
@@ -303,28 +348,77 @@ patchTerrain(TerrainDataset &terrain, const string &outputDirectory) {
     command->warn(stream.str());
   }
 
+  DirectoryTileStore input(terrain.getIndex().root(), "terrain", false);
+  unique_ptr<DirectoryTileStore> output;
+  bool inPlace = false;
+
+  if (!command->simulate) {
+    output.reset(new DirectoryTileStore(outputDirectory, "terrain", true));
+    inPlace = equivalent(path(terrain.getIndex().root()), path(outputDirectory));
+  }
+
+  // Patched tiles are re-encoded with the codec the input was recorded with,
+  // as the tiles linked unchanged keep their compression
+  const unique_ptr<TileCodec> recorded = TileCodec::createRecorded(terrain.getIndex().root());
+  const TileCodec &codec = recorded ? *recorded : TileCodec::defaultCodec();
+  const TileCodec::Format format = recorded ? recorded->format() : TileCodec::FORMAT_UNKNOWN;
+
+  if (recorded && output && !inPlace) {
+    recorded->record(outputDirectory);
+  }
+
   // Force BBox to maximum emprise for level 0 in order to warn for missing tiles.
   int minX = (minLevel == 0) ? 0 : terrain.getMinX(minLevel);
   int maxX = (minLevel == 0) ? 1 : terrain.getMaxX(minLevel);
   int minY = (minLevel == 0) ? 0 : terrain.getMinY(minLevel);
   int maxY = (minLevel == 0) ? 0 : terrain.getMaxY(minLevel);
 
-  for (int x = minX; x <= maxX; ++x) {
-    for (int y = minY; y <= maxY; ++y) {
-      string file = terrain.getTileFilename(minLevel, x, y);
-      try {
-        TerrainTile tile(file.c_str(), TileCoordinate(minLevel, x, y));
-        patchTerrainTile(terrain, tile, outputDir);
-      }
-      catch (CTBException e) {
-        if (minLevel == 0) {
-          stringstream stream;
-          stream << file << " tile does not exist. (Must be present for Cesium to work)";
-          command->warn(stream.str());
-        }
+  PatchQueue queue;
+  for (int x = maxX; x >= minX; --x) {
+    for (int y = maxY; y >= minY; --y) {
+      if (terrain.hasTile(minLevel, x, y)) {
+        queue.pending.push_back(TileCoordinate(minLevel, x, y));
+      } else if (minLevel == 0) {
+        stringstream stream;
+        stream << terrain.getTileFilename(minLevel, x, y) << " tile does not exist. (Must be present for Cesium to work)";
+        command->warn(stream.str());
       }
     }
   }
+
+  vector<thread> threads;
+  for (int i = 1; i < threadCount; ++i) {
+    threads.push_back(thread(patchWorker, ref(queue), cref(terrain), cref(input), output.get(), inPlace,
+                             cref(codec), format));
+  }
+  patchWorker(queue, terrain, input, output.get(), inPlace, codec, format);
+
+  for (auto &thread: threads) {
+    thread.join();
+  }
+}
+
+/**
+* Write the `layer.json` describing the tiles in the output directory
+*
+* Tiles which can't be reached from the top level aren't written to a new
+* output directory, so unless every tile was written the output directory is
+* indexed itself.
+*/
+void
+writeLayer(TerrainDataset &terrain, const string &outputDirectory, int threadCount) {
+  const TileIndex &input = terrain.getIndex();
+  const path outputDir = canonical(path(outputDirectory));
+  LayerJson layer(outputDir.filename().string());
+
+  if ((tileErrorCount == 0 && tileCount == (long long) input.count())
+      || equivalent(path(input.root()), outputDir)) {
+    layer.addAvailable(input);
+  } else {
+    layer.addAvailable(TileIndex::scan(outputDirectory, "terrain", threadCount));
+  }
+
+  layer.writeFile((outputDir / "layer.json").string());
 }
 
 int
@@ -340,6 +434,7 @@ main(int argc, char *argv[]) {
   command->option("-i", "--input-directory <directory>", "the terrain root directory to convert", TerrainPatch::setInputDirectory);
   command->option("-o", "--output-directory <directory>", "the output root directory to create", TerrainPatch::setOutputDirectory);
   command->option("-s", "--simulate", "simulate patching, no file will be written", TerrainPatch::setSimulate);
+  command->option("-c", "--thread-count <count>", "specify the number of threads to use for patching and scanning tiles. On multicore machines this defaults to the number of CPUs", TerrainPatch::setThreadCount);
   command->option("-v", "--verbose", "output patched tiles", TerrainPatch::setVerbose);
   command->option("-q", "--quiet", "no output", TerrainPatch::setQuiet);
 
@@ -364,8 +459,10 @@ main(int argc, char *argv[]) {
 
     GDALAllRegister();
 
+    int threadCount = (command->threadCount > 0) ? command->threadCount : CPLGetNumCPUs();
+
     // Instantiate an appropriate terrain dataset
-    TerrainDataset dataset(command->inputDirectory);
+    TerrainDataset dataset(command->inputDirectory, true, threadCount);
 
     {
       stringstream stream;
@@ -376,10 +473,17 @@ main(int argc, char *argv[]) {
     }
 
     // Write the data to tiff
-    patchTerrain(dataset, command->outputDirectory);
+    patchTerrain(dataset, command->outputDirectory, threadCount);
+
+    if (!command->simulate) {
+      writeLayer(dataset, command->outputDirectory, threadCount);
+    }
 
     // Report
     cout << "\nTile patched: " << tilePatchedCount << "/" << tileCount << endl;
+    if (tileErrorCount > 0) {
+      cout << "Tile errors: " << tileErrorCount << endl;
+    }
   }
   catch (CTBException e) {
     command->err(e.what());
@@ -0,0 +1,1634 @@
+/*******************************************************************************
+ * Copyright 2014 GeoData <geodata@soton.ac.uk>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ *******************************************************************************/
+
+/**
+ * @file ctb-serve.cpp
+ * @brief Serve a terrain tileset over HTTP
+ *
+ * This tool serves a tile directory, tile pack or MBTiles database created by
+ * `ctb-tile` to Cesium clients, along with its `layer.json`.  Each thread runs
+ * its own `epoll` event loop.  Tiles are sent exactly as they are stored, so
+ * gzipped tiles are sent with `Content-Encoding: gzip` rather than being
+ * decompressed.  Tile files are sent with `sendfile` from a cache of open
+ * file handles and tile packs are sent directly from the memory mapped file.
+ *
+ * Alternatively tiles can be created from a GDAL dataset when they are first
+ * requested, using an `OnDemandTiler`.  Tiles which aren't cached are created
+ * by the tiler's own threads, and the connection waiting for a tile is
+ * resumed by its event loop once an `eventfd` signals the tile is ready.
+ *
+ * It uses Linux specific system calls so it is only built on Linux.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>             // for atoi
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cpl_conv.h"           // for CPLGetBasename
+#include "cpl_multiproc.h"      // for CPLGetNumCPUs
+#include "gdal_priv.h"
+#include "commander.hpp"        // for cli parsing
+
+#include "config.hpp"
+#include "CTBException.hpp"
+#include "DirectoryTileStore.hpp"
+#include "GlobalGeodetic.hpp"
+#include "GlobalMercator.hpp"
+#include "LatencyHistogram.hpp"
+#include "LayerJson.hpp"
+#include "LRUCache.hpp"
+#include "OnDemandTiler.hpp"
+#include "TerrainTile.hpp"
+#include "TileCodec.hpp"
+#include "TilePackStore.hpp"
+#include "TileStore.hpp"
+
+using namespace std;
+using namespace ctb;
+
+/// Handle the terrain server CLI options
+class TerrainServe : public Command {
+public:
+  TerrainServe(const char *name, const char *version) :
+    Command(name, version),
+    address("127.0.0.1"),
+    port(8000),
+    threadCount(-1),
+    handleCount(4096),
+    idleTimeout(60),
+    verbosity(1),
+    generate(false),
+    profile("geodetic"),
+    compression("gzip"),
+    cacheSize(256),
+    diskCache(NULL),
+    prefetchThreads(1),
+    tileThreads(-1)
+  {}
+
+  void
+  check() const {
+    switch(command->argc) {
+    case 1:
+      return;
+    case 0:
+      cerr << "  Error: The tileset must be specified" << endl;
+      break;
+    default:
+      cerr << "  Error: Only one command line argument must be specified" << endl;
+      break;
+    }
+
+    help();                   // print help and exit
+  }
+
+  static void
+  setAddress(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->address = command->arg;
+  }
+
+  static void
+  setPort(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->port = atoi(command->arg);
+  }
+
+  static void
+  setThreadCount(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->threadCount = atoi(command->arg);
+  }
+
+  static void
+  setHandleCount(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->handleCount = atoi(command->arg);
+  }
+
+  static void
+  setIdleTimeout(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->idleTimeout = atoi(command->arg);
+  }
+
+  static void
+  setGenerate(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->generate = true;
+  }
+
+  static void
+  setProfile(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->profile = command->arg;
+  }
+
+  static void
+  setCompression(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->compression = command->arg;
+  }
+
+  static void
+  setCacheSize(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->cacheSize = atoi(command->arg);
+  }
+
+  static void
+  setDiskCache(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->diskCache = command->arg;
+  }
+
+  static void
+  setPrefetchThreads(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->prefetchThreads = atoi(command->arg);
+  }
+
+  static void
+  setTileThreads(command_t *command) {
+    static_cast<TerrainServe *>(Command::self(command))->tileThreads = atoi(command->arg);
+  }
+
+  static void
+  setQuiet(command_t *command) {
+    --(static_cast<TerrainServe *>(Command::self(command))->verbosity);
+  }
+
+  static void
+  setVerbose(command_t *command) {
+    ++(static_cast<TerrainServe *>(Command::self(command))->verbosity);
+  }
+
+  const char *
+  getTileset() const {
+    return (command->argc == 1) ? command->argv[0] : NULL;
+  }
+
+  const char *address;
+
+  int port,
+    threadCount,
+    handleCount,
+    idleTimeout,
+    verbosity;
+
+  /// Create tiles from a GDAL dataset instead of serving a tileset
+  bool generate;
+
+  const char *profile,
+    *compression;
+
+  int cacheSize;                ///< The size of the tile cache in megabytes
+
+  const char *diskCache;
+
+  int prefetchThreads,
+    tileThreads;
+};
+
+/// How long an open file is trusted before checking whether it has changed
+static const chrono::seconds cRevalidateInterval(1);
+
+/// Read a whole file, returning nothing if it can't be read
+static shared_ptr<const string>
+readFile(const string &filename) {
+  ifstream file(filename.c_str(), ios::in | ios::binary);
+  if (!file) {
+    return shared_ptr<const string>();
+  }
+
+  ostringstream contents;
+  contents << file.rdbuf();
+  return make_shared<const string>(contents.str());
+}
+
+/**
+ * The `layer.json` served with the tiles
+ *
+ * A file is checked at most once every `cRevalidateInterval` and read again
+ * when it has been replaced or modified, so a tileset being updated is served
+ * with its current description.
+ */
+class LayerFile {
+public:
+
+  /// Serve fixed contents, such as the description of generated tiles
+  LayerFile(shared_ptr<const string> contents):
+    mContents(contents),
+    mDevice(0),
+    mInode(0),
+    mModified(0)
+  {}
+
+  /// Serve a file, which doesn't have to exist yet
+  LayerFile(const string &filename):
+    mFilename(filename),
+    mDevice(0),
+    mInode(0),
+    mModified(0)
+  {
+    reload();
+  }
+
+  /// Get the current contents, or nothing if there aren't any
+  shared_ptr<const string>
+  get() {
+    lock_guard<mutex> lock(mMutex);
+
+    if (!mFilename.empty() && chrono::steady_clock::now() - mChecked >= cRevalidateInterval) {
+      reload();
+    }
+
+    return mContents;
+  }
+
+private:
+
+  /// Read the file again if it has changed since it was last read
+  void
+  reload() {
+    mChecked = chrono::steady_clock::now();
+
+    struct stat st;
+    if (stat(mFilename.c_str(), &st) != 0) {
+      mContents.reset();
+      return;
+    }
+
+    if (!mContents || st.st_dev != mDevice || st.st_ino != mInode || st.st_mtime != mModified) {
+      mContents = readFile(mFilename);
+      mDevice = st.st_dev;
+      mInode = st.st_ino;
+      mModified = st.st_mtime;
+    }
+  }
+
+  mutex mMutex;
+  const string mFilename;       ///< The file, or empty for fixed contents
+  shared_ptr<const string> mContents;
+  dev_t mDevice;                ///< The file read
+  ino_t mInode;
+  time_t mModified;
+  chrono::steady_clock::time_point mChecked; ///< When the file was last checked
+};
+
+/// The body of a response: either part of an open file or bytes in memory
+struct Body {
+  Body():
+    fd(-1),
+    data(NULL),
+    size(0),
+    format(TileCodec::FORMAT_NONE)
+  {}
+
+  shared_ptr<const void> owner; ///< Keeps the file handle or memory alive
+  int fd;                       ///< A file sent using `sendfile`, or `-1`
+  const unsigned char *data;    ///< The bytes to send when there is no file
+  size_t size;                  ///< The size of the body
+  TileCodec::Format format;     ///< The compression of the body
+};
+
+/**
+ * Somewhere tiles are served from
+ *
+ * The compression of the tiles is the format recorded for the tileset, and
+ * is only detected from each tile when none was recorded.
+ */
+class TileSource {
+public:
+
+  TileSource(TileCodec::Format format):
+    mFormat(format)
+  {}
+
+  virtual ~TileSource() {}
+
+  /// Called from another thread with a tile found in the background
+  typedef function<void(bool exists, const Body &body, exception_ptr error)> Callback;
+
+  /// Find the encoded data of a tile, returning `false` if it doesn't exist
+  virtual bool
+  find(const TileCoordinate &coord, Body &body) = 0;
+
+  /**
+   * Find a tile unless doing so would block for a long time
+   *
+   * This returns `true` having found the tile, or found it doesn't exist, as
+   * `find` does.  Otherwise the tile is found in the background and `false`
+   * is returned, in which case `callback` is called from another thread with
+   * the result.
+   */
+  virtual bool
+  request(const TileCoordinate &coord, bool &exists, Body &body, Callback callback) {
+    (void) callback;
+    exists = find(coord, body);
+    return true;
+  }
+
+  /// Write any statistics about the source as JSON object members
+  virtual void
+  writeStats(ostream &stream) const {
+    (void) stream;
+  }
+
+protected:
+
+  /// Get the compression of a tile of `size` bytes from its first bytes
+  TileCodec::Format
+  format(const unsigned char *data, size_t size) const {
+    return (mFormat == TileCodec::FORMAT_UNKNOWN) ? Terrain::detectFormat(data, size) : mFormat;
+  }
+
+  const TileCodec::Format mFormat;
+};
+
+/**
+ * Serve tiles from a directory with a cache of open file handles
+ *
+ * The cache is split into shards, each with its own lock, so that threads
+ * rarely contend.  A handle is closed once it has been evicted and the last
+ * response using it has been sent.
+ *
+ * Tiles are replaced rather than rewritten when a tileset is updated, so a
+ * cached handle is checked against the file at most once every
+ * `cRevalidateInterval`, and reopened if the file has been replaced or
+ * modified.
+ */
+class DirectorySource : public TileSource {
+public:
+
+  DirectorySource(unique_ptr<TileStore> store, TileCodec::Format format, size_t capacity):
+    TileSource(format),
+    mStore(move(store)),
+    mDirectory(dynamic_cast<DirectoryTileStore &>(*mStore))
+  {
+    for (size_t i = 0; i < cShardCount; ++i) {
+      mShards.emplace_back(new LRUCache<uint64_t, Handle>((capacity + cShardCount - 1) / cShardCount));
+    }
+  }
+
+  bool
+  find(const TileCoordinate &coord, Body &body) override {
+    const uint64_t key = TileStore::tileKey(coord);
+    LRUCache<uint64_t, Handle> &shard = *mShards[key % cShardCount];
+    shared_ptr<const Handle> handle = shard.get(key);
+
+    if (handle && !isCurrent(coord, *handle)) {
+      shard.remove(key);
+      handle.reset();
+    }
+
+    if (!handle) {
+      handle = open(coord);
+      if (!handle) {
+        return false;
+      }
+
+      shard.put(key, handle, 1); // each handle counts as one
+    }
+
+    body.owner = handle;
+    body.fd = handle->fd;
+    body.size = handle->size;
+    body.format = handle->format;
+    return true;
+  }
+
+  void
+  writeStats(ostream &stream) const override {
+    uint64_t hits = 0, misses = 0;
+    for (const auto &shard: mShards) {
+      hits += shard->hits();
+      misses += shard->misses();
+    }
+
+    stream << ",\n  \"handles\": {\"hits\": " << hits << ", \"misses\": " << misses << "}";
+  }
+
+private:
+
+  /// An open tile file
+  struct Handle {
+    Handle(int fd):
+      fd(fd)
+    {}
+
+    ~Handle() {
+      close(fd);
+    }
+
+    int fd;
+    size_t size;
+    TileCodec::Format format;
+
+    dev_t device;               ///< The file opened
+    ino_t inode;
+    time_t modified;
+
+    /// When the handle was last checked against the file
+    mutable atomic<chrono::steady_clock::rep> checked;
+  };
+
+  /// Is a handle still open on the current tile file?
+  bool
+  isCurrent(const TileCoordinate &coord, const Handle &handle) const {
+    const chrono::steady_clock::rep now = chrono::steady_clock::now().time_since_epoch().count();
+    if (now - handle.checked < chrono::steady_clock::duration(cRevalidateInterval).count()) {
+      return true;
+    }
+
+    struct stat st;
+    if (stat(mDirectory.tileFilename(coord).c_str(), &st) != 0
+        || st.st_dev != handle.device || st.st_ino != handle.inode
+        || st.st_mtime != handle.modified || (size_t) st.st_size != handle.size) {
+      return false;
+    }
+
+    handle.checked = now;
+    return true;
+  }
+
+  /// Open a tile file, returning nothing if it doesn't exist
+  shared_ptr<const Handle>
+  open(const TileCoordinate &coord) const {
+    const int fd = ::open(mDirectory.tileFilename(coord).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return shared_ptr<const Handle>();
+    }
+
+    shared_ptr<Handle> handle = make_shared<Handle>(fd);
+    struct stat st;
+    unsigned char magic[4];
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      return shared_ptr<const Handle>();
+    }
+
+    // Only the size and the magic bytes are needed to detect the compression
+    const ssize_t length = (mFormat == TileCodec::FORMAT_UNKNOWN) ? pread(fd, magic, sizeof(magic), 0) : 0;
+    handle->size = (size_t) st.st_size;
+    handle->device = st.st_dev;
+    handle->inode = st.st_ino;
+    handle->modified = st.st_mtime;
+    handle->checked = chrono::steady_clock::now().time_since_epoch().count();
+    handle->format = format(magic, ((size_t) length == sizeof(magic)) ? handle->size : 0);
+
+    return handle;
+  }
+
+  static const size_t cShardCount = 16;
+
+  unique_ptr<TileStore> mStore;
+  const DirectoryTileStore &mDirectory;
+  vector<unique_ptr<LRUCache<uint64_t, Handle>>> mShards;
+};
+
+/// Serve tiles directly from the memory mapping of a tile pack
+class PackSource : public TileSource {
+public:
+
+  PackSource(unique_ptr<TileStore> store, TileCodec::Format format):
+    TileSource(format),
+    mStore(move(store)),
+    mPack(dynamic_cast<TilePackStore &>(*mStore))
+  {}
+
+  bool
+  find(const TileCoordinate &coord, Body &body) override {
+    if (!mPack.findTile(coord, body.data, body.size)) {
+      return false;
+    }
+
+    body.format = format(body.data, body.size);
+    return true;
+  }
+
+private:
+
+  unique_ptr<TileStore> mStore;
+  const TilePackStore &mPack;
+};
+
+/// Serve tiles read from any other tile store, such as an MBTiles database
+class StoreSource : public TileSource {
+public:
+
+  StoreSource(unique_ptr<TileStore> store, TileCodec::Format format):
+    TileSource(format),
+    mStore(move(store))
+  {}
+
+  bool
+  find(const TileCoordinate &coord, Body &body) override {
+    shared_ptr<vector<unsigned char>> data = make_shared<vector<unsigned char>>();
+    if (!mStore->readTile(coord, *data)) {
+      return false;
+    }
+
+    body.owner = data;
+    body.data = data->data();
+    body.size = data->size();
+    body.format = format(body.data, body.size);
+    return true;
+  }
+
+private:
+
+  unique_ptr<TileStore> mStore;
+};
+
+/**
+ * Serve tiles created from a GDAL dataset when they are first requested
+ *
+ * The children of each tile requested are created in the background, ready
+ * for when the client zooms in.
+ */
+class GenerateSource : public TileSource {
+public:
+
+  GenerateSource(unique_ptr<OnDemandTiler> tiler, TileCodec::Format format):
+    TileSource(format),
+    mTiler(move(tiler))
+  {}
+
+  bool
+  find(const TileCoordinate &coord, Body &body) override {
+    OnDemandTiler::Data data = mTiler->getTile(coord);
+    if (!data) {
+      return false;
+    }
+
+    mTiler->prefetchChildren(coord);
+    setBody(data, body);
+    return true;
+  }
+
+  /// Tiles which aren't cached are created by the tiler's threads
+  bool
+  request(const TileCoordinate &coord, bool &exists, Body &body, Callback callback) override {
+    OnDemandTiler::Data data;
+    const bool ready = mTiler->requestTile(coord, data, [this, callback](const OnDemandTiler::Data &data, exception_ptr error) {
+        Body body;
+        if (data) {
+          setBody(data, body);
+        }
+        callback((bool) data, body, error);
+      });
+
+    if (ready) {
+      exists = (bool) data;
+      if (!exists) {
+        return true;
+      }
+      setBody(data, body);
+    }
+
+    mTiler->prefetchChildren(coord);
+    return ready;
+  }
+
+  void
+  writeStats(ostream &stream) const override {
+    const LRUCache<uint64_t, vector<unsigned char>> &cache = mTiler->cache();
+
+    stream
+      << ",\n  \"cache\": {\"tiles\": " << cache.count()
+      << ", \"bytes\": " << cache.cost()
+      << ", \"capacity\": " << cache.capacity()
+      << ", \"hits\": " << cache.hits()
+      << ", \"misses\": " << cache.misses() << "}"
+      << ",\n  \"tiles\": {\"created\": " << mTiler->createdCount()
+      << ", \"prefetched\": " << mTiler->prefetchedCount()
+      << ", \"coalesced\": " << mTiler->coalescedCount()
+      << ", \"diskHits\": " << mTiler->diskHitCount() << "}";
+  }
+
+private:
+
+  /// Send an encoded tile
+  void
+  setBody(const OnDemandTiler::Data &data, Body &body) const {
+    body.owner = data;
+    body.data = data->data();
+    body.size = data->size();
+    body.format = format(body.data, body.size);
+  }
+
+  unique_ptr<OnDemandTiler> mTiler;
+};
+
+/// Has the server been asked to stop?
+static atomic<bool> stopping(false);
+
+static void
+stop(int) {
+  stopping = true;
+}
+
+/**
+ * An HTTP/1.1 server for a tileset
+ *
+ * Each thread has its own `epoll` instance, all of which wait on the
+ * listening socket so that connections are spread between the threads.  A
+ * connection then stays with the thread which accepted it.  Requests on a
+ * connection are handled in turn, including pipelined requests, and
+ * connections are kept alive unless the client asks otherwise.
+ *
+ * A connection waiting for a tile found in the background is set aside,
+ * and each thread has an `eventfd` in its `epoll` instance through which it
+ * is woken to resume the connection once the tile has been found.
+ */
+class TileServer {
+public:
+
+  TileServer(TileSource &source, LayerFile &layer, const TerrainServe &options):
+    mSource(source),
+    mLayer(layer),
+    mOptions(options),
+    mListenFd(-1),
+    mStarted(chrono::steady_clock::now()),
+    mConnectionIds(0),
+    mOpenConnections(0),
+    mTotalConnections(0),
+    mRequests(0),
+    mNotFound(0),
+    mErrors(0),
+    mBytes(0)
+  {}
+
+  ~TileServer() {
+    if (mListenFd >= 0) {
+      close(mListenFd);
+    }
+  }
+
+  /// Listen on an address and port
+  void
+  listen(const char *address, int port) {
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(address, to_string(port).c_str(), &hints, &addresses) != 0) {
+      throw CTBException("Could not resolve the address to listen on");
+    }
+
+    for (struct addrinfo *ai = addresses; ai != NULL && mListenFd < 0; ai = ai->ai_next) {
+      mListenFd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+      if (mListenFd < 0) {
+        continue;
+      }
+
+      const int on = 1;
+      setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+      if (bind(mListenFd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(mListenFd, SOMAXCONN) != 0) {
+        close(mListenFd);
+        mListenFd = -1;
+      }
+    }
+
+    freeaddrinfo(addresses);
+
+    if (mListenFd < 0) {
+      throw CTBException("Could not listen on the address and port");
+    }
+  }
+
+  /// Serve requests using a number of threads until the server is stopped
+  void
+  run(int threadCount) {
+    vector<thread> threads;
+    for (int i = 1; i < threadCount; ++i) {
+      threads.push_back(thread(&TileServer::serve, this));
+    }
+
+    serve();
+
+    for (auto &thread: threads) {
+      thread.join();
+    }
+  }
+
+private:
+
+  /// The kinds of request which are timed separately
+  enum Endpoint {
+    ENDPOINT_TILE,
+    ENDPOINT_LAYER,
+    ENDPOINT_OTHER,
+    ENDPOINT_COUNT
+  };
+
+  struct Connection;
+
+  /// Tiles found in the background for the connections of one thread
+  struct Waker {
+    Waker():
+      fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+      if (fd < 0) {
+        throw CTBException("Could not create an eventfd");
+      }
+    }
+
+    ~Waker() {
+      close(fd);
+    }
+
+    /// A tile found for a connection
+    struct Found {
+      Connection *connection;
+      uint64_t id;              ///< Identifies the connection if it was closed
+      bool exists;
+      Body body;
+      exception_ptr error;
+    };
+
+    /// Pass a tile to the thread, called from the thread which found it
+    void
+    wake(const Found &tile) {
+      {
+        lock_guard<mutex> lock(mMutex);
+        mFound.push_back(tile);
+      }
+
+      const uint64_t one = 1;
+      if (write(fd, &one, sizeof(one)) < 0) {
+        // The counter can only overflow if it is already waiting to be read
+      }
+    }
+
+    /// Take the tiles which have been found
+    void
+    take(vector<Found> &tiles) {
+      uint64_t count;
+      if (read(fd, &count, sizeof(count)) < 0) {
+        // Nothing has been found since it was last read
+      }
+
+      lock_guard<mutex> lock(mMutex);
+      tiles.swap(mFound);
+    }
+
+    int fd;
+
+  private:
+    vector<Found> mFound;
+    mutex mMutex;
+  };
+
+  /// A client connection and the response being sent on it
+  struct Connection {
+    Connection(int fd, uint64_t id, const shared_ptr<Waker> &waker):
+      fd(fd),
+      id(id),
+      waker(waker),
+      headerSent(0),
+      bodySent(0),
+      keepAlive(true),
+      responding(false),
+      writing(false),
+      waiting(false),
+      head(false),
+      hasAcceptEncoding(false),
+      endpoint(ENDPOINT_OTHER),
+      lastActive(chrono::steady_clock::now())
+    {}
+
+    ~Connection() {
+      close(fd);
+    }
+
+    int fd;
+    uint64_t id;                ///< Unique to the connection
+    shared_ptr<Waker> waker;    ///< Wakes the thread once a tile is found
+    string input;               ///< Data received but not yet handled
+    string header;              ///< The header of the response
+    string content;             ///< The body of a response generated in memory
+    Body body;                  ///< The body of the response
+    size_t headerSent, bodySent;
+    bool keepAlive;             ///< Keep the connection open after the response?
+    bool responding;            ///< Is a response being sent?
+    bool writing;               ///< Is the connection waiting to be writable?
+    bool waiting;               ///< Is a tile being found in the background?
+    bool head;                  ///< Was the request a `HEAD` request?
+    bool hasAcceptEncoding;     ///< Did the request have `Accept-Encoding`?
+    string acceptEncoding;      ///< The lower cased `Accept-Encoding` values
+    Endpoint endpoint;          ///< What the request was for
+    string target;              ///< The request target, for logging
+    int status;                 ///< The response status code
+    chrono::steady_clock::time_point started, lastActive;
+  };
+
+  /// The largest request header which is accepted
+  static const size_t cMaxRequestSize = 16 * 1024;
+
+  /// Run an event loop on the current thread
+  void
+  serve() {
+    const int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      throw CTBException("Could not create an epoll instance");
+    }
+
+    struct epoll_event event;
+    event.data.ptr = NULL;      // the listening socket
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    event.events |= EPOLLEXCLUSIVE; // only wake one thread for each connection
+#endif
+    epoll_ctl(epfd, EPOLL_CTL_ADD, mListenFd, &event);
+
+    // The waker is shared with callbacks which may outlive the thread
+    const shared_ptr<Waker> waker = make_shared<Waker>();
+    event.data.ptr = waker.get();
+    event.events = EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, waker->fd, &event);
+
+    unordered_map<Connection *, unique_ptr<Connection>> connections;
+    struct epoll_event events[64];
+    chrono::steady_clock::time_point lastSweep = chrono::steady_clock::now();
+
+    while (!stopping) {
+      const int count = epoll_wait(epfd, events, 64, 1000);
+
+      for (int i = 0; i < count; ++i) {
+        if (events[i].data.ptr == waker.get()) {
+          resume(epfd, connections, *waker);
+          continue;
+        }
+
+        Connection *connection = static_cast<Connection *>(events[i].data.ptr);
+
+        if (connection == NULL) {
+          accept(epfd, connections, waker);
+          continue;
+        }
+
+        bool open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+        connection->lastActive = chrono::steady_clock::now();
+
+        if (open && (events[i].events & EPOLLOUT)) {
+          open = send(epfd, *connection) && handleRequests(epfd, *connection);
+        } else if (open && (events[i].events & EPOLLIN)) {
+          open = receive(*connection) && handleRequests(epfd, *connection);
+        }
+
+        if (!open) {
+          disconnect(epfd, connections, connection);
+        }
+      }
+
+      // Close connections which have been idle for too long
+      const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+      if (now - lastSweep >= chrono::seconds(1)) {
+        lastSweep = now;
+        vector<Connection *> idle;
+
+        for (const auto &item: connections) {
+          if (!item.first->responding && !item.first->waiting && now - item.first->lastActive >= chrono::seconds(mOptions.idleTimeout)) {
+            idle.push_back(item.first);
+          }
+        }
+
+        for (Connection *connection: idle) {
+          disconnect(epfd, connections, connection);
+        }
+      }
+    }
+
+    while (!connections.empty()) {
+      disconnect(epfd, connections, connections.begin()->first);
+    }
+    close(epfd);
+  }
+
+  /**
+   * Respond with the tiles found in the background
+   *
+   * Tiles found for connections which have since been closed are dropped.
+   * A connection is identified by its id as well as its address, as the
+   * address may have been reused by a newer connection.
+   */
+  void
+  resume(int epfd, unordered_map<Connection *, unique_ptr<Connection>> &connections, Waker &waker) {
+    vector<Waker::Found> tiles;
+    waker.take(tiles);
+
+    for (const Waker::Found &tile: tiles) {
+      auto found = connections.find(tile.connection);
+      if (found == connections.end() || found->second->id != tile.id) {
+        continue;
+      }
+
+      Connection &connection = *found->second;
+      connection.lastActive = chrono::steady_clock::now();
+      connection.waiting = false;
+      respondWithTile(connection, tile.exists, tile.body, tile.error);
+
+      if (!(send(epfd, connection) && handleRequests(epfd, connection))) {
+        disconnect(epfd, connections, &connection);
+      }
+    }
+  }
+
+  /// Accept all pending connections
+  void
+  accept(int epfd, unordered_map<Connection *, unique_ptr<Connection>> &connections,
+         const shared_ptr<Waker> &waker) {
+    while (true) {
+      const int fd = accept4(mListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;                 // there are none left or too many are open
+      }
+
+      // Responses are small, so don't delay sending them
+      const int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+      unique_ptr<Connection> connection(new Connection(fd, mConnectionIds++, waker));
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.ptr = connection.get();
+
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == 0) {
+        mOpenConnections++;
+        mTotalConnections++;
+        connections[connection.get()] = move(connection);
+      }
+    }
+  }
+
+  /// Close a connection
+  void
+  disconnect(int epfd, unordered_map<Connection *, unique_ptr<Connection>> &connections, Connection *connection) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, connection->fd, NULL);
+    connections.erase(connection);
+    mOpenConnections--;
+  }
+
+  /// Read the data available on a connection, returning `false` if it has closed
+  bool
+  receive(Connection &connection) {
+    char buffer[16384];
+
+    while (true) {
+      const ssize_t length = recv(connection.fd, buffer, sizeof(buffer), 0);
+
+      if (length > 0) {
+        connection.input.append(buffer, (size_t) length);
+        if (connection.input.size() > 4 * cMaxRequestSize) {
+          return false;         // the client isn't waiting for responses
+        }
+      } else if (length == 0) {
+        return false;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      } else if (errno != EINTR) {
+        return false;
+      }
+    }
+  }
+
+  /**
+   * Respond to the complete requests received on a connection
+   *
+   * This stops when a response can't be sent without blocking or is waiting
+   * for a tile, and returns `false` if the connection should be closed.
+   */
+  bool
+  handleRequests(int epfd, Connection &connection) {
+    while (!connection.responding && !connection.waiting) {
+      const size_t end = connection.input.find("\r\n\r\n");
+
+      if (end == string::npos) {
+        if (connection.input.size() > cMaxRequestSize) {
+          connection.keepAlive = false;
+          respondWithError(connection, 431, "Request Header Fields Too Large");
+        } else {
+          break;                // wait for the rest of the request
+        }
+      } else {
+        connection.started = chrono::steady_clock::now();
+        const string request = connection.input.substr(0, end + 2);
+        connection.input.erase(0, end + 4);
+        respond(connection, request);
+
+        if (connection.waiting) {
+          break;                // resumed once the tile has been found
+        }
+      }
+
+      if (!send(epfd, connection)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /// Create the response to a request
+  void
+  respond(Connection &connection, const string &request) {
+    // Parse the request line: `METHOD TARGET VERSION`
+    const size_t lineEnd = request.find("\r\n"),
+      methodEnd = request.find(' '),
+      targetEnd = (methodEnd < lineEnd) ? request.find(' ', methodEnd + 1) : string::npos;
+
+    if (targetEnd == string::npos || targetEnd > lineEnd) {
+      connection.keepAlive = false;
+      connection.target = "-";
+      respondWithError(connection, 400, "Bad Request");
+      return;
+    }
+
+    const string method = request.substr(0, methodEnd),
+      version = request.substr(targetEnd + 1, lineEnd - targetEnd - 1);
+    connection.target = request.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+
+    // HTTP/1.1 connections persist by default but HTTP/1.0 ones don't
+    connection.keepAlive = (version == "HTTP/1.1");
+    connection.acceptEncoding.clear();
+    connection.hasAcceptEncoding = false;
+
+    for (size_t start = lineEnd + 2; start < request.size();) {
+      const size_t end = request.find("\r\n", start);
+      string line = request.substr(start, end - start);
+      start = end + 2;
+
+      for (char &c: line) {
+        c = (char) tolower(c);
+      }
+      if (line.compare(0, 11, "connection:") == 0) {
+        if (line.find("close") != string::npos) {
+          connection.keepAlive = false;
+        } else if (line.find("keep-alive") != string::npos) {
+          connection.keepAlive = true;
+        }
+      } else if (line.compare(0, 16, "accept-encoding:") == 0) {
+        connection.acceptEncoding += (connection.hasAcceptEncoding ? "," : "") + line.substr(16);
+        connection.hasAcceptEncoding = true;
+      }
+    }
+
+    const bool head = (method == "HEAD");
+    connection.head = head;
+    if (method != "GET" && !head) {
+      respondWithError(connection, 405, "Method Not Allowed");
+      return;
+    }
+
+    // Ignore any query string, such as the version Cesium adds
+    const string path = connection.target.substr(0, connection.target.find('?'));
+    TileCoordinate coord;
+    shared_ptr<const string> layer;
+
+    if (parseTilePath(path, coord)) {
+      connection.endpoint = ENDPOINT_TILE;
+      bool exists = false;
+      Body body;
+      exception_ptr error;
+
+      // The callback is only given what identifies the connection, as the
+      // connection may be closed before the tile is found
+      const shared_ptr<Waker> waker = connection.waker;
+      Connection *pointer = &connection;
+      const uint64_t id = connection.id;
+
+      try {
+        if (!mSource.request(coord, exists, body, [waker, pointer, id](bool exists, const Body &body, exception_ptr error) {
+              waker->wake(Waker::Found{pointer, id, exists, body, error});
+            })) {
+          connection.waiting = true;
+          return;
+        }
+      } catch (CTBException &) {
+        error = current_exception();
+      }
+
+      respondWithTile(connection, exists, body, error);
+    } else if (path == "/layer.json" && (layer = mLayer.get())) {
+      connection.endpoint = ENDPOINT_LAYER;
+      Body body;
+      body.owner = layer;
+      body.data = reinterpret_cast<const unsigned char *>(layer->data());
+      body.size = layer->size();
+
+      respondWithBody(connection, 200, "OK", "application/json", body, head);
+    } else if (path == "/stats") {
+      connection.endpoint = ENDPOINT_OTHER;
+      shared_ptr<string> stats = make_shared<string>(statistics());
+      Body body;
+      body.owner = stats;
+      body.data = reinterpret_cast<const unsigned char *>(stats->data());
+      body.size = stats->size();
+
+      respondWithBody(connection, 200, "OK", "application/json", body, head);
+    } else {
+      respondWithError(connection, 404, "Not Found");
+    }
+  }
+
+  /// Respond with a tile once it has been found
+  void
+  respondWithTile(Connection &connection, bool exists, const Body &body, exception_ptr error) {
+    if (error) {
+      try {
+        rethrow_exception(error);
+      } catch (exception &e) {
+        cerr << "Error: " << e.what() << ": " << connection.target << endl;
+      }
+
+      respondWithError(connection, 500, "Internal Server Error");
+      return;
+    }
+
+    if (!exists) {
+      respondWithError(connection, 404, "Not Found");
+      return;
+    }
+
+    // Tiles are sent as they are stored, so the client must accept their encoding
+    const char *encoding = contentEncoding(body.format);
+    if (encoding != NULL && connection.hasAcceptEncoding
+        && !acceptsEncoding(connection.acceptEncoding, encoding)) {
+      respondWithError(connection, 406, "Not Acceptable");
+      return;
+    }
+
+    respondWithBody(connection, 200, "OK", "application/octet-stream", body, connection.head);
+  }
+
+  /// Parse a path of the form `/{zoom}/{x}/{y}.terrain`
+  static bool
+  parseTilePath(const string &path, TileCoordinate &coord) {
+    unsigned long values[3];
+    const char *position = path.c_str();
+
+    for (int i = 0; i < 3; ++i) {
+      char *end;
+      if (*position != '/' || !isdigit((unsigned char) position[1])) {
+        return false;
+      }
+
+      values[i] = strtoul(position + 1, &end, 10);
+      position = end;
+    }
+
+    if (strcmp(position, ".terrain") != 0 || values[0] > 32) {
+      return false;
+    }
+
+    coord = TileCoordinate((i_zoom) values[0], (i_tile) values[1], (i_tile) values[2]);
+    return true;
+  }
+
+  /// Get the content coding of a compression format, or `NULL` for none
+  static const char *
+  contentEncoding(TileCodec::Format format) {
+    switch (format) {
+    case TileCodec::FORMAT_GZIP:
+      return "gzip";
+    case TileCodec::FORMAT_ZSTD:
+      return "zstd";
+    case TileCodec::FORMAT_NONE:
+    case TileCodec::FORMAT_UNKNOWN:
+      break;
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Does a lower cased `Accept-Encoding` header value accept a content coding?
+   *
+   * A coding is accepted if it is listed, or matched by `*`, with a non-zero
+   * quality.  An explicit listing takes precedence over `*`.
+   */
+  static bool
+  acceptsEncoding(const string &accept, const char *coding) {
+    bool listed = false, wildcard = false;
+
+    for (size_t start = 0; start <= accept.size();) {
+      size_t end = accept.find(',', start);
+      if (end == string::npos) {
+        end = accept.size();
+      }
+
+      // Split `coding;q=value` and trim the spaces around the coding
+      const string item = accept.substr(start, end - start);
+      start = end + 1;
+
+      const size_t semicolon = item.find(';'),
+        first = item.find_first_not_of(" \t"),
+        last = item.find_last_not_of(" \t", (semicolon == string::npos) ? string::npos : semicolon - 1);
+      if (first == string::npos || last == string::npos || first > last) {
+        continue;
+      }
+
+      const string name = item.substr(first, last - first + 1);
+      double quality = 1;
+      const size_t q = (semicolon == string::npos) ? string::npos : item.find("q=", semicolon);
+      if (q != string::npos) {
+        quality = strtod(item.c_str() + q + 2, NULL);
+      }
+
+      if (name == coding || (name == "x-" + string(coding))) {
+        if (quality > 0) {
+          return true;
+        }
+        listed = true;          // explicitly refused
+      } else if (name == "*") {
+        wildcard = quality > 0;
+      }
+    }
+
+    return !listed && wildcard;
+  }
+
+  /// Start sending a response
+  void
+  respondWithBody(Connection &connection, int status, const char *reason,
+                  const char *contentType, const Body &body, bool head) {
+    ostringstream header;
+    header
+      << "HTTP/1.1 " << status << " " << reason << "\r\n"
+      << "Content-Type: " << contentType << "\r\n"
+      << "Content-Length: " << body.size << "\r\n"
+      << "Access-Control-Allow-Origin: *\r\n";
+
+    const char *encoding = contentEncoding(body.format);
+    if (encoding != NULL) {
+      header << "Content-Encoding: " << encoding << "\r\n";
+    }
+
+    // Whether a tile is acceptable depends on the encodings the client accepts
+    if (connection.endpoint == ENDPOINT_TILE) {
+      header << "Vary: Accept-Encoding\r\n";
+    }
+
+    if (status == 405) {
+      header << "Allow: GET, HEAD\r\n";
+    }
+
+    header << "Connection: " << (connection.keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+
+    connection.header = header.str();
+    connection.headerSent = 0;
+    connection.body = body;
+    connection.bodySent = 0;
+    connection.status = status;
+    connection.responding = true;
+
+    if (head) {
+      connection.body = Body();
+    }
+  }
+
+  /// Start sending an error response
+  void
+  respondWithError(Connection &connection, int status, const char *reason) {
+    connection.content = string(reason) + "\n";
+
+    Body body;
+    body.data = reinterpret_cast<const unsigned char *>(connection.content.data());
+    body.size = connection.content.size();
+
+    respondWithBody(connection, status, reason, "text/plain", body, false);
+  }
+
+  /**
+   * Send as much of the response as possible without blocking
+   *
+   * This returns `false` if the connection should be closed.
+   */
+  bool
+  send(int epfd, Connection &connection) {
+    while (connection.headerSent < connection.header.size()) {
+      const int flags = MSG_NOSIGNAL | ((connection.body.size > 0) ? MSG_MORE : 0);
+      const ssize_t length = ::send(connection.fd, connection.header.data() + connection.headerSent,
+                                    connection.header.size() - connection.headerSent, flags);
+      if (length < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? waitToWrite(epfd, connection) : false;
+      }
+      connection.headerSent += (size_t) length;
+    }
+
+    while (connection.bodySent < connection.body.size) {
+      const size_t remaining = connection.body.size - connection.bodySent;
+      ssize_t length;
+
+      if (connection.body.fd >= 0) {
+        off_t offset = (off_t) connection.bodySent;
+        length = sendfile(connection.fd, connection.body.fd, &offset, remaining);
+      } else {
+        length = ::send(connection.fd, connection.body.data + connection.bodySent, remaining, MSG_NOSIGNAL);
+      }
+
+      if (length < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? waitToWrite(epfd, connection) : false;
+      } else if (length == 0) {
+        return false;           // the file has been truncated
+      }
+      connection.bodySent += (size_t) length;
+    }
+
+    finish(connection);
+
+    if (connection.writing) {
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.ptr = &connection;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, connection.fd, &event);
+      connection.writing = false;
+    }
+
+    return connection.keepAlive;
+  }
+
+  /// Wait for a connection to become writable
+  bool
+  waitToWrite(int epfd, Connection &connection) {
+    if (!connection.writing) {
+      struct epoll_event event;
+      event.events = EPOLLOUT | EPOLLRDHUP;
+      event.data.ptr = &connection;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, connection.fd, &event);
+      connection.writing = true;
+    }
+
+    return true;
+  }
+
+  /// Record a response which has been sent
+  void
+  finish(Connection &connection) {
+    const uint64_t micros = chrono::duration_cast<chrono::microseconds>
+      (chrono::steady_clock::now() - connection.started).count();
+
+    mLatency[connection.endpoint].record(micros);
+    mRequests++;
+    mBytes += connection.headerSent + connection.bodySent;
+
+    if (connection.status == 404) {
+      mNotFound++;
+    } else if (connection.status >= 400) {
+      mErrors++;
+    }
+
+    if (mOptions.verbosity > 1) {
+      ostringstream stream;
+      stream << connection.status << " " << connection.target << " " << micros << "us\n";
+      cout << stream.str() << flush;
+    }
+
+    connection.responding = false;
+    connection.header.clear();
+    connection.content.clear();
+    connection.body = Body();    // release the file handle or memory
+    connection.endpoint = ENDPOINT_OTHER;
+  }
+
+  /// Describe the server statistics as JSON
+  string
+  statistics() const {
+    static const char *names[ENDPOINT_COUNT] = { "tile", "layer", "other" };
+    ostringstream stream;
+
+    stream
+      << "{\n"
+      << "  \"uptime\": " << chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - mStarted).count() << ",\n"
+      << "  \"connections\": {\"open\": " << mOpenConnections << ", \"total\": " << mTotalConnections << "},\n"
+      << "  \"requests\": {\"total\": " << mRequests << ", \"notFound\": " << mNotFound << ", \"errors\": " << mErrors << "},\n"
+      << "  \"bytes\": " << mBytes;
+
+    mSource.writeStats(stream);
+
+    stream << ",\n  \"latency\": {";
+    for (int i = 0; i < ENDPOINT_COUNT; ++i) {
+      const LatencyHistogram &histogram = mLatency[i];
+
+      stream
+        << ((i > 0) ? ",\n" : "\n")
+        << "    \"" << names[i] << "\": {"
+        << "\"count\": " << histogram.count()
+        << ", \"mean\": " << (uint64_t) histogram.mean()
+        << ", \"p50\": " << histogram.percentile(0.5)
+        << ", \"p90\": " << histogram.percentile(0.9)
+        << ", \"p99\": " << histogram.percentile(0.99)
+        << ", \"p999\": " << histogram.percentile(0.999)
+        << ", \"max\": " << histogram.max()
+        << ", \"buckets\": [";
+
+      // Only buckets with values are listed, as [upper bound, count] pairs
+      bool first = true;
+      for (unsigned int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; ++bucket) {
+        const uint64_t count = histogram.bucketCount(bucket);
+        if (count > 0) {
+          stream << (first ? "" : ", ") << "[" << LatencyHistogram::bucketUpperBound(bucket) << ", " << count << "]";
+          first = false;
+        }
+      }
+
+      stream << "]}";
+    }
+    stream << "\n  }\n}\n";
+
+    return stream.str();
+  }
+
+  TileSource &mSource;
+  LayerFile &mLayer;            ///< The contents of `layer.json`, if any
+  const TerrainServe &mOptions;
+  int mListenFd;
+  const chrono::steady_clock::time_point mStarted;
+
+  /// Response times in microseconds for each endpoint
+  LatencyHistogram mLatency[ENDPOINT_COUNT];
+
+  atomic<uint64_t> mConnectionIds; ///< The id of the next connection
+  atomic<uint64_t> mOpenConnections, mTotalConnections, mRequests, mNotFound, mErrors, mBytes;
+};
+
+/**
+ * Create tiles from a GDAL dataset
+ *
+ * The `layer.json` describes every tile within the extent of the dataset.
+ */
+static unique_ptr<TileSource>
+openDataset(const TerrainServe &command, const TileCodec &codec, unique_ptr<LayerFile> &layer) {
+  const string filename = command.getTileset();
+  Grid grid;
+  string projection;
+
+  // Terrain tiles are always 65 cells across
+  if (strcmp(command.profile, "geodetic") == 0) {
+    grid = GlobalGeodetic(65);
+    projection = "EPSG:4326";
+  } else if (strcmp(command.profile, "mercator") == 0) {
+    grid = GlobalMercator(65);
+    projection = "EPSG:3857";
+  } else {
+    throw CTBException("Unknown profile");
+  }
+
+  unique_ptr<TileStore> diskCache;
+  if (command.diskCache != NULL) {
+    diskCache.reset(new DirectoryTileStore(command.diskCache, "terrain", true));
+
+    // Cached tiles are served as having the compression of generated tiles
+    const TileCodec::Format recorded = TileCodec::recorded(command.diskCache);
+    if (recorded != TileCodec::FORMAT_UNKNOWN && recorded != codec.format()) {
+      throw CTBException("The disk cache holds tiles compressed differently");
+    }
+    codec.record(command.diskCache);
+  }
+
+  unique_ptr<OnDemandTiler> tiler(new OnDemandTiler(filename, grid, TilerOptions(), codec,
+                                                    (size_t) max(command.cacheSize, 0) * 1024 * 1024,
+                                                    move(diskCache),
+                                                    (unsigned int) max(command.prefetchThreads, 0),
+                                                    (unsigned int) ((command.tileThreads >= 0) ? command.tileThreads : CPLGetNumCPUs())));
+
+  LayerJson json(CPLGetBasename(filename.c_str()), projection);
+  for (i_zoom zoom = 0; zoom <= tiler->maxZoomLevel(); ++zoom) {
+    json.addAvailable(zoom, tiler->tileBoundsForZoom(zoom));
+  }
+  layer.reset(new LayerFile(make_shared<const string>(json.toString())));
+
+  return unique_ptr<TileSource>(new GenerateSource(move(tiler), codec.format()));
+}
+
+/**
+ * Open a tileset
+ *
+ * `layer.json` is kept alongside containers and inside directories, and
+ * isn't served while it doesn't exist.
+ */
+static unique_ptr<TileSource>
+openTileset(const TerrainServe &command, unique_ptr<LayerFile> &layer) {
+  const string tileset = command.getTileset();
+  unique_ptr<TileStore> store = TileStore::open(tileset, "terrain", false);
+  const TileCodec::Format format = TileCodec::recorded(tileset);
+  unique_ptr<TileSource> source;
+
+  if (dynamic_cast<DirectoryTileStore *>(store.get())) {
+    source.reset(new DirectorySource(move(store), format, (size_t) max(command.handleCount, 1)));
+  } else if (dynamic_cast<TilePackStore *>(store.get())) {
+    source.reset(new PackSource(move(store), format));
+  } else {
+    source.reset(new StoreSource(move(store), format));
+  }
+
+  const string layerFilename = tileset + (TileStore::isContainer(tileset) ? ".layer.json" : "/layer.json");
+  layer.reset(new LayerFile(layerFilename));
+  if (!layer->get() && command.verbosity > 0) {
+    cerr << "Warning: " << layerFilename << " does not exist so it won't be served until it is created" << endl;
+  }
+
+  return source;
+}
+
+int
+main(int argc, char *argv[]) {
+  // Specify the command line interface
+  TerrainServe command(argv[0], version.cstr);
+  command.setUsage("[options] TILESET|GDAL_DATASET");
+  command.option("-a", "--address <address>", "specify the address to listen on (defaults to 127.0.0.1). Use 0.0.0.0 to listen on all interfaces", TerrainServe::setAddress);
+  command.option("-p", "--port <port>", "specify the port to listen on (defaults to 8000)", TerrainServe::setPort);
+  command.option("-c", "--thread-count <count>", "specify the number of threads serving requests. On multicore machines this defaults to the number of CPUs", TerrainServe::setThreadCount);
+  command.option("-H", "--handle-count <count>", "specify the number of open tile files to cache when serving a directory (defaults to 4096)", TerrainServe::setHandleCount);
+  command.option("-t", "--idle-timeout <seconds>", "specify how long idle connections are kept open (defaults to 60)", TerrainServe::setIdleTimeout);
+  command.option("-g", "--generate", "create tiles from a GDAL dataset when they are first requested instead of serving a tileset", TerrainServe::setGenerate);
+  command.option("-P", "--profile <profile>", "specify the TMS profile for generated tiles. This is either `geodetic` (the default) or `mercator`", TerrainServe::setProfile);
+  command.option("-C", "--compression <codec>", "specify the compression of generated tiles in the form CODEC[:LEVEL] (defaults to gzip)", TerrainServe::setCompression);
+  command.option("-M", "--cache-size <megabytes>", "specify the size of the memory cache of generated tiles (defaults to 256)", TerrainServe::setCacheSize);
+  command.option("-d", "--disk-cache <dir>", "keep generated tiles in a directory so they are only ever created once", TerrainServe::setDiskCache);
+  command.option("-f", "--prefetch-threads <count>", "specify the number of threads creating the children of requested tiles in advance (defaults to 1). Use 0 to disable prefetching", TerrainServe::setPrefetchThreads);
+  command.option("-w", "--tile-threads <count>", "specify the number of threads creating requested tiles, so that threads serving requests don't wait for them. This defaults to the number of CPUs. Use 0 to create tiles on the threads serving requests", TerrainServe::setTileThreads);
+  command.option("-q", "--quiet", "only output errors", TerrainServe::setQuiet);
+  command.option("-v", "--verbose", "log every request", TerrainServe::setVerbose);
+
+  // Parse and check the arguments
+  command.parse(argc, argv);
+  command.check();
+
+  const string tileset = command.getTileset();
+  unique_ptr<TileCodec> codec;
+  unique_ptr<TileSource> source;
+  unique_ptr<LayerFile> layer;
+
+  try {
+    if (command.generate) {
+      GDALAllRegister();
+      codec = TileCodec::create(command.compression);
+      source = openDataset(command, *codec, layer);
+    } else {
+      source = openTileset(command, layer);
+    }
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << tileset << endl;
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  TileServer server(*source, *layer, command);
+  try {
+    server.listen(command.address, command.port);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << command.address << ":" << command.port << endl;
+    return 1;
+  }
+
+  if (command.verbosity > 0) {
+    cout << "Serving " << tileset << " at http://" << command.address << ":" << command.port << "/" << endl;
+  }
+
+  int threadCount = (command.threadCount > 0) ? command.threadCount : CPLGetNumCPUs();
+  try {
+    server.run(threadCount);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -33,14 +33,33 @@
  * in other raster formats that are supported by GDAL.
  */
 
+#include <atomic>
+#include <chrono>
+#include <cmath>                // for fabs
+#include <condition_variable>
 #include <iostream>
 #include <sstream>
 #include <string.h>             // for strcmp
+#include <stdio.h>              // for sscanf
 #include <stdlib.h>             // for atoi
 #include <thread>
 #include <mutex>
 #include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_set>
+
+#include "config.hpp"           // for CTB_HAVE_INOTIFY
+
+#ifdef CTB_HAVE_INOTIFY
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
 
+#include "cpl_conv.h"           // for CPLGetBasename
 #include "cpl_multiproc.h"      // for CPLGetNumCPUs
 #include "cpl_vsi.h"            // for virtual filesystem
 #include "gdal_priv.h"
@@ -49,15 +68,52 @@
 #include "GlobalMercator.hpp"
 #include "RasterIterator.hpp"
 #include "TerrainIterator.hpp"
+#include "TileCodec.hpp"
+#include "Cutline.hpp"
+#include "DeduplicatingTileStore.hpp"
+#include "DirectoryTileStore.hpp"
+#include "LayerJson.hpp"
+#include "SourceFingerprint.hpp"
+#include "TileHeightIndex.hpp"
+#include "TileHash.hpp"
+#include "TileIndex.hpp"
+#include "TilePriority.hpp"
+#include "WorkQueue.hpp"
 
 using namespace std;
 using namespace ctb;
 
-#ifdef _WIN32
-static const char *osDirSep = "\\";
-#else
-static const char *osDirSep = "/";
-#endif
+/// A terrain tile waiting to be written when building adaptively
+struct AdaptiveTile {
+  TileCoordinate coord;
+  unique_ptr<TerrainTile> tile; ///< The tile, if it has already been created
+};
+
+/// A raster output created alongside the main output from the same source
+struct ExtraOutput {
+  string dir;
+  GDALDriver *driver;
+  string extension;             ///< The file extension of the format, if any
+  Grid grid;                    ///< The grid of the profile at the output's tile size
+  unique_ptr<TileStore> store;
+};
+
+/// A scratch file which is removed however `main` returns
+struct ScratchFile {
+  const char *filename = NULL;  ///< The file to remove, if any
+
+  /// Remove the file now rather than on leaving scope
+  void remove() {
+    if (filename != NULL) {
+      VSIUnlink(filename);
+      filename = NULL;
+    }
+  }
+
+  ~ScratchFile() {
+    remove();
+  }
+};
 
 /// Handle the terrain build CLI options
 class TerrainBuild : public Command {
@@ -67,11 +123,34 @@ public:
     outputDir("."),
     outputFormat("Terrain"),
     profile("geodetic"),
+    prewarpFilename(NULL),
+    compression("gzip"),
+    bbox(NULL),
+    cutlineFilename(NULL),
+    priorityLogFilename(NULL),
+    priorityRegionsFilename(NULL),
+    priorityNext(0),
+    priorityDone(0),
+    watchDir(NULL),
+    watchDelay(10),
+    updateNext(0),
+    queueDir(NULL),
+    leaseSeconds(300),
+    queueTiles(0),
+    queueCreated(0),
+    queueFinished(false),
     threadCount(-1),
     tileSize(0),
     startZoom(-1),
     endZoom(-1),
-    verbosity(1)
+    verbosity(1),
+    deduplicate(false),
+    skipUnchanged(false),
+    unchangedCount(0),
+    adaptiveError(-1),
+    adaptiveBusy(0),
+    adaptiveCount(0),
+    adaptiveFailed(false)
   {}
 
   void
@@ -126,6 +205,76 @@ public:
     static_cast<TerrainBuild *>(Command::self(command))->endZoom = atoi(command->arg);
   }
 
+  static void
+  setPrewarpFilename(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->prewarpFilename = command->arg;
+  }
+
+  static void
+  setCompression(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->compression = command->arg;
+  }
+
+  static void
+  setDeduplicate(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->deduplicate = true;
+  }
+
+  static void
+  setSkipUnchanged(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->skipUnchanged = true;
+  }
+
+  static void
+  setBBox(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->bbox = command->arg;
+  }
+
+  static void
+  setCutlineFilename(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->cutlineFilename = command->arg;
+  }
+
+  static void
+  setPriorityLogFilename(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->priorityLogFilename = command->arg;
+  }
+
+  static void
+  setPriorityRegionsFilename(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->priorityRegionsFilename = command->arg;
+  }
+
+  static void
+  setWatchDir(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->watchDir = command->arg;
+  }
+
+  static void
+  setWatchDelay(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->watchDelay = atoi(command->arg);
+  }
+
+  static void
+  setQueueDir(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->queueDir = command->arg;
+  }
+
+  static void
+  setLeaseSeconds(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->leaseSeconds = atoi(command->arg);
+  }
+
+  static void
+  setAdaptiveError(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->adaptiveError = atof(command->arg);
+  }
+
+  static void
+  addExtraOutput(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->extraOutputSpecs.push_back(command->arg);
+  }
+
   static void
   setQuiet(command_t *command) {
     --(static_cast<TerrainBuild *>(Command::self(command))->verbosity);
@@ -151,6 +300,11 @@ public:
     static_cast<TerrainBuild *>(Command::self(command))->tilerOptions.warpMemoryLimit = atof(command->arg);
   }
 
+  static void
+  setWarpedVRT(command_t *command) {
+    static_cast<TerrainBuild *>(Command::self(command))->tilerOptions.useWarpedVRT = true;
+  }
+
   const char *
   getInputFilename() const {
     return  (command->argc == 1) ? command->argv[0] : NULL;
@@ -158,7 +312,76 @@ public:
 
   const char *outputDir,
     *outputFormat,
-    *profile;
+    *profile,
+    *prewarpFilename,
+    *compression,
+    *bbox,
+    *cutlineFilename,
+    *priorityLogFilename,
+    *priorityRegionsFilename;
+
+  /// The region of the grid CRS which tiling is restricted to, if any
+  unique_ptr<CRSBounds> clipBounds;
+
+  /// The polygon region which tiling is restricted to, if any
+  shared_ptr<const Cutline> cutline;
+
+  /// The weights of the tiles to create before any others
+  TilePriority priority;
+
+  /// The tiles to create first, in order, shared between the threads along
+  /// with the index of the next one to create and the number created
+  vector<TileCoordinate> prioritySchedule;
+  unordered_set<uint64_t> priorityKeys;
+  once_flag priorityOnce;
+  atomic<size_t> priorityNext, priorityDone;
+
+  /// The `layer.json` metadata listing only the priority tiles
+  unique_ptr<LayerJson> priorityLayer;
+
+  /// The directory of source files to watch for changes, if any, and the
+  /// seconds without a change to wait for before updating the tiles
+  const char *watchDir;
+  int watchDelay;
+
+  /// The tiles affected by changed source files, shared between the threads
+  /// along with the index of the next one to update
+  vector<TileCoordinate> updates;
+  atomic<size_t> updateNext;
+
+  /// The directory of a work queue shared with other processes, if any, and
+  /// the seconds a lease on one of its units lasts
+  const char *queueDir;
+  int leaseSeconds;
+
+  /// The units of the work queue and a description of the job they belong
+  /// to, along with the number of tiles in them and the number created here
+  vector<WorkQueue::Unit> queueUnits;
+  string queueJob;
+  once_flag queueOnce;
+  size_t queueTiles;
+  atomic<size_t> queueCreated;
+
+  /// Whether a thread has seen every unit of the work queue completed
+  atomic<bool> queueFinished;
+
+  /// The codec used to compress terrain tiles
+  unique_ptr<TileCodec> codec;
+
+  /// Where the tiles are written
+  unique_ptr<TileStore> store;
+
+  /// The `layer.json` metadata for terrain tiles
+  unique_ptr<LayerJson> layer;
+
+  /// Ensure the tiles available are recorded by only one thread
+  once_flag layerOnce;
+
+  /// The range of heights in each terrain tile
+  TileHeightIndex heights;
+
+  /// The dataset the tilers read from (either the input or the prewarped file)
+  string sourceFilename;
 
   int threadCount,
     tileSize,
@@ -166,60 +389,57 @@ public:
     endZoom,
     verbosity;
 
-  CPLStringList creationOptions;
-  TilerOptions tilerOptions;
-};
+  bool deduplicate,
+    skipUnchanged;
 
-/**
- * Create a filename for a tile coordinate
- *
- * This also creates the tile directory structure.
- */
-static string
-getTileFilename(const TileCoordinate *coord, const string dirname, const char *extension) {
-  static mutex mutex;
-  VSIStatBufL stat;
-  string filename = dirname + static_cast<ostringstream*>
-    (
-     &(ostringstream()
-       << coord->zoom
-       << osDirSep
-       << coord->x)
-     )->str();
+  /// The fingerprints of the terrain tiles' sources, when skipping tiles
+  /// whose sources are unchanged, along with the number skipped
+  unique_ptr<SourceFingerprint> fingerprints;
+  string fingerprintsFilename;
+  atomic<size_t> unchangedCount;
 
-  lock_guard<std::mutex> lock(mutex);
+  /// The error in metres below which children aren't created, or negative
+  double adaptiveError;
 
-  // Check whether the `{zoom}/{x}` directory exists or not
-  if (VSIStatExL(filename.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
-    filename = dirname + static_cast<ostringstream*>(&(ostringstream() << coord->zoom))->str();
+  /// The tiles waiting to be written when building adaptively, shared
+  /// between the threads along with the number of tiles being processed
+  vector<AdaptiveTile> adaptiveQueue;
+  mutex adaptiveMutex;
+  condition_variable adaptiveReady;
+  once_flag adaptiveOnce;
+  int adaptiveBusy, adaptiveCount;
+  bool adaptiveFailed;
 
-    // Check whether the `{zoom}` directory exists or not
-    if (VSIStatExL(filename.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
-      // Create the `{zoom}` directory
-      if (VSIMkdir(filename.c_str(), 0755))
-        throw CTBException("Could not create the zoom level directory");
+  /// The raster outputs created alongside the main output, as given on the
+  /// command line and once they are set up
+  vector<string> extraOutputSpecs;
+  vector<unique_ptr<ExtraOutput>> extraOutputs;
 
-    } else if (!VSI_ISDIR(stat.st_mode)) {
-      throw CTBException("Zoom level file path is not a directory");
-    }
+  /// The tiles written, when they don't fill the extent of the tiler
+  vector<TileCoordinate> written;
+  mutex writtenMutex;
 
-    // Create the `{zoom}/{x}` directory
-    filename += static_cast<ostringstream*>(&(ostringstream() << osDirSep << coord->x))->str();
-    if (VSIMkdir(filename.c_str(), 0755))
-      throw CTBException("Could not create the x level directory");
+  CPLStringList creationOptions;
+  TilerOptions tilerOptions;
+};
 
-  } else if (!VSI_ISDIR(stat.st_mode)) {
-    throw CTBException("X level file path is not a directory");
+/// Describe where a tile is stored, for reporting progress
+static string
+getTileName(const TileCoordinate &coord, const TerrainBuild *command) {
+  const TileStore *store = command->store.get();
+  const DeduplicatingTileStore *deduplicating = dynamic_cast<const DeduplicatingTileStore *>(store);
+  if (deduplicating) {
+    store = &(deduplicating->store());
   }
 
-  // Create the filename itself, adding the extension if required
-  filename += static_cast<ostringstream*>(&(ostringstream() << osDirSep << coord->y))->str();
-  if (extension != NULL) {
-    filename += ".";
-    filename += extension;
+  const DirectoryTileStore *directory = dynamic_cast<const DirectoryTileStore *>(store);
+  if (directory) {
+    return directory->tileFilename(coord);
   }
 
-  return filename;
+  ostringstream stream;
+  stream << command->outputDir << ":" << coord.zoom << "/" << coord.x << "/" << coord.y;
+  return stream.str();
 }
 
 /**
@@ -287,17 +507,125 @@ static GDALProgressFunc progressFunc = termProgress;
 
 /// Output the progress of the tiling operation
 int
-showProgress(int currentIndex, string filename) {
+showProgress(int currentIndex, string filename, int size = iteratorSize) {
   stringstream stream;
   stream << "created " << filename << " in thread " << this_thread::get_id();
   string message = stream.str();
 
-  return progressFunc(currentIndex / (double) iteratorSize, message.c_str(), NULL);
+  return progressFunc(currentIndex / (double) size, message.c_str(), NULL);
+}
+
+/// Is a tile entirely outside the polygon region being tiled?
+static bool
+isOutsideCutline(const GDALTiler &tiler, const TileCoordinate &coord) {
+  return tiler.cutline() && tiler.cutline()->coverage(tiler.grid().tileBounds(coord)) == Cutline::OUTSIDE;
+}
+
+/// Record a tile written, if the tiles written don't fill the tiler's extent
+static void
+recordWritten(const TileCoordinate &coord, TerrainBuild *command) {
+  if (command->cutline || command->adaptiveError >= 0) {
+    lock_guard<mutex> lock(command->writtenMutex);
+    command->written.push_back(coord);
+  }
+}
+
+/// Get the name of the in-memory file a thread creates the tiles of an output in
+static string
+getMemFilename(const char *extension, size_t output = 0) {
+  ostringstream memFilename;
+  memFilename << "/vsimem/ctb-tile-" << this_thread::get_id();
+  if (output > 0) {
+    memFilename << "-" << output;
+  }
+  if (extension != NULL && *extension) {
+    memFilename << "." << extension;
+  }
+
+  return memFilename.str();
+}
+
+/**
+ * Copy a raster tile to a tile store in a GDAL format
+ *
+ * Tiles destined for a directory are written in place, otherwise they are
+ * created in memory and copied to the store.
+ */
+static void
+writeRasterTile(GDALDriver *poDriver, TileStore *store, GDALDataset *poTile, const TileCoordinate &coord,
+                char **creationOptions, const string &memFilename) {
+  DirectoryTileStore *directory = dynamic_cast<DirectoryTileStore *>(store);
+  const string filename = directory ? directory->createTileFilename(coord) : memFilename;
+
+  GDALDataset *poDstDS = poDriver->CreateCopy(filename.c_str(), poTile, FALSE,
+                                              creationOptions, NULL, NULL );
+
+  // Close the datasets, flushing data to destination
+  if (poDstDS == NULL) {
+    throw CTBException("Could not create GDAL tile");
+  }
+
+  GDALClose(poDstDS);
+
+  if (!directory) {
+    vsi_l_offset length;
+    const GByte *data = VSIGetMemFileBuffer(filename.c_str(), &length, FALSE);
+    if (data == NULL) {
+      throw CTBException("Could not read the GDAL tile from memory");
+    }
+
+    store->writeTile(coord, data, (size_t) length);
+    VSIUnlink(filename.c_str());
+  }
+}
+
+/**
+ * Write the tiles of the extra raster outputs at a tile coordinate
+ *
+ * The tilers of the outputs share the thread's handle on the source dataset,
+ * so the source blocks read for a tile are still cached when the next output
+ * reads the same area.  Outputs with the same tile size are aligned, so their
+ * tile is only warped once: each format is copied from the same warped
+ * dataset, whose blocks are cached as they are read.  `mainTile` is the raster
+ * tile of the main output if it has one, which outputs of the same size copy
+ * from rather than warping again.
+ */
+static void
+writeExtraTiles(const vector<unique_ptr<RasterTiler>> &tilers, const TileCoordinate &coord,
+                TerrainBuild *command, const GDALTile *mainTile = NULL) {
+  map<i_tile, unique_ptr<GDALTile>> warped; // the tiles warped, by tile size
+
+  for (size_t i = 0; i < tilers.size(); ++i) {
+    const RasterTiler &tiler = *tilers[i];
+    const ExtraOutput &output = *(command->extraOutputs[i]);
+    const i_zoom startZoom = (command->startZoom < 0) ? tiler.maxZoomLevel() : command->startZoom;
+
+    if (coord.zoom > startZoom || isOutsideCutline(tiler, coord)) {
+      continue;
+    }
+
+    const i_tile tileSize = output.grid.tileSize();
+    GDALDataset *poTile;
+
+    if (mainTile && (i_tile) mainTile->dataset->GetRasterXSize() == tileSize) {
+      poTile = mainTile->dataset;
+    } else {
+      unique_ptr<GDALTile> &tile = warped[tileSize];
+      if (!tile) {
+        tile = tiler.createRasterTile(coord);
+      }
+      poTile = tile->dataset;
+    }
+
+    writeRasterTile(output.driver, output.store.get(), poTile, coord, NULL,
+                    getMemFilename(output.extension.c_str(), i + 1));
+  }
 }
 
-/// Output GDAL tiles represented by a tiler to a directory
+/// Output GDAL tiles represented by a tiler to the tile store
 static void
-buildGDAL(const RasterTiler &tiler, TerrainBuild *command) {
+buildGDAL(const RasterTiler &tiler, TerrainBuild *command,
+          const vector<unique_ptr<RasterTiler>> &extraTilers) {
   GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName(command->outputFormat);
 
   if (poDriver == NULL) {
@@ -309,112 +637,940 @@ buildGDAL(const RasterTiler &tiler, TerrainBuild *command) {
   }
 
   const char *extension = poDriver->GetMetadataItem(GDAL_DMD_EXTENSION);
-  const string dirname = string(command->outputDir) + osDirSep;
   i_zoom startZoom = (command->startZoom < 0) ? tiler.maxZoomLevel() : command->startZoom,
     endZoom = (command->endZoom < 0) ? 0 : command->endZoom;
 
+  const string memFilename = getMemFilename(extension);
+
   RasterIterator iter(tiler, startZoom, endZoom);
   int currentIndex = incrementIterator(iter, 0);
   setIteratorSize(iter);
 
   while (!iter.exhausted()) {
-    GDALTile *tile = *iter;
-    GDALDataset *poDstDS;
-    const string filename = getTileFilename(tile, dirname, extension);
+    if (isOutsideCutline(tiler, iter.coordinate())) {
+      currentIndex = incrementIterator(iter, currentIndex);
+      continue;
+    }
+
+    unique_ptr<GDALTile> tile = *iter;
+    const TileCoordinate coord = *tile;
+
+    writeRasterTile(poDriver, command->store.get(), tile->dataset, coord,
+                    command->creationOptions.List(), memFilename);
+    writeExtraTiles(extraTilers, coord, command, tile.get());
+    tile.reset();
 
-    poDstDS = poDriver->CreateCopy(filename.c_str(), tile->dataset, FALSE,
-                                   command->creationOptions.List(), NULL, NULL );
-    delete tile;
+    currentIndex = incrementIterator(iter, currentIndex);
+    showProgress(currentIndex, getTileName(coord, command));
+  }
+}
 
-    // Close the datasets, flushing data to destination
-    if (poDstDS == NULL) {
-      throw CTBException("Could not create GDAL tile");
+/**
+ * Create and write a terrain tile, reusing the tile and buffer given
+ *
+ * When skipping unchanged tiles the tile isn't created if its source is
+ * unchanged since it was last written.  Its heights are recorded in the
+ * command's height index unless another one is given.
+ */
+static void
+writeTerrainTile(const TerrainTiler &tiler, const TileCoordinate &coord, TerrainBuild *command,
+                 TerrainTile &tile, vector<unsigned char> &buffer, TileHeightIndex *heights = NULL) {
+  uint64_t fingerprint = 0;
+  if (command->fingerprints) {
+    fingerprint = command->fingerprints->fingerprint(tiler, coord);
+
+    if (command->fingerprints->unchanged(coord, fingerprint)) {
+      ++command->unchangedCount;
+      recordWritten(coord, command);
+      return;
     }
+  }
 
-    GDALClose(poDstDS);
+  tiler.createTerrainTile(coord, tile);
 
-    currentIndex = incrementIterator(iter, currentIndex);
-    showProgress(currentIndex, filename);
+  tile.encode(buffer, *(command->codec));
+  command->store->writeTile(tile, buffer.data(), buffer.size());
+  (heights ? *heights : command->heights).add(tile, tile, buffer.size());
+  recordWritten(tile, command);
+
+  if (command->fingerprints) {
+    command->fingerprints->record(coord, fingerprint);
+  }
+}
+
+/**
+ * Output the priority terrain tiles before any others
+ *
+ * The tiles are shared out between the threads in order of weight.  Once the
+ * last one is written a `layer.json` listing only these tiles is written to an
+ * output directory, so the areas of most interest can be served whilst the
+ * rest of the tileset is built.  Containers are only readable once closed, so
+ * they gain nothing from this beyond the order the tiles are written in.
+ */
+static void
+buildPriorityTerrain(const TerrainTiler &tiler, TerrainBuild *command, i_zoom startZoom, i_zoom endZoom,
+                     TerrainTile &tile, vector<unsigned char> &buffer) {
+  call_once(command->priorityOnce, [&] {
+    command->prioritySchedule = command->priority.schedule(tiler, startZoom, endZoom);
+    for (const TileCoordinate &coord: command->prioritySchedule) {
+      command->priorityKeys.insert(TileStore::tileKey(coord));
+    }
+  });
+
+  const size_t count = command->prioritySchedule.size();
+  size_t index;
+
+  while ((index = command->priorityNext++) < count) {
+    const TileCoordinate &coord = command->prioritySchedule[index];
+    writeTerrainTile(tiler, coord, command, tile, buffer);
+
+    showProgress((int) index + 1, getTileName(coord, command));
+
+    if (++command->priorityDone == count && !TileStore::isContainer(command->outputDir)) {
+      const string filename = string(command->outputDir) + "/layer.json";
+      command->priorityLayer->addAvailable(TileIndex::build(command->prioritySchedule));
+
+      // The full tileset is still described when tiling finishes
+      try {
+        command->priorityLayer->writeFile(filename);
+      } catch (CTBException &e) {
+        cerr << "Warning: " << e.what() << ": " << filename << endl;
+      }
+    }
+  }
+}
+
+/// The number of tiles in each unit of a work queue
+static const size_t cQueueUnitTiles = 1024;
+
+/**
+ * Output the terrain tiles in the units of a work queue shared with other
+ * processes
+ *
+ * Each thread is a worker on the queue, claiming units until they are all
+ * complete, and waiting to take over any unit whose lease expires whilst
+ * other workers hold the last ones.  The heights of the tiles in a unit are
+ * saved with the unit, as another process may be the one to finish the queue.
+ */
+static void
+buildQueuedTerrain(const TerrainTiler &tiler, TerrainBuild *command, i_zoom startZoom, i_zoom endZoom) {
+  // The job is described by everything which decides the tiles created
+  call_once(command->queueOnce, [&] {
+    command->queueUnits = WorkQueue::partition(tiler, startZoom, endZoom, cQueueUnitTiles);
+
+    ostringstream job;
+    job << version.cstr << '\n' << command->profile << '\n' << tiler.grid().tileSize() << '\n'
+        << command->compression << '\n' << command->tilerOptions.errorThreshold << '\n'
+        << command->tilerOptions.analyticTransform << '\n';
+    for (i_zoom zoom = endZoom; zoom <= startZoom; ++zoom) {
+      const TileBounds tiles = tiler.tileBoundsForZoom(zoom);
+      job << zoom << ' ' << tiles.getMinX() << ' ' << tiles.getMinY() << ' '
+          << tiles.getMaxX() << ' ' << tiles.getMaxY() << '\n';
+      command->queueTiles += ((size_t) tiles.getMaxX() - tiles.getMinX() + 1)
+        * ((size_t) tiles.getMaxY() - tiles.getMinY() + 1);
+    }
+    command->queueJob = job.str();
+  });
+
+  WorkQueue queue(command->queueDir, command->queueJob, command->queueUnits, command->leaseSeconds);
+  TerrainTile tile(TileCoordinate(startZoom, 0, 0));
+  vector<unsigned char> buffer;
+  WorkQueue::Unit unit;
+
+  while (true) {
+    if (!queue.claim(unit)) {
+      if (queue.finished()) break;
+
+      this_thread::sleep_for(chrono::seconds(min(5u, queue.leaseSeconds())));
+      continue;
+    }
+
+    TileHeightIndex unitHeights;
+    bool held = true;
+
+    for (i_tile y = unit.tiles.getMinY(); held && y <= unit.tiles.getMaxY(); ++y) {
+      for (i_tile x = unit.tiles.getMinX(); held && x <= unit.tiles.getMaxX(); ++x) {
+        const TileCoordinate coord(unit.zoom, x, y);
+        writeTerrainTile(tiler, coord, command, tile, buffer, &unitHeights);
+
+        showProgress((int) ++command->queueCreated, getTileName(coord, command), (int) command->queueTiles);
+        held = queue.renew();
+      }
+    }
+
+    // A unit is only complete once the heights of its tiles are saved
+    if (held && queue.renew()) {
+      unitHeights.save(queue.resultFilename(unit));
+      queue.complete();
+    }
   }
+
+  command->queueFinished = true;
 }
 
-/// Output terrain tiles represented by a tiler to a directory
+/// Output terrain tiles represented by a tiler to the tile store
 static void
-buildTerrain(const TerrainTiler &tiler, TerrainBuild *command) {
-  const string dirname = string(command->outputDir) + osDirSep;
+buildTerrain(const TerrainTiler &tiler, TerrainBuild *command,
+             const vector<unique_ptr<RasterTiler>> &extraTilers) {
   i_zoom startZoom = (command->startZoom < 0) ? tiler.maxZoomLevel() : command->startZoom,
     endZoom = (command->endZoom < 0) ? 0 : command->endZoom;
 
+  // Every tile within the extent of the tiler is created at each zoom level,
+  // unless a cutline leaves some out
+  call_once(command->layerOnce, [&] {
+    if (command->cutline) return;
+
+    const CRSBounds &bounds = tiler.bounds();
+    for (i_zoom zoom = endZoom; zoom <= startZoom; ++zoom) {
+      command->layer->addAvailable(zoom, TileBounds(tiler.grid().crsToTile(bounds.getLowerLeft(), zoom),
+                                                    tiler.grid().crsToTile(bounds.getUpperRight(), zoom)));
+    }
+  });
+
+  if (command->queueDir != NULL) {
+    buildQueuedTerrain(tiler, command, startZoom, endZoom);
+    return;
+  }
+
   TerrainIterator iter(tiler, startZoom, endZoom);
   int currentIndex = incrementIterator(iter, 0);
   setIteratorSize(iter);
 
+  // The same tile and buffer are reused for every iteration
+  TerrainTile tile(iter.coordinate());
+  vector<unsigned char> buffer;
+
+  if (command->priorityLayer) {
+    buildPriorityTerrain(tiler, command, startZoom, endZoom, tile, buffer);
+  }
+
+  // Create the remaining tiles, skipping those already created first
   while (!iter.exhausted()) {
-    TerrainTile *tile = *iter;
-    const string filename = getTileFilename(tile, dirname, "terrain");
+    if (isOutsideCutline(tiler, iter.coordinate())
+        || command->priorityKeys.count(TileStore::tileKey(iter.coordinate()))) {
+      currentIndex = incrementIterator(iter, currentIndex);
+      continue;
+    }
 
-    tile->writeFile(filename.c_str());
-    delete tile;
+    const TileCoordinate coord = iter.coordinate();
+    writeTerrainTile(tiler, coord, command, tile, buffer);
+    writeExtraTiles(extraTilers, coord, command);
 
     currentIndex = incrementIterator(iter, currentIndex);
-    showProgress(currentIndex, filename);
+    showProgress(currentIndex, getTileName(coord, command));
+  }
+}
+
+/// Does a terrain tile have the child in the quadrant given by `dx` and `dy`?
+static bool
+hasChild(const Terrain &terrain, i_tile dx, i_tile dy) {
+  if (dy) {
+    return dx ? terrain.hasChildNE() : terrain.hasChildNW();
+  } else {
+    return dx ? terrain.hasChildSE() : terrain.hasChildSW();
+  }
+}
+
+/// Clear the flag of the child in the quadrant given by `dx` and `dy`
+static void
+clearChild(Terrain &terrain, i_tile dx, i_tile dy) {
+  if (dy) {
+    dx ? terrain.setChildNE(false) : terrain.setChildNW(false);
+  } else {
+    dx ? terrain.setChildSE(false) : terrain.setChildSW(false);
+  }
+}
+
+/**
+ * Get the largest difference in metres between a child tile and the parent
+ * tile upsampled bilinearly over the child's quadrant
+ *
+ * This is the error Cesium makes if it upsamples the parent in place of the
+ * child.  Heights run from the north west corner, so the northern children
+ * (`dy` of 1) cover the first half of the parent's rows.
+ */
+static double
+upsamplingError(const Terrain &parent, const Terrain &child, i_tile dx, i_tile dy) {
+  const vector<i_terrain_height> &parentHeights = parent.getHeights(),
+    &childHeights = child.getHeights();
+  const unsigned int last = TILE_SIZE - 1;
+  double error = 0;
+
+  for (unsigned int row = 0; row < TILE_SIZE; ++row) {
+    const double py = ((1 - dy) * last + row) / 2.0;
+    const unsigned int y0 = (unsigned int) py, y1 = min(y0 + 1, last);
+    const double fy = py - y0;
+
+    for (unsigned int column = 0; column < TILE_SIZE; ++column) {
+      const double px = (dx * last + column) / 2.0;
+      const unsigned int x0 = (unsigned int) px, x1 = min(x0 + 1, last);
+      const double fx = px - x0;
+
+      const double upsampled =
+        (1 - fy) * ((1 - fx) * parentHeights[y0 * TILE_SIZE + x0] + fx * parentHeights[y0 * TILE_SIZE + x1])
+        + fy * ((1 - fx) * parentHeights[y1 * TILE_SIZE + x0] + fx * parentHeights[y1 * TILE_SIZE + x1]);
+
+      error = max(error, fabs(childHeights[row * TILE_SIZE + column] - upsampled));
+    }
+  }
+
+  return error / 5;             // heights are stored in fifths of a metre
+}
+
+/**
+ * Output terrain tiles to the tile store, only descending where needed
+ *
+ * Each tile at the end zoom level is created, then the children of every tile
+ * are created and compared with the tile upsampled over them.  Children within
+ * the error threshold are dropped along with their descendants and their
+ * flags are cleared, so Cesium upsamples the parent instead.  The tiles
+ * waiting to be written are shared between the threads, each of which creates
+ * tiles with its own tiler.
+ */
+static void
+buildAdaptiveTerrain(const TerrainTiler &tiler, TerrainBuild *command) {
+  i_zoom startZoom = (command->startZoom < 0) ? tiler.maxZoomLevel() : command->startZoom,
+    endZoom = (command->endZoom < 0) ? 0 : command->endZoom;
+
+  // Progress is reported against every tile which could be created
+  TerrainIterator iter(tiler, startZoom, endZoom);
+  setIteratorSize(iter);
+
+  call_once(command->adaptiveOnce, [&] {
+    const CRSBounds &bounds = tiler.bounds();
+    const TileBounds tiles(tiler.grid().crsToTile(bounds.getLowerLeft(), endZoom),
+                           tiler.grid().crsToTile(bounds.getUpperRight(), endZoom));
+
+    for (i_tile x = tiles.getMinX(); x <= tiles.getMaxX(); ++x) {
+      for (i_tile y = tiles.getMinY(); y <= tiles.getMaxY(); ++y) {
+        const TileCoordinate coord(endZoom, x, y);
+        if (!isOutsideCutline(tiler, coord)) {
+          command->adaptiveQueue.push_back(AdaptiveTile{coord, nullptr});
+        }
+      }
+    }
+  });
+
+  vector<unsigned char> buffer;
+
+  while (true) {
+    AdaptiveTile current;
+    {
+      unique_lock<mutex> lock(command->adaptiveMutex);
+      command->adaptiveReady.wait(lock, [command] {
+          return command->adaptiveFailed || !command->adaptiveQueue.empty() || command->adaptiveBusy == 0;
+        });
+
+      if (command->adaptiveFailed || command->adaptiveQueue.empty()) {
+        return;
+      }
+
+      // Taking the most recent tile descends depth first, limiting memory
+      current = move(command->adaptiveQueue.back());
+      command->adaptiveQueue.pop_back();
+      ++command->adaptiveBusy;
+    }
+
+    vector<AdaptiveTile> children;
+    try {
+      if (!current.tile) {
+        current.tile = tiler.createTerrainTile(current.coord);
+      }
+
+      TerrainTile &tile = *current.tile;
+      const TileCoordinate &coord = current.coord;
+
+      if (coord.zoom < startZoom) {
+        for (i_tile dy = 0; dy < 2; ++dy) {
+          for (i_tile dx = 0; dx < 2; ++dx) {
+            if (!hasChild(tile, dx, dy)) continue;
+
+            const TileCoordinate childCoord(coord.zoom + 1, coord.x * 2 + dx, coord.y * 2 + dy);
+            unique_ptr<TerrainTile> child = tiler.createTerrainTile(childCoord);
+
+            if (upsamplingError(tile, *child, dx, dy) > command->adaptiveError) {
+              children.push_back(AdaptiveTile{childCoord, move(child)});
+            } else {
+              clearChild(tile, dx, dy);
+            }
+          }
+        }
+      }
+
+      tile.encode(buffer, *(command->codec));
+      command->store->writeTile(coord, buffer.data(), buffer.size());
+      command->heights.add(coord, tile, buffer.size());
+    } catch (...) {
+      {
+        lock_guard<mutex> lock(command->adaptiveMutex);
+        command->adaptiveFailed = true;
+        --command->adaptiveBusy;
+      }
+      command->adaptiveReady.notify_all();
+      throw;
+    }
+
+    int currentIndex;
+    {
+      lock_guard<mutex> lock(command->adaptiveMutex);
+      for (AdaptiveTile &child: children) {
+        command->adaptiveQueue.push_back(move(child));
+      }
+      --command->adaptiveBusy;
+
+      // The last tile completes the progress, as most tiles are never created
+      const bool finished = command->adaptiveQueue.empty() && command->adaptiveBusy == 0;
+      currentIndex = finished ? iteratorSize : ++command->adaptiveCount;
+    }
+    command->adaptiveReady.notify_all();
+
+    recordWritten(current.coord, command);
+    showProgress(currentIndex, getTileName(current.coord, command));
+  }
+}
+
+/// Restrict a tiler to the region given on the command line, if any
+static void
+restrictTiler(GDALTiler &tiler, const TerrainBuild *command) {
+  if (command->clipBounds) {
+    tiler.clip(*(command->clipBounds));
+  }
+
+  if (command->cutline) {
+    tiler.setCutline(command->cutline);
   }
 }
 
 /**
  * Perform a tile building operation
  *
- * This function is designed to be run in a separate thread.
+ * This function is designed to be run in a separate thread.  It returns
+ * non-zero if the thread failed to create all of its tiles.
  */
 static int
 runTiler(TerrainBuild *command, Grid *grid) {
-  GDALDataset  *poDataset = (GDALDataset *) GDALOpen(command->getInputFilename(), GA_ReadOnly);
+  GDALDataset  *poDataset = (GDALDataset *) GDALOpen(command->sourceFilename.c_str(), GA_ReadOnly);
   if (poDataset == NULL) {
     cerr << "Error: could not open GDAL dataset" << endl;
     return 1;
   }
 
+  int status = 0;
   try {
+    // The extra outputs read from the same dataset handle as the main output.
+    // VRT tiles are serialised along with their transformer, which is only
+    // possible with the GDAL transformer.
+    vector<unique_ptr<RasterTiler>> extraTilers;
+    for (const auto &output: command->extraOutputs) {
+      TilerOptions options = command->tilerOptions;
+      if (EQUAL(output->driver->GetDescription(), "VRT")) {
+        options.analyticTransform = false;
+      }
+
+      extraTilers.emplace_back(new RasterTiler(poDataset, output->grid, options));
+      restrictTiler(*extraTilers.back(), command);
+    }
+
     if (strcmp(command->outputFormat, "Terrain") == 0) {
-      const TerrainTiler tiler(poDataset, *grid);
-      buildTerrain(tiler, command);
+      TerrainTiler tiler(poDataset, *grid, command->tilerOptions);
+      restrictTiler(tiler, command);
+
+      if (command->adaptiveError < 0) {
+        buildTerrain(tiler, command, extraTilers);
+      } else {
+        buildAdaptiveTerrain(tiler, command);
+      }
     } else {                    // it's a GDAL format
-      const RasterTiler tiler(poDataset, *grid, command->tilerOptions);
-      buildGDAL(tiler, command);
+      TilerOptions options = command->tilerOptions;
+      if (EQUAL(command->outputFormat, "VRT")) {
+        options.analyticTransform = false;
+      }
+
+      RasterTiler tiler(poDataset, *grid, options);
+      restrictTiler(tiler, command);
+
+      buildGDAL(tiler, command, extraTilers);
     }
 
   } catch (CTBException &e) {
     cerr << "Error: " << e.what() << endl;
+    status = 1;
   }
 
   GDALClose(poDataset);
 
-  return 0;
+  return status;
 }
 
-int
-main(int argc, char *argv[]) {
-  // Specify the command line interface
-  TerrainBuild command = TerrainBuild(argv[0], version.cstr);
-  command.setUsage("[options] GDAL_DATASOURCE");
-  command.option("-o", "--output-dir <dir>", "specify the output directory for the tiles (defaults to working directory)", TerrainBuild::setOutputDir);
-  command.option("-f", "--output-format <format>", "specify the output format for the tiles. This is either `Terrain` (the default) or any format listed by `gdalinfo --formats`", TerrainBuild::setOutputFormat);
-  command.option("-p", "--profile <profile>", "specify the TMS profile for the tiles. This is either `geodetic` (the default) or `mercator`", TerrainBuild::setProfile);
-  command.option("-c", "--thread-count <count>", "specify the number of threads to use for tile generation. On multicore machines this defaults to the number of CPUs", TerrainBuild::setThreadCount);
-  command.option("-t", "--tile-size <size>", "specify the size of the tiles in pixels. This defaults to 65 for terrain tiles and 256 for other GDAL formats", TerrainBuild::setTileSize);
-  command.option("-s", "--start-zoom <zoom>", "specify the zoom level to start at. This should be greater than the end zoom level", TerrainBuild::setStartZoom);
-  command.option("-e", "--end-zoom <zoom>", "specify the zoom level to end at. This should be less than the start zoom level and >= 0", TerrainBuild::setEndZoom);
-  command.option("-n", "--creation-option <option>", "specify a GDAL creation option for the output dataset in the form NAME=VALUE. Can be specified multiple times. Not valid for Terrain tiles.", TerrainBuild::addCreationOption);
-  command.option("-z", "--error-threshold <threshold>", "specify the error threshold in pixel units for transformation approximation. Larger values should mean faster transforms. Defaults to 0.125", TerrainBuild::setErrorThreshold);
-  command.option("-m", "--warp-memory <bytes>", "The memory limit in bytes used for warp operations. Higher settings should be faster. Defaults to a conservative GDAL internal setting.", TerrainBuild::setWarpMemory);
-  command.option("-q", "--quiet", "only output errors", TerrainBuild::setQuiet);
-  command.option("-v", "--verbose", "be more noisy", TerrainBuild::setVerbose);
+/// Open a tile store, deduplicating tiles if requested
+static unique_ptr<TileStore>
+openStore(const TerrainBuild &command, const string &dir, const string &extension) {
+  unique_ptr<TileStore> store = TileStore::open(dir, extension, true);
 
-  // Parse and check the arguments
-  command.parse(argc, argv);
-  command.check();
+  // The manifest is kept alongside containers and inside directories
+  if (command.deduplicate) {
+    const string manifest = dir + (TileStore::isContainer(dir) ? ".tilehashes" : "/.tilehashes");
+    store.reset(new DeduplicatingTileStore(move(store), manifest));
+  }
 
-  GDALAllRegister();
+  return store;
+}
+
+/// Check that an output directory exists, unless it is a container
+static bool
+checkOutputDir(const string &dir) {
+  VSIStatBufL stat;
+  if (TileStore::isContainer(dir)) {
+    // the database is created if need be
+  } else if (VSIStatExL(dir.c_str(), &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
+    cerr << "Error: The output directory does not exist: " << dir << endl;
+    return false;
+  } else if (!VSI_ISDIR(stat.st_mode)) {
+    cerr << "Error: The output filepath is not a directory: " << dir << endl;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Set up a raster output to create alongside the main output
+ *
+ * The output is given as `FORMAT:SIZE:DIR`, where an empty size is 256
+ * pixels.  Its tiles use the profile of the main output, so they are aligned
+ * with the main tiles.
+ */
+static bool
+setUpExtraOutput(TerrainBuild &command, const string &spec) {
+  const size_t first = spec.find(':'),
+    second = (first == string::npos) ? string::npos : spec.find(':', first + 1);
+  if (second == string::npos || second + 1 == spec.size()) {
+    cerr << "Error: Extra outputs must be given as FORMAT:SIZE:DIR: " << spec << endl;
+    return false;
+  }
+
+  unique_ptr<ExtraOutput> output(new ExtraOutput());
+  const string format = spec.substr(0, first), size = spec.substr(first + 1, second - first - 1);
+  const int tileSize = size.empty() ? 256 : atoi(size.c_str());
+  output->dir = spec.substr(second + 1);
+  output->driver = GetGDALDriverManager()->GetDriverByName(format.c_str());
+
+  if (output->driver == NULL) {
+    cerr << "Error: Unknown output format: " << format << endl;
+    return false;
+  } else if (output->driver->pfnCreateCopy == NULL) {
+    cerr << "Error: The GDAL driver must be write enabled, specifically supporting 'CreateCopy': " << format << endl;
+    return false;
+  } else if (tileSize < 1) {
+    cerr << "Error: Invalid tile size: " << size << endl;
+    return false;
+  } else if (!checkOutputDir(output->dir)) {
+    return false;
+  }
+
+  if (strcmp(command.profile, "geodetic") == 0) {
+    output->grid = GlobalGeodetic(tileSize);
+  } else {
+    output->grid = GlobalMercator(tileSize);
+  }
+
+  const char *extension = output->driver->GetMetadataItem(GDAL_DMD_EXTENSION);
+  output->extension = (extension == NULL) ? "" : extension;
+
+  try {
+    output->store = openStore(command, output->dir, output->extension);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << output->dir << endl;
+    return false;
+  }
+
+  command.extraOutputs.push_back(move(output));
+  return true;
+}
+
+/// Describe the terrain tiles, alongside containers and inside directories
+static bool
+writeMetadata(TerrainBuild &command, const string &heightsFilename) {
+  const string filename = string(command.outputDir)
+    + (TileStore::isContainer(command.outputDir) ? ".layer.json" : "/layer.json");
+
+  try {
+    command.layer->writeFile(filename);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << filename << endl;
+    return false;
+  }
+
+  try {
+    command.heights.save(heightsFilename);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << heightsFilename << endl;
+    return false;
+  }
+
+  if (command.fingerprints) {
+    try {
+      command.fingerprints->save(command.fingerprintsFilename);
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.fingerprintsFilename << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Index the files the source is read from, to skip unchanged terrain tiles
+ *
+ * Everything on the command line which changes the tiles is hashed into the
+ * fingerprints, so changing any of it recreates every tile.
+ */
+static void
+indexSource(TerrainBuild &command, GDALDataset *poDataset, const Grid &grid) {
+  ostringstream settings;
+  settings << version.cstr << '\n' << command.profile << '\n' << grid.tileSize() << '\n'
+           << command.compression << '\n' << command.tilerOptions.errorThreshold << '\n'
+           << command.tilerOptions.analyticTransform << '\n';
+
+  if (command.cutlineFilename != NULL) {
+    VSIStatBufL stat;
+    settings << command.cutlineFilename;
+    if (VSIStatL(command.cutlineFilename, &stat) == 0) {
+      settings << '\n' << stat.st_size << '\n' << stat.st_mtime;
+    }
+  }
+
+  const string text = settings.str();
+  command.fingerprints->indexSource(poDataset, grid, TileHash::hash((const unsigned char *) text.data(), text.size()));
+}
+
+#ifdef CTB_HAVE_INOTIFY
+/// Get the extent of a raster in the grid CRS, if the file is a raster
+static bool
+getRasterExtent(const string &filename, const Grid &grid, CRSBounds &bounds) {
+  CPLPushErrorHandler(CPLQuietErrorHandler);
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(filename.c_str(), GA_ReadOnly);
+  CPLPopErrorHandler();
+
+  if (poDataset == NULL) {
+    return false;
+  }
+
+  bool found = true;
+  try {
+    bounds = RasterTiler(poDataset, grid).bounds();
+  } catch (CTBException &) {
+    found = false;              // it isn't georeferenced
+  }
+
+  GDALClose(poDataset);
+  return found;
+}
+
+/**
+ * Start watching the source directory for changed files
+ *
+ * The extent of every raster in the directory is recorded, so the area a file
+ * covered is still known once it has been replaced or removed.
+ */
+static int
+startWatching(const TerrainBuild &command, const Grid &grid, map<string, CRSBounds> &extents) {
+  const int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (inotify_add_watch(fd, command.watchDir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  char **names = VSIReadDir(command.watchDir);
+  for (int i = 0; names != NULL && names[i] != NULL; ++i) {
+    CRSBounds bounds;
+    if (names[i][0] != '.' && getRasterExtent(string(command.watchDir) + "/" + names[i], grid, bounds)) {
+      extents[names[i]] = bounds;
+    }
+  }
+  CSLDestroy(names);
+
+  return fd;
+}
+
+/**
+ * Wait for files in the watched directory to change, returning their names
+ *
+ * Files usually change in bursts, such as when a batch of rasters is copied
+ * in, so this only returns once no change has been seen for the delay.
+ * Hidden files are ignored as these are often partial copies.
+ */
+static set<string>
+waitForChanges(int fd, int delay) {
+  set<string> changed;
+  alignas(struct inotify_event) char buffer[4096];
+
+  while (true) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    const int ready = poll(&pfd, 1, changed.empty() ? -1 : delay * 1000);
+
+    if (ready == 0) {
+      return changed;           // the burst is over
+    } else if (ready < 0) {
+      if (errno == EINTR) continue;
+      throw CTBException("Could not wait for changes to the source files");
+    }
+
+    const ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR) continue;
+      throw CTBException("Could not read changes to the source files");
+    }
+
+    for (const char *position = buffer; position < buffer + length; ) {
+      const struct inotify_event *event = (const struct inotify_event *) position;
+      if (event->len > 0 && event->name[0] != '.') {
+        changed.insert(event->name);
+      }
+
+      position += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+/// Get the regions covered by changed files, both before and after the change
+static vector<CRSBounds>
+getChangedRegions(const set<string> &names, const TerrainBuild &command, const Grid &grid,
+                  map<string, CRSBounds> &extents) {
+  vector<CRSBounds> regions;
+
+  for (const string &name: names) {
+    auto previous = extents.find(name);
+    if (previous != extents.end()) {
+      regions.push_back(previous->second);
+      extents.erase(previous);
+    }
+
+    CRSBounds bounds;
+    if (getRasterExtent(string(command.watchDir) + "/" + name, grid, bounds)) {
+      regions.push_back(bounds);
+      extents[name] = bounds;
+    }
+  }
+
+  return regions;
+}
+
+/**
+ * Find the terrain tiles overlapping changed regions at every zoom level
+ *
+ * Regions are widened by a pixel at each zoom level as terrain tiles share
+ * their edges with their neighbours.  Tiles are listed from the start zoom
+ * level down, so children are generally updated before the parents which
+ * flag them.
+ */
+static vector<TileCoordinate>
+findUpdates(const TerrainTiler &tiler, const TerrainBuild *command, const vector<CRSBounds> &regions) {
+  const Grid &grid = tiler.grid();
+  i_zoom startZoom = (command->startZoom < 0) ? tiler.maxZoomLevel() : command->startZoom,
+    endZoom = (command->endZoom < 0) ? 0 : command->endZoom;
+
+  vector<TileCoordinate> updates;
+  unordered_set<uint64_t> keys;
+
+  for (i_zoom zoom = startZoom; ; --zoom) {
+    const TileBounds tiles = tiler.tileBoundsForZoom(zoom);
+    const double pixel = grid.resolution(zoom);
+
+    for (const CRSBounds &region: regions) {
+      const TileCoordinate ll = grid.crsToTile(CRSPoint(region.getMinX() - pixel, region.getMinY() - pixel), zoom),
+        ur = grid.crsToTile(CRSPoint(region.getMaxX() + pixel, region.getMaxY() + pixel), zoom);
+
+      for (i_tile x = max(ll.x, tiles.getMinX()); x <= min(ur.x, tiles.getMaxX()); ++x) {
+        for (i_tile y = max(ll.y, tiles.getMinY()); y <= min(ur.y, tiles.getMaxY()); ++y) {
+          const TileCoordinate coord(zoom, x, y);
+          if (keys.insert(TileStore::tileKey(coord)).second && !isOutsideCutline(tiler, coord)) {
+            updates.push_back(coord);
+          }
+        }
+      }
+    }
+
+    if (zoom == endZoom) break;
+  }
+
+  return updates;
+}
+
+/**
+ * Update the terrain tiles affected by changed source files
+ *
+ * This function is designed to be run in a separate thread, with the tiles
+ * shared out between the threads.
+ */
+static int
+runUpdater(TerrainBuild *command, Grid *grid) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(command->sourceFilename.c_str(), GA_ReadOnly);
+  if (poDataset == NULL) {
+    cerr << "Error: could not open GDAL dataset" << endl;
+    return 1;
+  }
+
+  int status = 0;
+  try {
+    TerrainTiler tiler(poDataset, *grid, command->tilerOptions);
+    restrictTiler(tiler, command);
+
+    // The same tile and buffer are reused for every update
+    TerrainTile tile(TileCoordinate(0, 0, 0));
+    vector<unsigned char> buffer;
+
+    const size_t count = command->updates.size();
+    size_t index;
+
+    while ((index = command->updateNext++) < count) {
+      const TileCoordinate &coord = command->updates[index];
+      writeTerrainTile(tiler, coord, command, tile, buffer);
+
+      showProgress((int) index + 1, getTileName(coord, command), (int) count);
+    }
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    status = 1;
+  }
+
+  GDALClose(poDataset);
+
+  return status;
+}
+
+/**
+ * Update the terrain tiles within regions of the source which have changed
+ *
+ * The source dataset is reopened to pick up the changed files, and the store
+ * is reopened and closed again so the tileset is complete between updates.
+ */
+static bool
+updateTerrain(TerrainBuild &command, Grid &grid, int threadCount, const vector<CRSBounds> &regions,
+              const LayerJson &emptyLayer, const string &heightsFilename) {
+  GDALDataset *poDataset = (GDALDataset *) GDALOpen(command.sourceFilename.c_str(), GA_ReadOnly);
+  if (poDataset == NULL) {
+    cerr << "Error: could not open GDAL dataset" << endl;
+    return false;
+  }
+
+  try {
+    TerrainTiler tiler(poDataset, grid, command.tilerOptions);
+    restrictTiler(tiler, &command);
+
+    command.updates = findUpdates(tiler, &command, regions);
+    command.updateNext = 0;
+
+    if (command.fingerprints) {
+      indexSource(command, poDataset, grid);
+    }
+
+    // The extent of the source may have changed along with it
+    *command.layer = emptyLayer;
+    if (!command.cutline) {
+      i_zoom startZoom = (command.startZoom < 0) ? tiler.maxZoomLevel() : command.startZoom,
+        endZoom = (command.endZoom < 0) ? 0 : command.endZoom;
+
+      for (i_zoom zoom = endZoom; zoom <= startZoom; ++zoom) {
+        command.layer->addAvailable(zoom, tiler.tileBoundsForZoom(zoom));
+      }
+    }
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    GDALClose(poDataset);
+    return false;
+  }
+
+  GDALClose(poDataset);
+
+  try {
+    command.store = openStore(command, command.outputDir, "terrain");
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << command.outputDir << endl;
+    return false;
+  }
+
+  vector<future<int>> tasks;
+  for (int i = 0; i < threadCount ; ++i) {
+    packaged_task<int(TerrainBuild *, Grid *)> task(runUpdater);
+    tasks.push_back(task.get_future());
+    thread(move(task), &command, &grid).detach();
+  }
+
+  bool succeeded = true;
+  for (auto &task : tasks) {
+    succeeded = (task.get() == 0) && succeeded;
+  }
+
+  if (command.cutline) {
+    command.layer->addAvailable(TileIndex::build(command.written));
+  }
+
+  try {
+    command.store->close();
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    return false;
+  }
+
+  // The metadata would describe tiles which weren't updated
+  if (!succeeded || !writeMetadata(command, heightsFilename)) {
+    return false;
+  }
+
+  if (command.verbosity > 0) {
+    cout << "Updated " << command.updates.size() << " tiles" << endl;
+  }
+
+  return true;
+}
+#endif
+
+int
+main(int argc, char *argv[]) {
+  // Specify the command line interface
+  TerrainBuild command(argv[0], version.cstr);
+  command.setUsage("[options] GDAL_DATASOURCE");
+  command.option("-o", "--output-dir <dir>", "specify the output directory for the tiles (defaults to working directory). If this ends in `.mbtiles` the tiles are written to an MBTiles database instead, or if it ends in `.ctbpack` to a memory mappable tile pack", TerrainBuild::setOutputDir);
+  command.option("-f", "--output-format <format>", "specify the output format for the tiles. This is either `Terrain` (the default) or any format listed by `gdalinfo --formats`", TerrainBuild::setOutputFormat);
+  command.option("-p", "--profile <profile>", "specify the TMS profile for the tiles. This is either `geodetic` (the default) or `mercator`", TerrainBuild::setProfile);
+  command.option("-c", "--thread-count <count>", "specify the number of threads to use for tile generation. On multicore machines this defaults to the number of CPUs", TerrainBuild::setThreadCount);
+  command.option("-t", "--tile-size <size>", "specify the size of the tiles in pixels. This defaults to 65 for terrain tiles and 256 for other GDAL formats", TerrainBuild::setTileSize);
+  command.option("-s", "--start-zoom <zoom>", "specify the zoom level to start at. This should be greater than the end zoom level", TerrainBuild::setStartZoom);
+  command.option("-e", "--end-zoom <zoom>", "specify the zoom level to end at. This should be less than the start zoom level and >= 0", TerrainBuild::setEndZoom);
+  command.option("-n", "--creation-option <option>", "specify a GDAL creation option for the output dataset in the form NAME=VALUE. Can be specified multiple times. Not valid for Terrain tiles.", TerrainBuild::addCreationOption);
+  command.option("-z", "--error-threshold <threshold>", "specify the error threshold in pixel units for transformation approximation. Larger values should mean faster transforms. Defaults to 0.125", TerrainBuild::setErrorThreshold);
+  command.option("-m", "--warp-memory <bytes>", "The memory limit in bytes used for warp operations. Higher settings should be faster. Defaults to a conservative GDAL internal setting.", TerrainBuild::setWarpMemory);
+  command.option("-x", "--warped-vrt", "warp terrain heights by reading them from a warped VRT dataset for each tile rather than warping them directly into the tile. The tiles should be the same either way, which `ctb-benchmark warp` checks: this is slower and only useful for comparing the two", TerrainBuild::setWarpedVRT);
+  command.option("-w", "--prewarp <filename>", "reproject the source dataset once to a temporary GeoTIFF at the given path before tiling. This is much faster for datasets not in the profile's spatial reference system. The file is removed when tiling is complete", TerrainBuild::setPrewarpFilename);
+  command.option("-C", "--compression <codec>", "specify the compression of terrain tiles in the form CODEC[:LEVEL]. The codec is `gzip` (the default, using zlib), `libdeflate` (gzip using the faster libdeflate), `zstd` or `none`. Cesium requires gzip: the others are only suitable for internal storage", TerrainBuild::setCompression);
+  command.option("-D", "--deduplicate", "store identical tiles only once, as hard links in directories or as shared data in containers. A manifest of tile hashes is kept with the output so that tiles which are unchanged when the tileset is next updated are not rewritten", TerrainBuild::setDeduplicate);
+  command.option("-U", "--skip-unchanged", "only create the terrain tiles whose source files have changed since they were last created. The files overlapping each tile are fingerprinted by their size and modification time, which works best for mosaics such as VRTs. The fingerprints are kept with the output in a `.tilesources` manifest", TerrainBuild::setSkipUnchanged);
+  command.option("-b", "--bbox <bounds>", "only create tiles overlapping a bounding box given as MINX,MINY,MAXX,MAXY in the spatial reference system of the profile (degrees for `geodetic`, metres for `mercator`)", TerrainBuild::setBBox);
+  command.option("-u", "--cutline <filename>", "only create tiles overlapping the polygons in a vector dataset such as a shapefile. Terrain heights outside the polygons are set to sea level, whereas other formats are only restricted to the tiles overlapping the polygons", TerrainBuild::setCutlineFilename);
+  command.option("-P", "--priority-log <filename>", "create the terrain tiles requested in a tile server access log, along with their ancestors, before any others. The most requested tiles are created first. Tiles are found from the `/{z}/{x}/{y}.terrain` paths in each line", TerrainBuild::setPriorityLogFilename);
+  command.option("-R", "--priority-regions <filename>", "create the terrain tiles overlapping the polygons in a vector dataset before any others. Each polygon is weighted by its numeric `priority` field, if any, and tiles are created in order of their total weight along with any from `--priority-log`. When writing to a directory a `layer.json` listing these tiles is written as soon as they are all created", TerrainBuild::setPriorityRegionsFilename);
+#ifdef CTB_HAVE_INOTIFY
+  command.option("-W", "--watch <dir>", "after creating the terrain tiles keep running, and whenever rasters in the directory are added, changed or removed update only the tiles they cover and their ancestors. The source should be a mosaic of the directory such as a VRT, which is reopened for each update", TerrainBuild::setWatchDir);
+  command.option("-I", "--watch-delay <seconds>", "specify how long to wait for changes in the watched directory to stop before updating the tiles. Defaults to 10 seconds", TerrainBuild::setWatchDelay);
+#endif
+  command.option("-Q", "--queue <dir>", "share the terrain tiles with any other processes using the same queue directory, which is created if need be. The processes can run on other machines sharing the directory and the output directory. Units of tiles are leased from the queue, and the units of a process which dies are taken over once their lease expires. The last process to finish writes the metadata. Remove the directory to tile again", TerrainBuild::setQueueDir);
+  command.option("-L", "--lease <seconds>", "specify how long a lease on a unit of the work queue lasts without being renewed. Defaults to 300 seconds", TerrainBuild::setLeaseSeconds);
+  command.option("-O", "--extra-output <spec>", "also create raster tiles in a GDAL format from the same source in the same run, given as FORMAT:SIZE:DIR, e.g. `PNG:256:hillshade`. The size defaults to 256 pixels and the profile is that of the main output. Each tile is created alongside the main tile covering the same area, at the zoom levels of the main output up to the output's own maximum zoom level, so the source is only read once. Outputs with the same tile size share a single warp. Can be specified multiple times", TerrainBuild::addExtraOutput);
+  command.option("-a", "--adaptive <error>", "only create the children of a terrain tile where they differ by more than the given error in metres from the tile upsampled over them. Cesium upsamples the parent in place of any children which are not created, so areas of low relief need far fewer tiles. Tiles are created from the end zoom level down to the start zoom level", TerrainBuild::setAdaptiveError);
+  command.option("-q", "--quiet", "only output errors", TerrainBuild::setQuiet);
+  command.option("-v", "--verbose", "be more noisy", TerrainBuild::setVerbose);
+
+  // Parse and check the arguments
+  command.parse(argc, argv);
+  command.check();
+
+  GDALAllRegister();
 
   // Set the output type
   if (command.verbosity > 1) {
@@ -424,31 +1580,259 @@ main(int argc, char *argv[]) {
   }
 
   // Check whether or not the output directory exists
-  VSIStatBufL stat;
-  if (VSIStatExL(command.outputDir, &stat, VSI_STAT_EXISTS_FLAG | VSI_STAT_NATURE_FLAG)) {
-    cerr << "Error: The output directory does not exist: " << command.outputDir << endl;
+  if (!checkOutputDir(command.outputDir)) {
     return 1;
-  } else if (!VSI_ISDIR(stat.st_mode)) {
-    cerr << "Error: The output filepath is not a directory: " << command.outputDir << endl;
+  }
+
+  // Open the tile store, using the GDAL driver extension for raster tiles
+  string extension = "terrain";
+  if (strcmp(command.outputFormat, "Terrain") != 0) {
+    GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName(command.outputFormat);
+    if (poDriver == NULL) {
+      cerr << "Error: Unknown output format: " << command.outputFormat << endl;
+      return 1;
+    }
+
+    if (command.adaptiveError >= 0) {
+      cerr << "Error: Adaptive tiling is only possible for Terrain tiles" << endl;
+      return 1;
+    }
+
+    if (command.priorityLogFilename != NULL || command.priorityRegionsFilename != NULL) {
+      cerr << "Error: Priority tiling is only possible for Terrain tiles" << endl;
+      return 1;
+    }
+
+    const char *driverExtension = poDriver->GetMetadataItem(GDAL_DMD_EXTENSION);
+    extension = (driverExtension == NULL) ? "" : driverExtension;
+  }
+
+  try {
+    command.store = openStore(command, command.outputDir, extension);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << command.outputDir << endl;
     return 1;
   }
 
+  // Skipping unchanged tiles needs terrain tiles kept from the last session
+  if (command.skipUnchanged) {
+    if (strcmp(command.outputFormat, "Terrain") != 0 || command.adaptiveError >= 0) {
+      cerr << "Error: Only non adaptive Terrain tiles can be skipped when unchanged" << endl;
+      return 1;
+    } else if (!command.store->preservesTiles()) {
+      cerr << "Error: Unchanged tiles can't be kept in " << command.outputDir << endl;
+      return 1;
+    }
+
+    command.fingerprints.reset(new SourceFingerprint());
+    command.fingerprintsFilename = string(command.outputDir)
+      + (TileStore::isContainer(command.outputDir) ? ".tilesources" : "/.tilesources");
+  }
+
+  // Watching needs terrain tiles which can be updated in place
+  if (command.watchDir != NULL) {
+    if (strcmp(command.outputFormat, "Terrain") != 0 || command.adaptiveError >= 0) {
+      cerr << "Error: Only non adaptive Terrain tiles can be kept up to date with the source" << endl;
+      return 1;
+    } else if (command.prewarpFilename != NULL) {
+      cerr << "Error: A prewarped source can't be kept up to date with the source" << endl;
+      return 1;
+    } else if (!command.store->preservesTiles()) {
+      cerr << "Error: The tiles can't be updated in place in " << command.outputDir << endl;
+      return 1;
+    }
+  }
+
+  // The processes sharing a work queue all write to the same directory, and
+  // the tiles they create must not depend on what each process has done
+  if (command.queueDir != NULL) {
+    if (strcmp(command.outputFormat, "Terrain") != 0 || command.adaptiveError >= 0
+        || command.cutlineFilename != NULL || command.prewarpFilename != NULL) {
+      cerr << "Error: Only non adaptive Terrain tiles without a cutline or prewarping can be shared by a work queue" << endl;
+      return 1;
+    } else if (command.deduplicate || command.skipUnchanged || command.watchDir != NULL
+               || command.priorityLogFilename != NULL || command.priorityRegionsFilename != NULL) {
+      cerr << "Error: Tiles shared by a work queue can't be deduplicated, skipped, watched or prioritised" << endl;
+      return 1;
+    } else if (TileStore::isContainer(command.outputDir)) {
+      cerr << "Error: Only a directory can be written by the processes sharing a work queue" << endl;
+      return 1;
+    }
+  }
+
+  // The height index is kept alongside containers and inside directories, and
+  // tiles from earlier runs are kept in it so partial runs can be merged
+  const string heightsFilename = string(command.outputDir)
+    + (TileStore::isContainer(command.outputDir) ? ".tileheights" : "/.tileheights");
+  if (strcmp(command.outputFormat, "Terrain") == 0) {
+    command.heights.load(heightsFilename);
+  }
+
   // Define the grid we are going to use
   Grid grid;
   if (strcmp(command.profile, "geodetic") == 0) {
     int tileSize = (command.tileSize < 1) ? 65 : command.tileSize;
     grid = GlobalGeodetic(tileSize);
+    command.layer.reset(new LayerJson(CPLGetBasename(command.getInputFilename()), "EPSG:4326"));
   } else if (strcmp(command.profile, "mercator") == 0) {
     int tileSize = (command.tileSize < 1) ? 256 : command.tileSize;
     grid = GlobalMercator(tileSize);
+    command.layer.reset(new LayerJson(CPLGetBasename(command.getInputFilename()), "EPSG:3857"));
   } else {
     cerr << "Error: Unknown profile: " << command.profile << endl;
     return 1;
   }
 
+  // Set up the raster outputs created alongside the main output, which follow
+  // the order the main tiles are created in
+  if (!command.extraOutputSpecs.empty()) {
+    if (command.adaptiveError >= 0 || command.queueDir != NULL || command.watchDir != NULL
+        || command.skipUnchanged || command.priorityLogFilename != NULL
+        || command.priorityRegionsFilename != NULL) {
+      cerr << "Error: Extra outputs can't be created when tiling adaptively, by priority, from a work queue, skipping unchanged tiles or watching" << endl;
+      return 1;
+    }
+
+    for (const string &spec: command.extraOutputSpecs) {
+      if (!setUpExtraOutput(command, spec)) {
+        return 1;
+      }
+    }
+  }
+
+  // Restrict tiling to a region of the grid
+  if (command.bbox != NULL) {
+    double minX, minY, maxX, maxY;
+    char extra;
+    if (sscanf(command.bbox, "%lf,%lf,%lf,%lf%c", &minX, &minY, &maxX, &maxY, &extra) != 4
+        || minX >= maxX || minY >= maxY) {
+      cerr << "Error: The bounding box must be given as MINX,MINY,MAXX,MAXY: " << command.bbox << endl;
+      return 1;
+    }
+    command.clipBounds.reset(new CRSBounds(minX, minY, maxX, maxY));
+  }
+
+  if (command.cutlineFilename != NULL) {
+    try {
+      command.cutline = make_shared<const Cutline>(Cutline::load(command.cutlineFilename, grid.getSRS()));
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.cutlineFilename << endl;
+      return 1;
+    }
+  }
+
+  // Weigh up the tiles to create first
+  if (command.priorityLogFilename != NULL) {
+    try {
+      command.priority.loadAccessLog(command.priorityLogFilename);
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.priorityLogFilename << endl;
+      return 1;
+    }
+  }
+
+  if (command.priorityRegionsFilename != NULL) {
+    try {
+      command.priority.loadRegions(command.priorityRegionsFilename, grid.getSRS());
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.priorityRegionsFilename << endl;
+      return 1;
+    }
+  }
+
+  if (!command.priority.empty()) {
+    if (command.adaptiveError >= 0) {
+      cerr << "Error: Priority tiling is not possible when tiling adaptively" << endl;
+      return 1;
+    }
+
+    command.priorityLayer.reset(new LayerJson(*command.layer));
+  }
+
+  // Set up the terrain compression
+  try {
+    command.codec = TileCodec::create(command.compression);
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << ": " << command.compression << endl;
+    return 1;
+  }
+
+  // Readers decode every tile with the codec recorded for the tileset, so a
+  // tileset can't mix tiles compressed differently
+  if (strcmp(command.outputFormat, "Terrain") == 0) {
+    const TileCodec::Format recorded = TileCodec::recorded(command.outputDir);
+    if (recorded != TileCodec::FORMAT_UNKNOWN && recorded != command.codec->format()) {
+      cerr << "Error: The existing tiles were compressed differently: " << TileCodec::recordFilename(command.outputDir) << endl;
+      return 1;
+    }
+
+    try {
+      command.codec->record(command.outputDir);
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << TileCodec::recordFilename(command.outputDir) << endl;
+      return 1;
+    }
+  }
+
+  int threadCount = (command.threadCount > 0) ? command.threadCount : CPLGetNumCPUs();
+  command.sourceFilename = command.getInputFilename();
+
+  // Reproject the source dataset up front if requested and required
+  ScratchFile prewarped;
+  if (command.prewarpFilename != NULL) {
+    GDALDataset *poDataset = (GDALDataset *) GDALOpen(command.getInputFilename(), GA_ReadOnly);
+    if (poDataset == NULL) {
+      cerr << "Error: could not open GDAL dataset" << endl;
+      return 1;
+    }
+
+    try {
+      const RasterTiler tiler(poDataset, grid, command.tilerOptions);
+
+      if (tiler.requiresReprojection()) {
+        prewarped.filename = command.prewarpFilename;
+        GDALDataset *poPrewarped = tiler.createPrewarpedDataset(command.prewarpFilename, threadCount,
+                                                                progressFunc == verboseProgress ? termProgress : progressFunc);
+        GDALClose(poPrewarped);
+        command.sourceFilename = command.prewarpFilename;
+      }
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << endl;
+      GDALClose(poDataset);
+      return 1;
+    }
+
+    GDALClose(poDataset);
+  }
+
+  // Fingerprint the original source, as a prewarped copy is always new
+  if (command.fingerprints) {
+    GDALDataset *poDataset = (GDALDataset *) GDALOpen(command.getInputFilename(), GA_ReadOnly);
+    if (poDataset == NULL) {
+      cerr << "Error: could not open GDAL dataset" << endl;
+      return 1;
+    }
+
+    indexSource(command, poDataset, grid);
+    command.fingerprints->load(command.fingerprintsFilename);
+    GDALClose(poDataset);
+  }
+
+#ifdef CTB_HAVE_INOTIFY
+  // Start watching before tiling, so no change made whilst tiling is missed
+  const LayerJson emptyLayer(*command.layer);
+  map<string, CRSBounds> watchExtents;
+  int watchFd = -1;
+
+  if (command.watchDir != NULL
+      && (watchFd = startWatching(command, grid, watchExtents)) < 0) {
+    cerr << "Error: Could not watch the directory: " << command.watchDir << endl;
+    return 1;
+  }
+#endif
+
   // Run the tilers in separate threads
   vector<future<int>> tasks;
-  int threadCount = (command.threadCount > 0) ? command.threadCount : CPLGetNumCPUs();
 
   // Instantiate the threads using futures from a packaged_task
   for (int i = 0; i < threadCount ; ++i) {
@@ -457,19 +1841,114 @@ main(int argc, char *argv[]) {
     thread(move(task), &command, &grid).detach(); // launch on a thread
   }
 
-  // Synchronise the completion of the threads
+  // Synchronise the completion of the threads, keeping the first failure
+  int status = 0;
   for (auto &task : tasks) {
-    task.wait();
+    const int retval = task.get();
+    if (status == 0) {
+      status = retval;
+    }
   }
 
-  // Get the value from the futures
-  for (auto &task : tasks) {
-    int retval = task.get();
+  // Only the tiles written are available when they don't fill the extent
+  if (command.adaptiveError >= 0 || command.cutline) {
+    command.layer->addAvailable(TileIndex::build(command.written));
+  }
 
-    // return on the first encountered problem
-    if (retval)
-      return retval;
+  // Remove the scratch dataset
+  prewarped.remove();
+
+  // Flush any tiles still buffered by the stores
+  try {
+    command.store->close();
+
+    for (const auto &output: command.extraOutputs) {
+      output->store->close();
+    }
+  } catch (CTBException &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
   }
 
+  // The tileset isn't described if any tiles failed, as the metadata would
+  // advertise tiles which were never written
+  if (status != 0) {
+    cerr << "Error: Not every tile was created, so the tileset metadata was not written" << endl;
+    return status;
+  }
+
+  // Only the process finishing a work queue describes the terrain tiles, with
+  // the heights of the tiles created by every process
+  bool describe = strcmp(command.outputFormat, "Terrain") == 0 && command.layer->maxZoom() >= 0;
+  if (describe && command.queueDir != NULL) {
+    if (!command.queueFinished) {
+      cerr << "Error: The work queue was not finished: " << command.queueDir << endl;
+      return 1;
+    }
+
+    try {
+      WorkQueue queue(command.queueDir, command.queueJob, command.queueUnits, command.leaseSeconds);
+      describe = queue.finish();
+
+      for (const string &filename: describe ? queue.resultFilenames() : vector<string>()) {
+        TileHeightIndex unitHeights;
+        if (!unitHeights.load(filename)) {
+          cerr << "Error: Could not load the tile heights: " << filename << endl;
+          return 1;
+        }
+        command.heights.merge(unitHeights);
+      }
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.queueDir << endl;
+      return 1;
+    }
+
+    if (!describe && command.verbosity > 0) {
+      cout << "The work queue is finished by another process" << endl;
+    }
+  }
+
+  // Describe the terrain tiles
+  if (describe && !writeMetadata(command, heightsFilename)) {
+    return 1;
+  }
+
+  if (command.fingerprints && command.verbosity > 0) {
+    cout << command.unchangedCount << " tiles with unchanged sources were not recreated" << endl;
+  }
+
+  const DeduplicatingTileStore *deduplicating = dynamic_cast<DeduplicatingTileStore *>(command.store.get());
+  if (deduplicating && command.verbosity > 0) {
+    cout << deduplicating->duplicateCount() << " duplicate tiles were shared and "
+         << deduplicating->unchangedCount() << " unchanged tiles were not rewritten" << endl;
+  }
+
+#ifdef CTB_HAVE_INOTIFY
+  // Keep the tiles up to date with the source files until interrupted.  The
+  // regions of a failed update are updated again when files next change.
+  if (command.watchDir != NULL) {
+    if (command.verbosity > 0) {
+      cout << "Watching " << command.watchDir << " for changes" << endl;
+    }
+
+    try {
+      vector<CRSBounds> regions;
+
+      while (true) {
+        const set<string> changed = waitForChanges(watchFd, command.watchDelay);
+        const vector<CRSBounds> changedRegions = getChangedRegions(changed, command, grid, watchExtents);
+        regions.insert(regions.end(), changedRegions.begin(), changedRegions.end());
+
+        if (!regions.empty() && updateTerrain(command, grid, threadCount, regions, emptyLayer, heightsFilename)) {
+          regions.clear();
+        }
+      }
+    } catch (CTBException &e) {
+      cerr << "Error: " << e.what() << ": " << command.watchDir << endl;
+      return 1;
+    }
+  }
+#endif
+
   return 0;
 }